@@ -0,0 +1,300 @@
+#include "Admission.hpp"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#define ADMISSION_BITS 128
+#define ADMISSION_MAPPED 96  // bits before an IPv4 address in its key
+
+Admission::Admission(const Config &config, Logger &log)
+    : _root(NULL), _subnetIpv4(ADMISSION_SUBNET_V4 + ADMISSION_MAPPED),
+      _subnetIpv6(ADMISSION_SUBNET_V6), _sweptAt(0) {
+  std::memset(_limits, 0, sizeof(_limits));  // NOLINT
+  const std::vector<Directive> connlimit = config.getAll("connlimit");
+  if (!connlimit.empty() && connlimit.back().size() >= 2) {
+    _limits[ADDRESS].connections = std::strtoul(connlimit.back()[0].c_str(),
+                                                NULL, 10);
+    _limits[SUBNET].connections = std::strtoul(connlimit.back()[1].c_str(),
+                                               NULL, 10);
+  }
+  const std::vector<Directive> connrate = config.getAll("connrate");
+  if (!connrate.empty() && connrate.back().size() >= 2) {
+    _limits[ADDRESS].perMinute = std::strtoul(connrate.back()[0].c_str(),
+                                              NULL, 10);
+    _limits[SUBNET].perMinute = std::strtoul(connrate.back()[1].c_str(),
+                                             NULL, 10);
+  }
+  const std::vector<Directive> subnet = config.getAll("subnet");
+  if (!subnet.empty() && subnet.back().size() >= 2) {
+    _subnetIpv4 = ADMISSION_MAPPED +
+                  std::min(32u, static_cast<unsigned int>(std::strtoul(
+                                    subnet.back()[0].c_str(), NULL, 10)));
+    _subnetIpv6 = std::min(128u, static_cast<unsigned int>(std::strtoul(
+                                     subnet.back()[1].c_str(), NULL, 10)));
+  }
+  const std::vector<Directive> exempt = config.getAll("exempt");
+  for (size_t i = 0; i < exempt.size(); ++i) {
+    if (exempt[i].empty()) {
+      continue;
+    }
+    const std::string &cidr = exempt[i][0];
+    const size_t slash = cidr.find('/');
+    Key key;
+    bool isIpv4 = false;
+    if (!_parse(cidr.substr(0, slash), key, isIpv4)) {
+      log.write(LOG_WARN, LOG_CLIENT, "Invalid exempt address: %", cidr);
+      continue;
+    }
+    unsigned int bits = ADMISSION_BITS;
+    if (slash != std::string::npos) {
+      bits = static_cast<unsigned int>(
+          std::strtoul(cidr.c_str() + slash + 1, NULL, 10));
+      if (cidr.find(':') == std::string::npos) {
+        bits += ADMISSION_MAPPED;  // counted from the start of the IPv4 part
+      }
+      bits = std::min(bits, static_cast<unsigned int>(ADMISSION_BITS));
+    }
+    _insert(key, bits)->isExempt = true;
+  }
+}
+
+Admission::~Admission() { _free(_root); }
+
+bool Admission::admit(const std::string &address, uint64_t now,
+                      std::string &reason) {
+  Key key;
+  bool isIpv4 = false;
+  if (!_isEnabled() || !_parse(address, key, isIpv4) || _isExempt(key)) {
+    return true;
+  }
+  Node *host = _entry(key, ADMISSION_BITS, ADDRESS, now);
+  Node *subnet = _entry(key, _subnetBits(isIpv4), SUBNET, now);
+  Node *const nodes[2] = {host, subnet};
+  for (size_t i = 0; i < 2; ++i) {
+    const Limit &limit = *nodes[i]->limit;
+    if (limit.connections != 0 && nodes[i]->connections >= limit.connections) {
+      reason = (i == 0 ? "Too many connections from your host"
+                       : "Too many connections from your network");
+      return false;
+    }
+    if (limit.perMinute != 0 && nodes[i]->tokens < 1) {
+      reason = (i == 0 ? "Your host is connecting too fast"
+                       : "Your network is connecting too fast");
+      return false;
+    }
+  }
+  for (size_t i = 0; i < 2; ++i) {
+    ++nodes[i]->connections;
+    if (nodes[i]->limit->perMinute != 0) {
+      nodes[i]->tokens -= 1;
+    }
+  }
+  return true;
+}
+
+// Connections handed over by an upgrade are counted even over the limits
+void Admission::restore(const std::string &address) {
+  Key key;
+  bool isIpv4 = false;
+  if (!_isEnabled() || !_parse(address, key, isIpv4) || _isExempt(key)) {
+    return;
+  }
+  ++_entry(key, ADMISSION_BITS, ADDRESS, 0)->connections;
+  ++_entry(key, _subnetBits(isIpv4), SUBNET, 0)->connections;
+}
+
+void Admission::release(const std::string &address) {
+  Key key;
+  bool isIpv4 = false;
+  if (!_isEnabled() || !_parse(address, key, isIpv4) || _isExempt(key)) {
+    return;
+  }
+  const unsigned int bits[2] = {ADMISSION_BITS, _subnetBits(isIpv4)};
+  for (size_t i = 0; i < 2; ++i) {
+    Node *node = _find(key, bits[i]);
+    if (node != NULL && node->connections != 0) {
+      --node->connections;
+    }
+  }
+}
+
+// Drops the entries without connections whose rate limit has recovered, the
+// trie then only holds the connected hosts and the recent connectors
+void Admission::sweep(uint64_t now) {
+  if (now - _sweptAt < static_cast<uint64_t>(ADMISSION_SWEEP) * 1000000000) {
+    return;
+  }
+  _sweptAt = now;
+  _prune(&_root, now);
+}
+
+// * Trie *
+
+// IPv4 addresses are mapped to ::ffff:a.b.c.d, like an IPv6 socket sees them
+bool Admission::_parse(const std::string &text, Key &key, bool &isIpv4) {
+  std::memset(&key, 0, sizeof(key));  // NOLINT
+  struct in6_addr ipv6 = {};
+  struct in_addr ipv4 = {};
+  if (inet_pton(AF_INET6, text.c_str(), &ipv6) == 1) {
+    std::memcpy(key.bytes, &ipv6, sizeof(key.bytes));  // NOLINT
+    isIpv4 = IN6_IS_ADDR_V4MAPPED(&ipv6);
+    return true;
+  }
+  if (inet_pton(AF_INET, text.c_str(), &ipv4) == 1) {
+    key.bytes[10] = 0xff;
+    key.bytes[11] = 0xff;
+    std::memcpy(key.bytes + 12, &ipv4, 4);  // NOLINT
+    isIpv4 = true;
+    return true;
+  }
+  return false;
+}
+
+bool Admission::_bit(const Key &key, unsigned int index) {
+  return ((key.bytes[index / 8] >> (7 - index % 8)) & 1) != 0;
+}
+
+// Leading bits a and b share, at most bits
+unsigned int Admission::_common(const Key &a, const Key &b,
+                                unsigned int bits) {
+  unsigned int index = 0;
+  while (index + 8 <= bits && a.bytes[index / 8] == b.bytes[index / 8]) {
+    index += 8;
+  }
+  while (index < bits && _bit(a, index) == _bit(b, index)) {
+    ++index;
+  }
+  return index;
+}
+
+void Admission::_refill(Node &node, uint64_t now) {
+  const double perMinute = static_cast<double>(node.limit->perMinute);
+  if (perMinute != 0 && now > node.refilledAt) {
+    node.tokens = std::min(
+        perMinute, node.tokens + static_cast<double>(now - node.refilledAt) *
+                                     perMinute / 60e9);
+  }
+  node.refilledAt = std::max(now, node.refilledAt);
+}
+
+void Admission::_free(Node *node) {
+  if (node != NULL) {
+    _free(node->children[0]);
+    _free(node->children[1]);
+    delete node;
+  }
+}
+
+bool Admission::_isEnabled() const {
+  return _limits[ADDRESS].connections != 0 || _limits[ADDRESS].perMinute != 0 ||
+         _limits[SUBNET].connections != 0 || _limits[SUBNET].perMinute != 0;
+}
+
+// Walks the prefixes of key, an exempt one covers it
+bool Admission::_isExempt(const Key &key) const {
+  for (const Node *node = _root; node != NULL;) {
+    if (_common(node->key, key, node->bits) != node->bits) {
+      return false;
+    }
+    if (node->isExempt) {
+      return true;
+    }
+    if (node->bits == ADMISSION_BITS) {
+      return false;
+    }
+    node = node->children[_bit(key, node->bits)];
+  }
+  return false;
+}
+
+unsigned int Admission::_subnetBits(bool isIpv4) const {
+  return isIpv4 ? _subnetIpv4 : _subnetIpv6;
+}
+
+Admission::Node *Admission::_find(const Key &key, unsigned int bits) const {
+  Node *node = _root;
+  while (node != NULL && node->bits <= bits &&
+         _common(node->key, key, node->bits) == node->bits) {
+    if (node->bits == bits) {
+      return node;
+    }
+    node = node->children[_bit(key, node->bits)];
+  }
+  return NULL;
+}
+
+// Returns the node for the first bits of key, splitting an edge if needed
+Admission::Node *Admission::_insert(const Key &key, unsigned int bits) {
+  Node **slot = &_root;
+  while (*slot != NULL) {
+    Node *node = *slot;
+    const unsigned int common =
+        _common(node->key, key, std::min(node->bits, bits));
+    if (common == node->bits && common == bits) {
+      return node;
+    }
+    if (common == node->bits) {
+      slot = &node->children[_bit(key, node->bits)];
+      continue;
+    }
+    // The new prefix branches off inside the edge to node
+    Node *fork = new Node();
+    fork->key = key;
+    fork->bits = common;
+    fork->children[_bit(node->key, common)] = node;
+    *slot = fork;
+    if (common == bits) {
+      return fork;
+    }
+    slot = &fork->children[_bit(key, common)];
+  }
+  *slot = new Node();
+  (*slot)->key = key;
+  (*slot)->bits = bits;
+  return *slot;
+}
+
+Admission::Node *Admission::_entry(const Key &key, unsigned int bits,
+                                   Level level, uint64_t now) {
+  Node *node = _insert(key, bits);
+  if (node->limit == NULL) {
+    node->limit = &_limits[level];
+    node->tokens = static_cast<double>(node->limit->perMinute);
+    node->refilledAt = now;
+  }
+  _refill(*node, now);
+  return node;
+}
+
+void Admission::_prune(Node **slot, uint64_t now) {
+  Node *node = *slot;
+  if (node == NULL) {
+    return;
+  }
+  _prune(&node->children[0], now);
+  _prune(&node->children[1], now);
+  if (node->isExempt) {
+    return;
+  }
+  if (node->limit != NULL) {
+    _refill(*node, now);
+    if (node->connections != 0 ||
+        node->tokens < static_cast<double>(node->limit->perMinute)) {
+      return;
+    }
+    node->limit = NULL;
+  }
+  if (node->children[0] != NULL && node->children[1] != NULL) {
+    return;  // still splits the tree
+  }
+  *slot = (node->children[0] != NULL ? node->children[0] : node->children[1]);
+  delete node;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <cstddef>
+#include <string>
+
+#include "Config.hpp"
+#include "Logger.hpp"
+
+#define ADMISSION_SUBNET_V4 24  // default IPv4 prefix of the "subnet" key
+#define ADMISSION_SUBNET_V6 64  // default IPv6 prefix
+#define ADMISSION_SWEEP 60      // s between two prunings of idle entries
+
+// Connection admission per address and per subnet. The counts live in a
+// compressed binary trie over 128-bit keys, IPv4 mapped to ::ffff:0:0/96, so
+// both families share one tree and an exempt CIDR is an ancestor of every
+// address it covers. Limits come from the config file:
+//   connlimit <per address> <per subnet>  open connections, 0 for no limit
+//   connrate <per address> <per subnet>   connects per minute, 0 for no limit
+//   subnet <IPv4 bits> <IPv6 bits>        size of a subnet
+//   exempt <address>[/<bits>]             never limited, may repeat
+// Without a limit every connection is admitted and nothing is counted.
+class Admission {
+ public:
+  Admission(const Config &config, Logger &log);
+  ~Admission();
+
+  // Counts the connection, or leaves the reason it is refused
+  bool admit(const std::string &address, uint64_t now, std::string &reason);
+  void restore(const std::string &address);  // handed over, never refused
+  void release(const std::string &address);
+  void sweep(uint64_t now);
+
+ private:
+  struct Key {
+    uint8_t bytes[16];
+  };
+  struct Limit {
+    size_t connections;
+    size_t perMinute;
+  };
+  struct Node {
+    Key key;
+    unsigned int bits;
+    Node *children[2];
+    const Limit *limit;  // NULL while the node only splits the tree
+    bool isExempt;
+    size_t connections;
+    double tokens;  // connects left, refilled at limit->perMinute
+    uint64_t refilledAt;
+  };
+  enum Level { ADDRESS, SUBNET };
+
+  Admission(const Admission &other);
+  Admission &operator=(const Admission &other);
+
+  static bool _parse(const std::string &text, Key &key, bool &isIpv4);
+  static bool _bit(const Key &key, unsigned int index);
+  static unsigned int _common(const Key &a, const Key &b, unsigned int bits);
+  static void _refill(Node &node, uint64_t now);
+  static void _free(Node *node);
+  bool _isEnabled() const;
+  bool _isExempt(const Key &key) const;
+  unsigned int _subnetBits(bool isIpv4) const;
+  Node *_find(const Key &key, unsigned int bits) const;
+  Node *_insert(const Key &key, unsigned int bits);
+  Node *_entry(const Key &key, unsigned int bits, Level level, uint64_t now);
+  void _prune(Node **slot, uint64_t now);
+
+  Node *_root;
+  Limit _limits[2];  // by Level
+  unsigned int _subnetIpv4;
+  unsigned int _subnetIpv6;
+  uint64_t _sweptAt;
+};
@@ -0,0 +1,80 @@
+#include "Blob.hpp"
+
+#include <stdint.h>
+
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+BlobWriter::BlobWriter() {}
+
+BlobWriter::~BlobWriter() {}
+
+void BlobWriter::putU8(uint8_t value) {
+  _data.append(reinterpret_cast<const char *>(&value),  // NOLINT
+               sizeof(value));
+}
+
+void BlobWriter::putU32(uint32_t value) {
+  _data.append(reinterpret_cast<const char *>(&value),  // NOLINT
+               sizeof(value));
+}
+
+void BlobWriter::putU64(uint64_t value) {
+  _data.append(reinterpret_cast<const char *>(&value),  // NOLINT
+               sizeof(value));
+}
+
+void BlobWriter::putString(const std::string &value) {
+  putU32(static_cast<uint32_t>(value.size()));
+  _data += value;
+}
+
+const std::string &BlobWriter::data() const { return _data; }
+
+void BlobWriter::clear() { _data.clear(); }
+
+BlobReader::BlobReader(const char *data, size_t size)
+    : _data(data), _size(size), _offset(0) {}
+
+BlobReader::~BlobReader() {}
+
+bool BlobReader::atEnd() const { return _offset == _size; }
+size_t BlobReader::offset() const { return _offset; }
+
+void BlobReader::_read(void *out, size_t size) {
+  if (size > _size - _offset) {
+    throw std::runtime_error("Truncated blob");
+  }
+  std::memcpy(out, _data + _offset, size);  // NOLINT
+  _offset += size;
+}
+
+uint8_t BlobReader::getU8() {
+  uint8_t value = 0;
+  _read(&value, sizeof(value));
+  return value;
+}
+
+uint32_t BlobReader::getU32() {
+  uint32_t value = 0;
+  _read(&value, sizeof(value));
+  return value;
+}
+
+uint64_t BlobReader::getU64() {
+  uint64_t value = 0;
+  _read(&value, sizeof(value));
+  return value;
+}
+
+std::string BlobReader::getString() {
+  const uint32_t size = getU32();
+  if (size > _size - _offset) {
+    throw std::runtime_error("Truncated blob");
+  }
+  const std::string value(_data + _offset, size);  // NOLINT
+  _offset += size;
+  return value;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <cstddef>
+#include <string>
+
+// Length-prefixed binary encoding used to hand state over to another process.
+// Integers are written in host byte order, both ends run on the same machine.
+class BlobWriter {
+ public:
+  BlobWriter();
+  ~BlobWriter();
+
+  void putU8(uint8_t value);
+  void putU32(uint32_t value);
+  void putU64(uint64_t value);
+  void putString(const std::string &value);
+
+  const std::string &data() const;
+  void clear();
+
+ private:
+  BlobWriter(const BlobWriter &other);
+  BlobWriter &operator=(const BlobWriter &other);
+
+  std::string _data;
+};
+
+// Throws std::runtime_error when the blob ends before the value
+class BlobReader {
+ public:
+  BlobReader(const char *data, size_t size);
+  ~BlobReader();
+
+  uint8_t getU8();
+  uint32_t getU32();
+  uint64_t getU64();
+  std::string getString();
+
+  bool atEnd() const;
+  size_t offset() const;
+
+ private:
+  BlobReader();
+  BlobReader(const BlobReader &other);
+  BlobReader &operator=(const BlobReader &other);
+
+  void _read(void *out, size_t size);
+
+  const char *_data;
+  size_t _size;
+  size_t _offset;
+};
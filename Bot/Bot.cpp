@@ -1,26 +1,101 @@
 #include "Bot.hpp"
 
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <stdint.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <cctype>
+#include <cerrno>
+#include <csignal>
 #include <cstddef>
 #include <cstdlib>
+#include <cstring>
 #include <ctime>
 #include <fstream>
 #include <iostream>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <vector>
 
-Bot::Bot(const std::string &port, const std::string &password) : _sockfd(-1) {
+extern volatile sig_atomic_t g_stop;  // NOLINT
+
+namespace {
+
+uint64_t monotonicNs() {
+  struct timespec ts = {};
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+std::string lowercase(const std::string &str) {
+  std::string result(str);
+  for (size_t i = 0; i < result.size(); ++i) {
+    result[i] = static_cast<char>(std::tolower(result[i]));
+  }
+  return result;
+}
+
+// [":" prefix] command params... [":" trailing], the prefix without ":"
+struct Message {
+  std::string prefix;
+  std::string command;
+  std::vector<std::string> params;
+};
+
+Message parseLine(const std::string &line) {
+  Message msg;
+  size_t pos = 0;
+  if (!line.empty() && line[0] == ':') {
+    pos = line.find(' ');
+    msg.prefix = line.substr(1, pos == std::string::npos ? pos : pos - 1);
+  }
+  while (pos != std::string::npos && pos < line.size()) {
+    pos = line.find_first_not_of(' ', pos);
+    if (pos == std::string::npos) {
+      break;
+    }
+    if (line[pos] == ':' && !msg.command.empty()) {
+      msg.params.push_back(line.substr(pos + 1));
+      break;
+    }
+    const size_t end = line.find(' ', pos);
+    const std::string word = line.substr(pos, end - pos);
+    if (msg.command.empty()) {
+      msg.command = word;
+    } else {
+      msg.params.push_back(word);
+    }
+    pos = end;
+  }
+  return msg;
+}
+
+}  // namespace
+
+Bot::Bot(const std::string &port, const std::string &password,
+         const std::vector<std::string> &channels)
+    : _sockfd(-1), _nick("Bot"), _replies(0), _limited(0) {
   int portNbr = 0;
   std::istringstream(port) >> portNbr;
   if (portNbr <= 0 || portNbr > MAX_PORT) {
     throw std::invalid_argument("Invalid port number: " + port);
   }
+  for (size_t i = 0; i < channels.size(); ++i) {
+    Channel channel;
+    channel.name = channels[i];
+    channel.tokens = BOT_REPLY_BURST;
+    channel.refilledAt = monotonicNs();
+    _channels[lowercase(channels[i])] = channel;
+  }
+  if (_channels.empty()) {
+    throw std::invalid_argument("No channel to serve");
+  }
 
   struct sockaddr_in serverAddr = {};
   serverAddr.sin_family = AF_INET;
@@ -37,11 +112,16 @@ Bot::Bot(const std::string &port, const std::string &password) : _sockfd(-1) {
     _sockfd = -1;
     throw std::runtime_error("Connection to server failed");
   }
+  fcntl(_sockfd, F_SETFL, O_NONBLOCK);
   std::cout << "Bot connected to server on port " << port << "\n";
-  sendMessage(
-      "PASS " + password +
-      "\r\nNICK Bot\r\nUSER Bot 0 * :Bot\r\nJOIN #trivia\r\nTOPIC #trivia "
-      ":Send any message to receive a ¡FUN! fact!\r\n");
+  _queue("PASS " + password);
+  _queue("NICK " + _nick);
+  _queue("USER Bot 0 * :Bot");
+  _loadTrivia();
+  std::srand(time(NULL));
+}
+
+void Bot::_loadTrivia() {
   std::ifstream triviaFile("trivia.txt");
   if (!triviaFile.is_open()) {
     std::cerr << "Failed to open trivia file\n";
@@ -52,45 +132,146 @@ Bot::Bot(const std::string &port, const std::string &password) : _sockfd(-1) {
     _trivia.push_back(line);
   }
   triviaFile.close();
-  std::srand(time(NULL));
-  run();
 }
 
-void Bot::sendMessage(const std::string &message) const {
-  send(_sockfd, message.c_str(), message.size(), 0);
+// Until the server closes the connection or SIGINT
+void Bot::run() {
+  while (g_stop == 0) {
+    struct pollfd pfd = {};
+    pfd.fd = _sockfd;
+    pfd.events = POLLIN;
+    if (!_out.empty()) {
+      pfd.events |= POLLOUT;
+    }
+    if (poll(&pfd, 1, -1) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error("poll: " + std::string(strerror(errno)));
+    }
+    if ((pfd.revents & (POLLIN | POLLHUP | POLLERR)) != 0 && !_receive()) {
+      std::cerr << "Connection lost or error occurred.\n";
+      break;
+    }
+    if (!_flush()) {
+      std::cerr << "Connection lost or error occurred.\n";
+      break;
+    }
+  }
+  std::cout << "Replies sent: " << _replies
+            << ", dropped by the rate limit: " << _limited << "\n";
 }
 
-void Bot::run() const {
-  char buffer[BUFFER_SIZE];
+// Reads everything available and handles the complete lines, false once the
+// connection is gone
+bool Bot::_receive() {
+  char buffer[BOT_READ_SIZE];
   while (true) {
-    const ssize_t bytesRead =
-        recv(_sockfd, buffer, sizeof(buffer) - 1, 0);  // NOLINT
-    if (bytesRead <= 0) {
-      std::cerr << "Connection lost or error occurred.\n";
-      break;
+    const ssize_t bytesRead = recv(_sockfd, buffer, sizeof(buffer), 0);
+    if (bytesRead == 0) {
+      return false;
+    }
+    if (bytesRead == -1) {
+      return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
     }
+    _in.append(buffer, bytesRead);
+    size_t begin = 0;
+    size_t end = 0;
+    while ((end = _in.find("\r\n", begin)) != std::string::npos) {
+      _handle(_in.substr(begin, end - begin));
+      begin = end + 2;
+    }
+    _in.erase(0, begin);
+  }
+}
 
-    buffer[bytesRead] = '\0';       // NOLINT
-    const std::string msg(buffer);  // NOLINT
+void Bot::_handle(const std::string &line) {
+  const Message msg = parseLine(line);
+  const std::string sender = msg.prefix.substr(0, msg.prefix.find('!'));
+  if (msg.command == "PING") {
+    _queue("PONG :" + (msg.params.empty() ? "" : msg.params[0]));
+  } else if (msg.command == "001") {
+    std::vector<std::string> names;
+    for (ChannelMap::const_iterator it = _channels.begin();
+         it != _channels.end(); ++it) {
+      names.push_back(it->second.name);
+    }
+    _join(names);
+  } else if (msg.command == "433") {
+    _nick += "_";  // nickname in use
+    _queue("NICK " + _nick);
+  } else if (msg.command == "JOIN" && sender == _nick && !msg.params.empty()) {
+    _queue("TOPIC " + msg.params[0] +
+           " :Send any message to receive a ¡FUN! fact!");
+  } else if (msg.command == "PRIVMSG" && sender != _nick &&
+             !msg.params.empty()) {
+    const ChannelMap::iterator it = _channels.find(lowercase(msg.params[0]));
+    if (it != _channels.end()) {
+      _reply(it->second);
+    }
+  } else if (msg.command == "KICK" && msg.params.size() > 1 &&
+             msg.params[1] == _nick) {
+    const ChannelMap::iterator it = _channels.find(lowercase(msg.params[0]));
+    if (it != _channels.end()) {
+      _join(std::vector<std::string>(1, it->second.name));
+      _queue("PRIVMSG " + it->second.name + " :I'm back b*tches!");
+    }
+  }
+}
 
-    size_t triviaIndex = 0;
-    if (msg.find("PRIVMSG #trivia :") != std::string::npos) {
-      if (_trivia.empty()) {
-        std::string const reply = "PRIVMSG #trivia :404 Trivia not found.\r\n";
-        send(_sockfd, reply.c_str(), reply.size(), 0);
-        continue;
-      }
-      triviaIndex = std::rand() % _trivia.size();
-      const std::string reply =
-          "PRIVMSG #trivia :" + _trivia[triviaIndex] + "\r\n";
-      send(_sockfd, reply.c_str(), reply.size(), 0);
-    } else if (msg.find("KICK #trivia Bot") != std::string::npos) {
-      sendMessage(
-          "JOIN #trivia\r\nTOPIC #trivia :Send any message to receive a ¡FUN! "
-          "fact!\r\n");
-      sendMessage("PRIVMSG #trivia :I'm back b*tches!\r\n");
+// Token bucket, a reply over the budget is dropped rather than queued
+void Bot::_reply(Channel &channel) {
+  const uint64_t now = monotonicNs();
+  channel.tokens += (now - channel.refilledAt) / 1e9 * BOT_REPLY_RATE;
+  channel.refilledAt = now;
+  if (channel.tokens > BOT_REPLY_BURST) {
+    channel.tokens = BOT_REPLY_BURST;
+  }
+  if (channel.tokens < 1) {
+    ++_limited;
+    return;
+  }
+  channel.tokens -= 1;
+  ++_replies;
+  if (_trivia.empty()) {
+    _queue("PRIVMSG " + channel.name + " :404 Trivia not found.");
+    return;
+  }
+  _queue("PRIVMSG " + channel.name + " :" +
+         _trivia[std::rand() % _trivia.size()]);
+}
+
+// Several channels per JOIN, the lines kept under BOT_JOIN_LENGTH
+void Bot::_join(const std::vector<std::string> &names) {
+  std::string line;
+  for (size_t i = 0; i < names.size(); ++i) {
+    if (!line.empty() && line.size() + names[i].size() > BOT_JOIN_LENGTH) {
+      _queue("JOIN " + line);
+      line.clear();
+    }
+    line += (line.empty() ? "" : ",") + names[i];
+  }
+  if (!line.empty()) {
+    _queue("JOIN " + line);
+  }
+}
+
+void Bot::_queue(const std::string &line) {
+  _out += line;
+  _out += "\r\n";
+}
+
+// Sends what the socket takes, the rest waits for POLLOUT
+bool Bot::_flush() {
+  while (!_out.empty()) {
+    const ssize_t sent =
+        send(_sockfd, _out.data(), _out.size(), MSG_NOSIGNAL);
+    if (sent == -1) {
+      return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
     }
+    _out.erase(0, sent);
   }
+  return true;
 }
 
 Bot::~Bot() {
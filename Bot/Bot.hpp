@@ -1,19 +1,55 @@
 #pragma once
 
+#include <stdint.h>
+
+#include <map>
 #include <string>
 #include <vector>
 
 #define BUFFER_SIZE 512  // standard message size for IRC
 #define MAX_PORT 65535
+#define BOT_CHANNEL "#trivia"  // served when no channel is given
+#define BOT_READ_SIZE 65536    // bytes read per recv
+#define BOT_JOIN_LENGTH 400    // channels are joined in lines up to this long
+#define BOT_REPLY_BURST 3      // replies a channel gets at once
+#define BOT_REPLY_RATE 1       // replies per second a channel gets after that
 
+// Trivia bot: one non-blocking connection serving any number of channels.
+// Lines are framed on CRLF, replies are queued and sent together, and each
+// channel has a token bucket so that a busy channel cannot flood the others.
 class Bot { // NOLINT
     public:
-        Bot(const std::string &port, const std::string &password);
+        Bot(const std::string &port, const std::string &password,
+            const std::vector<std::string> &channels);
         ~Bot();
+
+        void run();
+
     private:
-        void run() const;
-        void sendMessage(const std::string &message) const;
+        struct Channel {
+            std::string name;
+            double tokens;  // replies left, refilled at BOT_REPLY_RATE
+            uint64_t refilledAt;
+        };
+        typedef std::map<std::string, Channel> ChannelMap;  // lowercase name
+
+        Bot(const Bot &other);
+        Bot &operator=(const Bot &other);
+
+        void _loadTrivia();
+        bool _receive();
+        void _handle(const std::string &line);
+        void _reply(Channel &channel);
+        void _join(const std::vector<std::string> &names);
+        void _queue(const std::string &line);
+        bool _flush();
 
         int _sockfd;
+        std::string _nick;
+        std::string _in;
+        std::string _out;  // every reply of a loop turn goes in one send
+        ChannelMap _channels;
         std::vector<std::string> _trivia;
+        uint64_t _replies;
+        uint64_t _limited;  // replies dropped by the rate limit
 };
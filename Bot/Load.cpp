@@ -0,0 +1,396 @@
+#include "Load.hpp"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "Bot.hpp"
+
+extern volatile sig_atomic_t g_stop;  // NOLINT
+
+namespace {
+
+const uint64_t SECOND = 1000000000;  // ns
+
+uint64_t monotonicNs() {
+  struct timespec ts = {};
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * SECOND + ts.tv_nsec;
+}
+
+// p in [0, 100], the values are sorted in place
+uint32_t percentile(std::vector<uint32_t> &values, double p) {
+  if (values.empty()) {
+    return 0;
+  }
+  size_t rank = static_cast<size_t>(p / 100.0 * (values.size() - 1) + 0.5);
+  std::nth_element(values.begin(), values.begin() + rank, values.end());
+  return values[rank];
+}
+
+void printDistribution(const std::string &name, std::vector<uint32_t> values) {
+  std::cout << name << "_count " << values.size() << "\n"
+            << name << "_p50_us " << percentile(values, 50) << "\n"
+            << name << "_p90_us " << percentile(values, 90) << "\n"
+            << name << "_p99_us " << percentile(values, 99) << "\n"
+            << name << "_p999_us " << percentile(values, 99.9) << "\n"
+            << name << "_max_us " << percentile(values, 100) << "\n";
+}
+
+}  // namespace
+
+// options: key=value, see _parseOption
+Load::Load(const std::string &port, const std::string &password,
+           const std::vector<std::string> &options)
+    : _port(0),
+      _password(password),
+      _host("127.0.0.1"),
+      _clients(1000),
+      _channels(10),
+      _perClient(1),
+      _rate(1000),
+      _ramp(500),
+      _duration(10),
+      _size(32),
+      _failed(0),
+      _registered(0),
+      _joins(0),
+      _nextSender(0),
+      _sent(0),
+      _expected(0),
+      _delivered(0),
+      _bytesIn(0) {
+  std::istringstream(port) >> _port;
+  if (_port <= 0 || _port > MAX_PORT) {
+    throw std::invalid_argument("Invalid port number: " + port);
+  }
+  for (size_t i = 0; i < options.size(); ++i) {
+    _parseOption(options[i]);
+  }
+  if (_clients == 0 || _channels == 0 || _perClient == 0 ||
+      _perClient > _channels || _rate <= 0 || _ramp <= 0) {
+    throw std::invalid_argument("Invalid load options");
+  }
+  _members.resize(_channels, 0);
+  // Thousands of sockets need more than the usual 1024 descriptors
+  struct rlimit limit = {};
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+      limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+}
+
+Load::~Load() {
+  for (size_t i = 0; i < _connections.size(); ++i) {
+    if (_connections[i].fd != -1) {
+      close(_connections[i].fd);
+    }
+  }
+}
+
+void Load::_parseOption(const std::string &option) {
+  const size_t equal = option.find('=');
+  if (equal == std::string::npos) {
+    throw std::invalid_argument("Expected key=value: " + option);
+  }
+  const std::string key = option.substr(0, equal);
+  std::istringstream value(option.substr(equal + 1));
+  if (key == "host") {
+    value >> _host;
+  } else if (key == "clients") {
+    value >> _clients;
+  } else if (key == "channels") {
+    value >> _channels;
+  } else if (key == "per") {
+    value >> _perClient;
+  } else if (key == "rate") {
+    value >> _rate;
+  } else if (key == "ramp") {
+    value >> _ramp;
+  } else if (key == "duration") {
+    value >> _duration;
+  } else if (key == "size") {
+    value >> _size;
+  } else {
+    throw std::invalid_argument("Unknown load option: " + key);
+  }
+  if (value.fail()) {
+    throw std::invalid_argument("Invalid value: " + option);
+  }
+}
+
+// Connections are opened at the ramp rate, registered, and joined. Sending
+// starts once every client has joined its channels, and lasts duration
+// seconds.
+void Load::run() {
+  const uint64_t start = monotonicNs();
+  uint64_t sendingSince = 0;
+  uint64_t lastProgress = start;
+  uint64_t lastSent = 0;
+  uint64_t lastDelivered = 0;
+  std::vector<struct pollfd> pollFds;
+
+  while (g_stop == 0) {
+    uint64_t now = monotonicNs();
+    while (_connections.size() < _clients &&
+           static_cast<double>(_connections.size()) <
+               (now - start) / 1e9 * _ramp + 1) {
+      _connect();
+    }
+    const bool isSetUp =
+        _registered + _failed == _clients && _joins == _registered * _perClient;
+    if (sendingSince == 0 &&
+        (isSetUp || now - start > LOAD_SETUP_TIMEOUT * SECOND)) {
+      sendingSince = now;
+      std::cout << "setup_s " << (now - start) / 1e9 << "\n";
+    }
+    if (sendingSince != 0) {
+      if (now - sendingSince > (_duration + LOAD_DRAIN) * SECOND) {
+        break;
+      }
+      if (now - sendingSince <= _duration * SECOND) {
+        _sendMessages(now - sendingSince);
+      }
+    }
+    if (now - lastProgress >= SECOND) {
+      std::cerr << "connected " << _registered << "/" << _clients
+                << " failed " << _failed << " sent/s " << _sent - lastSent
+                << " delivered/s " << _delivered - lastDelivered << "\n";
+      lastProgress = now;
+      lastSent = _sent;
+      lastDelivered = _delivered;
+    }
+
+    pollFds.clear();
+    for (size_t i = 0; i < _connections.size(); ++i) {
+      struct pollfd pfd = {};
+      pfd.fd = _connections[i].fd;
+      pfd.events = POLLIN;
+      if (!_connections[i].out.empty()) {
+        pfd.events |= POLLOUT;  // registration is queued before connect() ends
+      }
+      pollFds.push_back(pfd);
+    }
+    if (poll(pollFds.data(), pollFds.size(), 1) == -1) {
+      if (errno != EINTR) {
+        throw std::runtime_error("poll: " + std::string(strerror(errno)));
+      }
+      continue;
+    }
+    for (size_t i = 0; i < pollFds.size(); ++i) {
+      Connection &connection = _connections[i];
+      if (connection.fd == -1 || pollFds[i].revents == 0) {
+        continue;
+      }
+      if ((pollFds[i].revents & (POLLERR | POLLHUP)) != 0) {
+        _drop(i);
+        continue;
+      }
+      if ((pollFds[i].revents & POLLIN) != 0) {
+        _receive(connection);
+      }
+      if (connection.fd != -1 && (pollFds[i].revents & POLLOUT) != 0 &&
+          !_flush(connection)) {
+        _drop(i);
+      }
+    }
+  }
+  _report(sendingSince != 0 ? monotonicNs() - sendingSince : 0);
+}
+
+void Load::_connect() {
+  Connection connection;
+  connection.fd = socket(AF_INET, SOCK_STREAM, 0);
+  connection.startedAt = monotonicNs();
+  connection.isRegistered = false;
+  connection.joined = 0;
+  std::stringstream nick;
+  nick << "load" << _connections.size();
+  connection.nick = nick.str();
+  // Spread the clients evenly, each on consecutive channels
+  for (size_t k = 0; k < _perClient; ++k) {
+    connection.channels.push_back((_connections.size() + k) % _channels);
+  }
+  if (connection.fd == -1) {
+    ++_failed;
+    _connections.push_back(connection);
+    return;
+  }
+  fcntl(connection.fd, F_SETFL, O_NONBLOCK);
+  struct sockaddr_in serverAddr = {};
+  serverAddr.sin_family = AF_INET;
+  serverAddr.sin_port = htons(_port);
+  serverAddr.sin_addr.s_addr = inet_addr(_host.c_str());
+  if (connect(connection.fd, (struct sockaddr *)&serverAddr,  // NOLINT
+              sizeof(serverAddr)) == -1 &&
+      errno != EINPROGRESS) {
+    close(connection.fd);
+    connection.fd = -1;
+    ++_failed;
+  } else {
+    _queue(connection, "PASS " + _password);
+    _queue(connection, "NICK " + connection.nick);
+    _queue(connection, "USER load 0 * :load");
+  }
+  _connections.push_back(connection);
+}
+
+void Load::_receive(Connection &connection) {
+  char buffer[BUFFER_SIZE * 8];
+  const ssize_t received = recv(connection.fd, buffer, sizeof(buffer), 0);
+  if (received <= 0) {
+    if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
+    }
+    _drop(&connection - &_connections[0]);
+    return;
+  }
+  _bytesIn += received;
+  connection.in.append(buffer, received);
+  const uint64_t now = monotonicNs();
+  size_t begin = 0;
+  size_t end = 0;
+  while ((end = connection.in.find("\r\n", begin)) != std::string::npos) {
+    _handle(connection, connection.in.substr(begin, end - begin), now);
+    begin = end + 2;
+  }
+  connection.in.erase(0, begin);
+}
+
+void Load::_handle(Connection &connection, const std::string &line,
+                   uint64_t now) {
+  // :nick!user@host PRIVMSG #loadN :<send time in ns> <padding>
+  const size_t privmsg = line.find(" PRIVMSG " LOAD_CHANNEL);
+  if (privmsg != std::string::npos) {
+    const size_t body = line.find(" :", privmsg);
+    if (body != std::string::npos) {
+      const uint64_t sentAt = std::strtoul(line.c_str() + body + 2, NULL, 10);
+      if (sentAt != 0 && sentAt <= now) {
+        _latencies.push_back(static_cast<uint32_t>((now - sentAt) / 1000));
+        ++_delivered;
+      }
+    }
+    return;
+  }
+  std::istringstream words(line);
+  std::string prefix;
+  std::string command;
+  words >> prefix >> command;
+  if (command == "001" && !connection.isRegistered) {
+    connection.isRegistered = true;
+    ++_registered;
+    _setupTimes.push_back(
+        static_cast<uint32_t>((now - connection.startedAt) / 1000));
+    for (size_t k = 0; k < connection.channels.size(); ++k) {
+      std::stringstream join;
+      join << "JOIN " LOAD_CHANNEL << connection.channels[k];
+      _queue(connection, join.str());
+    }
+  } else if (command == "JOIN" &&
+             connection.joined < connection.channels.size() &&
+             prefix.compare(1, connection.nick.size() + 1,
+                            connection.nick + "!") == 0) {
+    ++_members[connection.channels[connection.joined]];
+    ++connection.joined;
+    ++_joins;
+  } else if (command == "PING") {
+    std::string token;
+    words >> token;
+    _queue(connection, "PONG " + token);
+  }
+}
+
+void Load::_queue(Connection &connection, const std::string &line) {
+  connection.out += line;
+  connection.out += "\r\n";
+}
+
+bool Load::_flush(Connection &connection) {
+  while (!connection.out.empty()) {
+    const ssize_t sent = send(connection.fd, connection.out.data(),
+                              connection.out.size(), MSG_NOSIGNAL);
+    if (sent == -1) {
+      return errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOTCONN;
+    }
+    connection.out.erase(0, sent);
+  }
+  return true;
+}
+
+// Keeps the number of messages sent at elapsed * rate, the senders taking
+// turns among the joined clients
+void Load::_sendMessages(uint64_t elapsed) {
+  const uint64_t due = static_cast<uint64_t>(elapsed / 1e9 * _rate);
+  const std::string padding(_size, 'x');
+  size_t skipped = 0;
+  while (_sent < due && skipped < _connections.size()) {
+    Connection &connection = _connections[_nextSender];
+    _nextSender = (_nextSender + 1) % _connections.size();
+    if (connection.fd == -1 || connection.joined == 0) {
+      ++skipped;
+      continue;
+    }
+    skipped = 0;
+    const size_t channel = connection.channels[_sent % connection.joined];
+    std::stringstream line;
+    line << "PRIVMSG " LOAD_CHANNEL << channel << " :" << monotonicNs() << " "
+         << padding;
+    _queue(connection, line.str());
+    if (!_flush(connection)) {
+      _drop(&connection - &_connections[0]);
+      continue;
+    }
+    _expected += _members[channel] - 1;
+    ++_sent;
+  }
+}
+
+void Load::_drop(size_t index) {
+  Connection &connection = _connections[index];
+  close(connection.fd);
+  connection.fd = -1;
+  if (!connection.isRegistered) {
+    ++_failed;
+  }
+  for (size_t k = 0; k < connection.joined; ++k) {
+    --_members[connection.channels[k]];
+  }
+  connection.joined = 0;
+}
+
+// One "key value" pair per line, on stdout
+void Load::_report(uint64_t elapsed) const {
+  const double seconds = elapsed / 1e9;
+  std::cout << std::fixed << std::setprecision(1) << "clients " << _clients
+            << "\nregistered " << _registered << "\nfailed " << _failed
+            << "\nchannels " << _channels << "\nper_client " << _perClient
+            << "\nsent " << _sent << "\nexpected " << _expected
+            << "\ndelivered " << _delivered << "\nsent_per_s "
+            << (_duration > 0 ? static_cast<double>(_sent) / _duration : 0)
+            << "\ndelivered_per_s "
+            << (seconds > 0 ? _delivered / seconds : 0) << "\nbytes_in_per_s "
+            << (seconds > 0 ? _bytesIn / seconds : 0) << "\n";
+  printDistribution("setup", _setupTimes);
+  printDistribution("latency", _latencies);
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#define LOAD_CHANNEL "#load"   // channels are #load0, #load1...
+#define LOAD_SETUP_TIMEOUT 60  // s to connect and join before sending anyway
+#define LOAD_DRAIN 2           // s to wait for the last deliveries
+
+// Load generator: many non-blocking connections from one process, joined to
+// a channel topology and sending PRIVMSG at a target rate. Every message
+// carries its send time, so each delivery gives an end-to-end latency.
+class Load {  // NOLINT
+ public:
+  Load(const std::string &port, const std::string &password,
+       const std::vector<std::string> &options);
+  ~Load();
+
+  void run();
+
+ private:
+  struct Connection {
+    int fd;
+    std::string nick;
+    std::string in;
+    std::string out;
+    uint64_t startedAt;  // connect(), then 001 gives the setup time
+    bool isRegistered;
+    size_t joined;
+    std::vector<size_t> channels;
+  };
+
+  Load(const Load &other);
+  Load &operator=(const Load &other);
+
+  void _parseOption(const std::string &option);
+  void _connect();
+  void _receive(Connection &connection);
+  void _handle(Connection &connection, const std::string &line, uint64_t now);
+  void _queue(Connection &connection, const std::string &line);
+  bool _flush(Connection &connection);
+  void _sendMessages(uint64_t now);
+  void _drop(size_t index);
+  void _report(uint64_t elapsed) const;
+
+  // options
+  int _port;
+  std::string _password;
+  std::string _host;
+  size_t _clients;
+  size_t _channels;
+  size_t _perClient;  // channels joined by each client
+  double _rate;       // messages per second, all clients together
+  double _ramp;       // connections opened per second
+  unsigned int _duration;
+  size_t _size;  // bytes of padding in each message
+
+  std::vector<Connection> _connections;
+  std::vector<size_t> _members;  // joined clients per channel
+  size_t _failed;
+  size_t _registered;
+  size_t _joins;
+  size_t _nextSender;
+  uint64_t _sent;
+  uint64_t _expected;  // deliveries the sent messages should cause
+  uint64_t _delivered;
+  uint64_t _bytesIn;
+  std::vector<uint32_t> _setupTimes;  // us
+  std::vector<uint32_t> _latencies;   // us
+};
@@ -1,15 +1,40 @@
 #include "Bot.hpp"
+#include "Load.hpp"
+#include <csignal>
 #include <exception>
 #include <iostream>
+#include <string>
+#include <vector>
+
+volatile sig_atomic_t g_stop = 0;  // NOLINT
+
+void handle_signal(int signum) {  // NOLINT
+    (void)signum;
+    g_stop = 1;
+}
 
 int main(int argc, char **argv) {
-    if (argc != 3) {
-        std::cerr << "Usage: ./bot <port> <password>\n";
+    if (argc < 3) {
+        std::cerr << "Usage: ./bot <port> <password> [channel...]\n"
+                  << "       ./bot <port> <password> load [key=value...]\n";
         return 1;
     }
 
     try {
-        Bot const bot(argv[1], argv[2]);
+        // Ctrl-C ends the run, the counts or the report are still printed
+        signal(SIGINT, handle_signal);  // NOLINT
+        if (argc > 3 && std::string(argv[3]) == "load") {
+            Load load(argv[1], argv[2],
+                      std::vector<std::string>(argv + 4, argv + argc));
+            load.run();
+            return 0;
+        }
+        std::vector<std::string> channels(argv + 3, argv + argc);
+        if (channels.empty()) {
+            channels.push_back(BOT_CHANNEL);
+        }
+        Bot bot(argv[1], argv[2], channels);
+        bot.run();
     } catch (const std::exception &e) {
         std::cerr << e.what() << "\n";
         return 1;
@@ -0,0 +1,103 @@
+#include "Capture.hpp"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <string>
+
+#include "utils.hpp"
+
+#define CAPTURE_INTERVAL 1000000000  // ns between two writes of a quiet trace
+
+Capture::Capture(Logger &log)
+    : _log(log), _fd(-1), _startedAt(0), _flushedAt(0) {}
+
+Capture::~Capture() { close(); }
+
+bool Capture::isOpen() const { return _fd != -1; }
+
+// Truncates the file, the lines carry the passwords so only the owner reads it
+bool Capture::open(const std::string &path) {
+  close();
+  _fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (_fd == -1) {
+    return false;
+  }
+  _startedAt = get_monotonic_ns();
+  _flushedAt = _startedAt;
+  _batch.putString(CAPTURE_MAGIC);
+  _batch.putU32(CAPTURE_VERSION);
+  flush(true);
+  return isOpen();
+}
+
+void Capture::close() {
+  if (_fd == -1) {
+    return;
+  }
+  flush(true);
+  if (_fd != -1) {
+    ::close(_fd);
+    _fd = -1;
+  }
+  _batch.clear();
+}
+
+// Writes the batch once it is big or old enough. The capture stops when the
+// file cannot be written.
+void Capture::flush(bool force) {
+  if (!isOpen() || _batch.data().empty()) {
+    return;
+  }
+  const uint64_t now = get_monotonic_ns();
+  if (!force && _batch.data().size() < CAPTURE_BUFFER &&
+      now - _flushedAt < CAPTURE_INTERVAL) {
+    return;
+  }
+  _flushedAt = now;
+  const std::string &data = _batch.data();
+  size_t written = 0;
+  while (written < data.size()) {
+    const ssize_t n = write(_fd, data.data() + written, data.size() - written);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n == -1) {
+      _log.write(LOG_ERROR, LOG_SERVER, "Capture stopped: %", strerror(errno));
+      ::close(_fd);
+      _fd = -1;
+      break;
+    }
+    written += n;
+  }
+  _batch.clear();
+}
+
+void Capture::connect(int fd) {
+  if (isOpen()) {
+    _record(CONNECT, fd);
+  }
+}
+
+void Capture::line(int fd, const std::string &line) {
+  if (isOpen()) {
+    _record(LINE, fd);
+    _batch.putString(line);
+  }
+}
+
+void Capture::disconnect(int fd) {
+  if (isOpen()) {
+    _record(DISCONNECT, fd);
+  }
+}
+
+void Capture::_record(Record type, int fd) {
+  _batch.putU8(type);
+  _batch.putU64(get_monotonic_ns() - _startedAt);
+  _batch.putU32(static_cast<uint32_t>(fd));
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <cstddef>
+#include <string>
+
+#include "Blob.hpp"
+#include "Logger.hpp"
+
+#define CAPTURE_FILE "ircserv.trace"  // default of the "capture" config key
+#define CAPTURE_MAGIC "IRCTRACE"
+#define CAPTURE_VERSION 1
+#define CAPTURE_BUFFER 65536  // bytes kept before they are written out
+
+// Binary trace of the client traffic, replayed by ircreplay. The file starts
+// with CAPTURE_MAGIC (a string) and CAPTURE_VERSION, then one record per
+// event: the type, the ns since the capture started, the fd, and for LINE the
+// line as received.
+// Without a file open every record is a no-op.
+class Capture {
+ public:
+  enum Record { CONNECT = 1, LINE, DISCONNECT };
+
+  explicit Capture(Logger &log);
+  ~Capture();
+
+  bool isOpen() const;
+  bool open(const std::string &path);
+  void close();
+  void flush(bool force = false);
+
+  void connect(int fd);
+  void line(int fd, const std::string &line);
+  void disconnect(int fd);
+
+ private:
+  Capture(const Capture &other);
+  Capture &operator=(const Capture &other);
+
+  void _record(Record type, int fd);
+
+  Logger &_log;  // the server's
+  int _fd;
+  uint64_t _startedAt;  // monotonic ns
+  uint64_t _flushedAt;
+  BlobWriter _batch;
+};
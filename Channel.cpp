@@ -1,10 +1,14 @@
 #include "Channel.hpp"
 
+#include <stdint.h>
+
 #include <cstddef>
 #include <map>
 #include <sstream>
 #include <string>
+#include <vector>
 
+#include "Blob.hpp"
 #include "Client.hpp"
 #include "Server.hpp"
 #include "utils.hpp"
@@ -25,34 +29,81 @@ ClientList Channel::getClients() const { return _clients; }
 ClientList Channel::getOperators() const { return _operators; }
 ClientList Channel::getInvited() const { return _invited; }
 std::string Channel::getName() const { return _name; }
+size_t Channel::getClientCount() const { return _clients.size(); }
+bool Channel::isOperator(int clientFd) const {
+  return _operators.count(clientFd) != 0;
+}
+
+// The nicks of RPL_NAMREPLY, operators with "@"
+std::string Channel::getNames() const {
+  std::string names;
+  for (ClientList::const_iterator it = _clients.begin(); it != _clients.end();
+       ++it) {
+    if (it != _clients.begin()) {
+      names += " ";
+    }
+    if (isOperator(it->first)) {
+      names += "@";
+    }
+    names += it->second->getNick();
+  }
+  return names;
+}
 bool Channel::isInviteOnly() const { return _isInviteOnly; }
 bool Channel::isTopicOperOnly() const { return _topicOperOnly; }
 bool Channel::isTopicSet() const { return _topicSet; }
 bool Channel::isPassRequired() const { return _passRequired; }
 bool Channel::isLimited() const { return _isLimited; }
 size_t Channel::getLimit() const { return _limit; }
+History &Channel::getHistory() { return _history; }
+const History &Channel::getHistory() const { return _history; }
 std::string Channel::getTopic() const { return _topic; }
 std::string Channel::getPassword() const { return _password; }
 void Channel::setTopic(const std::string &topic) {
   _topic = topic;
   _topicSet = true;
+  _server->getJournal().topic(_name, _topic);
+  _server->touchChannel(_name);
+}
+void Channel::setInviteOnly(bool inviteOnly) {
+  _isInviteOnly = inviteOnly;
+  _journalModes();
 }
-void Channel::setInviteOnly(bool inviteOnly) { _isInviteOnly = inviteOnly; }
 void Channel::setTopicSet(bool topicSet) { _topicSet = topicSet; }
 void Channel::setPassRequired(bool passRequired) {
   _passRequired = passRequired;
+  _journalModes();
 }
 void Channel::setPass(const std::string &pass) {
   _password = pass;
   _passRequired = true;
+  _journalModes();
+}
+void Channel::setLimited(bool limited) {
+  _isLimited = limited;
+  _journalModes();
 }
-void Channel::setLimited(bool limited) { _isLimited = limited; }
 void Channel::setLimit(size_t limit) {
   _limit = limit;
   _isLimited = true;
+  _journalModes();
 }
 void Channel::setTopicOperOnly(bool topicOperOnly) {
   _topicOperOnly = topicOperOnly;
+  _journalModes();
+}
+
+uint8_t Channel::getFlags() const {
+  return static_cast<uint8_t>(
+      (_isInviteOnly ? FLAG_INVITE_ONLY : 0) |
+      (_topicOperOnly ? FLAG_TOPIC_OPER_ONLY : 0) |
+      (_topicSet ? FLAG_TOPIC_SET : 0) |
+      (_passRequired ? FLAG_PASS_REQUIRED : 0) |
+      (_isLimited ? FLAG_LIMITED : 0));
+}
+
+void Channel::_journalModes() {
+  _server->getJournal().modes(_name, getFlags(), _password, _limit);
 }
 
 std::string Channel::getMode(Client *client) const {
@@ -93,6 +144,8 @@ void Channel::addClient(Client *client) {
     _operators[client->getClientFd()] = client;
   }
   _clients[client->getClientFd()] = client;
+  _server->getJournal().join(_name, client->getClientFd());
+  _server->touchChannel(_name);
   if (_isInviteOnly) {
     _invited.erase(client->getClientFd());
   }
@@ -102,8 +155,11 @@ void Channel::removeClient(int clientFd) {
   const ClientList::iterator it = _clients.find(clientFd);
   if (it != _clients.end()) {
     _clients.erase(it);
+    _server->getJournal().part(_name, clientFd);
+    _server->touchChannel(_name);
   }
-  removeOperator(clientFd);
+  _operators.erase(clientFd);
+  _isBanned.erase(clientFd);
 }
 
 void Channel::addOperator(Client *client) {
@@ -111,11 +167,15 @@ void Channel::addOperator(Client *client) {
     return;
   }
   _operators[client->getClientFd()] = client;
+  _server->getJournal().setOperator(_name, client->getClientFd(), true);
+  _server->touchChannel(_name);
 }
 
 void Channel::removeOperator(int clientFd) {
   if (findClient(_operators, clientFd) != NULL) {
     _operators.erase(clientFd);
+    _server->getJournal().setOperator(_name, clientFd, false);
+    _server->touchChannel(_name);
   }
 }
 
@@ -124,10 +184,179 @@ void Channel::addInvited(Client *client) {
     return;
   }
   _invited[client->getClientFd()] = client;
+  client->addInvitation(_name);
+}
+
+// Also when the client leaves the server, its fd may be reused. The client
+// forgets the invitations it had then, see Client::forgetInvitations.
+void Channel::removeInvited(int clientFd) { _invited.erase(clientFd); }
+
+void Channel::measure(MemoryUsage &usage) const {
+  usage.add(MEM_CHANNELS, sizeof(*this));
+  usage.add(MEM_STRINGS, MemoryUsage::ofString(_name) +
+                             MemoryUsage::ofString(_topic) +
+                             MemoryUsage::ofString(_password) +
+                             MemoryUsage::ofString(_pass));
+  const size_t entry = sizeof(ClientList::value_type);
+  usage.add(MEM_MEMBERS,
+            MemoryUsage::ofMap(_clients.size() + _operators.size(), entry) +
+                MemoryUsage::ofMap(_isBanned.size(),
+                                   sizeof(std::map<int, bool>::value_type)));
+  usage.add(MEM_INVITES, MemoryUsage::ofMap(_invited.size(), entry));
+  usage.add(MEM_HISTORY, _history.getBytes());
+  _bans.measure(usage);
+  _exceptions.measure(usage);
+}
+
+// * Ban and exception lists *
+
+const MaskList &Channel::getMasks(char mode) const {
+  return mode == 'e' ? _exceptions : _bans;
+}
+
+bool Channel::addMask(char mode, const std::string &mask,
+                      const std::string &setter, uint64_t setAt) {
+  MaskList &list = (mode == 'e' ? _exceptions : _bans);
+  if (list.size() >= MAX_MASKS || !list.add(mask, setter, setAt)) {
+    return false;
+  }
+  _isBanned.clear();
+  _server->getJournal().mask(_name, mode, true, mask, setter, setAt);
+  return true;
+}
+
+bool Channel::removeMask(char mode, const std::string &mask) {
+  if (!(mode == 'e' ? _exceptions : _bans).remove(mask)) {
+    return false;
+  }
+  _isBanned.clear();
+  _server->getJournal().mask(_name, mode, false, mask, "", 0);
+  return true;
 }
 
+// Matched by a ban and by no exception. Members keep their verdict until a
+// list or their prefix changes, so a message does not glob the lists again.
+bool Channel::isBanned(Client *client) {
+  if (_bans.size() == 0) {
+    return false;
+  }
+  const int fd = client->getClientFd();
+  const bool isMember = _clients.count(fd) != 0;
+  if (isMember) {
+    const std::map<int, bool>::const_iterator it = _isBanned.find(fd);
+    if (it != _isBanned.end()) {
+      return it->second;
+    }
+  }
+  const std::string mask = client->getPrefix().substr(1);
+  const bool isBanned = _bans.matches(mask) && !_exceptions.matches(mask);
+  if (isMember) {
+    _isBanned[fd] = isBanned;
+  }
+  return isBanned;
+}
+
+void Channel::forgetMatch(int clientFd) { _isBanned.erase(clientFd); }
+
 bool Channel::isValidName(const std::string &name) {
   return !name.empty() && name[0] == '#' && name.length() <= 50 &&
          name.find_first_of(" ,:") == std::string::npos &&
          name.find('\a') == std::string::npos;
 }
+
+namespace {
+
+void saveMembers(BlobWriter &out, const ClientList &members) {
+  out.putU32(static_cast<uint32_t>(members.size()));
+  for (ClientList::const_iterator it = members.begin(); it != members.end();
+       ++it) {
+    out.putU32(static_cast<uint32_t>(it->first));
+  }
+}
+
+// Clients are saved by the fd they had in the previous process
+void loadMembers(BlobReader &in, ClientList &members,
+                 const ClientList &clientsByOldFd) {
+  const uint32_t count = in.getU32();
+  for (uint32_t i = 0; i < count; ++i) {
+    Client *client =
+        findClient(clientsByOldFd, static_cast<int>(in.getU32()));
+    if (client != NULL) {
+      members[client->getClientFd()] = client;
+    }
+  }
+}
+
+void saveMasks(BlobWriter &out, const MaskList &list) {
+  const std::vector<MaskList::Entry> &entries = list.getEntries();
+  out.putU32(static_cast<uint32_t>(entries.size()));
+  for (size_t i = 0; i < entries.size(); ++i) {
+    out.putString(entries[i].mask);
+    out.putString(entries[i].setter);
+    out.putU64(entries[i].setAt);
+  }
+}
+
+void loadMasks(BlobReader &in, MaskList &list) {
+  const uint32_t count = in.getU32();
+  for (uint32_t i = 0; i < count; ++i) {
+    const std::string mask = in.getString();
+    const std::string setter = in.getString();
+    list.add(mask, setter, in.getU64());
+  }
+}
+
+}  // namespace
+
+void Channel::saveState(BlobWriter &out) const {
+  out.putString(_topic);
+  out.putString(_password);
+  out.putU8(getFlags());
+  out.putU64(_limit);
+  saveMembers(out, _clients);
+  saveMembers(out, _operators);
+  saveMembers(out, _invited);
+  saveMasks(out, _bans);
+  saveMasks(out, _exceptions);
+  std::vector<const History::Entry *> entries;
+  _history.select(History::AFTER, true, 0, _history.size(), entries);
+  out.putU32(static_cast<uint32_t>(entries.size()));
+  for (std::vector<const History::Entry *>::const_iterator it =
+           entries.begin();
+       it != entries.end(); ++it) {
+    out.putU64((*it)->msgid);
+    out.putU64((*it)->time);
+    out.putString((*it)->line);
+  }
+}
+
+void Channel::loadState(BlobReader &in, const ClientList &clientsByOldFd) {
+  _topic = in.getString();
+  _password = in.getString();
+  const uint8_t flags = in.getU8();
+  _isInviteOnly = (flags & FLAG_INVITE_ONLY) != 0;
+  _topicOperOnly = (flags & FLAG_TOPIC_OPER_ONLY) != 0;
+  _topicSet = (flags & FLAG_TOPIC_SET) != 0;
+  _passRequired = (flags & FLAG_PASS_REQUIRED) != 0;
+  _isLimited = (flags & FLAG_LIMITED) != 0;
+  _limit = static_cast<size_t>(in.getU64());
+  loadMembers(in, _clients, clientsByOldFd);
+  loadMembers(in, _operators, clientsByOldFd);
+  loadMembers(in, _invited, clientsByOldFd);
+  for (ClientList::const_iterator it = _invited.begin(); it != _invited.end();
+       ++it) {
+    it->second->addInvitation(_name);
+  }
+  loadMasks(in, _bans);
+  loadMasks(in, _exceptions);
+  const uint32_t count = in.getU32();
+  for (uint32_t i = 0; i < count; ++i) {
+    const uint64_t msgid = in.getU64();
+    const uint64_t time = in.getU64();
+    _history.push(msgid, time, in.getString());
+  }
+  for (ClientList::const_iterator it = _clients.begin(); it != _clients.end();
+       ++it) {
+    it->second->addChannel(this);
+  }
+}
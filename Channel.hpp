@@ -1,9 +1,19 @@
 #pragma once
 
+#include <stdint.h>
+
 #include <cstddef>
 #include <map>
 #include <string>
 
+#include "History.hpp"
+#include "MaskList.hpp"
+#include "Memory.hpp"
+
+#define MAX_MASKS 1000  // entries of a +b or +e list, advertised as MAXLIST
+
+class BlobReader;
+class BlobWriter;
 class Server;
 class Client;
 
@@ -11,6 +21,14 @@ typedef std::map<int, Client *> ClientList;
 
 class Channel {
  public:
+  enum Flag {  // as stored by saveState() and sent to the standby
+    FLAG_INVITE_ONLY = 1,
+    FLAG_TOPIC_OPER_ONLY = 2,
+    FLAG_TOPIC_SET = 4,
+    FLAG_PASS_REQUIRED = 8,
+    FLAG_LIMITED = 16
+  };
+
   Channel(const std::string &name, Server *server);
   ~Channel();
 
@@ -24,6 +42,9 @@ class Channel {
   ClientList getClients() const;
   ClientList getOperators() const;
   ClientList getInvited() const;
+  size_t getClientCount() const;
+  bool isOperator(int clientFd) const;
+  std::string getNames() const;
   std::string getName() const;
   std::string getTopic() const;
   std::string getPassword() const;
@@ -35,6 +56,9 @@ class Channel {
   std::string getPass() const;
   bool isLimited() const;
   size_t getLimit() const;
+  uint8_t getFlags() const;
+  History &getHistory();
+  const History &getHistory() const;
   void setTopic(const std::string &topic);
   void setPassword(const std::string &password);
   void setInviteOnly(bool inviteOnly);
@@ -50,14 +74,27 @@ class Channel {
   void addOperator(Client *client);
   void removeOperator(int clientFd);
   void addInvited(Client *client);
+  void removeInvited(int clientFd);
+  void measure(MemoryUsage &usage) const;
+  const MaskList &getMasks(char mode) const;
+  bool addMask(char mode, const std::string &mask, const std::string &setter,
+               uint64_t setAt);
+  bool removeMask(char mode, const std::string &mask);
+  bool isBanned(Client *client);
+  void forgetMatch(int clientFd);
 
   static bool isValidName(const std::string &name);
 
+  void saveState(BlobWriter &out) const;
+  void loadState(BlobReader &in, const ClientList &clientsByOldFd);
+
  private:
   Channel();
   Channel(const Channel &other);
   Channel &operator=(const Channel &other);
 
+  void _journalModes();
+
   std::string _name;
   std::string _topic;
   std::string _password;
@@ -71,5 +108,9 @@ class Channel {
   ClientList _clients;
   ClientList _operators;
   ClientList _invited;
+  MaskList _bans;
+  MaskList _exceptions;
+  std::map<int, bool> _isBanned;  // verdict per member, reset on list changes
+  History _history;
   Server *_server;
 };
@@ -1,8 +1,10 @@
 #include "Client.hpp"
 
+#include <stdint.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 
+#include <algorithm>
 #include <cctype>
 #include <cerrno>
 #include <cstdlib>
@@ -11,63 +13,251 @@
 #include <map>
 #include <string>
 
+#include "Blob.hpp"
 #include "Channel.hpp"
 #include "Server.hpp"
+#include "Tls.hpp"
 
 // * Static members initialization *
 
-const std::map<std::string, CommandFunction> Client::COMMANDS =
-    Client::init_commands_map();
-
-std::map<std::string, CommandFunction> Client::init_commands_map() {
-  std::map<std::string, CommandFunction> commands;
-  commands["PASS"] = &Client::pass;
-  commands["NICK"] = &Client::nick;
-  commands["USER"] = &Client::user;
-  commands["JOIN"] = &Client::join;
-  commands["PART"] = &Client::part;
-  commands["KICK"] = &Client::kick;
-  commands["INVITE"] = &Client::invite;
-  commands["TOPIC"] = &Client::topic;
-  commands["MODE"] = &Client::mode;
-  commands["LIST"] = &Client::list;
-  commands["NAMES"] = &Client::names;
-  commands["CAP"] = &Client::cap;
-  commands["PING"] = &Client::ping;
-  commands["QUIT"] = &Client::quit;
-  commands["WHOIS"] = &Client::whois;
-  commands["PRIVMSG"] = &Client::privmsg;
-  commands["TIME"] = &Client::server_time;
+const CommandList Client::COMMANDS = Client::init_commands_map();
+
+CommandList Client::init_commands_map() {
+  CommandList commands;
+  commands["PASS"].function = &Client::pass;
+  commands["NICK"].function = &Client::nick;
+  commands["USER"].function = &Client::user;
+  commands["JOIN"].function = &Client::join;
+  commands["PART"].function = &Client::part;
+  commands["KICK"].function = &Client::kick;
+  commands["INVITE"].function = &Client::invite;
+  commands["TOPIC"].function = &Client::topic;
+  commands["MODE"].function = &Client::mode;
+  commands["LIST"].function = &Client::list;
+  commands["NAMES"].function = &Client::names;
+  commands["CAP"].function = &Client::cap;
+  commands["PING"].function = &Client::ping;
+  commands["QUIT"].function = &Client::quit;
+  commands["WHOIS"].function = &Client::whois;
+  commands["PRIVMSG"].function = &Client::privmsg;
+  commands["NOTICE"].function = &Client::notice;
+  commands["TIME"].function = &Client::server_time;
+  commands["CHATHISTORY"].function = &Client::chathistory;
+  commands["SERVER"].function = &Client::server;
+  commands["LINKS"].function = &Client::links;
+  commands["OPER"].function = &Client::oper;
+  commands["STATS"].function = &Client::stats;
+  commands["CAPTURE"].function = &Client::capture;
+  commands["LOG"].function = &Client::log;
+  size_t index = 0;
+  for (CommandList::iterator it = commands.begin(); it != commands.end();
+       ++it) {
+    it->second.index = index++;
+  }
   return commands;
 }
 
 // * Constructors and destructors *
 
-Client::Client(int sockfd, Server *server)
+Client::Client(int sockfd, Server *server, const std::string &address)
     : _clientFd(sockfd),
+      _hostname(address),
+      _address(address),
       _joinedAt(0),
       _isPassSet(false),
       _isNickSet(false),
       _isUserSet(false),
       _isAuthenticated(false),
+      _isLookingUp(false),
+      _isQuerying(false),
+      _isReady(false),
+      _floodStart(0),
+      _floodLines(0),
       _wantsToQuit(false),
-      _server(server) {}
+      _isOper(false),
+      _caps(0),
+      _batchCount(0),
+      _isLink(false),
+      _uplink(NULL),
+      _server(server),
+      _replySent(0),
+      _tls(NULL) {}
 
-Client::~Client() {}
+Client::~Client() { delete _tls; }
 
 // * Getters and setters *
 
 const std::string &Client::getNick() const { return _nick; }
 const std::string &Client::getUser() const { return _user; }
+std::string Client::getUsername() const {
+  return _ident.empty() ? "~" + _user : _ident;
+}
 const std::string &Client::getHostname() const { return _hostname; }
+const std::string &Client::getAddress() const { return _address; }
 const std::string &Client::getRealName() const { return _realName; }
 const std::string &Client::getPassword() const { return _password; }
+const std::string &Client::getPrefix() const { return _prefix; }
 time_t Client::getJoinedAt() const { return _joinedAt; }
 bool Client::isPassSet() const { return _isPassSet; }
 bool Client::isNickSet() const { return _isNickSet; }
 bool Client::isUserSet() const { return _isUserSet; }
 bool Client::isAuthenticated() const { return _isAuthenticated; }
+bool Client::isLookingUp() const { return _isLookingUp; }
+bool Client::hasCap(Capability cap) const { return (_caps & cap) != 0; }
 bool Client::wantsToQuit() const { return _wantsToQuit; }
-bool Client::wantsToWrite() const { return !_outBuffer.empty(); }
+// Replies queued during a TLS handshake wait for it, so POLLOUT is not armed
+// for them
+bool Client::wantsToWrite() const {
+  return !_outBuffer.empty() && (_tls == NULL || _tls->isEstablished());
+}
+size_t Client::getOutBufferSize() const { return _outBuffer.size(); }
+
+void Client::measure(MemoryUsage &usage) const {
+  usage.add(MEM_CLIENTS, sizeof(*this));
+  const std::string *const strings[] = {
+      &_nick,     &_user,  &_hostname, &_address,    &_realName,
+      &_password, &_ident, &_prefix,   &_serverName};
+  for (size_t i = 0; i < sizeof(strings) / sizeof(strings[0]); ++i) {
+    usage.add(MEM_STRINGS, MemoryUsage::ofString(*strings[i]));
+  }
+  usage.add(MEM_RECVQ, MemoryUsage::ofString(_inBuffer));
+  usage.add(MEM_SENDQ, MemoryUsage::ofString(_outBuffer));
+  usage.add(MEM_SENDQ, MemoryUsage::ofString(_reply));
+  usage.add(MEM_MEMBERS, MemoryUsage::ofMap(_channels.size(),
+                                            sizeof(ChannelList::value_type)));
+  usage.add(MEM_INVITES, MemoryUsage::ofMap(_invitations.size(),
+                                            sizeof(std::string)));
+  for (std::set<std::string>::const_iterator it = _invitations.begin();
+       it != _invitations.end(); ++it) {
+    usage.add(MEM_STRINGS, MemoryUsage::ofString(*it));
+  }
+}
+bool Client::isOper() const { return _isOper; }
 int Client::getClientFd() const { return _clientFd; }
 const ChannelList &Client::getChannels() const { return _channels; }
+bool Client::isLink() const { return _isLink; }
+bool Client::isRemote() const { return _uplink != NULL; }
+const std::string &Client::getServerName() const { return _serverName; }
+Client *Client::getUplink() const { return _uplink; }
+void Client::setWantsToQuit(bool wantsToQuit) { _wantsToQuit = wantsToQuit; }
+void Client::setServerName(const std::string &name) { _serverName = name; }
+
+// The link a message from this client arrived on, NULL for local users
+Client *Client::getRoute() { return _isLink ? this : _uplink; }
+
+void Client::setLink(const std::string &name) {
+  _isLink = true;
+  _serverName = name;
+}
+
+void Client::setNick(const std::string &nick) {
+  _nick = nick;
+  _updatePrefix();
+}
+
+// uid: UID <nick> <user> <host> <registration time> <real name>
+void Client::setRemote(Client *uplink, const std::string &server,
+                       const std::vector<std::string> &uid) {
+  _uplink = uplink;
+  _serverName = server;
+  _nick = uid[1];
+  _user = uid[2];
+  _ident = uid[2];  // already with the "~" of its server
+  _hostname = uid[3];
+  _joinedAt = static_cast<time_t>(std::atol(uid[4].c_str()));
+  _realName = uid[5];
+  _isNickSet = true;
+  _isUserSet = true;
+  _isAuthenticated = true;
+  _updatePrefix();
+}
+
+// Holds the registration until lookupDone()
+void Client::startLookup() {
+  _isLookingUp = true;
+  _server->sendToClient(this, ":" + _server->getName() +
+                                  " NOTICE * :*** Looking up your hostname...");
+}
+
+// An empty host keeps the address, an empty ident the one already known.
+// Completes a registration that only waited for the lookup.
+void Client::lookupDone(const std::string &host, const std::string &ident) {
+  _isLookingUp = false;
+  if (!host.empty()) {
+    _hostname = host;
+  }
+  if (!ident.empty()) {
+    _ident = ident;
+  }
+  _updatePrefix();
+  _server->sendToClient(this, ":" + _server->getName() + " NOTICE * :*** " +
+                                  (_hostname == _address
+                                       ? "Couldn't look up your hostname"
+                                       : "Found your hostname: " + _hostname));
+  if (!_isAuthenticated && _isNickSet && _isUserSet) {
+    _authenticate();
+  }
+}
+
+// The password is not kept once checked
+void Client::passwordChecked(bool isValid) {
+  std::fill(_password.begin(), _password.end(), '\0');
+  _password.clear();
+  if (!isValid) {
+    createMessage(Server::ERR_PASSWDMISMATCH);
+    _wantsToQuit = true;
+    return;
+  }
+  _register();
+}
+
+void Client::closeLink(const std::string &reason) {
+  _server->sendToClient(
+      this, "ERROR :Closing Link: " + _hostname + " (" + reason + ")");
+  _wantsToQuit = true;
+}
+
+// * State handover *
+
+void Client::saveState(BlobWriter &out) const {
+  out.putString(_nick);
+  out.putString(_user);
+  out.putString(_hostname);
+  out.putString(_address);
+  out.putString(_ident);
+  out.putString(_realName);
+  out.putString(_password);
+  out.putU64(static_cast<uint64_t>(_joinedAt));
+  out.putU8(static_cast<uint8_t>((_isPassSet ? 1 : 0) | (_isNickSet ? 2 : 0) |
+                                 (_isUserSet ? 4 : 0) |
+                                 (_isAuthenticated ? 8 : 0) |
+                                 (_isOper ? 16 : 0) |
+                                 (_isLookingUp ? 32 : 0)));
+  out.putU32(static_cast<uint32_t>(_caps));
+  out.putU64(_batchCount);
+  out.putString(_inBuffer);
+  out.putString(_outBuffer + _reply.substr(_replySent));  // sent whole
+}
+
+void Client::loadState(BlobReader &in) {
+  _nick = in.getString();
+  _user = in.getString();
+  _hostname = in.getString();
+  _address = in.getString();
+  _ident = in.getString();
+  _realName = in.getString();
+  _password = in.getString();
+  _joinedAt = static_cast<time_t>(in.getU64());
+  const uint8_t flags = in.getU8();
+  _isPassSet = (flags & 1) != 0;
+  _isNickSet = (flags & 2) != 0;
+  _isUserSet = (flags & 4) != 0;
+  _isAuthenticated = (flags & 8) != 0;
+  _isOper = (flags & 16) != 0;
+  _isLookingUp = (flags & 32) != 0;
+  _caps = static_cast<int>(in.getU32());
+  _batchCount = static_cast<unsigned long>(in.getU64());
+  _inBuffer = in.getString();
+  _outBuffer = in.getString();
+  _updatePrefix();
+}
@@ -1,36 +1,64 @@
 #pragma once
 
 #include <arpa/inet.h>  // for send, recv
+#include <stdint.h>
 
+#include <cstddef>
 #include <ctime>
 #include <map>
+#include <set>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include "History.hpp"
 #include "Server.hpp"
 
 #define BUFFER_SIZE 512  // standard message size for IRC
-#define CHANNEL_PREFIXES "#&+!"
-
+#define TURN_LINES 16    // lines a client has handled per tick at most
+#define TURN_BYTES 2048  // same, in bytes
+#define REPLY_CHUNK 16384  // bytes of a query reply queued at once
+#define CHANNEL_PREFIXES "#"  // advertised as CHANTYPES, all Channel accepts
+#define MAX_TARGETS 4  // advertised as TARGMAX for PRIVMSG and NOTICE
+#define SUPPORTED_CAPS "batch draft/chathistory message-tags server-time"
+#define TRYAGAIN_TEXT "Server load is temporarily too heavy, please try again"
+
+class BlobReader;
+class BlobWriter;
 class Channel;
+class TlsSession;
 
 typedef void (Client::*CommandFunction)(const std::vector<std::string> &);
+
+// A handler and its index in the stats counters and latency histograms, which
+// list the commands in name order
+struct Command {
+  CommandFunction function;
+  size_t index;
+};
+
+typedef std::map<std::string, Command> CommandList;
 typedef std::map<std::string, Channel *> ChannelList;
 typedef std::vector<std::pair<char, char> > ModeChanges;
 
 class Client {
  public:
   enum TargetType { CLIENT, CHANNEL, SERVER };
+  enum Capability {
+    CAP_BATCH = 1,
+    CAP_CHATHISTORY = 2,
+    CAP_SERVER_TIME = 4,
+    CAP_MESSAGE_TAGS = 8
+  };
 
   typedef Server::ERR ERR;
   typedef Server::RPL RPL;
 
-  static const std::map<std::string, CommandFunction> COMMANDS;
+  static const CommandList COMMANDS;
 
-  static std::map<std::string, CommandFunction> init_commands_map();
+  static CommandList init_commands_map();
 
-  Client(int sockfd, Server *server);
+  Client(int sockfd, Server *server, const std::string &address = "");
   ~Client();
 
   // * COMMANDS *
@@ -40,11 +68,19 @@ class Client {
   void user(const std::vector<std::string> &msg);
   void whois(const std::vector<std::string> &msg);
   void privmsg(const std::vector<std::string> &msg);
+  void notice(const std::vector<std::string> &msg);
   void ping(const std::vector<std::string> &msg);
   void cap(const std::vector<std::string> &msg);
   void quit(const std::vector<std::string> &msg);
   void list(const std::vector<std::string> &msg);
   void server_time(const std::vector<std::string> &msg);
+  void chathistory(const std::vector<std::string> &msg);
+  void server(const std::vector<std::string> &msg);
+  void links(const std::vector<std::string> &msg);
+  void oper(const std::vector<std::string> &msg);
+  void stats(const std::vector<std::string> &msg);
+  void capture(const std::vector<std::string> &msg);
+  void log(const std::vector<std::string> &msg);
 
   // * CHANNEL COMMANDS *
   void join(const std::vector<std::string> &msg);
@@ -59,23 +95,52 @@ class Client {
   int getClientFd() const;
   const std::string &getNick() const;
   const std::string &getUser() const;
+  std::string getUsername() const;  // ident reply, or "~" and the USER one
   const std::string &getHostname() const;
+  const std::string &getAddress() const;
   const std::string &getRealName() const;
   const std::string &getPassword() const;
+  const std::string &getPrefix() const;
   time_t getJoinedAt() const;
   bool isPassSet() const;
   bool isNickSet() const;
   bool isUserSet() const;
   bool isAuthenticated() const;
+  bool isLookingUp() const;
+  bool hasCap(Capability cap) const;
   bool wantsToQuit() const;
-  bool wantsToWrite() const;
+  bool wantsToWrite() const;  // false until a TLS handshake is done
+  size_t getOutBufferSize() const;
+  void measure(MemoryUsage &usage) const;
+  bool isOper() const;
   const ChannelList &getChannels() const;
+  bool isLink() const;
+  bool isRemote() const;
+  const std::string &getServerName() const;
+  Client *getUplink() const;
+  Client *getRoute();
+  void setWantsToQuit(bool wantsToQuit);
+  void setServerName(const std::string &name);
+  void setLink(const std::string &name);
+  void setNick(const std::string &nick);
+  void setRemote(Client *uplink, const std::string &server,
+                 const std::vector<std::string> &uid);
+  void startLookup();
+  void lookupDone(const std::string &host, const std::string &ident);
+  void passwordChecked(bool isValid);
+  void operChecked(bool isValid);
+  void operBusy();  // the check was refused or timed out
+  void queryDone(const std::string &reply);
+  void closeLink(const std::string &reason);
 
   // * HELPERS *
   static bool isValidName(const std::string &name);
+  void addChannel(Channel *channel);
   void removeChannel(const std::string &name);
   void appendToOutBuffer(const std::string &msg);
   void leaveAllChannels();
+  void addInvitation(const std::string &channel);
+  void forgetInvitations();
   void broadcastToAllChannels(const std::string &msg,
                               const std::string &command = "");
   void joinChannel(Channel *channel);
@@ -86,7 +151,13 @@ class Client {
                          const std::string &modes);
 
   // * COMMUNICATION *
+  void startTls(TlsSession *session);
+  bool hasTlsSession() const;
   void receive();
+  void resume();  // the lines left from the last turn
+  bool hasLines() const;
+  bool isReady() const;  // on the server's ready queue
+  void setReady(bool isReady);
   void answer();
   void createMessage(ERR error_code, const std::string &param = "",
                      const std::string &end = "");
@@ -96,30 +167,71 @@ class Client {
   void createMessage(RPL response_code, Channel *targetChannel,
                      Client *targetClient);
 
+  // * STATE HANDOVER *
+  void saveState(BlobWriter &out) const;
+  void loadState(BlobReader &in);
+
  private:
   Client();
   Client(const Client &other);
   Client &operator=(const Client &other);
 
   void _authenticate();
+  void _register();
+  void _handshake();
   void _broadcastNickChange(const std::string &newNick);
-  void _messageClient(const std::vector<std::string> &msg);
-  void _messageChannel(const std::vector<std::string> &msg);
+  void _updatePrefix();
+  static int _capFromName(const std::string &name);
+  std::string _capNames() const;
+  void _replayHistory(const std::string &target,
+                      const std::vector<const History::Entry *> &entries);
+  std::string _format(RPL response_code) const;
+  std::string _format(RPL response_code, const Client *targetClient) const;
+  void _handleLines();
+  bool _isThrottled();
+  void _query(QueryJob *job);
+  void _streamReply(const std::string &reply);
+  bool _sendReplyChunk();
+  void _statsReply(RPL response_code, const std::string &text);
+  void _listMasks(Channel *channel, char mode);
+  void _relayMessage(const std::vector<std::string> &msg, bool isNotice);
+  void _messageClient(const std::string &target, const std::string &line,
+                      bool isNotice);
+  void _messageChannel(const std::string &target, const std::string &line,
+                       bool isNotice);
 
   int _clientFd;
   std::string _nick;
   std::string _user;
   std::string _hostname;
+  std::string _address;  // numeric peer address, empty for dialed links
   std::string _realName;
   std::string _password;
+  std::string _ident;   // user name from ident, as given for remote users
+  std::string _prefix;  // ":nick!user@host", rebuilt on NICK and USER
   time_t _joinedAt;
   bool _isPassSet;
   bool _isNickSet;
   bool _isUserSet;
   bool _isAuthenticated;  // true after pass, nick, user
+  bool _isLookingUp;      // registration waits for the host lookups
+  bool _isQuerying;       // the next lines wait for a query and its reply
+  bool _isReady;          // deferred, its turn comes on the next tick
+  uint64_t _floodStart;   // ns, second the lines are counted in
+  size_t _floodLines;
   bool _wantsToQuit;
+  bool _isOper;  // after a successful OPER
+  int _caps;  // bitmask of the negotiated Capability values
+  unsigned long _batchCount;
+  bool _isLink;             // the connection is a server link
+  std::string _serverName;  // peer of a link, home server of a remote client
+  Client *_uplink;          // link a remote client is reachable through
   Server *_server;
   std::string _inBuffer;
   std::string _outBuffer;
+  std::string _reply;  // rest of a query reply, queued as the socket drains
+  size_t _replySent;
   ChannelList _channels;
+  std::set<std::string> _invitations;  // channels it may be on the list of
+  TlsSession *_tls;  // until kTLS takes over, NULL for plaintext
 };
@@ -1,37 +1,56 @@
+#include <stdint.h>
+
+#include <algorithm>
 #include <cctype>
 #include <cstddef>
 #include <cstdlib>
 #include <ctime>
-#include <iostream>
+#include <deque>
+#include <iomanip>
 #include <iterator>
 #include <map>
+#include <sstream>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include "Channel.hpp"
 #include "Client.hpp"
+#include "History.hpp"
+#include "Probes.hpp"
 #include "Server.hpp"
 #include "utils.hpp"
 
 void Client::handle(const std::string &msg) {
+  if (_isLink) {
+    _server->handleLinkMessage(this, msg);
+    return;
+  }
   std::vector<std::string> parsed = parse(msg);
 
   if (parsed.empty()) {
     return;  // Ignore empty lines
   }
   if (!_isAuthenticated && parsed[0] != "PASS" && parsed[0] != "NICK" &&
-      parsed[0] != "USER" && parsed[0] != "CAP") {
+      parsed[0] != "USER" && parsed[0] != "CAP" && parsed[0] != "SERVER") {
     createMessage(Server::ERR_NOTREGISTERED);
     return;
   }
-  const std::map<std::string, CommandFunction>::const_iterator fn =
-      COMMANDS.find(parsed[0]);
+  const CommandList::const_iterator fn = COMMANDS.find(parsed[0]);
   if (fn == COMMANDS.end()) {
+    _server->getStats().countCommand(COMMANDS.size());
     createMessage(Server::ERR_UNKNOWNCOMMAND, parsed[0]);
     return;
   }
-  const CommandFunction command = fn->second;
+  const size_t index = fn->second.index;
+  _server->getStats().countCommand(index);
+  const CommandFunction command = fn->second.function;
+  PROBE2(command_start, _clientFd, fn->first.c_str());
+  const uint64_t start = get_monotonic_ns();
   (this->*command)(parsed);
+  const uint64_t ns = get_monotonic_ns() - start;
+  PROBE3(command_end, _clientFd, fn->first.c_str(), ns);
+  _server->recordCommand(index, ns, this, parsed);
 }
 
 void Client::pass(const std::vector<std::string> &msg) {
@@ -70,7 +89,12 @@ void Client::nick(const std::vector<std::string> &msg) {
   }
   _nick = nick;
   _isNickSet = true;
-  if (!_isAuthenticated && _isUserSet) {
+  _updatePrefix();
+  if (_isAuthenticated) {
+    _server->getJournal().nick(_clientFd, _nick);
+    _server->touchChannels(_channels);
+  }
+  if (!_isAuthenticated && _isUserSet && !_isLookingUp) {
     _authenticate();
   }
 }
@@ -86,19 +110,52 @@ void Client::user(const std::vector<std::string> &msg) {
   }
 
   _user = msg[1];
-  // mode is usually ignored in irc servers
-  _hostname = msg[3];
+  // mode is usually ignored in irc servers, the host is the peer address
+  if (_address.empty()) {
+    _hostname = msg[3];
+  }
   _realName = msg[4];
   _isUserSet = true;
-  if (_isNickSet) {
+  _updatePrefix();
+  if (_isNickSet && !_isLookingUp) {
     _authenticate();
   }
 }
 
 void Client::cap(const std::vector<std::string> &msg) {
-  if (msg.size() >= 2 && msg[1] == "LS") {
-    _server->sendToClient(this, ":" + _server->getName() + " CAP " +
-                                    (_isAuthenticated ? _nick : "*") + " LS :");
+  if (msg.size() < 2) {
+    createMessage(Server::ERR_NEEDMOREPARAMS, msg[0]);
+    return;
+  }
+  const std::string reply = ":" + _server->getName() + " CAP " +
+                            (_isAuthenticated ? _nick : "*") + " ";
+  const std::string subcommand = uppercase(msg[1]);
+  if (subcommand == "LS") {
+    _server->sendToClient(this, reply + "LS :" + SUPPORTED_CAPS);
+  } else if (subcommand == "LIST") {
+    _server->sendToClient(this, reply + "LIST :" + _capNames());
+  } else if (subcommand == "REQ") {
+    const std::string requested = (msg.size() > 2 ? msg[2] : "");
+    const std::vector<std::string> names = split(requested, ' ');
+    int enable = 0;
+    int disable = 0;
+    for (std::vector<std::string>::const_iterator it = names.begin();
+         it != names.end(); ++it) {
+      const bool removing = ((*it)[0] == '-');
+      const int cap = _capFromName(removing ? it->substr(1) : *it);
+      if (cap == 0) {
+        // The request is accepted or rejected as a whole
+        _server->sendToClient(this, reply + "NAK :" + requested);
+        return;
+      }
+      (removing ? disable : enable) |= cap;
+    }
+    _caps = (_caps | enable) & ~disable;
+    _server->sendToClient(this, reply + "ACK :" + requested);
+  } else if (subcommand != "END") {
+    _server->sendToClient(this, ":" + _server->getName() + " 410 " +
+                                    (_isAuthenticated ? _nick : "*") + " " +
+                                    msg[1] + " :Invalid CAP command");
   }
 }
 
@@ -136,30 +193,30 @@ void Client::whois(const std::vector<std::string> &msg) {
     createMessage(Server::ERR_NOSUCHNICK, target);
     return;
   }
-  createMessage(Server::RPL_WHOISUSER, targetClient);
-  if (!_channels.empty()) {
-    createMessage(Server::RPL_WHOISCHANNELS, targetClient);
-  }
-  createMessage(Server::RPL_WHOISSERVER, targetClient);
-  createMessage(Server::RPL_WHOISIDLE, targetClient);
-  createMessage(Server::RPL_ENDOFWHOIS);
+  std::vector<std::string> channels;
+  const ChannelList &joined = targetClient->getChannels();
+  for (ChannelList::const_iterator it = joined.begin(); it != joined.end();
+       ++it) {
+    channels.push_back(
+        (it->second->isOperator(targetClient->getClientFd()) ? "@" : "") +
+        it->first);
+  }
+  QueryJob *job =
+      new QueryJob(_clientFd, QueryJob::WHOIS, _server->getName(), _nick);
+  job->setChannels(targetClient->getNick(), channels);
+  job->addHead(_format(Server::RPL_WHOISUSER, targetClient));
+  job->addTail(_format(Server::RPL_WHOISSERVER, targetClient));
+  job->addTail(_format(Server::RPL_WHOISIDLE, targetClient));
+  job->addTail(_format(Server::RPL_ENDOFWHOIS));
+  _query(job);
 }
 
 void Client::privmsg(const std::vector<std::string> &msg) {
-  if (msg.size() < 2) {
-    createMessage(Server::ERR_NORECIPIENT, "", "(" + msg[0] + ")");
-    return;
-  }
-  if (msg.size() < 3) {
-    createMessage(Server::ERR_NOTEXTTOSEND, msg[0]);
-    return;
-  }
-  if (!msg[1].empty() &&
-      std::string(CHANNEL_PREFIXES).find(msg[1][0]) != std::string::npos) {
-    _messageChannel(msg);
-  } else {
-    _messageClient(msg);
-  }
+  _relayMessage(msg, false);
+}
+
+void Client::notice(const std::vector<std::string> &msg) {
+  _relayMessage(msg, true);
 }
 
 void Client::join(const std::vector<std::string> &msg) {
@@ -194,6 +251,12 @@ void Client::join(const std::vector<std::string> &msg) {
       createMessage(Server::ERR_INVITEONLYCHAN, name);
       continue;
     }
+    // An invitation lifts the ban
+    if (targetChannel->isBanned(this) &&
+        findClient(targetChannel->getInvited(), _clientFd) == NULL) {
+      createMessage(Server::ERR_BANNEDFROMCHAN, name);
+      continue;
+    }
     if (targetChannel->isLimited() &&
         targetChannel->getClients().size() >= targetChannel->getLimit()) {
       createMessage(Server::ERR_CHANNELISFULL, name);
@@ -229,10 +292,8 @@ void Client::part(const std::vector<std::string> &msg) {
       continue;
     }
     const std::string reason = (msg.size() > 2 ? msg[2] : "");
-    _server->sendToChannel(channel, ":" + _nick + "!~" + _user + "@" +
-                                        _hostname + " PART " + name +
-                                        " :" +  // NOLINT
-                                        reason);
+    _server->sendToChannel(channel, _prefix + " PART " + name + " :" + reason,
+                           NULL, true);
     removeChannel(name);
   }
 }
@@ -281,9 +342,10 @@ void Client::kick(const std::vector<std::string> &msg) {
                     nick + " " + channelName);  // NOLINT
       continue;
     }
-    _server->sendToChannel(channel, ":" + _nick + "!~" + _user + "@" +
-                                        _hostname + " KICK " + channelName +
-                                        " " + nick + " :" + reason);  // NOLINT
+    _server->sendToChannel(channel,
+                           _prefix + " KICK " + channelName + " " + nick +
+                               " :" + reason,
+                           NULL, true);
     targetClient->removeChannel(channelName);
   }
 }
@@ -321,9 +383,8 @@ void Client::invite(const std::vector<std::string> &msg) {
     return;
   }
   targetChannel->addInvited(targetClient);
-  _server->sendToClient(targetClient, ":" + _nick + "!~" + _user + "@" +
-                                          _hostname + " INVITE " + nick + " " +
-                                          channel);
+  _server->sendToClient(targetClient,
+                        _prefix + " INVITE " + nick + " " + channel);
   createMessage(Server::RPL_INVITING, targetChannel, targetClient);
 }
 
@@ -350,9 +411,9 @@ void Client::topic(const std::vector<std::string> &msg) {
     }
     channel->setTopic(msg[2]);
     channel->setTopicSet(true);
-    _server->sendToChannel(channel, ":" + _nick + "!~" + _user + "@" +
-                                        _hostname + " TOPIC " + target + " :" +
-                                        channel->getTopic());
+    _server->sendToChannel(
+        channel, _prefix + " TOPIC " + target + " :" + channel->getTopic(),
+        NULL, true);
   }
   if (!channel->isTopicSet()) {
     createMessage(Server::RPL_NOTOPIC, channel);
@@ -367,6 +428,12 @@ void Client::mode(const std::vector<std::string> &msg) {
   }
   const std::string &modes = msg[2];
   std::vector<std::string> params(msg.begin() + 3, msg.end());
+  // Anyone may read the lists
+  if (params.empty() && (modes == "b" || modes == "+b" || modes == "e" ||
+                         modes == "+e")) {
+    _listMasks(channel, modes[modes.size() - 1]);
+    return;
+  }
 
   if (!modeCheck(modes, channel, params)) {
     return;
@@ -388,9 +455,9 @@ void Client::mode(const std::vector<std::string> &msg) {
     mode_change += " " + *it;
   }
   if (!mode_change.empty()) {
-    _server->sendToChannel(channel, ":" + _nick + "!~" + _user + "@" +
-                                        _hostname + " MODE " +
-                                        channel->getName() + " " + mode_change);
+    _server->sendToChannel(
+        channel, _prefix + " MODE " + channel->getName() + " " + mode_change,
+        NULL, true);
   }
 }
 
@@ -399,19 +466,24 @@ void Client::names(const std::vector<std::string> &msg) {
     createMessage(Server::ERR_NOSUCHSERVER, msg[2]);
     return;
   }
+  if (msg.size() == 1 && _server->getOverload() >= Server::OVERLOAD_BULK) {
+    _statsReply(Server::RPL_TRYAGAIN, msg[0] + " :" + TRYAGAIN_TEXT);
+    return;
+  }
   if (msg.size() == 1) {
-    for (ChannelList::const_iterator it = _server->getChannels().begin();
-         it != _server->getChannels().end(); ++it) {
-      createMessage(Server::RPL_NAMREPLY, it->second);
-    }
-  } else {
-    std::vector<std::string> channels = split(msg[1], ',');
-    for (std::vector<std::string>::const_iterator it = channels.begin();
-         it != channels.end(); ++it) {
-      Channel *channel = findChannel(_server->getChannels(), *it);
-      if (channel != NULL) {
-        createMessage(Server::RPL_NAMREPLY, channel);
-      }
+    QueryJob *job =
+        new QueryJob(_clientFd, QueryJob::NAMES, _server->getName(), _nick);
+    job->setDirectory(_server->getDirectory(true));
+    job->addTail(_format(Server::RPL_ENDOFNAMES));
+    _query(job);
+    return;
+  }
+  std::vector<std::string> channels = split(msg[1], ',');
+  for (std::vector<std::string>::const_iterator it = channels.begin();
+       it != channels.end(); ++it) {
+    Channel *channel = findChannel(_server->getChannels(), *it);
+    if (channel != NULL) {
+      createMessage(Server::RPL_NAMREPLY, channel);
     }
   }
   createMessage(Server::RPL_ENDOFNAMES);
@@ -422,19 +494,24 @@ void Client::list(const std::vector<std::string> &msg) {
     createMessage(Server::ERR_NOSUCHSERVER, msg[2]);
     return;
   }
+  if (msg.size() == 1 && _server->getOverload() >= Server::OVERLOAD_BULK) {
+    _statsReply(Server::RPL_TRYAGAIN, msg[0] + " :" + TRYAGAIN_TEXT);
+    return;
+  }
   if (msg.size() == 1) {
-    for (ChannelList::const_iterator it = _server->getChannels().begin();
-         it != _server->getChannels().end(); ++it) {
-      createMessage(Server::RPL_LIST, it->second);
-    }
-  } else {
-    std::vector<std::string> channels = split(msg[1], ',');
-    for (std::vector<std::string>::const_iterator it = channels.begin();
-         it != channels.end(); ++it) {
-      Channel *channel = findChannel(_server->getChannels(), *it);
-      if (channel != NULL) {
-        createMessage(Server::RPL_LIST, channel);
-      }
+    QueryJob *job =
+        new QueryJob(_clientFd, QueryJob::LIST, _server->getName(), _nick);
+    job->setDirectory(_server->getDirectory(false));
+    job->addTail(_format(Server::RPL_LISTEND));
+    _query(job);
+    return;
+  }
+  std::vector<std::string> channels = split(msg[1], ',');
+  for (std::vector<std::string>::const_iterator it = channels.begin();
+       it != channels.end(); ++it) {
+    Channel *channel = findChannel(_server->getChannels(), *it);
+    if (channel != NULL) {
+      createMessage(Server::RPL_LIST, channel);
     }
   }
   createMessage(Server::RPL_LISTEND);
@@ -447,3 +524,244 @@ void Client::server_time(const std::vector<std::string> &msg) {
   }
   createMessage(Server::RPL_TIME);
 }
+
+// Only for clients that negotiated draft/chathistory
+void Client::chathistory(const std::vector<std::string> &msg) {
+  if (!hasCap(CAP_CHATHISTORY)) {
+    createMessage(Server::ERR_UNKNOWNCOMMAND, msg[0]);
+    return;
+  }
+  const std::string fail = "FAIL CHATHISTORY ";
+  if (msg.size() < 5) {
+    _server->sendToClient(this, fail + "NEED_MORE_PARAMS " +
+                                    (msg.size() > 1 ? msg[1] : "*") +
+                                    " :Missing parameters");
+    return;
+  }
+  const std::string subcommand = uppercase(msg[1]);
+  const std::string &target = msg[2];
+  const std::string &reference = msg[3];
+
+  History::Query query = History::LATEST;
+  if (subcommand == "BEFORE") {
+    query = History::BEFORE;
+  } else if (subcommand == "AFTER") {
+    query = History::AFTER;
+  } else if (subcommand != "LATEST") {
+    _server->sendToClient(this, fail + "INVALID_PARAMS " + msg[1] +
+                                    " :Unknown subcommand");
+    return;
+  }
+  Channel *channel = findChannel(_server->getChannels(), target);
+  if (channel == NULL || findChannel(_channels, target) == NULL) {
+    _server->sendToClient(this, fail + "INVALID_TARGET " + subcommand + " " +
+                                    target +
+                                    " :Messages could not be retrieved");
+    return;
+  }
+
+  bool byMsgid = true;
+  uint64_t value = 0;
+  bool valid = true;
+  if (reference == "*") {
+    valid = (query == History::LATEST);
+  } else if (startsWith(reference, "MSGID=")) {
+    char *end = NULL;
+    value = std::strtoul(reference.c_str() + 6, &end, 10);  // NOLINT
+    valid = (end != NULL && *end == '\0' && value != 0);
+  } else if (startsWith(reference, "TIMESTAMP=")) {
+    byMsgid = false;
+    valid = parse_server_time(reference.substr(10), value);
+  } else {
+    valid = false;
+  }
+  const long limit = std::atol(msg[4].c_str());
+  if (!valid || limit <= 0) {
+    _server->sendToClient(this, fail + "INVALID_PARAMS " + subcommand + " " +
+                                    reference + " :Invalid reference or limit");
+    return;
+  }
+
+  const size_t count = std::min(static_cast<size_t>(limit),
+                                static_cast<size_t>(CHATHISTORY_MAX));
+  std::vector<const History::Entry *> entries;
+  channel->getHistory().select(query, byMsgid, value, count, entries);
+  _replayHistory(channel->getName(), entries);
+}
+
+void Client::server(const std::vector<std::string> &msg) {
+  if (msg.size() < 3) {
+    createMessage(Server::ERR_NEEDMOREPARAMS, msg[0]);
+    return;
+  }
+  _server->acceptLink(this, msg);
+}
+
+void Client::links(const std::vector<std::string> &msg) {
+  (void)msg;
+  std::stringstream ss;
+  ss << ":" << _server->getName() << " " << Server::RPL_LINKS << " " << _nick
+     << " " << _server->getName() << " " << _server->getName()
+     << " :0 ft_irc server";
+  _server->sendToClient(this, ss.str());
+  const ServerList &servers = _server->getServers();
+  for (ServerList::const_iterator it = servers.begin(); it != servers.end();
+       ++it) {
+    size_t hops = 1;
+    for (ServerList::const_iterator parent = servers.find(it->second.parent);
+         parent != servers.end();
+         parent = servers.find(parent->second.parent)) {
+      ++hops;
+    }
+    std::stringstream line;
+    line << ":" << _server->getName() << " " << Server::RPL_LINKS << " "
+         << _nick << " " << it->first << " " << it->second.parent << " :"
+         << hops << " ft_irc server";
+    _server->sendToClient(this, line.str());
+  }
+  createMessage(Server::RPL_ENDOFLINKS);
+}
+
+// Operators come from the "oper <name> <password>" config directives
+void Client::oper(const std::vector<std::string> &msg) {
+  if (msg.size() < 3) {
+    createMessage(Server::ERR_NEEDMOREPARAMS, msg[0]);
+    return;
+  }
+  const std::string hash = _server->getOperHash(msg[1]);
+  if (hash.empty()) {
+    createMessage(Server::ERR_NOOPERHOST);
+    return;
+  }
+  _server->checkOper(this, msg[2], hash);  // operChecked() goes on
+}
+
+void Client::operChecked(bool isValid) {
+  if (!isValid) {
+    createMessage(Server::ERR_PASSWDMISMATCH);
+    return;
+  }
+  _isOper = true;
+  createMessage(Server::RPL_YOUREOPER);
+}
+
+void Client::operBusy() {
+  _statsReply(Server::RPL_TRYAGAIN, "OPER :" + std::string(TRYAGAIN_TEXT));
+}
+
+// STATS t: traffic counters, m: commands, u: uptime (the same numbers ircstat
+// reads from the shared segment), l: latencies and loop lag in us, s: slow
+// commands, z: memory in bytes
+void Client::stats(const std::vector<std::string> &msg) {
+  if (!_isOper) {
+    createMessage(Server::ERR_NOPRIVILEGES);
+    return;
+  }
+  if (msg.size() < 2 || msg[1].empty()) {
+    createMessage(Server::ERR_NEEDMOREPARAMS, msg[0]);
+    return;
+  }
+  const Stats &stats = _server->getStats();
+  const char query = msg[1][0];
+  if (query == 't') {
+    for (int i = 0; i < STAT_COUNT; ++i) {
+      const StatCounter counter = static_cast<StatCounter>(i);
+      std::stringstream ss;
+      ss << ":" << stats.getName(counter) << " " << stats.get(counter);
+      _statsReply(Server::RPL_STATSDEBUG, ss.str());
+    }
+  } else if (query == 'm') {
+    for (size_t i = 0; i < stats.getCommandCount(); ++i) {
+      if (stats.getCommand(i) == 0) {
+        continue;
+      }
+      std::stringstream ss;
+      ss << stats.getCommandName(i) << " " << stats.getCommand(i);
+      _statsReply(Server::RPL_STATSCOMMANDS, ss.str());
+    }
+  } else if (query == 'u') {
+    const uint64_t up =
+        static_cast<uint64_t>(std::time(NULL)) - stats.getStartedAt();
+    std::stringstream ss;
+    ss << ":Server Up " << up / 86400 << " days " << (up / 3600) % 24 << ":"
+       << std::setw(2) << std::setfill('0') << (up / 60) % 60 << ":"
+       << std::setw(2) << std::setfill('0') << up % 60;
+    _statsReply(Server::RPL_STATSUPTIME, ss.str());
+  } else if (query == 'l') {
+    const std::vector<std::string> report = _server->latencyReport();
+    for (size_t i = 0; i < report.size(); ++i) {
+      _statsReply(Server::RPL_STATSDEBUG, ":" + report[i]);
+    }
+  } else if (query == 's') {
+    const std::deque<std::string> &slowLog = _server->getSlowLog();
+    for (size_t i = 0; i < slowLog.size(); ++i) {
+      _statsReply(Server::RPL_STATSDEBUG, ":" + slowLog[i]);
+    }
+  } else if (query == 'z') {
+    const MemoryUsage usage = _server->measureMemory();
+    for (int i = 0; i < MEM_COUNT; ++i) {
+      const MemoryKind kind = static_cast<MemoryKind>(i);
+      std::stringstream ss;
+      ss << ":" << MemoryUsage::name(kind) << " " << usage.bytes[kind];
+      _statsReply(Server::RPL_STATSDEBUG, ss.str());
+    }
+    std::stringstream ss;
+    ss << ":total " << usage.total() << " budget "
+       << _server->getMemoryBudget();
+    _statsReply(Server::RPL_STATSDEBUG, ss.str());
+  }
+  _statsReply(Server::RPL_ENDOFSTATS,
+              std::string(1, query) + " :End of STATS report");
+}
+
+// CAPTURE ON|OFF starts or stops the trace ircreplay reads, written to the
+// "capture" config file. Without parameter, tells whether it runs.
+void Client::capture(const std::vector<std::string> &msg) {
+  if (!_isOper) {
+    createMessage(Server::ERR_NOPRIVILEGES);
+    return;
+  }
+  Capture &capture = _server->getCapture();
+  const std::string path =
+      _server->getConfig().getString("capture", CAPTURE_FILE);
+  const std::string mode = msg.size() < 2 ? "" : uppercase(msg[1]);
+  std::string status;
+  if (mode == "ON") {
+    status = capture.open(path) ? "Capture started, writing " + path
+                                : "Cannot write " + path;
+  } else if (mode == "OFF") {
+    capture.close();
+    status = "Capture stopped";
+  } else if (mode.empty()) {
+    status = capture.isOpen() ? "Capture running" : "Capture stopped";
+  } else {
+    createMessage(Server::ERR_NEEDMOREPARAMS, msg[0]);
+    return;
+  }
+  _server->getLog().write(LOG_INFO, LOG_SERVER, "%", status);
+  _server->sendToClient(this, ":" + _server->getName() + " NOTICE " + _nick +
+                                  " :" + status);
+}
+
+// LOG <subsystem|*> <level> sets the lowest level logged. Then, or without
+// parameter, tells the level of every subsystem and the records dropped.
+void Client::log(const std::vector<std::string> &msg) {
+  if (!_isOper) {
+    createMessage(Server::ERR_NOPRIVILEGES);
+    return;
+  }
+  Logger &log = _server->getLog();
+  if (msg.size() == 2 || (msg.size() > 2 && !log.setLevel(msg[1], msg[2]))) {
+    createMessage(Server::ERR_NEEDMOREPARAMS, msg[0]);
+    return;
+  }
+  std::stringstream ss;
+  for (int i = 0; i < LOG_SUBSYSTEMS; ++i) {
+    const LogSubsystem subsystem = static_cast<LogSubsystem>(i);
+    ss << Logger::subsystemName(subsystem) << " "
+       << Logger::levelName(log.getLevel(subsystem)) << ", ";
+  }
+  ss << log.getDropped() << " dropped";
+  _server->sendToClient(this, ":" + _server->getName() + " NOTICE " + _nick +
+                                  " :Log " + ss.str());
+}
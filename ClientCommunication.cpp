@@ -14,46 +14,220 @@
 
 #include "Channel.hpp"
 #include "Client.hpp"
+#include "Tls.hpp"
 #include "utils.hpp"
 
+// Set on connections accepted by the TLS listener, the handshake is driven by
+// receive() from then on
+void Client::startTls(TlsSession *session) {
+  delete _tls;
+  _tls = session;
+}
+
+bool Client::hasTlsSession() const { return _tls != NULL; }
+
+// The client speaks first, so the handshake only waits for input. The server
+// flight is a few KiB on a fresh socket, WANT_WRITE is retried on the next
+// input as well.
+void Client::_handshake() {
+  const TlsSession::Status status = _tls->handshake();
+  if (status == TlsSession::FAILED) {
+    throw std::runtime_error("TLS handshake failed");
+  }
+  if (status != TlsSession::DONE) {
+    return;
+  }
+  _server->queueWrite(this);  // what was sent during the handshake
+  if (_tls->isKernel() && !_tls->hasPending()) {
+    // The kernel encrypts and decrypts from now on, send/recv as plaintext
+    delete _tls;
+    _tls = NULL;
+    _server->getLog().write(LOG_INFO, LOG_TLS,
+                            "TLS on fd % offloaded to the kernel", _clientFd);
+  } else {
+    _server->getLog().write(LOG_INFO, LOG_TLS, "TLS on fd % in userspace",
+                            _clientFd);
+  }
+}
+
 void Client::receive() {
+  if (_tls != NULL && !_tls->isEstablished()) {
+    _handshake();
+    if (_tls != NULL && !_tls->isEstablished()) {
+      return;
+    }
+  }
   char buffer[BUFFER_SIZE];
   memset(buffer, 0, sizeof(buffer));  // NOLINT
 
-  const ssize_t received =
-      recv(_clientFd, buffer, sizeof(buffer) - 1, 0);  // NOLINT
-  if (received == 0) {
-    throw std::runtime_error("Client disconnected");
-  }
-  if (received == -1) {
-    throw std::runtime_error("Error receiving data: " +
-                             std::string(strerror(errno)));
-  }
-  _inBuffer.append(buffer, received);  // NOLINT
+  // OpenSSL may hold decrypted bytes poll does not know about
+  do {
+    const ssize_t received =
+        (_tls != NULL ? _tls->read(buffer, sizeof(buffer) - 1)
+                      : recv(_clientFd, buffer, sizeof(buffer) - 1,
+                             0));  // NOLINT
+    if (received == 0) {
+      throw std::runtime_error("Client disconnected");
+    }
+    if (received == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      throw std::runtime_error("Error receiving data: " +
+                               std::string(strerror(errno)));
+    }
+    _inBuffer.append(buffer, received);  // NOLINT
+    _server->getStats().add(STAT_BYTES_IN, received);
+  } while (_tls != NULL && _tls->hasPending());
 #ifdef DEBUG
-  std::cout << "< " << buffer << '\n';
+  std::cout << "< " << _inBuffer << '\n';
 #endif
+  _handleLines();
+  if (_inBuffer.size() > RECVQ_MAX) {
+    throw std::runtime_error("Input buffer full");
+  }
+}
+
+void Client::resume() { _handleLines(); }
+
+// Also while a query runs, so that what the client pipelines behind it waits
+// in the socket rather than in the input buffer
+bool Client::hasLines() const {
+  return _isQuerying || _inBuffer.find("\r\n") != std::string::npos;
+}
+
+bool Client::isReady() const { return _isReady; }
+
+void Client::setReady(bool isReady) { _isReady = isReady; }
+
+// Stops at a query job, the lines after it are handled once it is done so
+// that the replies keep the order of the commands. A turn handles up to
+// TURN_LINES lines or TURN_BYTES bytes, the rest waits for the next tick so
+// that a client pipelining thousands of lines does not hold up the others.
+// Links carry the lines of a whole server and are not limited.
+void Client::_handleLines() {
+  size_t lines = 0;
+  size_t bytes = 0;
   size_t pos = 0;
-  while ((pos = _inBuffer.find("\r\n")) != std::string::npos) {
+  while (!_isQuerying && (pos = _inBuffer.find("\r\n")) != std::string::npos) {
+    if (!_isLink && (lines == TURN_LINES || bytes >= TURN_BYTES)) {
+      _server->deferLines(this);
+      return;
+    }
+    if (_isThrottled()) {
+      _server->throttle(this);
+      return;
+    }
     std::string const line = _inBuffer.substr(0, pos);
+    _server->getStats().add(STAT_LINES_IN);
+    if (!_isLink) {
+      _server->getCapture().line(_clientFd, line);
+    }
     handle(line);
     _inBuffer.erase(0, pos + 2);
+    ++lines;
+    bytes += pos + 2;
+  }
+  if (_inBuffer.empty() && _inBuffer.capacity() > BUFFER_KEEP) {
+    std::string().swap(_inBuffer);  // after a burst
+  }
+}
+
+// Lines are only limited while the server is throttling, opers and links
+// never are
+bool Client::_isThrottled() {
+  if (_isLink || _isOper ||
+      _server->getOverload() < Server::OVERLOAD_THROTTLE) {
+    return false;
+  }
+  const uint64_t now = get_monotonic_ns();
+  if (now - _floodStart >= 1000000000) {
+    _floodStart = now;
+    _floodLines = 0;
+  }
+  return ++_floodLines > OVERLOAD_LINES;
+}
+
+// Inline when the query pool does not run or is full. The client is not read
+// until the reply is queued.
+void Client::_query(QueryJob *job) {
+  _isQuerying = true;
+  _server->stopReading(this);
+  if (_server->runQuery(job)) {
+    return;
   }
+  job->run();
+  _streamReply(job->getReply());
+  delete job;
+}
+
+// The reply of a query job, CRLF terminated lines
+void Client::queryDone(const std::string &reply) { _streamReply(reply); }
+
+// A LIST of every channel can outgrow SENDQ_MAX, so the reply is queued
+// REPLY_CHUNK bytes at a time, the next chunk once answer() sent the last
+void Client::_streamReply(const std::string &reply) {
+  _reply = reply;
+  _replySent = 0;
+  if (!_sendReplyChunk()) {
+    _isQuerying = false;
+    _server->deferLines(this);
+  }
+}
+
+// Whole lines, as many as fit in REPLY_CHUNK. After the last one, the lines
+// that waited get a turn on the next tick. False when there was none left.
+bool Client::_sendReplyChunk() {
+  if (_replySent == _reply.size()) {
+    return false;
+  }
+  size_t end = _reply.size();
+  if (end - _replySent > REPLY_CHUNK) {
+    end = _reply.rfind("\r\n", _replySent + REPLY_CHUNK - 2);
+    if (end == std::string::npos || end < _replySent) {
+      end = _reply.find("\r\n", _replySent);
+    }
+    end += 2;
+  }
+  _server->sendToClient(this,
+                        _reply.substr(_replySent, end - _replySent - 2));
+  _replySent = end;
+  if (_replySent == _reply.size()) {
+    std::string().swap(_reply);
+    _replySent = 0;
+    _isQuerying = false;
+    _server->deferLines(this);
+  }
+  return true;
 }
 
 void Client::answer() {
+  if (_tls != NULL && !_tls->isEstablished()) {
+    return;  // replies wait for the handshake
+  }
 #ifdef DEBUG
   std::cout << "> " << _outBuffer << '\n';
 #endif
 
-  while (!_outBuffer.empty()) {
-    const ssize_t sent =
-        send(_clientFd, _outBuffer.c_str(), _outBuffer.length(), 0);  // NOLINT
-    if (sent == -1) {
-      throw std::runtime_error("Error sending data: " +
-                               std::string(strerror(errno)));
+  do {
+    while (!_outBuffer.empty()) {
+      const ssize_t sent =
+          (_tls != NULL ? _tls->write(_outBuffer.c_str(), _outBuffer.length())
+                        : send(_clientFd, _outBuffer.c_str(),
+                               _outBuffer.length(), MSG_NOSIGNAL));  // NOLINT
+      if (sent == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          return;  // Poll tells us when to continue
+        }
+        throw std::runtime_error("Error sending data: " +
+                                 std::string(strerror(errno)));
+      }
+      _outBuffer.erase(0, sent);
+      _server->getStats().add(STAT_BYTES_OUT, sent);
     }
-    _outBuffer.erase(0, sent);
+  } while (_sendReplyChunk());
+  if (_outBuffer.capacity() > BUFFER_KEEP) {
+    std::string().swap(_outBuffer);  // after a burst
   }
 }
 
@@ -77,20 +251,27 @@ void Client::createMessage(ERR error_code, const std::string &param,
   _server->sendToClient(this, ss.str());
 }
 
-void Client::createMessage(RPL response_code) {
+std::string Client::_format(RPL response_code) const {
   std::stringstream ss;
   ss << ":" << _server->getName() << " " << std::setw(3) << std::setfill('0')
      << response_code << " " << _nick << " ";
   if (response_code == Server::RPL_WELCOME) {
-    ss << ":Welcome to the Internet Relay Network " << _nick << "!~" << _user
-       << "@" << _hostname;
+    ss << ":Welcome to the Internet Relay Network " << _nick << "!"
+       << getUsername() << "@" << _hostname;
   } else if (response_code == Server::RPL_YOURHOST) {
     ss << ":Your host is " << _server->getName() << ", running version 1.0";
   } else if (response_code == Server::RPL_CREATED) {
     ss << ":This server was created " << get_time(_server->getCreatedAt());
   } else if (response_code == Server::RPL_MYINFO) {
     ss << _server->getName() << " 1.0 "
-       << "- " << "itklo";
+       << "- " << "itklobe";
+  } else if (response_code == Server::RPL_ISUPPORT) {
+    ss << "CHANTYPES=" CHANNEL_PREFIXES
+       << " PREFIX=(o)@ CHANMODES=be,k,l,it EXCEPTS=e MAXLIST=be:"
+       << MAX_MASKS << " TARGMAX=PRIVMSG:" << MAX_TARGETS
+       << ",NOTICE:" << MAX_TARGETS
+       << " CHATHISTORY=" << CHATHISTORY_MAX
+       << " MSGREFTYPES=msgid,timestamp :are supported by this server";
   } else if (response_code == Server::RPL_LISTEND) {
     ss << ":End of LIST";
   } else if (response_code == Server::RPL_TIME) {
@@ -99,43 +280,42 @@ void Client::createMessage(RPL response_code) {
     ss << ":End of WHOIS list";
   } else if (response_code == Server::RPL_ENDOFNAMES) {
     ss << ":End of NAMES list";
+  } else if (response_code == Server::RPL_ENDOFLINKS) {
+    ss << "* :End of LINKS list";
+  } else if (response_code == Server::RPL_YOUREOPER) {
+    ss << ":You are now an IRC operator";
   } else {
     ss << ":Unknown response code";
   }
-  _server->sendToClient(this, ss.str());
+  return ss.str();
 }
 
-void Client::createMessage(RPL response_code, Client *targetClient) {
+void Client::createMessage(RPL response_code) {
+  _server->sendToClient(this, _format(response_code));
+}
+
+std::string Client::_format(RPL response_code,
+                            const Client *targetClient) const {
   std::stringstream ss;
   ss << ":" << _server->getName() << " " << response_code << " " << _nick << " "
      << targetClient->getNick() << " ";
   if (response_code == Server::RPL_WHOISUSER) {
-    ss << "~" << targetClient->getUser() << " " << targetClient->getHostname()
+    ss << targetClient->getUsername() << " " << targetClient->getHostname()
        << " * :" << targetClient->getRealName();
-  } else if (response_code == Server::RPL_WHOISCHANNELS) {
-    ss << ":";
-    const ChannelList &channels = targetClient->getChannels();
-    for (ChannelList::const_iterator it = channels.begin();
-         it != channels.end(); ++it) {
-      if (findClient(it->second->getClients(), targetClient->_clientFd) !=
-          NULL) {
-        ss << "@";  // Channel operator
-      }
-      ss << it->first;
-      ChannelList::const_iterator nextIt = it;
-      ++nextIt;
-      if (nextIt != channels.end()) {
-        ss << " ";
-      }
-    }
   } else if (response_code == Server::RPL_WHOISSERVER) {
-    ss << _server->getName() << " :ft_irc server";
+    ss << (targetClient->isRemote() ? targetClient->getServerName()
+                                    : _server->getName())
+       << " :ft_irc server";
   } else if (response_code == Server::RPL_WHOISIDLE) {
     ss << (time(NULL) - targetClient->getJoinedAt()) << " :seconds idle";
   } else {
     ss << ":Unknown response code";
   }
-  _server->sendToClient(this, ss.str());
+  return ss.str();
+}
+
+void Client::createMessage(RPL response_code, Client *targetClient) {
+  _server->sendToClient(this, _format(response_code, targetClient));
 }
 
 void Client::createMessage(RPL response_code, Channel *targetChannel) {
@@ -197,18 +377,24 @@ void Client::createMessage(RPL response_code, Channel *targetChannel,
 
 void Client::broadcastToAllChannels(const std::string &msg,
                                     const std::string &command) {
-  std::string reply =
-      ":" + _nick + "!~" + _user + "@" + _hostname + " " + command;
+  std::string reply = _prefix + " " + command;
   if (command == "PART") {
     for (ChannelList::const_iterator it = _channels.begin();
          it != _channels.end(); ++it) {
-      _server->sendToChannel(it->second, reply + " " + it->first + " :" + msg);
+      _server->sendToChannel(it->second, reply + " " + it->first + " :" + msg,
+                             NULL, true);
     }
     return;
   }
   reply += " :" + msg;
+  // NICK and QUIT concern the whole network, every link gets them once
+  if (_isAuthenticated) {
+    _server->propagate(reply, this);
+  }
   if (_channels.empty()) {
-    _server->sendToClient(this, reply);
+    if (!isRemote()) {
+      _server->sendToClient(this, reply);
+    }
     return;
   }
   std::vector<int> fds;
@@ -216,7 +402,9 @@ void Client::broadcastToAllChannels(const std::string &msg,
        it != _channels.end(); ++it) {
     ClientList cl = it->second->getClients();
     for (ClientList::const_iterator cit = cl.begin(); cit != cl.end(); ++cit) {
-      fds.push_back(cit->first);
+      if (!cit->second->isRemote()) {
+        fds.push_back(cit->first);
+      }
     }
   }
   const ClientList clients = _server->getClients();
@@ -227,32 +415,118 @@ void Client::broadcastToAllChannels(const std::string &msg,
   }
 }
 
-void Client::_messageClient(const std::vector<std::string> &msg) {
-  const std::string &target = msg[1];
-  const std::string &text = msg[2];
+void Client::_relayMessage(const std::vector<std::string> &msg,
+                           bool isNotice) {
+  // NOTICE must never trigger automatic replies (RFC 2812 3.3.2)
+  if (msg.size() < 2) {
+    if (!isNotice) {
+      createMessage(Server::ERR_NORECIPIENT, "", "(" + msg[0] + ")");
+    }
+    return;
+  }
+  if (msg.size() < 3) {
+    if (!isNotice) {
+      createMessage(Server::ERR_NOTEXTTOSEND, msg[0]);
+    }
+    return;
+  }
+  const std::vector<std::string> targets = split(msg[1], ',');
+  if (targets.size() > MAX_TARGETS) {
+    if (!isNotice) {
+      createMessage(Server::ERR_TOOMANYTARGETS, msg[1]);
+    }
+    return;
+  }
+  // The prefix and the text are serialized once, only the target differs
+  const std::string head = _prefix + " " + msg[0] + " ";
+  const std::string tail = " :" + msg[2];
+  std::set<std::string> seen;
+  for (std::vector<std::string>::const_iterator it = targets.begin();
+       it != targets.end(); ++it) {
+    if (!seen.insert(lowercase(*it)).second) {
+      continue;  // Duplicate recipient
+    }
+    const std::string line = head + *it + tail;
+    if (std::string(CHANNEL_PREFIXES).find((*it)[0]) != std::string::npos) {
+      _messageChannel(*it, line, isNotice);
+    } else {
+      _messageClient(*it, line, isNotice);
+    }
+  }
+}
+
+void Client::_messageClient(const std::string &target, const std::string &line,
+                            bool isNotice) {
   Client *targetClient = findClient(_server->getClients(), target);
   if (targetClient == NULL) {
-    createMessage(Server::ERR_NOSUCHNICK, target);
+    if (!isNotice) {
+      createMessage(Server::ERR_NOSUCHNICK, target);
+    }
     return;
   }
-  const std::string toSend = ":" + _nick + "!~" + _user + "@" + _hostname +
-                             " PRIVMSG " + target + " :" + text;
-  _server->sendToClient(targetClient, toSend);
+  _server->sendToClient(targetClient, line);
 }
 
-void Client::_messageChannel(const std::vector<std::string> &msg) {
-  const std::string &target = msg[1];
-  const std::string &text = msg[2];
+void Client::_messageChannel(const std::string &target,
+                             const std::string &line, bool isNotice) {
   Channel *targetChannel = findChannel(_server->getChannels(), target);
   if (targetChannel == NULL) {
-    createMessage(Server::ERR_NOSUCHCHANNEL, target);
+    if (!isNotice) {
+      createMessage(Server::ERR_NOSUCHCHANNEL, target);
+    }
     return;
   }
-  if (findChannel(_channels, target) == NULL) {
-    createMessage(Server::ERR_CANNOTSENDTOCHAN, target);
+  // Banned members may still listen, operators may still speak
+  if (findChannel(_channels, target) == NULL ||
+      (targetChannel->isBanned(this) &&
+       findClient(targetChannel->getOperators(), _clientFd) == NULL)) {
+    if (!isNotice) {
+      createMessage(Server::ERR_CANNOTSENDTOCHAN, target);
+    }
     return;
   }
-  const std::string toSend = ":" + _nick + "!~" + _user + "@" + _hostname +
-                             " PRIVMSG " + target + " :" + text;
-  _server->sendToChannel(targetChannel, toSend, this);
+  _server->relayToChannel(targetChannel, line, this);
+}
+
+void Client::_replayHistory(
+    const std::string &target,
+    const std::vector<const History::Entry *> &entries) {
+  std::stringstream id;
+  id << "history" << ++_batchCount;
+  const bool batched = hasCap(CAP_BATCH);
+  if (batched) {
+    _server->sendToClient(this, ":" + _server->getName() + " BATCH +" +
+                                    id.str() + " chathistory " + target);
+  }
+  // Only the tags the client enabled, batch comes with its capability
+  const bool timed = hasCap(CAP_SERVER_TIME) || hasCap(CAP_MESSAGE_TAGS);
+  for (std::vector<const History::Entry *>::const_iterator it =
+           entries.begin();
+       it != entries.end(); ++it) {
+    std::stringstream tags;
+    if (batched) {
+      tags << ";batch=" << id.str();
+    }
+    if (timed) {
+      tags << ";time=" << format_server_time((*it)->time);
+    }
+    if (hasCap(CAP_MESSAGE_TAGS)) {
+      tags << ";msgid=" << (*it)->msgid;
+    }
+    const std::string tagged = tags.str();
+    _server->sendToClient(this, tagged.empty() ? (*it)->line
+                                               : "@" + tagged.substr(1) + " " +
+                                                     (*it)->line);
+  }
+  if (batched) {
+    _server->sendToClient(this,
+                          ":" + _server->getName() + " BATCH -" + id.str());
+  }
+}
+
+void Client::_statsReply(RPL response_code, const std::string &text) {
+  std::stringstream ss;
+  ss << ":" << _server->getName() << " " << response_code << " " << _nick
+     << " " << text;
+  _server->sendToClient(this, ss.str());
 }
@@ -1,13 +1,17 @@
 #include <cctype>
 #include <cstddef>
 #include <cstdlib>
+#include <set>
 #include <ctime>
+#include <sstream>
 #include <string>
 #include <utility>
 #include <vector>
 
 #include "Channel.hpp"
 #include "Client.hpp"
+#include "MaskList.hpp"
+#include "Probes.hpp"
 #include "utils.hpp"
 
 bool Client::isValidName(const std::string &name) {
@@ -23,6 +27,12 @@ bool Client::isValidName(const std::string &name) {
   return true;
 }
 
+void Client::addChannel(Channel *channel) {
+  if (channel != NULL) {
+    _channels[channel->getName()] = channel;
+  }
+}
+
 void Client::removeChannel(const std::string &name) {
   Channel *channel = findChannel(_channels, name);
   if (channel != NULL) {
@@ -34,23 +44,100 @@ void Client::removeChannel(const std::string &name) {
   }
 }
 
+// NICK and USER are in, the password is checked off the poll loop and
+// passwordChecked() goes on
 void Client::_authenticate() {
-  if (_server->isPassRequired() &&
-      (!_isPassSet || _server->getPassword() != _password)) {
-    createMessage(Server::ERR_PASSWDMISMATCH);
-    _wantsToQuit = true;
-    return;
+  if (!_server->isPassRequired()) {
+    _register();
+  } else if (!_isPassSet) {
+    passwordChecked(false);
+  } else {
+    _server->checkPassword(this);
   }
+}
+
+void Client::_register() {
   _joinedAt = time(NULL);
   _isAuthenticated = true;
+  PROBE2(registered, _clientFd, _nick.c_str());
   createMessage(Server::RPL_WELCOME);
   createMessage(Server::RPL_YOURHOST);
   createMessage(Server::RPL_CREATED);
   createMessage(Server::RPL_MYINFO);
+  createMessage(Server::RPL_ISUPPORT);
+  _server->introduce(this);
 }
 
 void Client::appendToOutBuffer(const std::string &msg) {
-  _outBuffer += msg + "\r\n";
+  _outBuffer += msg;
+  _outBuffer += "\r\n";
+}
+
+int Client::_capFromName(const std::string &name) {
+  if (name == "batch") {
+    return CAP_BATCH;
+  }
+  if (name == "draft/chathistory") {
+    return CAP_CHATHISTORY;
+  }
+  if (name == "server-time") {
+    return CAP_SERVER_TIME;
+  }
+  if (name == "message-tags") {
+    return CAP_MESSAGE_TAGS;
+  }
+  return 0;
+}
+
+std::string Client::_capNames() const {
+  std::string names;
+  if (hasCap(CAP_BATCH)) {
+    names += "batch ";
+  }
+  if (hasCap(CAP_CHATHISTORY)) {
+    names += "draft/chathistory ";
+  }
+  if (hasCap(CAP_MESSAGE_TAGS)) {
+    names += "message-tags ";
+  }
+  if (hasCap(CAP_SERVER_TIME)) {
+    names += "server-time ";
+  }
+  if (!names.empty()) {
+    names.erase(names.size() - 1);
+  }
+  return names;
+}
+
+// The channels matched the old prefix against their bans
+void Client::_updatePrefix() {
+  _prefix = ":" + _nick + "!" + getUsername() + "@" + _hostname;
+  for (ChannelList::iterator it = _channels.begin(); it != _channels.end();
+       ++it) {
+    it->second->forgetMatch(_clientFd);
+  }
+}
+
+// RPL_BANLIST or RPL_EXCEPTLIST per entry, then the end of the list
+void Client::_listMasks(Channel *channel, char mode) {
+  const std::vector<MaskList::Entry> &entries =
+      channel->getMasks(mode).getEntries();
+  const RPL entry =
+      (mode == 'b' ? Server::RPL_BANLIST : Server::RPL_EXCEPTLIST);
+  const RPL end =
+      (mode == 'b' ? Server::RPL_ENDOFBANLIST : Server::RPL_ENDOFEXCEPTLIST);
+  for (size_t i = 0; i < entries.size(); ++i) {
+    std::stringstream ss;
+    ss << ":" << _server->getName() << " " << entry << " " << _nick << " "
+       << channel->getName() << " " << entries[i].mask << " "
+       << entries[i].setter << " " << entries[i].setAt;
+    _server->sendToClient(this, ss.str());
+  }
+  std::stringstream ss;
+  ss << ":" << _server->getName() << " " << end << " " << _nick << " "
+     << channel->getName() << " :End of channel "
+     << (mode == 'b' ? "ban" : "exception") << " list";
+  _server->sendToClient(this, ss.str());
 }
 
 void Client::joinChannel(Channel *channel) {
@@ -58,8 +145,7 @@ void Client::joinChannel(Channel *channel) {
   const std::string &name = channel->getName();
   _channels[name] = channel;
 
-  _server->sendToChannel(
-      channel, ":" + _nick + "!~" + _user + "@" + _hostname + " JOIN " + name);
+  _server->sendToChannel(channel, _prefix + " JOIN " + name, NULL, true);
   if (channel->isTopicSet()) {
     createMessage(Server::RPL_TOPIC, channel);
   }
@@ -80,15 +166,32 @@ void Client::leaveAllChannels() {
   _channels.clear();
 }
 
+void Client::addInvitation(const std::string &channel) {
+  _invitations.insert(channel);
+}
+
+// Only the channels that invited the client, rather than every channel. The
+// ones it joined since, or that were removed, are left as they are.
+void Client::forgetInvitations() {
+  for (std::set<std::string>::const_iterator it = _invitations.begin();
+       it != _invitations.end(); ++it) {
+    Channel *channel = findChannel(_server->getChannels(), *it);
+    if (channel != NULL) {
+      channel->removeInvited(_clientFd);
+    }
+  }
+  _invitations.clear();
+}
+
 bool Client::modeCheck(const std::string &modes, Channel *channel,
                        std::vector<std::string> &params) {
   const std::string name = channel->getName();
-  const size_t c = modes.find_first_not_of("+-itklo");
+  const size_t c = modes.find_first_not_of("+-itklobe");
   if (c != std::string::npos) {
     createMessage(Server::ERR_UNKNOWNMODE, modes.substr(c, 1), name);
     return false;
   }
-  if (modes.find_first_of("itklo") == std::string::npos) {
+  if (modes.find_first_of("itklobe") == std::string::npos) {
     return false;
   }
   if (findClient(channel->getOperators(), _clientFd) == NULL) {
@@ -104,7 +207,8 @@ bool Client::modeCheck(const std::string &modes, Channel *channel,
       setting = (*it == '+');
       continue;
     }
-    if (*it == 'k' || *it == 'o' || (setting && *it == 'l')) {
+    if (*it == 'k' || *it == 'o' || *it == 'b' || *it == 'e' ||
+        (setting && *it == 'l')) {
       parameter_count++;
     }
   }
@@ -183,6 +287,21 @@ ModeChanges Client::changeMode(std::vector<std::string> &params,
       } else {
         channel->setLimited(false);
       }
+    } else if (*it == 'b' || *it == 'e') {
+      *param_it = MaskList::normalize(*param_it);
+      if (setting && channel->getMasks(*it).size() >= MAX_MASKS) {
+        createMessage(Server::ERR_BANLISTFULL,
+                      channel->getName() + " " + *param_it);
+        param_it = params.erase(param_it);
+        continue;
+      }
+      if (setting ? !channel->addMask(*it, *param_it, _prefix.substr(1),
+                                      std::time(NULL))
+                  : !channel->removeMask(*it, *param_it)) {
+        param_it = params.erase(param_it);
+        continue;  // already listed, or not listed
+      }
+      ++param_it;
     } else if (*it == 'o') {
       const std::string &nick = *param_it;
       Client *targetClient = findClient(channel->getClients(), nick);
@@ -0,0 +1,98 @@
+#include "Config.hpp"
+
+#include <cstddef>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+Config::Config() {}
+
+Config::Config(const std::string &path) : _path(path) {
+  std::ifstream file(path.c_str());
+  if (!file.is_open()) {
+    throw std::runtime_error("Cannot open config file: " + path);
+  }
+  std::string line;
+  while (std::getline(file, line)) {
+    const size_t comment = line.find('#');
+    if (comment != std::string::npos) {
+      line.erase(comment);
+    }
+    std::istringstream words(line);
+    std::string key;
+    if (!(words >> key)) {
+      continue;
+    }
+    Directive values;
+    std::string word;
+    while (words >> word) {
+      values.push_back(word);
+    }
+    _directives.insert(std::make_pair(key, values));
+  }
+}
+
+Config::Config(const Config &other)
+    : _path(other._path), _directives(other._directives) {}
+
+Config &Config::operator=(const Config &other) {
+  if (this != &other) {
+    _path = other._path;
+    _directives = other._directives;
+  }
+  return *this;
+}
+
+Config::~Config() {}
+
+const std::string &Config::getPath() const { return _path; }
+
+// The last occurrence of a key wins
+std::string Config::getString(const std::string &key,
+                              const std::string &fallback) const {
+  std::multimap<std::string, Directive>::const_iterator it =
+      _directives.upper_bound(key);
+  if (it == _directives.begin()) {
+    return fallback;
+  }
+  --it;
+  if (it->first != key || it->second.empty()) {
+    return fallback;
+  }
+  return it->second[0];
+}
+
+size_t Config::getSize(const std::string &key, size_t fallback) const {
+  const std::string value = getString(key);
+  if (value.empty()) {
+    return fallback;
+  }
+  char *end = NULL;
+  const unsigned long size = std::strtoul(value.c_str(), &end, 10);
+  if (end == NULL || *end != '\0') {
+    throw std::runtime_error("Invalid number for " + key + ": " + value);
+  }
+  return size;
+}
+
+// Replaces every occurrence of the key, for the servers ircsim and ircbench
+// build
+void Config::set(const std::string &key, const std::string &value) {
+  _directives.erase(key);
+  _directives.insert(std::make_pair(key, Directive(1, value)));
+}
+
+std::vector<Directive> Config::getAll(const std::string &key) const {
+  std::vector<Directive> result;
+  typedef std::multimap<std::string, Directive>::const_iterator Iterator;
+  const std::pair<Iterator, Iterator> range = _directives.equal_range(key);
+  for (Iterator it = range.first; it != range.second; ++it) {
+    result.push_back(it->second);
+  }
+  return result;
+}
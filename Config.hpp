@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstddef>
+#include <map>
+#include <string>
+#include <vector>
+
+typedef std::vector<std::string> Directive;  // the words after the key
+
+// Optional configuration file, one "key value..." directive per line and
+// "#" for comments. Keys may repeat (e.g. one "link" line per peer).
+class Config {
+ public:
+  Config();
+  explicit Config(const std::string &path);
+  Config(const Config &other);
+  Config &operator=(const Config &other);
+  ~Config();
+
+  const std::string &getPath() const;
+  std::string getString(const std::string &key,
+                        const std::string &fallback = "") const;
+  size_t getSize(const std::string &key, size_t fallback) const;
+  std::vector<Directive> getAll(const std::string &key) const;
+  void set(const std::string &key, const std::string &value);
+
+ private:
+  std::string _path;
+  std::multimap<std::string, Directive> _directives;
+};
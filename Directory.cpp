@@ -0,0 +1,156 @@
+#include "Directory.hpp"
+
+#include <cstddef>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "Client.hpp"
+#include "Server.hpp"
+#include "utils.hpp"
+
+// * Directory *
+
+// Walks the channels and the previous version side by side, both by name
+Directory::Directory(const ChannelList &channels, bool withNames,
+                     const Directory *previous,
+                     const std::set<std::string> &touched)
+    : _hasNames(withNames || (previous != NULL && previous->hasNames())),
+      _references(1) {
+  const bool isShared = previous != NULL && previous->hasNames() == _hasNames;
+  _entries.reserve(channels.size());
+  size_t i = 0;
+  for (ChannelList::const_iterator it = channels.begin(); it != channels.end();
+       ++it) {
+    while (isShared && i < previous->_entries.size() &&
+           previous->_entries[i]->name < it->first) {
+      ++i;
+    }
+    if (isShared && i < previous->_entries.size() &&
+        previous->_entries[i]->name == it->first &&
+        touched.find(it->first) == touched.end()) {
+      Entry *entry = previous->_entries[i];
+      ++entry->references;
+      _entries.push_back(entry);
+    } else {
+      _entries.push_back(_entry(*it->second, _hasNames));
+    }
+  }
+}
+
+Directory::~Directory() {
+  for (size_t i = 0; i < _entries.size(); ++i) {
+    if (--_entries[i]->references == 0) {
+      delete _entries[i];
+    }
+  }
+}
+
+Directory::Entry *Directory::_entry(const Channel &channel, bool withNames) {
+  Entry *entry = new Entry;
+  entry->name = channel.getName();
+  entry->members = channel.getClientCount();
+  entry->topic = channel.getTopic();
+  if (withNames) {
+    entry->names = channel.getNames();
+  }
+  entry->references = 1;
+  return entry;
+}
+
+void Directory::retain() { ++_references; }
+
+void Directory::release() {
+  if (--_references == 0) {
+    delete this;
+  }
+}
+
+bool Directory::hasNames() const { return _hasNames; }
+
+const std::vector<Directory::Entry *> &Directory::getEntries() const {
+  return _entries;
+}
+
+// * Query job *
+
+QueryJob::QueryJob(int fd, Kind kind, const std::string &server,
+                   const std::string &nick)
+    : Job(fd), _kind(kind), _server(server), _nick(nick), _directory(NULL) {}
+
+QueryJob::~QueryJob() {
+  if (_directory != NULL) {
+    _directory->release();
+  }
+}
+
+void QueryJob::setDirectory(Directory *directory) {
+  directory->retain();
+  _directory = directory;
+}
+
+void QueryJob::setChannels(const std::string &target,
+                           const std::vector<std::string> &channels) {
+  _target = target;
+  _channels = channels;
+}
+
+void QueryJob::addHead(const std::string &line) { _head += line + "\r\n"; }
+
+void QueryJob::addTail(const std::string &line) { _tail += line + "\r\n"; }
+
+const std::string &QueryJob::getReply() const { return _reply; }
+
+void QueryJob::run() {
+  _reply = _head;
+  if (_kind == LIST || _kind == NAMES) {
+    const std::vector<Directory::Entry *> &entries = _directory->getEntries();
+    for (size_t i = 0; i < entries.size(); ++i) {
+      if (_kind == LIST) {
+        std::stringstream ss;
+        ss << entries[i]->name << " " << entries[i]->members << " :"
+           << entries[i]->topic;
+        _line("322", ss.str());
+      } else {
+        _line("353", "= " + entries[i]->name + " :" + entries[i]->names);
+      }
+    }
+  } else {
+    // As many channels per RPL_WHOISCHANNELS as fit in a line
+    const std::string start = _target + " :";
+    const size_t room =
+        BUFFER_SIZE - 2 - (_server.size() + _nick.size() + start.size() + 7);
+    std::string list;
+    for (size_t i = 0; i < _channels.size(); ++i) {
+      if (!list.empty() && list.size() + 1 + _channels[i].size() > room) {
+        _line("319", start + list);
+        list.clear();
+      }
+      list += (list.empty() ? "" : " ") + _channels[i];
+    }
+    if (!list.empty()) {
+      _line("319", start + list);
+    }
+  }
+  _reply += _tail;
+}
+
+// ":<server> <numeric> <nick> <text>"
+void QueryJob::_line(const std::string &numeric, const std::string &text) {
+  _reply += ":" + _server + " " + numeric + " " + _nick + " " + text + "\r\n";
+}
+
+void QueryJob::finish(Server &server) {
+  Client *client = findClient(server.getClients(), getFd());
+  if (client != NULL) {
+    client->queryDone(_reply);
+  }
+}
+
+// Only the lines made on the poll thread, the client's next lines go on
+void QueryJob::expire(Server &server) {
+  Client *client = findClient(server.getClients(), getFd());
+  if (client != NULL) {
+    client->queryDone(_head + _tail);
+  }
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstddef>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "Channel.hpp"
+#include "WorkerPool.hpp"
+
+#define QUERY_THREADS 2      // default of the "queryworkers" config key
+#define QUERY_QUEUE 256      // queries waiting for a thread, then inline
+#define QUERY_TIMEOUT 10000  // ms before a client's input goes on without
+
+typedef std::map<std::string, Channel *> ChannelList;
+
+// Copy of what LIST and NAMES show of every channel, taken on the poll thread
+// and only read by the query workers. The jobs made from one version share
+// it, the last one to be deleted frees it. A new version shares the entries
+// of the channels that did not change with the previous one, so it copies
+// only the touched channels. References are only counted on the poll thread,
+// where jobs are created and deleted.
+class Directory {
+ public:
+  struct Entry {
+    std::string name;
+    size_t members;
+    std::string topic;
+    std::string names;  // nicks of RPL_NAMREPLY, when taken with the names
+    size_t references;  // versions sharing the entry
+  };
+
+  Directory(const ChannelList &channels, bool withNames,
+            const Directory *previous = NULL,
+            const std::set<std::string> &touched = std::set<std::string>());
+
+  void retain();
+  void release();
+  bool hasNames() const;
+  const std::vector<Entry *> &getEntries() const;
+
+ private:
+  ~Directory();
+  Directory(const Directory &other);
+  Directory &operator=(const Directory &other);
+
+  static Entry *_entry(const Channel &channel, bool withNames);
+
+  std::vector<Entry *> _entries;  // by name
+  bool _hasNames;
+  size_t _references;
+};
+
+// Formats a reply that walks many channels off the poll thread. The lines
+// before and after the walk are made on the poll thread, so that the whole
+// reply is one consistent view, and the client's next lines wait for it.
+class QueryJob : public Job {
+ public:
+  enum Kind { LIST, NAMES, WHOIS };
+
+  QueryJob(int fd, Kind kind, const std::string &server,
+           const std::string &nick);
+  ~QueryJob();
+
+  void setDirectory(Directory *directory);
+  void setChannels(const std::string &target,
+                   const std::vector<std::string> &channels);
+  void addHead(const std::string &line);
+  void addTail(const std::string &line);
+  const std::string &getReply() const;
+
+  void run();
+  void finish(Server &server);
+  void expire(Server &server);
+
+ private:
+  void _line(const std::string &numeric, const std::string &text);
+
+  Kind _kind;
+  std::string _server;
+  std::string _nick;
+  Directory *_directory;
+  std::string _target;                 // WHOIS
+  std::vector<std::string> _channels;  // WHOIS, with the "@" of operators
+  std::string _head;                   // CRLF terminated lines
+  std::string _tail;
+  std::string _reply;
+};
@@ -0,0 +1,72 @@
+#include "Histogram.hpp"
+
+#include <stdint.h>
+
+#include <cstddef>
+#include <cstring>
+
+Histogram::Histogram() { reset(); }
+
+void Histogram::record(uint64_t ns) {
+  ++_counts[_bucketOf(ns)];
+  ++_count;
+  _total += ns;
+  if (ns > _max) {
+    _max = ns;
+  }
+}
+
+void Histogram::reset() {
+  std::memset(_counts, 0, sizeof(_counts));  // NOLINT
+  _count = 0;
+  _total = 0;
+  _max = 0;
+}
+
+uint64_t Histogram::count() const { return _count; }
+uint64_t Histogram::total() const { return _total; }
+uint64_t Histogram::max() const { return _max; }
+
+// Upper bound of the bucket holding the p-th percentile (0 < p <= 100)
+uint64_t Histogram::percentile(double p) const {
+  if (_count == 0) {
+    return 0;
+  }
+  uint64_t rank = static_cast<uint64_t>(p / 100.0 * _count + 0.5);
+  if (rank == 0) {
+    rank = 1;
+  }
+  uint64_t seen = 0;
+  for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+    seen += _counts[i];
+    if (seen >= rank) {
+      const uint64_t value = _valueOf(i + 1) - 1;
+      return value < _max ? value : _max;
+    }
+  }
+  return _max;
+}
+
+size_t Histogram::_bucketOf(uint64_t ns) {
+  const uint64_t sub = static_cast<uint64_t>(1) << HISTOGRAM_SUB_BITS;
+  if (ns < sub) {
+    return static_cast<size_t>(ns);
+  }
+  if (ns >= (static_cast<uint64_t>(1) << HISTOGRAM_MAX_BITS)) {
+    return HISTOGRAM_BUCKETS - 1;
+  }
+  const int msb = 63 - __builtin_clzll(ns);
+  const int shift = msb - HISTOGRAM_SUB_BITS;
+  return static_cast<size_t>(shift + 1) * sub +
+         static_cast<size_t>((ns >> shift) - sub);
+}
+
+// Lowest value falling in the bucket
+uint64_t Histogram::_valueOf(size_t bucket) {
+  const uint64_t sub = static_cast<uint64_t>(1) << HISTOGRAM_SUB_BITS;
+  if (bucket < sub) {
+    return bucket;
+  }
+  const size_t shift = bucket / sub - 1;
+  return (sub + bucket % sub) << shift;
+}
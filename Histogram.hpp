@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <cstddef>
+
+#define HISTOGRAM_SUB_BITS 4  // 16 buckets per power of two, about 6% error
+#define HISTOGRAM_MAX_BITS 36  // values are clamped to 2^36 ns, about 68 s
+#define HISTOGRAM_BUCKETS \
+  ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+// Log-linear latency histogram in the style of HdrHistogram: linear below
+// 2^HISTOGRAM_SUB_BITS, then a fixed number of buckets per power of two.
+// Recording is a shift and an increment, percentiles are read by walking the
+// buckets.
+class Histogram {
+ public:
+  Histogram();
+
+  void record(uint64_t ns);
+  void reset();
+
+  uint64_t count() const;
+  uint64_t total() const;
+  uint64_t max() const;
+  uint64_t percentile(double p) const;
+
+ private:
+  static size_t _bucketOf(uint64_t ns);
+  static uint64_t _valueOf(size_t bucket);
+
+  uint64_t _counts[HISTOGRAM_BUCKETS];
+  uint64_t _count;
+  uint64_t _total;  // sum of the recorded values, for the mean
+  uint64_t _max;
+};
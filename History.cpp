@@ -0,0 +1,101 @@
+#include "History.hpp"
+
+#include <stdint.h>
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+History::History() : _head(0), _size(0), _bytes(0) {}
+
+History::~History() {}
+
+bool History::empty() const { return _size == 0; }
+size_t History::size() const { return _size; }
+size_t History::getBytes() const { return _bytes; }
+uint64_t History::getLastMsgid() const {
+  return _size == 0 ? 0 : _at(_size - 1).msgid;
+}
+
+const History::Entry &History::_at(size_t index) const {
+  return _slots[(_head + index) % _slots.size()];
+}
+
+// Evicted for the byte caps, the slot gives its memory back
+void History::_dropOldest() {
+  _bytes -= _slots[_head].line.capacity();
+  std::string().swap(_slots[_head].line);
+  _head = (_head + 1) % _slots.size();
+  --_size;
+}
+
+// The bytes counted are the capacity of the strings, what the history
+// really holds. A slot reused for a much shorter line is reallocated, so one
+// long message does not pin its size in the ring.
+void History::push(uint64_t msgid, uint64_t time, const std::string &line) {
+  if (line.size() > HISTORY_BYTES) {
+    return;
+  }
+  if (_slots.empty()) {
+    _slots.resize(HISTORY_LENGTH);
+  }
+  if (_size == _slots.size()) {  // the oldest slot takes the new message
+    _bytes -= _slots[_head].line.capacity();
+    _head = (_head + 1) % _slots.size();
+    --_size;
+  }
+  Entry &slot = _slots[(_head + _size) % _slots.size()];
+  slot.msgid = msgid;
+  slot.time = time;
+  if (slot.line.capacity() > 2 * line.size() + HISTORY_SLACK) {
+    std::string(line).swap(slot.line);
+  } else {
+    slot.line.assign(line);  // reuses the capacity of the evicted message
+  }
+  _bytes += slot.line.capacity();
+  ++_size;
+  while (_size > 1 && _bytes > HISTORY_BYTES) {
+    _dropOldest();
+  }
+}
+
+// Releases the slots too, used when the channel is evicted from the budget
+void History::clear() {
+  std::vector<Entry>().swap(_slots);
+  _head = 0;
+  _size = 0;
+  _bytes = 0;
+}
+
+// Collects at most limit entries in chronological order. LATEST and AFTER
+// want messages after the reference, BEFORE the ones before it. LATEST and
+// BEFORE keep the newest of the matches, AFTER the oldest.
+void History::select(Query query, bool byMsgid, uint64_t reference,
+                     size_t limit, std::vector<const Entry *> &result) const {
+  size_t first = _size;
+  size_t last = 0;  // one past the last match
+  for (size_t i = 0; i < _size; ++i) {
+    const Entry &entry = _at(i);
+    const uint64_t key = (byMsgid ? entry.msgid : entry.time);
+    const bool match = (query == BEFORE ? key < reference : key > reference);
+    if (match) {
+      if (first == _size) {
+        first = i;
+      }
+      last = i + 1;
+    }
+  }
+  if (first == _size) {
+    return;
+  }
+  if (last - first > limit) {
+    if (query == AFTER) {
+      last = first + limit;
+    } else {
+      first = last - limit;
+    }
+  }
+  for (size_t i = first; i < last; ++i) {
+    result.push_back(&_at(i));
+  }
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#define HISTORY_LENGTH 128       // messages kept per channel
+#define HISTORY_BYTES 32768      // bytes of messages kept per channel
+#define HISTORY_BUDGET 67108864  // bytes of messages kept across all channels
+#define CHATHISTORY_MAX 100      // messages replayed by one CHATHISTORY
+#define HISTORY_SLACK 64         // bytes a slot keeps past twice its line
+
+// Fixed-capacity ring of the latest messages of a channel. The slots are
+// allocated on the first push and reused afterwards, so a channel in steady
+// state does not allocate (the strings keep their capacity). The byte caps
+// count that capacity.
+class History {
+ public:
+  enum Query { LATEST, BEFORE, AFTER };
+
+  struct Entry {
+    uint64_t msgid;
+    uint64_t time;  // milliseconds since the epoch
+    std::string line;
+  };
+
+  History();
+  ~History();
+
+  void push(uint64_t msgid, uint64_t time, const std::string &line);
+  void clear();
+  void select(Query query, bool byMsgid, uint64_t reference, size_t limit,
+              std::vector<const Entry *> &result) const;
+
+  bool empty() const;
+  size_t size() const;
+  size_t getBytes() const;
+  uint64_t getLastMsgid() const;
+
+ private:
+  History(const History &other);
+  History &operator=(const History &other);
+
+  const Entry &_at(size_t index) const;
+  void _dropOldest();
+
+  std::vector<Entry> _slots;
+  size_t _head;  // index of the oldest entry
+  size_t _size;
+  size_t _bytes;
+};
@@ -0,0 +1,187 @@
+#include "Journal.hpp"
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstddef>
+#include <string>
+
+Journal::Journal() : _fd(-1) {}
+
+Journal::~Journal() { close(); }
+
+bool Journal::isOpen() const { return _fd != -1; }
+
+// Replaces the previous standby, if any
+void Journal::open(int fd) {
+  close();
+  _fd = fd;
+}
+
+void Journal::close() {
+  if (_fd != -1) {
+    ::close(_fd);
+    _fd = -1;
+  }
+  _batch.clear();
+  _unsent.clear();
+}
+
+// Queues the records of this tick as one frame and sends as much as the socket
+// takes without blocking, unless wait is set. Returns false when the standby
+// is gone or too far behind, the journal is closed then.
+bool Journal::flush(bool wait) {
+  if (!isOpen()) {
+    return true;
+  }
+  if (!_batch.data().empty()) {
+    const uint32_t size = static_cast<uint32_t>(_batch.data().size());
+    _unsent.append(reinterpret_cast<const char *>(&size),  // NOLINT
+                   sizeof(size));
+    _unsent += _batch.data();
+    _batch.clear();
+  }
+  while (!_unsent.empty()) {
+    const ssize_t sent = send(_fd, _unsent.data(), _unsent.size(),
+                              MSG_NOSIGNAL | (wait ? 0 : MSG_DONTWAIT));
+    if (sent == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      close();
+      return false;
+    }
+    _unsent.erase(0, sent);
+  }
+  if (_unsent.size() > JOURNAL_BACKLOG) {
+    close();
+    return false;
+  }
+  return true;
+}
+
+void Journal::client(int id, const std::string &nick, const std::string &user,
+                     const std::string &host, const std::string &realName,
+                     uint64_t joinedAt) {
+  if (!isOpen()) {
+    return;
+  }
+  _batch.putU8(CLIENT);
+  _batch.putU32(static_cast<uint32_t>(id));
+  _batch.putString(nick);
+  _batch.putString(user);
+  _batch.putString(host);
+  _batch.putString(realName);
+  _batch.putU64(joinedAt);
+}
+
+void Journal::nick(int id, const std::string &nick) {
+  if (!isOpen()) {
+    return;
+  }
+  _batch.putU8(NICK);
+  _batch.putU32(static_cast<uint32_t>(id));
+  _batch.putString(nick);
+}
+
+void Journal::quit(int id) {
+  if (!isOpen()) {
+    return;
+  }
+  _batch.putU8(QUIT);
+  _batch.putU32(static_cast<uint32_t>(id));
+}
+
+void Journal::channel(const std::string &name) {
+  if (!isOpen()) {
+    return;
+  }
+  _batch.putU8(CHANNEL);
+  _batch.putString(name);
+}
+
+void Journal::join(const std::string &channel, int id) {
+  if (!isOpen()) {
+    return;
+  }
+  _batch.putU8(JOIN);
+  _batch.putString(channel);
+  _batch.putU32(static_cast<uint32_t>(id));
+}
+
+void Journal::part(const std::string &channel, int id) {
+  if (!isOpen()) {
+    return;
+  }
+  _batch.putU8(PART);
+  _batch.putString(channel);
+  _batch.putU32(static_cast<uint32_t>(id));
+}
+
+void Journal::setOperator(const std::string &channel, int id,
+                          bool isOperator) {
+  if (!isOpen()) {
+    return;
+  }
+  _batch.putU8(OPERATOR);
+  _batch.putString(channel);
+  _batch.putU32(static_cast<uint32_t>(id));
+  _batch.putU8(isOperator ? 1 : 0);
+}
+
+void Journal::topic(const std::string &channel, const std::string &topic) {
+  if (!isOpen()) {
+    return;
+  }
+  _batch.putU8(TOPIC);
+  _batch.putString(channel);
+  _batch.putString(topic);
+}
+
+void Journal::modes(const std::string &channel, uint8_t flags,
+                    const std::string &password, size_t limit) {
+  if (!isOpen()) {
+    return;
+  }
+  _batch.putU8(MODES);
+  _batch.putString(channel);
+  _batch.putU8(flags);
+  _batch.putString(password);
+  _batch.putU64(limit);
+}
+
+void Journal::history(const std::string &channel, uint64_t msgid,
+                      uint64_t time, const std::string &line) {
+  if (!isOpen()) {
+    return;
+  }
+  _batch.putU8(HISTORY);
+  _batch.putString(channel);
+  _batch.putU64(msgid);
+  _batch.putU64(time);
+  _batch.putString(line);
+}
+
+void Journal::mask(const std::string &channel, char mode, bool isSet,
+                   const std::string &mask, const std::string &setter,
+                   uint64_t setAt) {
+  if (!isOpen()) {
+    return;
+  }
+  _batch.putU8(MASK);
+  _batch.putString(channel);
+  _batch.putU8(static_cast<uint8_t>(mode));
+  _batch.putU8(isSet ? 1 : 0);
+  _batch.putString(mask);
+  _batch.putString(setter);
+  _batch.putU64(setAt);
+}
+
+void Journal::upgrade() {
+  if (!isOpen()) {
+    return;
+  }
+  _batch.putU8(UPGRADE);
+}
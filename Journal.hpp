@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <cstddef>
+#include <string>
+
+#include "Blob.hpp"
+
+#define JOURNAL_BACKLOG 16777216  // unsent bytes before the standby is dropped
+
+// Append-only log of the state changes a standby needs to mirror the server.
+// Records written during a poll tick are sent as one length-prefixed frame by
+// flush(). Without a standby attached every record is a no-op.
+class Journal {
+ public:
+  enum Record {
+    CLIENT = 1,
+    NICK,
+    QUIT,
+    CHANNEL,
+    JOIN,
+    PART,
+    OPERATOR,
+    TOPIC,
+    MODES,
+    HISTORY,
+    UPGRADE,  // the primary was replaced, attach to the new one
+    MASK      // +b or +e entry
+  };
+
+  Journal();
+  ~Journal();
+
+  bool isOpen() const;
+  void open(int fd);
+  void close();
+  bool flush(bool wait = false);
+
+  void client(int id, const std::string &nick, const std::string &user,
+              const std::string &host, const std::string &realName,
+              uint64_t joinedAt);
+  void nick(int id, const std::string &nick);
+  void quit(int id);
+  void channel(const std::string &name);
+  void join(const std::string &channel, int id);
+  void part(const std::string &channel, int id);
+  void setOperator(const std::string &channel, int id, bool isOperator);
+  void topic(const std::string &channel, const std::string &topic);
+  void modes(const std::string &channel, uint8_t flags,
+             const std::string &password, size_t limit);
+  void history(const std::string &channel, uint64_t msgid, uint64_t time,
+               const std::string &line);
+  void mask(const std::string &channel, char mode, bool isSet,
+            const std::string &mask, const std::string &setter,
+            uint64_t setAt);
+  void upgrade();
+
+ private:
+  Journal(const Journal &other);
+  Journal &operator=(const Journal &other);
+
+  int _fd;
+  BlobWriter _batch;    // records of the current tick
+  std::string _unsent;  // frames the socket did not take yet
+};
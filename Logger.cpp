@@ -0,0 +1,308 @@
+#include "Logger.hpp"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "utils.hpp"
+
+namespace {
+
+const char *const LEVEL_NAMES[] = {"debug", "info", "warn", "error", "off"};
+const char *const SUBSYSTEM_NAMES[] = {"server", "client", "link",
+                                       "standby", "tls", "jobs"};
+
+// Blocks, only on the writer thread
+void write_all(int fd, const std::string &data) {
+  size_t done = 0;
+  while (done < data.size()) {
+    const ssize_t n = ::write(fd, data.data() + done, data.size() - done);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return;
+    }
+    done += n;
+  }
+}
+
+}  // namespace
+
+// * Arguments *
+
+LogArg::LogArg() : _kind(NONE), _number(0), _text(NULL), _length(0) {}
+LogArg::LogArg(int number)
+    : _kind(NUMBER), _number(number), _text(NULL), _length(0) {}
+LogArg::LogArg(unsigned int number)
+    : _kind(NUMBER), _number(number), _text(NULL), _length(0) {}
+LogArg::LogArg(long number)  // NOLINT
+    : _kind(NUMBER), _number(number), _text(NULL), _length(0) {}
+LogArg::LogArg(unsigned long number)  // NOLINT
+    : _kind(NUMBER),
+      _number(static_cast<int64_t>(number)),
+      _text(NULL),
+      _length(0) {}
+LogArg::LogArg(const char *str)
+    : _kind(TEXT), _number(0), _text(str), _length(std::strlen(str)) {}
+LogArg::LogArg(const std::string &str)
+    : _kind(TEXT), _number(0), _text(str.data()), _length(str.size()) {}
+
+bool LogArg::isNone() const { return _kind == NONE; }
+bool LogArg::isText() const { return _kind == TEXT; }
+int64_t LogArg::getNumber() const { return _number; }
+const char *LogArg::getText() const { return _text; }
+size_t LogArg::getLength() const { return _length; }
+
+// * Logger *
+
+Logger::Logger(const Config &config)
+    : _head(0),
+      _tail(0),
+      _dropped(0),
+      _reported(0),
+      _isStopping(false),
+      _isRunning(false),
+      _thread(),
+      _fd(-1) {
+  for (int i = 0; i < LOG_SUBSYSTEMS; ++i) {
+    _levels[i] = LOG_INFO;
+  }
+  const std::vector<Directive> directives = config.getAll("log");
+  for (size_t i = 0; i < directives.size(); ++i) {
+    if (directives[i].size() < 2 ||
+        !setLevel(directives[i][0], directives[i][1])) {
+      std::cerr << "Invalid log directive in " << config.getPath() << "\n";
+    }
+  }
+}
+
+Logger::~Logger() { stop(); }
+
+// The ring is allocated here, once, the sim and bench never start it
+bool Logger::start() {
+  if (_isRunning) {
+    return true;
+  }
+  _fd = eventfd(0, EFD_CLOEXEC);
+  if (_fd == -1) {
+    return false;
+  }
+  _ring.resize(LOG_RING);
+  std::cout.flush();  // the inline lines come first
+  std::cerr.flush();
+  _head = 0;
+  _tail = 0;
+  _reported = _dropped;
+  __atomic_store_n(&_isStopping, false, __ATOMIC_SEQ_CST);
+  if (pthread_create(&_thread, NULL, &Logger::_main, this) != 0) {
+    close(_fd);
+    _fd = -1;
+    return false;
+  }
+  _isRunning = true;
+  return true;
+}
+
+void Logger::stop() {
+  if (!_isRunning) {
+    return;
+  }
+  __atomic_store_n(&_isStopping, true, __ATOMIC_SEQ_CST);
+  _wake();
+  pthread_join(_thread, NULL);
+  _isRunning = false;
+  close(_fd);
+  _fd = -1;
+}
+
+bool Logger::isRunning() const { return _isRunning; }
+
+void Logger::write(LogLevel level, LogSubsystem subsystem, const char *format,
+                   const LogArg &a, const LogArg &b, const LogArg &c,
+                   const LogArg &d) {
+  if (level < _levels[subsystem]) {
+    return;
+  }
+  const LogArg *args[LOG_ARGS] = {&a, &b, &c, &d};
+  LogRecord inline_record;
+  LogRecord *record = &inline_record;
+  const uint64_t head = _head;
+  if (_isRunning) {
+    if (head - __atomic_load_n(&_tail, __ATOMIC_SEQ_CST) == LOG_RING) {
+      __atomic_store_n(&_dropped, _dropped + 1, __ATOMIC_SEQ_CST);
+      return;
+    }
+    record = &_ring[head & (LOG_RING - 1)];
+  }
+  record->time = get_time_ms();
+  record->format = format;
+  record->level = level;
+  record->subsystem = subsystem;
+  record->count = 0;
+  record->texts = 0;
+  size_t used = 0;
+  for (size_t i = 0; i < LOG_ARGS && !args[i]->isNone(); ++i) {
+    record->numbers[i] = args[i]->getNumber();
+    record->lengths[i] = 0;
+    if (args[i]->isText()) {
+      const size_t length = std::min(args[i]->getLength(),
+                                     std::min<size_t>(LOG_TEXT - used, 255));
+      std::memcpy(record->text + used, args[i]->getText(), length);  // NOLINT
+      record->texts |= 1 << i;
+      record->lengths[i] = length;
+      used += length;
+    }
+    ++record->count;
+  }
+  if (!_isRunning) {
+    std::string line;
+    _format(*record, line);
+    (level >= LOG_WARN ? std::cerr : std::cout) << line;
+    return;
+  }
+  __atomic_store_n(&_head, head + 1, __ATOMIC_SEQ_CST);
+  // The writer may have found the ring empty and gone to sleep
+  if (__atomic_load_n(&_tail, __ATOMIC_SEQ_CST) == head) {
+    _wake();
+  }
+}
+
+LogLevel Logger::getLevel(LogSubsystem subsystem) const {
+  return _levels[subsystem];
+}
+
+void Logger::setLevel(LogSubsystem subsystem, LogLevel level) {
+  _levels[subsystem] = level;
+}
+
+// "*" for every subsystem
+bool Logger::setLevel(const std::string &subsystem, const std::string &level) {
+  LogLevel parsed = LOG_INFO;
+  LogSubsystem only = LOG_SERVER;
+  if (!parseLevel(level, parsed) ||
+      (subsystem != "*" && !parseSubsystem(subsystem, only))) {
+    return false;
+  }
+  for (int i = 0; i < LOG_SUBSYSTEMS; ++i) {
+    if (subsystem == "*" || i == only) {
+      _levels[i] = parsed;
+    }
+  }
+  return true;
+}
+
+uint64_t Logger::getDropped() const {
+  return __atomic_load_n(&_dropped, __ATOMIC_SEQ_CST);
+}
+
+bool Logger::parseLevel(const std::string &name, LogLevel &level) {
+  for (int i = LOG_DEBUG; i <= LOG_OFF; ++i) {
+    if (lowercase(name) == LEVEL_NAMES[i]) {
+      level = static_cast<LogLevel>(i);
+      return true;
+    }
+  }
+  return false;
+}
+
+bool Logger::parseSubsystem(const std::string &name, LogSubsystem &subsystem) {
+  for (int i = 0; i < LOG_SUBSYSTEMS; ++i) {
+    if (lowercase(name) == SUBSYSTEM_NAMES[i]) {
+      subsystem = static_cast<LogSubsystem>(i);
+      return true;
+    }
+  }
+  return false;
+}
+
+const char *Logger::levelName(LogLevel level) { return LEVEL_NAMES[level]; }
+
+const char *Logger::subsystemName(LogSubsystem subsystem) {
+  return SUBSYSTEM_NAMES[subsystem];
+}
+
+// Only fails once the counter nears 2^64, the writer reads it long before
+void Logger::_wake() {
+  const uint64_t one = 1;
+  const ssize_t written = ::write(_fd, &one, sizeof(one));
+  (void)written;
+}
+
+void *Logger::_main(void *logger) {
+  static_cast<Logger *>(logger)->_drain();  // NOLINT
+  return NULL;
+}
+
+// Drains the ring, then sleeps on the eventfd until the poll thread writes
+// to an empty ring. Drops are reported once the ring has room again.
+void Logger::_drain() {
+  uint64_t reported = _reported;
+  std::string out;
+  std::string err;
+  for (;;) {
+    const uint64_t head = __atomic_load_n(&_head, __ATOMIC_SEQ_CST);
+    uint64_t tail = _tail;
+    for (; tail != head; ++tail) {
+      const LogRecord &record = _ring[tail & (LOG_RING - 1)];
+      _format(record, record.level >= LOG_WARN ? err : out);
+    }
+    __atomic_store_n(&_tail, tail, __ATOMIC_SEQ_CST);
+    const uint64_t dropped = getDropped();
+    if (dropped != reported) {
+      std::stringstream ss;
+      ss << format_server_time(get_time_ms()) << " warn server Log ring full, "
+         << dropped - reported << " records dropped\n";
+      err += ss.str();
+      reported = dropped;
+    }
+    write_all(STDOUT_FILENO, out);
+    write_all(STDERR_FILENO, err);
+    out.clear();
+    err.clear();
+    if (__atomic_load_n(&_head, __ATOMIC_SEQ_CST) != tail) {
+      continue;
+    }
+    if (__atomic_load_n(&_isStopping, __ATOMIC_SEQ_CST)) {
+      return;
+    }
+    uint64_t count = 0;
+    if (read(_fd, &count, sizeof(count)) == -1 && errno != EINTR) {
+      return;
+    }
+  }
+}
+
+// "<time> <level> <subsystem> <message>\n"
+void Logger::_format(const LogRecord &record, std::string &out) {
+  std::stringstream ss;
+  ss << format_server_time(record.time) << " " << LEVEL_NAMES[record.level]
+     << " " << SUBSYSTEM_NAMES[record.subsystem] << " ";
+  size_t arg = 0;
+  size_t used = 0;
+  for (const char *p = record.format; *p != '\0'; ++p) {
+    if (*p != '%' || arg == record.count) {
+      ss << *p;
+      continue;
+    }
+    if ((record.texts & (1 << arg)) != 0) {
+      ss.write(record.text + used, record.lengths[arg]);  // NOLINT
+      used += record.lengths[arg];
+    } else {
+      ss << record.numbers[arg];
+    }
+    ++arg;
+  }
+  ss << "\n";
+  out += ss.str();
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "Config.hpp"
+
+#define LOG_RING 4096  // records, a power of two
+#define LOG_ARGS 4     // arguments of a record
+#define LOG_TEXT 192   // bytes of the string arguments of a record
+
+enum LogLevel { LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR, LOG_OFF };
+
+enum LogSubsystem {
+  LOG_SERVER,  // listeners, poll loop, snapshots, upgrades
+  LOG_CLIENT,  // connections, admission, client errors
+  LOG_LINK,    // server links
+  LOG_STANDBY,
+  LOG_TLS,
+  LOG_JOBS,  // worker pools, slow commands
+  LOG_SUBSYSTEMS
+};
+
+// A number, or a string copied into the record. Only lives for the call.
+class LogArg {
+ public:
+  LogArg();
+  LogArg(int number);            // NOLINT, implicit on purpose
+  LogArg(unsigned int number);   // NOLINT
+  LogArg(long number);           // NOLINT
+  LogArg(unsigned long number);  // NOLINT
+  LogArg(const char *str);       // NOLINT
+  LogArg(const std::string &str);  // NOLINT
+
+  bool isNone() const;
+  bool isText() const;
+  int64_t getNumber() const;
+  const char *getText() const;
+  size_t getLength() const;
+
+ private:
+  enum Kind { NONE, NUMBER, TEXT };
+
+  Kind _kind;
+  int64_t _number;
+  const char *_text;
+  size_t _length;
+};
+
+// What the poll thread leaves in the ring: the arguments as they are, the
+// formatting happens on the writer thread
+struct LogRecord {
+  uint64_t time;       // ms since the epoch
+  const char *format;  // a literal, each "%" takes the next argument
+  uint8_t level;
+  uint8_t subsystem;
+  uint8_t count;
+  uint8_t texts;              // bit i set when argument i is text
+  uint8_t lengths[LOG_ARGS];  // of the text arguments
+  int64_t numbers[LOG_ARGS];
+  char text[LOG_TEXT];  // the text arguments one after the other
+};
+
+// Logs without blocking the poll loop. Records go through a ring buffer with
+// a single producer, the poll thread, to a writer thread that formats them
+// and writes warnings and errors to stderr, the rest to stdout. A full ring
+// drops the record and counts it. Until start(), and after stop(), records
+// are written inline through std::cout and std::cerr. The levels come from
+// the "log <subsystem|*> <level>" config directives and the LOG command.
+class Logger {
+ public:
+  explicit Logger(const Config &config);
+  ~Logger();
+
+  bool start();
+  void stop();  // writes what is left in the ring
+  bool isRunning() const;
+
+  void write(LogLevel level, LogSubsystem subsystem, const char *format,
+             const LogArg &a = LogArg(), const LogArg &b = LogArg(),
+             const LogArg &c = LogArg(), const LogArg &d = LogArg());
+
+  LogLevel getLevel(LogSubsystem subsystem) const;
+  void setLevel(LogSubsystem subsystem, LogLevel level);
+  bool setLevel(const std::string &subsystem, const std::string &level);
+  uint64_t getDropped() const;
+
+  static bool parseLevel(const std::string &name, LogLevel &level);
+  static bool parseSubsystem(const std::string &name, LogSubsystem &subsystem);
+  static const char *levelName(LogLevel level);
+  static const char *subsystemName(LogSubsystem subsystem);
+
+ private:
+  Logger(const Logger &other);
+  Logger &operator=(const Logger &other);
+
+  void _wake();
+  static void *_main(void *logger);
+  void _drain();
+  static void _format(const LogRecord &record, std::string &out);
+
+  LogLevel _levels[LOG_SUBSYSTEMS];  // only read by the poll thread
+  std::vector<LogRecord> _ring;
+  uint64_t _head;      // next record written, by the poll thread
+  uint64_t _tail;      // next record read, by the writer thread
+  uint64_t _dropped;   // written by the poll thread, read by the writer
+  uint64_t _reported;  // drops before start(), not reported
+  bool _isStopping;
+  bool _isRunning;
+  pthread_t _thread;
+  int _fd;  // eventfd, wakes the writer when the ring stops being empty
+};
@@ -0,0 +1,189 @@
+#include "MaskList.hpp"
+
+#include <stdint.h>
+
+#include <cstddef>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "utils.hpp"
+
+#define MASK_WILDCARDS "*?"
+
+// Completes a partial mask the way most servers do: "nick" bans nick!*@*,
+// "user@host" bans *!user@host and "nick!user" bans nick!user@*
+std::string MaskList::normalize(const std::string &mask) {
+  const size_t bang = mask.find('!');
+  const size_t at = mask.find('@', bang == std::string::npos ? 0 : bang);
+  if (bang == std::string::npos && at == std::string::npos) {
+    return mask + "!*@*";
+  }
+  if (bang == std::string::npos) {
+    return "*!" + mask;
+  }
+  if (at == std::string::npos) {
+    return mask + "@*";
+  }
+  return mask;
+}
+
+// Glob with * and ?, backtracking only to the last star. Case sensitive.
+bool MaskList::match(const std::string &mask, const std::string &text) {
+  size_t m = 0;
+  size_t t = 0;
+  size_t star = std::string::npos;
+  size_t retry = 0;
+  while (t < text.size()) {
+    if (m < mask.size() && (mask[m] == '?' || mask[m] == text[t])) {
+      ++m;
+      ++t;
+    } else if (m < mask.size() && mask[m] == '*') {
+      star = m++;
+      retry = t;
+    } else if (star != std::string::npos) {
+      m = star + 1;
+      t = ++retry;
+    } else {
+      return false;
+    }
+  }
+  while (m < mask.size() && mask[m] == '*') {
+    ++m;
+  }
+  return m == mask.size();
+}
+
+// False when the mask is already listed
+bool MaskList::add(const std::string &mask, const std::string &setter,
+                   uint64_t setAt) {
+  const std::string key = lowercase(mask);
+  for (size_t i = 0; i < _keys.size(); ++i) {
+    if (_keys[i] == key) {
+      return false;
+    }
+  }
+  Entry entry;
+  entry.mask = mask;
+  entry.setter = setter;
+  entry.setAt = setAt;
+  _entries.push_back(entry);
+  _keys.push_back(key);
+  _index(_entries.size() - 1);
+  return true;
+}
+
+// The indexes shift, the groups are rebuilt
+bool MaskList::remove(const std::string &mask) {
+  const std::string key = lowercase(mask);
+  for (size_t entry = 0; entry < _keys.size(); ++entry) {
+    if (_keys[entry] == key) {
+      _entries.erase(_entries.begin() + entry);
+      _keys.erase(_keys.begin() + entry);
+      _exact.clear();
+      _bySuffix.clear();
+      _byPrefix.clear();
+      _suffixLengths.clear();
+      _prefixLengths.clear();
+      _others.clear();
+      for (size_t i = 0; i < _entries.size(); ++i) {
+        _index(i);
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
+bool MaskList::matches(const std::string &text) const {
+  if (_entries.empty()) {
+    return false;
+  }
+  const std::string lower = lowercase(text);
+  if (_exact.count(lower) != 0 ||
+      _matchGroups(_bySuffix, _suffixLengths, lower, true) ||
+      _matchGroups(_byPrefix, _prefixLengths, lower, false)) {
+    return true;
+  }
+  for (size_t i = 0; i < _others.size(); ++i) {
+    if (match(_keys[_others[i]], lower)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+const std::vector<MaskList::Entry> &MaskList::getEntries() const {
+  return _entries;
+}
+
+size_t MaskList::size() const { return _entries.size(); }
+
+void MaskList::_index(size_t entry) {
+  const std::string &mask = _keys[entry];
+  const size_t first = mask.find_first_of(MASK_WILDCARDS);
+  if (first == std::string::npos) {
+    _exact.insert(mask);
+    return;
+  }
+  const size_t last = mask.find_last_of(MASK_WILDCARDS);
+  if (last + 1 < mask.size()) {
+    _bySuffix[mask.substr(last + 1)].push_back(entry);
+    _suffixLengths.insert(mask.size() - last - 1);
+  } else if (first != 0) {
+    _byPrefix[mask.substr(0, first)].push_back(entry);
+    _prefixLengths.insert(first);
+  } else {
+    _others.push_back(entry);
+  }
+}
+
+// One lookup per literal length in use, then a glob per mask of the group
+bool MaskList::_matchGroups(const Groups &groups,
+                            const std::set<size_t> &lengths,
+                            const std::string &text, bool isSuffix) const {
+  for (std::set<size_t>::const_iterator it = lengths.begin();
+       it != lengths.end() && *it <= text.size(); ++it) {
+    const Groups::const_iterator group = groups.find(
+        isSuffix ? text.substr(text.size() - *it) : text.substr(0, *it));
+    if (group == groups.end()) {
+      continue;
+    }
+    for (size_t i = 0; i < group->second.size(); ++i) {
+      if (match(_keys[group->second[i]], text)) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// The entries and everything compiled from them, under MEM_MASKS
+void MaskList::measure(MemoryUsage &usage) const {
+  size_t bytes = _entries.capacity() * sizeof(Entry) +
+                 _keys.capacity() * sizeof(std::string) +
+                 _others.capacity() * sizeof(size_t);
+  for (size_t i = 0; i < _entries.size(); ++i) {
+    bytes += MemoryUsage::ofString(_entries[i].mask) +
+             MemoryUsage::ofString(_entries[i].setter) +
+             MemoryUsage::ofString(_keys[i]);
+  }
+  bytes += MemoryUsage::ofMap(_exact.size(), sizeof(std::string));
+  for (std::set<std::string>::const_iterator it = _exact.begin();
+       it != _exact.end(); ++it) {
+    bytes += MemoryUsage::ofString(*it);
+  }
+  bytes += _measureGroups(_bySuffix) + _measureGroups(_byPrefix) +
+           MemoryUsage::ofMap(_suffixLengths.size() + _prefixLengths.size(),
+                              sizeof(size_t));
+  usage.add(MEM_MASKS, bytes);
+}
+
+size_t MaskList::_measureGroups(const Groups &groups) {
+  size_t bytes = MemoryUsage::ofMap(groups.size(), sizeof(Groups::value_type));
+  for (Groups::const_iterator it = groups.begin(); it != groups.end(); ++it) {
+    bytes += MemoryUsage::ofString(it->first) +
+             it->second.capacity() * sizeof(size_t);
+  }
+  return bytes;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <cstddef>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "Memory.hpp"
+
+// Channel ban (+b) or exception (+e) masks, nick!user@host with * and ?
+// wildcards, matched without case. They are compiled so that a lookup globs
+// only the masks that can match: masks without wildcards are looked up whole,
+// the others are grouped by the literal text after their last wildcard, or
+// before their first one when they end with a wildcard. Only "*...*" masks
+// are globbed on every lookup.
+class MaskList {
+ public:
+  struct Entry {
+    std::string mask;
+    std::string setter;
+    uint64_t setAt;  // s since the epoch
+  };
+
+  static std::string normalize(const std::string &mask);
+  static bool match(const std::string &mask, const std::string &text);
+
+  bool add(const std::string &mask, const std::string &setter,
+           uint64_t setAt);
+  bool remove(const std::string &mask);
+  bool matches(const std::string &text) const;
+  const std::vector<Entry> &getEntries() const;
+  size_t size() const;
+  void measure(MemoryUsage &usage) const;
+
+ private:
+  typedef std::map<std::string, std::vector<size_t> > Groups;
+
+  void _index(size_t entry);
+  bool _matchGroups(const Groups &groups, const std::set<size_t> &lengths,
+                    const std::string &text, bool isSuffix) const;
+  static size_t _measureGroups(const Groups &groups);
+
+  std::vector<Entry> _entries;
+  std::vector<std::string> _keys;  // lowercase masks, by entry
+  std::set<std::string> _exact;
+  Groups _bySuffix;
+  Groups _byPrefix;
+  std::set<size_t> _suffixLengths;  // keys of _bySuffix have these lengths
+  std::set<size_t> _prefixLengths;
+  std::vector<size_t> _others;  // start and end with a wildcard
+};
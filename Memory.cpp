@@ -0,0 +1,36 @@
+#include "Memory.hpp"
+
+#include <cstddef>
+#include <cstring>
+#include <string>
+
+MemoryUsage::MemoryUsage() {
+  std::memset(bytes, 0, sizeof(bytes));  // NOLINT
+}
+
+void MemoryUsage::add(MemoryKind kind, size_t n) { bytes[kind] += n; }
+
+size_t MemoryUsage::total() const {
+  size_t sum = 0;
+  for (int i = 0; i < MEM_COUNT; ++i) {
+    sum += bytes[i];
+  }
+  return sum;
+}
+
+const char *MemoryUsage::name(MemoryKind kind) {
+  static const char *const names[MEM_COUNT] = {
+      "clients",  "strings", "recvq",   "sendq",
+      "channels", "members", "invites", "history", "masks"};
+  return names[kind];
+}
+
+// Short strings live inside the object, in the small string buffer
+size_t MemoryUsage::ofString(const std::string &str) {
+  static const size_t inlineCapacity = std::string().capacity();
+  return str.capacity() > inlineCapacity ? str.capacity() + 1 : 0;
+}
+
+size_t MemoryUsage::ofMap(size_t entries, size_t valueSize) {
+  return entries * (MEMORY_MAP_NODE + valueSize);
+}
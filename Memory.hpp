@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <cstddef>
+#include <string>
+
+#define MEMORY_BUDGET 1024     // MiB, default of the "memory" config key
+#define MEMORY_REFUSE 80       // % of the budget, then connections are refused
+#define MEMORY_SHED 90         // % past which the largest send queues go
+#define MEMORY_SHED_MIN 65536  // bytes, smaller send queues are never dropped
+#define MEMORY_INTERVAL 1000   // ms between two measurements
+#define MEMORY_MAP_NODE 32     // bytes of a std::map node besides its value
+#define RECVQ_MAX 65536        // bytes of input a client may have unhandled
+#define BUFFER_KEEP 4096       // capacity an emptied buffer keeps
+
+enum MemoryKind {
+  MEM_CLIENTS,   // Client objects
+  MEM_STRINGS,   // nicks, hosts, topics, keys... past the inline buffer
+  MEM_RECVQ,     // input buffers
+  MEM_SENDQ,     // output buffers
+  MEM_CHANNELS,  // Channel objects
+  MEM_MEMBERS,   // membership maps, on both sides
+  MEM_INVITES,   // invite lists
+  MEM_HISTORY,   // channel history messages
+  MEM_MASKS,     // ban and exception lists, with their indexes
+  MEM_COUNT
+};
+
+// Heap bytes held by the server's data, by kind. Estimated from sizeof and
+// capacities rather than counted by the allocator, so it leaves out the
+// allocator's own overhead.
+struct MemoryUsage {
+  MemoryUsage();
+
+  void add(MemoryKind kind, size_t bytes);
+  size_t total() const;
+
+  static const char *name(MemoryKind kind);
+  static size_t ofString(const std::string &str);
+  static size_t ofMap(size_t entries, size_t valueSize);
+
+  size_t bytes[MEM_COUNT];
+};
@@ -0,0 +1,426 @@
+#include "Password.hpp"
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "Client.hpp"
+#include "Server.hpp"
+#include "utils.hpp"
+
+namespace {
+
+// * SHA-256, HMAC and PBKDF2 (FIPS 180-4, RFC 2104, RFC 8018) *
+
+const uint32_t SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+uint32_t rotr(uint32_t x, unsigned int n) { return (x >> n) | (x << (32 - n)); }
+uint32_t rotl(uint32_t x, unsigned int n) { return (x << n) | (x >> (32 - n)); }
+
+class Sha256 {
+ public:
+  Sha256() : _used(0), _length(0) {
+    const uint32_t init[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                              0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    std::memcpy(_state, init, sizeof(_state));  // NOLINT
+  }
+
+  void update(const unsigned char *data, size_t size) {
+    _length += size;
+    while (size > 0) {
+      const size_t chunk = std::min(size, sizeof(_block) - _used);
+      std::memcpy(_block + _used, data, chunk);  // NOLINT
+      _used += chunk;
+      data += chunk;
+      size -= chunk;
+      if (_used == sizeof(_block)) {
+        _compress();
+        _used = 0;
+      }
+    }
+  }
+
+  void update(const std::string &data) {
+    update(reinterpret_cast<const unsigned char *>(data.data()),  // NOLINT
+           data.size());
+  }
+
+  std::string digest() {
+    const uint64_t bits = _length * 8;
+    const unsigned char pad = 0x80;
+    const unsigned char zero = 0;
+    update(&pad, 1);
+    while (_used != 56) {
+      update(&zero, 1);
+    }
+    unsigned char length[8];
+    for (int i = 0; i < 8; ++i) {
+      length[i] = static_cast<unsigned char>(bits >> (56 - 8 * i));
+    }
+    update(length, sizeof(length));
+    std::string out(32, '\0');
+    for (int i = 0; i < 32; ++i) {
+      out[i] = static_cast<char>(_state[i / 4] >> (24 - 8 * (i % 4)));
+    }
+    return out;
+  }
+
+ private:
+  void _compress() {
+    uint32_t w[64];
+    for (int i = 0; i < 16; ++i) {
+      w[i] = (static_cast<uint32_t>(_block[4 * i]) << 24) |
+             (static_cast<uint32_t>(_block[4 * i + 1]) << 16) |
+             (static_cast<uint32_t>(_block[4 * i + 2]) << 8) |
+             static_cast<uint32_t>(_block[4 * i + 3]);
+    }
+    for (int i = 16; i < 64; ++i) {
+      const uint32_t s0 =
+          rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      const uint32_t s1 =
+          rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t v[8];
+    std::memcpy(v, _state, sizeof(v));  // NOLINT
+    for (int i = 0; i < 64; ++i) {
+      const uint32_t s1 = rotr(v[4], 6) ^ rotr(v[4], 11) ^ rotr(v[4], 25);
+      const uint32_t ch = (v[4] & v[5]) ^ (~v[4] & v[6]);
+      const uint32_t t1 = v[7] + s1 + ch + SHA256_K[i] + w[i];
+      const uint32_t s0 = rotr(v[0], 2) ^ rotr(v[0], 13) ^ rotr(v[0], 22);
+      const uint32_t maj = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+      std::memmove(v + 1, v, 7 * sizeof(uint32_t));  // NOLINT
+      v[4] += t1;
+      v[0] = t1 + s0 + maj;
+    }
+    for (int i = 0; i < 8; ++i) {
+      _state[i] += v[i];
+    }
+  }
+
+  uint32_t _state[8];
+  unsigned char _block[64];
+  size_t _used;
+  uint64_t _length;
+};
+
+std::string hmacSha256(const std::string &key, const std::string &message) {
+  std::string block = key;
+  if (block.size() > 64) {
+    Sha256 hash;
+    hash.update(block);
+    block = hash.digest();
+  }
+  block.resize(64, '\0');
+  std::string inner(block);
+  std::string outer(block);
+  for (size_t i = 0; i < 64; ++i) {
+    inner[i] = static_cast<char>(inner[i] ^ 0x36);
+    outer[i] = static_cast<char>(outer[i] ^ 0x5c);
+  }
+  Sha256 innerHash;
+  innerHash.update(inner);
+  innerHash.update(message);
+  Sha256 outerHash;
+  outerHash.update(outer);
+  outerHash.update(innerHash.digest());
+  return outerHash.digest();
+}
+
+// One iteration, all scrypt needs
+std::string pbkdf2Sha256(const std::string &password, const std::string &salt,
+                         size_t length) {
+  std::string out;
+  for (uint32_t block = 1; out.size() < length; ++block) {
+    std::string input = salt;
+    input += static_cast<char>(block >> 24);
+    input += static_cast<char>(block >> 16);
+    input += static_cast<char>(block >> 8);
+    input += static_cast<char>(block);
+    out += hmacSha256(password, input);
+  }
+  out.resize(length);
+  return out;
+}
+
+// * scrypt (RFC 7914) *
+
+void salsa20_8(uint32_t b[16]) {
+  uint32_t x[16];
+  std::memcpy(x, b, sizeof(x));  // NOLINT
+  for (int i = 0; i < 8; i += 2) {
+    x[4] ^= rotl(x[0] + x[12], 7);
+    x[8] ^= rotl(x[4] + x[0], 9);
+    x[12] ^= rotl(x[8] + x[4], 13);
+    x[0] ^= rotl(x[12] + x[8], 18);
+    x[9] ^= rotl(x[5] + x[1], 7);
+    x[13] ^= rotl(x[9] + x[5], 9);
+    x[1] ^= rotl(x[13] + x[9], 13);
+    x[5] ^= rotl(x[1] + x[13], 18);
+    x[14] ^= rotl(x[10] + x[6], 7);
+    x[2] ^= rotl(x[14] + x[10], 9);
+    x[6] ^= rotl(x[2] + x[14], 13);
+    x[10] ^= rotl(x[6] + x[2], 18);
+    x[3] ^= rotl(x[15] + x[11], 7);
+    x[7] ^= rotl(x[3] + x[15], 9);
+    x[11] ^= rotl(x[7] + x[3], 13);
+    x[15] ^= rotl(x[11] + x[7], 18);
+    x[1] ^= rotl(x[0] + x[3], 7);
+    x[2] ^= rotl(x[1] + x[0], 9);
+    x[3] ^= rotl(x[2] + x[1], 13);
+    x[0] ^= rotl(x[3] + x[2], 18);
+    x[6] ^= rotl(x[5] + x[4], 7);
+    x[7] ^= rotl(x[6] + x[5], 9);
+    x[4] ^= rotl(x[7] + x[6], 13);
+    x[5] ^= rotl(x[4] + x[7], 18);
+    x[11] ^= rotl(x[10] + x[9], 7);
+    x[8] ^= rotl(x[11] + x[10], 9);
+    x[9] ^= rotl(x[8] + x[11], 13);
+    x[10] ^= rotl(x[9] + x[8], 18);
+    x[12] ^= rotl(x[15] + x[14], 7);
+    x[13] ^= rotl(x[12] + x[15], 9);
+    x[14] ^= rotl(x[13] + x[12], 13);
+    x[15] ^= rotl(x[14] + x[13], 18);
+  }
+  for (int i = 0; i < 16; ++i) {
+    b[i] += x[i];
+  }
+}
+
+// in and out hold 2r blocks of 16 words, the even outputs go first
+void blockMix(const uint32_t *in, uint32_t *out, size_t r) {
+  uint32_t x[16];
+  std::memcpy(x, in + (2 * r - 1) * 16, sizeof(x));  // NOLINT
+  for (size_t i = 0; i < 2 * r; ++i) {
+    for (int k = 0; k < 16; ++k) {
+      x[k] ^= in[i * 16 + k];
+    }
+    salsa20_8(x);
+    std::memcpy(out + ((i % 2) * r + i / 2) * 16, x, sizeof(x));  // NOLINT
+  }
+}
+
+void roMix(uint32_t *b, size_t r, size_t n, std::vector<uint32_t> &v) {
+  const size_t words = 32 * r;
+  std::vector<uint32_t> y(words);
+  for (size_t i = 0; i < n; ++i) {
+    std::memcpy(&v[i * words], b, words * sizeof(uint32_t));  // NOLINT
+    blockMix(b, &y[0], r);
+    std::memcpy(b, &y[0], words * sizeof(uint32_t));  // NOLINT
+  }
+  for (size_t i = 0; i < n; ++i) {
+    const size_t j = b[(2 * r - 1) * 16] & (n - 1);
+    for (size_t k = 0; k < words; ++k) {
+      b[k] ^= v[j * words + k];
+    }
+    blockMix(b, &y[0], r);
+    std::memcpy(b, &y[0], words * sizeof(uint32_t));  // NOLINT
+  }
+}
+
+std::string scrypt(const std::string &password, const std::string &salt,
+                   unsigned int logN, size_t r, size_t p, size_t length) {
+  const size_t n = static_cast<size_t>(1) << logN;
+  const std::string bytes = pbkdf2Sha256(password, salt, p * 128 * r);
+  std::vector<uint32_t> b(bytes.size() / 4);
+  for (size_t i = 0; i < b.size(); ++i) {
+    b[i] = static_cast<uint32_t>(static_cast<unsigned char>(bytes[4 * i])) |
+           static_cast<uint32_t>(static_cast<unsigned char>(bytes[4 * i + 1]))
+               << 8 |
+           static_cast<uint32_t>(static_cast<unsigned char>(bytes[4 * i + 2]))
+               << 16 |
+           static_cast<uint32_t>(static_cast<unsigned char>(bytes[4 * i + 3]))
+               << 24;
+  }
+  std::vector<uint32_t> v(32 * r * n);
+  for (size_t i = 0; i < p; ++i) {
+    roMix(&b[i * 32 * r], r, n, v);
+  }
+  std::string mixed(b.size() * 4, '\0');
+  for (size_t i = 0; i < b.size(); ++i) {
+    for (int k = 0; k < 4; ++k) {
+      mixed[4 * i + k] = static_cast<char>(b[i] >> (8 * k));
+    }
+  }
+  return pbkdf2Sha256(password, mixed, length);
+}
+
+// * Encoding *
+
+std::string toHex(const std::string &bytes) {
+  static const char digits[] = "0123456789abcdef";
+  std::string hex;
+  for (size_t i = 0; i < bytes.size(); ++i) {
+    const unsigned char c = static_cast<unsigned char>(bytes[i]);
+    hex += digits[c >> 4];
+    hex += digits[c & 15];
+  }
+  return hex;
+}
+
+bool fromHex(const std::string &hex, std::string &bytes) {
+  static const std::string digits = "0123456789abcdef";
+  if (hex.empty() || hex.size() % 2 != 0) {
+    return false;
+  }
+  bytes.clear();
+  for (size_t i = 0; i < hex.size(); i += 2) {
+    const size_t high = digits.find(hex[i]);
+    const size_t low = digits.find(hex[i + 1]);
+    if (high == std::string::npos || low == std::string::npos) {
+      return false;
+    }
+    bytes += static_cast<char>(high << 4 | low);
+  }
+  return true;
+}
+
+struct Params {
+  unsigned int logN;
+  size_t r;
+  size_t p;
+  std::string salt;
+  std::string key;
+};
+
+// The cost is bounded, a hash comes from the command line of the operator
+// but should not be able to take all the memory
+bool parseHash(const std::string &hash, Params &params) {
+  const std::vector<std::string> fields = split(hash, '$');
+  if (fields.size() != 6 || fields[0] != PASSWORD_SCHEME) {
+    return false;
+  }
+  char *end = NULL;
+  const unsigned long logN = std::strtoul(fields[1].c_str(), &end, 10);
+  if (*end != '\0' || logN < 1 || logN > SCRYPT_LOG_N_MAX) {
+    return false;
+  }
+  params.logN = static_cast<unsigned int>(logN);
+  params.r = std::strtoul(fields[2].c_str(), &end, 10);
+  if (*end != '\0' || params.r < 1 || params.r > 32) {
+    return false;
+  }
+  params.p = std::strtoul(fields[3].c_str(), &end, 10);
+  if (*end != '\0' || params.p < 1 || params.p > 16) {
+    return false;
+  }
+  return fromHex(fields[4], params.salt) && fromHex(fields[5], params.key);
+}
+
+// Looks at every byte whatever the first difference
+bool constantTimeEqual(const std::string &a, const std::string &b) {
+  if (a.size() != b.size()) {
+    return false;  // the key length is no secret
+  }
+  unsigned char diff = 0;
+  for (size_t i = 0; i < a.size(); ++i) {
+    diff |= static_cast<unsigned char>(a[i] ^ b[i]);
+  }
+  return diff == 0;
+}
+
+std::string randomBytes(size_t count) {
+  std::ifstream random("/dev/urandom", std::ios::binary);
+  std::string bytes(count, '\0');
+  if (!random.read(&bytes[0], count)) {
+    throw std::runtime_error("Cannot read /dev/urandom");
+  }
+  return bytes;
+}
+
+}  // namespace
+
+// * Hashes *
+
+std::string hash_password(const std::string &password) {
+  const std::string salt = randomBytes(SCRYPT_SALT);
+  std::stringstream ss;
+  ss << PASSWORD_SCHEME << "$" << SCRYPT_LOG_N << "$" << SCRYPT_R << "$"
+     << SCRYPT_P << "$" << toHex(salt) << "$"
+     << toHex(scrypt(password, salt, SCRYPT_LOG_N, SCRYPT_R, SCRYPT_P,
+                     SCRYPT_KEY));
+  return ss.str();
+}
+
+bool is_password_hash(const std::string &str) {
+  return str.compare(0, sizeof(PASSWORD_SCHEME), PASSWORD_SCHEME "$") == 0;
+}
+
+bool is_valid_password_hash(const std::string &str) {
+  Params params;
+  return parseHash(str, params);
+}
+
+bool verify_password(const std::string &password, const std::string &hash) {
+  Params params;
+  if (!parseHash(hash, params)) {
+    return false;
+  }
+  return constantTimeEqual(scrypt(password, params.salt, params.logN, params.r,
+                                  params.p, params.key.size()),
+                           params.key);
+}
+
+// * Auth job *
+
+AuthJob::AuthJob(int fd, const std::string &password, const std::string &hash)
+    : Job(fd), _password(password), _hash(hash), _isValid(false) {}
+
+// The password does not linger in freed memory
+AuthJob::~AuthJob() {
+  if (!_password.empty()) {
+    std::memset(&_password[0], 0, _password.size());  // NOLINT
+  }
+}
+
+void AuthJob::run() { _isValid = verify_password(_password, _hash); }
+
+void AuthJob::finish(Server &server) {
+  Client *client = findClient(server.getClients(), getFd());
+  if (client != NULL) {
+    client->passwordChecked(_isValid);
+  }
+}
+
+void AuthJob::expire(Server &server) {
+  Client *client = findClient(server.getClients(), getFd());
+  if (client != NULL) {
+    client->closeLink("Server busy");
+  }
+}
+
+OperJob::OperJob(int fd, const std::string &password, const std::string &hash)
+    : AuthJob(fd, password, hash) {}
+
+void OperJob::finish(Server &server) {
+  Client *client = findClient(server.getClients(), getFd());
+  if (client != NULL) {
+    client->operChecked(_isValid);
+  }
+}
+
+void OperJob::expire(Server &server) {
+  Client *client = findClient(server.getClients(), getFd());
+  if (client != NULL) {
+    client->operBusy();
+  }
+}
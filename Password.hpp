@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+#include "WorkerPool.hpp"
+
+#define AUTH_THREADS 2      // default of the "authworkers" config key
+#define AUTH_QUEUE 64       // checks waiting for a thread, more are refused
+#define AUTH_TIMEOUT 10000  // ms a registration waits for its check
+#define SCRYPT_LOG_N 14     // 16 MiB per check with r = 8
+#define SCRYPT_R 8
+#define SCRYPT_P 1
+#define SCRYPT_LOG_N_MAX 20  // hashes asking for more are rejected
+#define SCRYPT_SALT 16       // bytes
+#define SCRYPT_KEY 32        // bytes
+#define PASSWORD_SCHEME "scrypt"
+
+// Server password hashes, "scrypt$<log2 N>$<r>$<p>$<salt>$<key>" with the
+// salt and the derived key in hex, as printed by "./ircserv --hash".
+std::string hash_password(const std::string &password);
+bool is_password_hash(const std::string &str);
+bool is_valid_password_hash(const std::string &str);
+bool verify_password(const std::string &password, const std::string &hash);
+
+// Checks the PASS of a registering client on the auth pool, so the key
+// derivation never runs on the poll loop
+class AuthJob : public Job {
+ public:
+  AuthJob(int fd, const std::string &password, const std::string &hash);
+  ~AuthJob();
+
+  void run();
+  void finish(Server &server);
+  void expire(Server &server);
+
+ protected:
+  std::string _password;
+  std::string _hash;
+  bool _isValid;
+};
+
+// Same check for the password of an OPER, a failure only fails the command
+class OperJob : public AuthJob {
+ public:
+  OperJob(int fd, const std::string &password, const std::string &hash);
+
+  void finish(Server &server);
+  void expire(Server &server);
+};
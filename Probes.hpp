@@ -0,0 +1,22 @@
+#pragma once
+
+// USDT probes of the "ircserv" provider, for bpftrace or perf on a running
+// server (scripts in probes/). With <sys/sdt.h> a probe is a nop and a note
+// in the binary until a tracer attaches; without it, probes compile to
+// nothing and their arguments are not evaluated.
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define IRC_HAS_PROBES
+#endif
+#endif
+
+#ifdef IRC_HAS_PROBES
+#define PROBE1(name, a) DTRACE_PROBE1(ircserv, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(ircserv, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(ircserv, name, a, b, c)
+#else
+#define PROBE1(name, a) ((void)0)
+#define PROBE2(name, a, b) ((void)0)
+#define PROBE3(name, a, b, c) ((void)0)
+#endif
@@ -0,0 +1,282 @@
+#include "Resolver.hpp"
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cctype>
+#include <cerrno>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "Client.hpp"
+#include "Server.hpp"
+#include "utils.hpp"
+
+namespace {
+
+socklen_t addressLength(const struct sockaddr_storage &addr) {
+  return addr.ss_family == AF_INET6 ? sizeof(struct sockaddr_in6)
+                                    : sizeof(struct sockaddr_in);
+}
+
+uint16_t portOf(const struct sockaddr_storage &addr) {
+  if (addr.ss_family == AF_INET6) {
+    return ntohs(reinterpret_cast<const struct sockaddr_in6 *>(&addr)  // NOLINT
+                     ->sin6_port);
+  }
+  return ntohs(
+      reinterpret_cast<const struct sockaddr_in *>(&addr)->sin_port);  // NOLINT
+}
+
+bool isValidHost(const std::string &host) {
+  if (host.empty() || host.size() > HOSTNAME_MAX || host[0] == '-' ||
+      host[0] == '.') {
+    return false;
+  }
+  for (size_t i = 0; i < host.size(); ++i) {
+    if (std::isalnum(static_cast<unsigned char>(host[i])) == 0 &&
+        host[i] != '-' && host[i] != '.') {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Goes in the prefix, so nothing a mask or a parser would trip on
+bool isValidIdent(const std::string &user) {
+  if (user.empty() || user.size() > IDENT_MAX) {
+    return false;
+  }
+  for (size_t i = 0; i < user.size(); ++i) {
+    if (std::isalnum(static_cast<unsigned char>(user[i])) == 0 &&
+        user[i] != '-' && user[i] != '_' && user[i] != '.') {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Waits for one event on fd until the deadline, false on timeout or error
+bool waitFor(int fd, short events, uint64_t deadline) {
+  const uint64_t now = get_monotonic_ns();
+  if (now >= deadline) {
+    return false;
+  }
+  struct pollfd pfd = {};
+  pfd.fd = fd;
+  pfd.events = events;
+  const int timeout = static_cast<int>((deadline - now) / 1000000) + 1;
+  return poll(&pfd, 1, timeout) == 1 && (pfd.revents & events) != 0;
+}
+
+}  // namespace
+
+// * Cache *
+
+HostCache::HostCache() {}
+
+bool HostCache::find(const std::string &address, uint64_t now,
+                     std::string &host) const {
+  const std::map<std::string, Entry>::const_iterator it =
+      _entries.find(address);
+  if (it == _entries.end() || it->second.expiresAt <= now) {
+    return false;
+  }
+  host = it->second.host;
+  return true;
+}
+
+// When full, the expired entries go first, then the lowest addresses
+void HostCache::insert(const std::string &address, const std::string &host,
+                       uint64_t expiresAt) {
+  if (_entries.size() >= RESOLVE_CACHE_MAX && _entries.count(address) == 0) {
+    const uint64_t now = get_monotonic_ns();
+    for (std::map<std::string, Entry>::iterator it = _entries.begin();
+         it != _entries.end();) {
+      if (it->second.expiresAt <= now) {
+        _entries.erase(it++);
+      } else {
+        ++it;
+      }
+    }
+    if (_entries.size() >= RESOLVE_CACHE_MAX) {
+      _entries.erase(_entries.begin());
+    }
+  }
+  Entry &entry = _entries[address];
+  entry.host = host;
+  entry.expiresAt = expiresAt;
+}
+
+// * Lookup *
+
+LookupJob::LookupJob(int fd, const struct sockaddr_storage &peer,
+                     const struct sockaddr_storage &local,
+                     const std::string &host, bool wantsIdent)
+    : Job(fd),
+      _peer(peer),
+      _local(local),
+      _wantsHost(host.empty()),
+      _wantsIdent(wantsIdent),
+      _host(host) {}
+
+void LookupJob::run() {
+  if (_wantsHost) {
+    _host = _resolve(_peer);
+  }
+  if (_wantsIdent) {
+    _ident = _queryIdent(_peer, _local);
+  }
+}
+
+void LookupJob::finish(Server &server) {
+  const std::string address = format_address(_peer);
+  if (_wantsHost) {
+    server.getHostCache().insert(
+        address, _host, get_monotonic_ns() + server.getResolveTtl());
+  }
+  Client *client = findClient(server.getClients(), getFd());
+  if (client != NULL) {
+    client->lookupDone(_host.empty() ? address : _host, _ident);
+  }
+}
+
+void LookupJob::expire(Server &server) {
+  Client *client = findClient(server.getClients(), getFd());
+  if (client != NULL) {
+    client->lookupDone(_wantsHost ? "" : _host, "");
+  }
+}
+
+// Empty unless the name maps back to the address, so that whoever controls
+// the reverse zone cannot pick any host name
+std::string LookupJob::_resolve(const struct sockaddr_storage &peer) {
+  char name[NI_MAXHOST] = {};
+  if (getnameinfo(reinterpret_cast<const struct sockaddr *>(&peer),  // NOLINT
+                  addressLength(peer), name, sizeof(name), NULL, 0,
+                  NI_NAMEREQD) != 0 ||
+      !isValidHost(name)) {
+    return "";
+  }
+  struct addrinfo hints = {};
+  std::memset(&hints, 0, sizeof(hints));
+  hints.ai_family = peer.ss_family;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo *res = NULL;
+  if (getaddrinfo(name, NULL, &hints, &res) != 0) {
+    return "";
+  }
+  const std::string address = format_address(peer);
+  bool isConfirmed = false;
+  for (struct addrinfo *p = res; p != NULL && !isConfirmed; p = p->ai_next) {
+    struct sockaddr_storage candidate = {};
+    std::memcpy(&candidate, p->ai_addr, p->ai_addrlen);  // NOLINT
+    isConfirmed = (format_address(candidate) == address);
+  }
+  freeaddrinfo(res);
+  return isConfirmed ? name : "";
+}
+
+// "<their port> , <our port>" to their port 113, which answers
+// "<ports> : USERID : <os> : <user>". Empty on any failure.
+std::string LookupJob::_queryIdent(const struct sockaddr_storage &peer,
+                                   const struct sockaddr_storage &local) {
+  const uint64_t deadline =
+      get_monotonic_ns() + static_cast<uint64_t>(IDENT_TIMEOUT) * 1000000;
+  const int fd = socket(peer.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    return "";
+  }
+  fcntl(fd, F_SETFL, O_NONBLOCK);
+  struct sockaddr_storage from = local;
+  struct sockaddr_storage to = peer;
+  if (from.ss_family == AF_INET6) {
+    reinterpret_cast<struct sockaddr_in6 *>(&from)->sin6_port = 0;  // NOLINT
+    reinterpret_cast<struct sockaddr_in6 *>(&to)->sin6_port =       // NOLINT
+        htons(IDENT_PORT);
+  } else {
+    reinterpret_cast<struct sockaddr_in *>(&from)->sin_port = 0;  // NOLINT
+    reinterpret_cast<struct sockaddr_in *>(&to)->sin_port =       // NOLINT
+        htons(IDENT_PORT);
+  }
+  std::stringstream query;
+  query << portOf(peer) << " , " << portOf(local) << "\r\n";
+  const std::string request = query.str();
+  std::string reply;
+  // Bound to the address the client reached, the reply routes the same way
+  if (bind(fd, reinterpret_cast<struct sockaddr *>(&from),  // NOLINT
+           addressLength(from)) == 0 &&
+      (connect(fd, reinterpret_cast<struct sockaddr *>(&to),  // NOLINT
+               addressLength(to)) == 0 ||
+       errno == EINPROGRESS) &&
+      waitFor(fd, POLLOUT, deadline) &&
+      send(fd, request.data(), request.size(), MSG_NOSIGNAL) ==
+          static_cast<ssize_t>(request.size())) {
+    char buffer[512];
+    while (reply.find('\n') == std::string::npos &&
+           reply.size() < sizeof(buffer) && waitFor(fd, POLLIN, deadline)) {
+      const ssize_t received = recv(fd, buffer, sizeof(buffer), 0);
+      if (received <= 0) {
+        break;
+      }
+      reply.append(buffer, received);
+    }
+  }
+  close(fd);
+  const std::vector<std::string> fields = split(reply, ':');
+  if (fields.size() < 4 || fields[1].find("USERID") == std::string::npos) {
+    return "";
+  }
+  std::string user = fields[3];
+  user.erase(0, user.find_first_not_of(" \t"));
+  user.erase(user.find_last_not_of(" \t\r\n") + 1);
+  return isValidIdent(user) ? user : "";
+}
+
+// * Link lookup *
+
+std::string resolve_link(const Directive &link, int flags,
+                         std::vector<struct sockaddr_storage> &addresses) {
+  struct addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = flags;
+  struct addrinfo *res = NULL;
+  const int status =
+      getaddrinfo(link[1].c_str(), link[2].c_str(), &hints, &res);
+  if (status != 0) {
+    return gai_strerror(status);
+  }
+  for (struct addrinfo *p = res; p != NULL; p = p->ai_next) {
+    struct sockaddr_storage addr = {};
+    std::memcpy(&addr, p->ai_addr, p->ai_addrlen);  // NOLINT
+    addresses.push_back(addr);
+  }
+  freeaddrinfo(res);
+  return "";
+}
+
+LinkLookupJob::LinkLookupJob(const Directive &link) : Job(-1), _link(link) {}
+
+void LinkLookupJob::run() {
+  _error = resolve_link(_link, 0, _addresses);
+}
+
+void LinkLookupJob::finish(Server &server) {
+  server.dialLink(_link, _addresses, _error);
+}
+
+void LinkLookupJob::expire(Server &server) {
+  server.dialLink(_link, std::vector<struct sockaddr_storage>(),
+                  "lookup timed out");
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include <cstddef>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "Config.hpp"
+#include "WorkerPool.hpp"
+
+#define RESOLVER_THREADS 4       // default of the "resolvers" config key
+#define RESOLVER_QUEUE 1024      // lookups waiting for a thread
+#define RESOLVE_TIMEOUT 5000     // ms registration waits for the lookups
+#define RESOLVE_TTL 3600         // s, default of the "resolvettl" config key
+#define RESOLVE_CACHE_MAX 65536  // cached addresses
+#define IDENT_PORT 113
+#define IDENT_TIMEOUT 3000  // ms, shorter than RESOLVE_TIMEOUT
+#define HOSTNAME_MAX 63
+#define IDENT_MAX 10  // user names longer than this are ignored
+
+// Host names by address, failed lookups included, used on the poll thread
+class HostCache {
+ public:
+  HostCache();
+
+  bool find(const std::string &address, uint64_t now, std::string &host) const;
+  void insert(const std::string &address, const std::string &host,
+              uint64_t expiresAt);
+
+ private:
+  struct Entry {
+    std::string host;  // empty when the address has no usable name
+    uint64_t expiresAt;
+  };
+
+  std::map<std::string, Entry> _entries;
+};
+
+// Looks up one accepted connection on the resolver pool: the reverse DNS
+// name, kept only if it resolves back to the address, and the RFC 1413 ident
+// user name.
+class LookupJob : public Job {
+ public:
+  LookupJob(int fd, const struct sockaddr_storage &peer,
+            const struct sockaddr_storage &local, const std::string &host,
+            bool wantsIdent);
+
+  void run();
+  void finish(Server &server);
+  void expire(Server &server);
+
+ private:
+  static std::string _resolve(const struct sockaddr_storage &peer);
+  static std::string _queryIdent(const struct sockaddr_storage &peer,
+                                 const struct sockaddr_storage &local);
+
+  struct sockaddr_storage _peer;
+  struct sockaddr_storage _local;
+  bool _wantsHost;  // false when the cache had it
+  bool _wantsIdent;
+  std::string _host;
+  std::string _ident;
+};
+
+// The addresses of a "link" directive's host and port, an error message when
+// there are none. flags go to getaddrinfo, AI_NUMERICHOST never blocks.
+std::string resolve_link(const Directive &link, int flags,
+                         std::vector<struct sockaddr_storage> &addresses);
+
+// Resolves the host of a "link" directive on the resolver pool, the poll loop
+// then dials the addresses with Server::dialLink
+class LinkLookupJob : public Job {
+ public:
+  explicit LinkLookupJob(const Directive &link);
+
+  void run();
+  void finish(Server &server);
+  void expire(Server &server);
+
+ private:
+  Directive _link;
+  std::vector<struct sockaddr_storage> _addresses;
+  std::string _error;  // set when the lookup failed
+};
@@ -4,6 +4,7 @@
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/poll.h>
 #include <sys/socket.h>
 #include <unistd.h>
@@ -11,19 +12,26 @@
 #include <cerrno>
 #include <csignal>
 #include <cstddef>
+#include <cstdlib>
 #include <cstring>
 #include <ctime>
 #include <iostream>
 #include <map>
+#include <set>
+#include <sstream>
 #include <stdexcept>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "Channel.hpp"
 #include "Client.hpp"
+#include "Probes.hpp"
 #include "utils.hpp"
 
 extern volatile sig_atomic_t g_terminate;  // NOLINT
+extern volatile sig_atomic_t g_upgrade;    // NOLINT
+extern volatile sig_atomic_t g_dumpStats;  // NOLINT
 
 const std::map<Server::ERR, std::string> Server::ERRORS = init_error_map();
 
@@ -33,7 +41,7 @@ std::map<Server::ERR, std::string> Server::init_error_map() {
   errorMap[ERR_NOSUCHSERVER] = "No such server";
   errorMap[ERR_NOSUCHCHANNEL] = "No such channel";
   errorMap[ERR_CANNOTSENDTOCHAN] = "Cannot send to channel";
-  errorMap[ERR_TOOMANYTARGETS] = "Duplicate recipients. No message delivered";
+  errorMap[ERR_TOOMANYTARGETS] = "Too many recipients. No message delivered";
   errorMap[ERR_NOORIGIN] = "No origin specified";
   errorMap[ERR_NORECIPIENT] = "No recipient given";
   errorMap[ERR_NOTEXTTOSEND] = "No text to send";
@@ -54,20 +62,77 @@ std::map<Server::ERR, std::string> Server::init_error_map() {
   errorMap[ERR_CHANNELISFULL] = "Cannot join channel (+l)";
   errorMap[ERR_UNKNOWNMODE] = "is unknown mode char to me for";
   errorMap[ERR_INVITEONLYCHAN] = "Cannot join channel (+i)";
+  errorMap[ERR_BANNEDFROMCHAN] = "Cannot join channel (+b)";
   errorMap[ERR_BADCHANNELKEY] = "Cannot join channel (+k)";
+  errorMap[ERR_BANLISTFULL] = "Channel list is full";
+  errorMap[ERR_NOPRIVILEGES] = "Permission Denied- You're not an IRC operator";
   errorMap[ERR_CHANOPRIVSNEEDED] = "You're not channel operator";
+  errorMap[ERR_NOOPERHOST] = "No O-lines for your host";
   return errorMap;
 }
 
-Server::Server(const std::string &port, const std::string &pass)
+Server::Server(const std::string &port, const std::string &pass,
+               const Config &config)
     : _port(port),
       _sockfdIpv4(-1),
       _sockfdIpv6(-1),
       _res(NULL),
-      _name("ft_irc"),  // TODO
-      _password(pass),
-      _createdAt(std::time(NULL)) {
+      _name(config.getString("name", "ft_irc")),
+      _password(pass.empty() || is_password_hash(pass) ? pass
+                                                       : hash_password(pass)),
+      _createdAt(std::time(NULL)),
+      _nextMsgid(1),
+      _historyBytes(0),
+      _snapshotPid(-1),
+      _lastSnapshot(std::time(NULL)),
+      _snapshotPath(config.getString("snapshot", SNAPSHOT_FILE)),
+      _config(config),
+      _nextRemoteId(-2),
+      _lastLinkAttempt(0),
+      _journalListener(-1),
+      _primaryFd(-1),
+      _stats(_commandNames()),
+      _log(config),
+      _commandLatency(Client::COMMANDS.size()),
+      _slowThreshold(config.getSize("slowlog", SLOWLOG_THRESHOLD) * 1000),
+      _capture(_log),
+      _admission(config, _log),
+      _resolveTtl(config.getSize("resolvettl", RESOLVE_TTL) * 1000000000),
+      _nextJobId(1),
+      _directory(NULL),
+      _memoryBudget(config.getSize("memory", MEMORY_BUDGET) * 1024 * 1024),
+      _memoryCheckedAt(0),
+      _overloadLag(config.getSize("overload", OVERLOAD_LAG) * 1000000),
+      _loopLag(0),
+      _overload(OVERLOAD_NONE),
+      _overloadChangedAt(0),
+      _overloadTicks(0),
+      _shedAt(0),
+      _throttledAt(0) {
   _isPassRequired = !_password.empty();
+  if (_snapshotPath == "none") {
+    _snapshotPath.clear();
+  }
+  if (_isPassRequired && !is_valid_password_hash(_password)) {
+    throw std::runtime_error("Invalid password hash");
+  }
+  _loadOpers();
+  std::memset(_phaseTime, 0, sizeof(_phaseTime));  // NOLINT
+  const char *upgradeFd = std::getenv(UPGRADE_ENV);
+  if (upgradeFd != NULL) {
+    const int sock = std::atoi(upgradeFd);
+    unsetenv(UPGRADE_ENV);
+    _resumeUpgrade(sock);
+    return;
+  }
+  const std::string primary = config.getString("standby");
+  if (!primary.empty()) {
+    if (!_attachPrimary(primary)) {
+      throw std::runtime_error("Cannot attach to the primary at " + primary +
+                               ": " + strerror(errno));
+    }
+    return;
+  }
   struct addrinfo hints = {};  // create hints struct for getaddrinfo
   std::memset(&hints, 0, sizeof(hints));
   hints.ai_family = AF_UNSPEC;      // AF_INET for IPv4 only, AF_INET6 for IPv6,
@@ -87,40 +152,89 @@ Server::Server(const std::string &port, const std::string &pass)
     try {
       if (p->ai_family == AF_INET) {
         _sockfdIpv4 = _bindAndListen(p);
-        std::cout << "Server is listening on port " << _port << " (IPv4)\n";
+        _log.write(LOG_INFO, LOG_SERVER, "Server is listening on port % (IPv4)",
+                   _port);
       } else if (p->ai_family == AF_INET6) {
         _sockfdIpv6 = _bindAndListen(p);
-        std::cout << "Server is listening on port " << _port << " (IPv6)\n";
+        _log.write(LOG_INFO, LOG_SERVER, "Server is listening on port % (IPv6)",
+                   _port);
       }
     } catch (const std::runtime_error &e) {
       _cleanup();
-      std::cerr << "Bind/listen error: " << e.what() << "\n";
+      _log.write(LOG_ERROR, LOG_SERVER, "Bind/listen error: %", e.what());
       continue;
     }
   }
+  _loadSnapshot();
 }
 
 Server::~Server() { _cleanup(); }
 
+// oper <name> <password or hash>. Like the server password, a plain password
+// is hashed here, so OPER always checks a hash on the auth pool. The first
+// line of a name wins.
+void Server::_loadOpers() {
+  const std::vector<Directive> opers = _config.getAll("oper");
+  for (size_t i = 0; i < opers.size(); ++i) {
+    if (opers[i].size() < 2 || _opers.count(opers[i][0]) != 0) {
+      continue;
+    }
+    const std::string &password = opers[i][1];
+    if (!is_password_hash(password)) {
+      _opers[opers[i][0]] = hash_password(password);
+    } else if (is_valid_password_hash(password)) {
+      _opers[opers[i][0]] = password;
+    } else {
+      throw std::runtime_error("Invalid password hash for oper " +
+                               opers[i][0]);
+    }
+  }
+}
+
 void Server::_cleanup() {
-  std::cout << "Cleaning up server resources...\n";
+  _log.write(LOG_INFO, LOG_SERVER, "Cleaning up server resources...");
   if (_sockfdIpv4 != -1) {
-    std::cout << "Closing IPv4 socket: " << _sockfdIpv4 << "\n";
+    _log.write(LOG_INFO, LOG_SERVER, "Closing IPv4 socket: %", _sockfdIpv4);
     close(_sockfdIpv4);
     _sockfdIpv4 = -1;
   }
   if (_sockfdIpv6 != -1) {
-    std::cout << "Closing IPv6 socket: " << _sockfdIpv6 << "\n";
+    _log.write(LOG_INFO, LOG_SERVER, "Closing IPv6 socket: %", _sockfdIpv6);
     close(_sockfdIpv6);
     _sockfdIpv6 = -1;
   }
+  for (size_t i = 0; i < _tlsListeners.size(); ++i) {
+    close(_tlsListeners[i]);
+  }
+  _tlsListeners.clear();
+  _resolver.stop();  // deletes the jobs still queued or done
+  _authPool.stop();
+  _queryPool.stop();
+  _jobs.clear();
+  if (_directory != NULL) {
+    _directory->release();
+    _directory = NULL;
+  }
+  _jobDeadlines.clear();
   if (_res != 0) {
     freeaddrinfo(_res);  // free the linked list, from netdb.h
     _res = NULL;
   }
+  if (_journalListener != -1) {
+    close(_journalListener);
+    _journalListener = -1;
+  }
+  _journal.close();
+  _dropMirror();
+  if (_primaryFd != -1) {
+    close(_primaryFd);
+    _primaryFd = -1;
+  }
   ClientList::iterator it;
   for (it = _clients.begin(); it != _clients.end(); ++it) {
-    close(it->first);
+    if (it->first >= 0) {  // remote users have no socket
+      close(it->first);
+    }
     delete it->second;
   }
   _clients.clear();
@@ -129,6 +243,7 @@ void Server::_cleanup() {
     delete itch->second;
   }
   _channels.clear();
+  _log.stop();  // what follows is written inline
 }
 
 int Server::_bindAndListen(const struct addrinfo *res) {
@@ -163,42 +278,157 @@ int Server::_bindAndListen(const struct addrinfo *res) {
 }
 
 void Server::run() {
+  if (!_log.start()) {
+    _log.write(LOG_WARN, LOG_SERVER,
+               "Could not start the log writer, logging inline");
+  }
+  if (_primaryFd != -1 && !_follow()) {
+    _cleanup();
+    return;  // Stopped while the primary was still serving
+  }
   // add server socket to pollfds
   _addPollFd(_sockfdIpv4, POLLIN);
   _addPollFd(_sockfdIpv6, POLLIN);
+  _listenTls();
+  for (size_t i = 0; i < _tlsListeners.size(); ++i) {
+    _addPollFd(_tlsListeners[i], POLLIN);
+  }
+  _startWorkers();
+  _listenJournal();
+  _connectLinks();
+  _openStats();
 
+  bool upgraded = false;
   while (g_terminate == 0) {
-    const int n_poll = poll(_pollFds.data(), _pollFds.size(), TIMEOUT);
-
-    if (n_poll == -1) {
-      if (errno != EINTR)
-        std::cerr << "Poll error: " << strerror(errno) << "\n";
+    if (g_upgrade != 0) {
+      g_upgrade = 0;
+      if (_upgrade()) {
+        upgraded = true;
+        break;
+      }
+    }
+    if (g_dumpStats != 0) {
+      g_dumpStats = 0;
+      const std::vector<std::string> report = latencyReport();
+      for (size_t i = 0; i < report.size(); ++i) {
+        _log.write(LOG_INFO, LOG_SERVER, "%", report[i]);
+      }
+    }
+    // An overloaded server steps down even when the clients went quiet, and
+    // throttled clients get their lines back
+    if (tick(_overload == OVERLOAD_NONE && _throttledClients.empty()
+                 ? TIMEOUT
+                 : OVERLOAD_HOLD) == -1) {
       continue;
     }
-
-    _handlePollEvents();
+    if (std::time(NULL) - _lastLinkAttempt >= LINK_RETRY) {
+      _connectLinks();
+    }
+    _reapSnapshot(false);
+    if (!_snapshotPath.empty() &&
+        std::time(NULL) - _lastSnapshot >= SNAPSHOT_INTERVAL) {
+      _startSnapshot();
+    }
+  }
+  _reapSnapshot(true);
+  if (upgraded) {
+    // Otherwise the standby would take the listeners from the new process
+    _journal.upgrade();
+    _journal.flush(true);
   }
+  if (!upgraded && !_snapshotPath.empty() && !_writeSnapshot(_snapshotPath)) {
+    _log.write(LOG_ERROR, LOG_SERVER, "Could not write snapshot %",
+               _snapshotPath);
+  }
+  _stats.close(!upgraded);  // the new process keeps counting
   _cleanup();
 }
 
+// Named after the port, so that a standby or an upgraded process taking it
+// over carries on with the same counters
+void Server::_openStats() {
+  if (!_stats.open(STATS_PREFIX + _port, _commandNames())) {
+    _log.write(LOG_ERROR, LOG_SERVER, "Could not open stats segment %%: %",
+               STATS_PREFIX, _port, strerror(errno));
+  }
+}
+
+// In Client::COMMANDS order, the indexes the counters and histograms use
+std::vector<std::string> Server::_commandNames() {
+  std::vector<std::string> commands;
+  for (CommandList::const_iterator it = Client::COMMANDS.begin();
+       it != Client::COMMANDS.end(); ++it) {
+    commands.push_back(it->first);
+  }
+  return commands;
+}
+
+// One poll and the handling of its events, then a turn for each client that
+// had lines left from the previous tick. Returns the number of ready fds and
+// clients, or -1 when poll failed. The simulation harness drives the server
+// with it.
+int Server::tick(int timeout) {
+  std::vector<std::pair<int, Client *> > ready;
+  ready.swap(_readyClients);  // clients deferred below wait for the next tick
+  const uint64_t waitStart = get_monotonic_ns();
+  const int n_poll =
+      poll(_pollFds.data(), _pollFds.size(), ready.empty() ? timeout : 0);
+  _phaseLatency[PHASE_WAIT].record(get_monotonic_ns() - waitStart);
+
+  if (n_poll == -1) {
+    if (errno != EINTR)
+      _log.write(LOG_ERROR, LOG_SERVER, "Poll error: %", strerror(errno));
+    _readyClients.insert(_readyClients.begin(), ready.begin(), ready.end());
+    return -1;
+  }
+
+  const uint64_t busyStart = get_monotonic_ns();
+  _stats.add(STAT_POLL_WAKEUPS);
+  _handlePollEvents();
+  _resumeClients(ready);
+  _releaseThrottled(get_monotonic_ns());
+  _expireJobs(get_monotonic_ns());
+  _checkMemory(get_monotonic_ns());
+  _flushRemovals();
+  const uint64_t writeStart = get_monotonic_ns();
+  _flushWrites();
+  _phaseTime[PHASE_WRITE] += get_monotonic_ns() - writeStart;
+  _recordPhases();
+  _stats.set(STAT_CLIENTS, _clients.size());
+  _stats.set(STAT_CHANNELS, _channels.size());
+  _stats.set(STAT_LOG_DROPS, _log.getDropped());
+  _capture.flush();
+  _admission.sweep(get_monotonic_ns());
+  if (!_journal.flush()) {
+    _log.write(LOG_WARN, LOG_STANDBY, "Standby dropped");
+  }
+  const uint64_t now = get_monotonic_ns();
+  _recordTick(busyStart - waitStart, now - busyStart, now);
+  return n_poll + static_cast<int>(ready.size());
+}
+
 void Server::_handlePollEvents() {
   for (size_t i = 0; i < _pollFds.size(); ++i) {
-    // If the returned events POLLIN bit is set, there is data to read
-    if ((_pollFds[i].revents & POLLIN) != 0) {
-      // if the socket is still the server socket, it has not been accept()-ed
-      // yet
-      if (_pollFds[i].fd == _sockfdIpv4 || _pollFds[i].fd == _sockfdIpv6) {
-        _handleNewConnection(_pollFds[i].fd);
-      } else {
-        if (!_handleClientActivity(i)) {
-          --i;
-        }
-      }
+    if (_pollFds[i].revents == 0) {
+      continue;
     }
-    if ((_pollFds[i].revents & POLLOUT) != 0) {
-      if (!_handleClientActivity(i)) {
-        --i;
-      }
+    // if the socket is still the server socket, it has not been accept()-ed
+    // yet
+    if (_pollFds[i].fd == _sockfdIpv4 || _pollFds[i].fd == _sockfdIpv6 ||
+        _isTlsListener(_pollFds[i].fd)) {
+      const uint64_t start = get_monotonic_ns();
+      _handleNewConnection(_pollFds[i].fd);
+      _phaseTime[PHASE_ACCEPT] += get_monotonic_ns() - start;
+    } else if (_pollFds[i].fd == _journalListener) {
+      _attachStandby();
+    } else if (_pollFds[i].fd == _resolver.getFd()) {
+      _collectJobs(_resolver);
+    } else if (_pollFds[i].fd == _authPool.getFd()) {
+      _collectJobs(_authPool);
+    } else if (_pollFds[i].fd == _queryPool.getFd()) {
+      _collectJobs(_queryPool);
+    } else if (!_handleClientActivity(i)) {
+      --i;
     }
   }
 }
@@ -219,13 +449,66 @@ void Server::_handleNewConnection(int sockfd) {
       accept(sockfd, (struct sockaddr *)&client_addr, &addrLen);  // NOLINT
 
   if (client_fd == -1) {
-    std::cerr << "Accept error: " << strerror(errno) << "\n";
+    _log.write(LOG_ERROR, LOG_SERVER, "Accept error: %", strerror(errno));
+    return;
+  }
+
+  // Refused before anything is allocated for it
+  const std::string address = format_address(client_addr);
+  std::string reason = (_isMemoryTight() ? "Server out of memory" : "");
+  if (!reason.empty() ||
+      !_admission.admit(address, get_monotonic_ns(), reason)) {
+    const std::string error =
+        "ERROR :Closing Link: " + address + " (" + reason + ")\r\n";
+    send(client_fd, error.data(), error.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(client_fd);
+    _stats.add(STAT_REFUSED);
+    _log.write(LOG_INFO, LOG_CLIENT, "Refused %: %", address, reason);
     return;
   }
 
-  std::cout << "New client connected: " << client_fd << "\n";
-  _clients[client_fd] = new Client(client_fd, this);
+  // A client that does not read then only grows its send queue
+  fcntl(client_fd, F_SETFL, O_NONBLOCK);
+  _tuneSocket(client_fd);
+  _stats.add(STAT_ACCEPTS);
+  _log.write(LOG_INFO, LOG_CLIENT, "New client connected: %", client_fd);
+  PROBE2(accept, client_fd, address.c_str());
+  _clients[client_fd] = new Client(client_fd, this, address);
+  if (_isTlsListener(sockfd)) {
+    _clients[client_fd]->startTls(new TlsSession(_tlsContext, client_fd));
+  }
   _addPollFd(client_fd, POLLIN);
+  _capture.connect(client_fd);
+  _startLookup(_clients[client_fd], client_addr);
+}
+
+// TCP_NODELAY, since the replies of a tick already leave in one send, and the
+// buffer sizes and keepalive of the config file
+void Server::_tuneSocket(int fd) const {
+  int yes = 1;
+  if (_config.getString("nodelay", "yes") == "yes") {
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+  }
+  const int sndbuf = static_cast<int>(_config.getSize("sndbuf", 0));
+  if (sndbuf > 0) {
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+  }
+  const int rcvbuf = static_cast<int>(_config.getSize("rcvbuf", 0));
+  if (rcvbuf > 0) {
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  }
+  // keepalive <idle s> <interval s> <probes>
+  const std::vector<Directive> keepalive = _config.getAll("keepalive");
+  if (keepalive.empty() || keepalive.back().size() < 3) {
+    return;
+  }
+  const int idle = std::atoi(keepalive.back()[0].c_str());
+  const int interval = std::atoi(keepalive.back()[1].c_str());
+  const int probes = std::atoi(keepalive.back()[2].c_str());
+  setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &yes, sizeof(yes));
+  setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+  setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+  setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &probes, sizeof(probes));
 }
 
 bool Server::_handleClientActivity(size_t index) {
@@ -235,50 +518,141 @@ bool Server::_handleClientActivity(size_t index) {
   if (client == 0) return true;
 
   if ((_pollFds[index].revents & (POLLHUP | POLLERR)) != 0) {
-    std::cerr << "Client fd " << client_fd << " hangup or error\n";
+    _log.write(LOG_WARN, LOG_CLIENT, "Client fd % hangup or error", client_fd);
     removeClient(client_fd);
     return false;
   }
-  if ((_pollFds[index].revents & POLLIN) != 0) {
-    try {
-      client->receive();
-      if (client->wantsToQuit()) {
-        std::cout << "Client fd " << client_fd << " wants to quit\n";
-        removeClient(client_fd);
-        return false;
-      }
-    } catch (const std::runtime_error &e) {
-      std::cerr << "Receive error on fd " << client_fd << ": " << e.what()
-                << "\n";
-      removeClient(client_fd);
+  if ((_pollFds[index].revents & POLLIN) != 0 && !client->wantsToQuit()) {
+    const uint64_t start = get_monotonic_ns();
+    const bool isAlive = _readClient(client);
+    _phaseTime[PHASE_READ] += get_monotonic_ns() - start;
+    if (!isAlive) {
       return false;
     }
   }
   if ((_pollFds[index].revents & POLLOUT) != 0) {
-    try {
-      client->answer();
-    } catch (const std::runtime_error &e) {
-      std::cerr << "Send error on fd " << client_fd << ": " << e.what() << "\n";
-      removeClient(client_fd);
+    const uint64_t start = get_monotonic_ns();
+    const bool isAlive = _writeClient(index, client);
+    _phaseTime[PHASE_WRITE] += get_monotonic_ns() - start;
+    if (!isAlive) {
       return false;
     }
-    if (!client->wantsToWrite()) {
-      _pollFds[index].events &= ~POLLOUT;
+  }
+  return true;
+}
+
+// Reads and dispatches the complete lines, or only dispatches the ones left
+// from the client's last turn. False once the client is removed.
+bool Server::_readClient(Client *client, bool isResumed) {
+  const int client_fd = client->getClientFd();
+  try {
+    if (isResumed) {
+      client->resume();
+    } else {
+      client->receive();
     }
+    if (client->wantsToQuit()) {
+      _log.write(LOG_INFO, LOG_CLIENT, "Client fd % wants to quit", client_fd);
+      removeClient(client_fd);
+      return false;
+    }
+  } catch (const std::runtime_error &e) {
+    _log.write(LOG_WARN, LOG_CLIENT, "Receive error on fd %: %", client_fd,
+               e.what());
+    removeClient(client_fd);
+    return false;
   }
   return true;
 }
 
+bool Server::_writeClient(size_t index, Client *client) {
+  const int client_fd = client->getClientFd();
+  try {
+    client->answer();
+  } catch (const std::runtime_error &e) {
+    _log.write(LOG_WARN, LOG_CLIENT, "Send error on fd %: %", client_fd,
+               e.what());
+    removeClient(client_fd);
+    return false;
+  }
+  if (!client->wantsToWrite()) {
+    _pollFds[index].events &= ~POLLOUT;
+  }
+  return true;
+}
+
+// The client is not read until its lines are handled, what it pipelines
+// meanwhile waits in the socket. A client already queued keeps its place, so
+// that it gets one turn a tick.
+void Server::deferLines(Client *client) {
+  if (client->isReady()) {
+    return;
+  }
+  client->setReady(true);
+  _readyClients.push_back(std::make_pair(client->getClientFd(), client));
+  _setReading(client->getClientFd(), false);
+}
+
+void Server::stopReading(Client *client) {
+  _setReading(client->getClientFd(), false);
+}
+
+// One turn each, in the order they were deferred
+void Server::_resumeClients(
+    const std::vector<std::pair<int, Client *> > &ready) {
+  const uint64_t start = get_monotonic_ns();
+  for (size_t i = 0; i < ready.size(); ++i) {
+    const int fd = ready[i].first;
+    Client *client = ready[i].second;
+    if (findClient(_clients, fd) != client) {
+      continue;
+    }
+    client->setReady(false);
+    if (!_readClient(client, true)) {
+      continue;
+    }
+    if (!client->hasLines()) {
+      _setReading(fd, true);
+    }
+  }
+  _phaseTime[PHASE_READ] += get_monotonic_ns() - start;
+}
+
+void Server::_setReading(int fd, bool isReading) {
+  for (size_t i = 0; i < _pollFds.size(); ++i) {
+    if (_pollFds[i].fd == fd) {
+      _pollFds[i].events = (isReading ? _pollFds[i].events | POLLIN
+                                      : _pollFds[i].events & ~POLLIN);
+      return;
+    }
+  }
+}
+
 void Server::removeClient(int fd) {
   Client *client = findClient(_clients, fd);
   if (client == NULL) {
     return;
   }
-  client->answer();
-  if (!client->wantsToQuit()) {
+  PROBE2(client_remove, fd, client->getNick().c_str());
+  try {
+    client->answer();  // Best effort, the peer may already be gone
+  } catch (const std::runtime_error &e) {
+    _log.write(LOG_WARN, LOG_CLIENT, "Send error on fd %: %", fd, e.what());
+  }
+  if (client->isLink()) {
+    _links.erase(client);
+    _netsplit(client);
+  } else if (!client->wantsToQuit()) {
     client->broadcastToAllChannels("Client disconnected", "QUIT");
     client->leaveAllChannels();
   }
+  if (client->isAuthenticated()) {
+    _journal.quit(fd);
+  }
+  client->forgetInvitations();
+  _capture.disconnect(fd);
+  _admission.release(client->getAddress());
+  _cancelJobs(fd);
   close(fd);
   delete client;
   _clients.erase(fd);
@@ -291,34 +665,190 @@ void Server::removeClient(int fd) {
   }
 }
 
+// Sends what the tick queued with one send per client, so that a burst of
+// replies (welcome, NAMES, WHOIS...) leaves in as few segments as possible.
+// What the socket does not take waits for POLLOUT.
+void Server::_flushWrites() {
+  while (!_pendingWrites.empty()) {
+    std::vector<std::pair<int, Client *> > writes;
+    writes.swap(_pendingWrites);  // a removal below may queue more
+    for (size_t i = 0; i < writes.size(); ++i) {
+      const int fd = writes[i].first;
+      Client *client = writes[i].second;
+      if (findClient(_clients, fd) != client || !client->wantsToWrite()) {
+        continue;
+      }
+      try {
+        client->answer();
+      } catch (const std::runtime_error &e) {
+        _log.write(LOG_WARN, LOG_CLIENT, "Send error on fd %: %", fd, e.what());
+        removeClient(fd);
+        continue;
+      }
+      if (!client->wantsToWrite()) {
+        continue;
+      }
+      for (size_t j = 0; j < _pollFds.size(); ++j) {
+        if (_pollFds[j].fd == fd) {
+          _pollFds[j].events |= POLLOUT;
+          break;
+        }
+      }
+    }
+  }
+}
+
+// Clients killed while the poll loop iterates are removed once it is done
+void Server::_flushRemovals() {
+  std::vector<std::pair<int, Client *> > removals;
+  removals.swap(_removals);
+  for (size_t i = 0; i < removals.size(); ++i) {
+    if (findClient(_clients, removals[i].first) == removals[i].second) {
+      removeClient(removals[i].first);
+    }
+  }
+}
+
 void Server::sendToClient(Client *client, const std::string &msg) {
   if (client == NULL || msg.empty()) {
     return;
   }
+  if (client->isRemote()) {
+    client = client->getUplink();
+  }
+  if (client->getOutBufferSize() > SENDQ_MAX && !client->isLink()) {
+    return;  // Already queued for removal
+  }
+  if (client->getOutBufferSize() == 0) {
+    queueWrite(client);  // otherwise already queued, or waiting for POLLOUT
+  }
   client->appendToOutBuffer(msg);
-  for (size_t i = 0; i < _pollFds.size(); ++i) {
-    if (_pollFds[i].fd == client->getClientFd()) {
-      _pollFds[i].events |= POLLOUT;
-      break;
-    }
+  if (client->getOutBufferSize() > SENDQ_MAX && !client->isLink()) {
+    // The client does not read, drop it rather than buffer without bound
+    _stats.add(STAT_SENDQ_DROPS);
+    PROBE2(sendq_overflow, client->getClientFd(), client->getOutBufferSize());
+    _removals.push_back(std::make_pair(client->getClientFd(), client));
   }
 }
 
+// Sent at the end of the tick, by _flushWrites
+void Server::queueWrite(Client *client) {
+  _pendingWrites.push_back(std::make_pair(client->getClientFd(), client));
+}
+
+// Local members get the message directly, remote ones through their link,
+// once per link. Membership changes (toAllLinks) reach every server since they
+// all keep track of every channel. The link the message came from is skipped.
 void Server::sendToChannel(Channel *channel, const std::string &msg,
-                           Client *sender) {
-  if (channel == NULL || msg.empty()) {
+                           Client *sender, bool toAllLinks) {
+  if (msg.empty()) {
     return;
   }
+  const std::string *const lines[TAGS_COUNT] = {&msg, &msg, &msg};
+  _sendToChannel(channel, lines, sender, toAllLinks);
+}
+
+// lines holds the message for each Tags level, links get the bare one
+void Server::_sendToChannel(Channel *channel,
+                            const std::string *const lines[TAGS_COUNT],
+                            Client *sender, bool toAllLinks) {
+  if (channel == NULL) {
+    return;
+  }
+  const Client *route = (sender != NULL ? sender->getRoute() : NULL);
+  std::set<Client *> links;
+  uint64_t fanout = 0;
   ClientList clients = channel->getClients();
   for (ClientList::const_iterator it = clients.begin(); it != clients.end();
        ++it) {
     Client *client = it->second;
-    if (client != sender) {
-      sendToClient(client, msg);
+    if (client == sender) {
+      continue;
+    }
+    if (client->isRemote()) {
+      links.insert(client->getUplink());
+    } else {
+      sendToClient(client, *lines[_tagsOf(client)]);
+      ++fanout;
+    }
+  }
+  if (toAllLinks) {
+    links.insert(_links.begin(), _links.end());
+  }
+  for (std::set<Client *>::const_iterator it = links.begin(); it != links.end();
+       ++it) {
+    if (*it != route) {
+      sendToClient(*it, *lines[TAGS_NONE]);
+      ++fanout;
+    }
+  }
+  _stats.add(STAT_FANOUT, fanout);
+  PROBE3(fanout, channel->getName().c_str(), clients.size(), fanout);
+}
+
+Server::Tags Server::_tagsOf(const Client *client) {
+  if (client->hasCap(Client::CAP_MESSAGE_TAGS)) {
+    return TAGS_MSGID;
+  }
+  return client->hasCap(Client::CAP_SERVER_TIME) ? TAGS_TIME : TAGS_NONE;
+}
+
+// Sends a network-wide event to every link except the one it came from
+void Server::propagate(const std::string &msg, Client *origin) {
+  const Client *route = (origin != NULL ? origin->getRoute() : NULL);
+  for (std::set<Client *>::const_iterator it = _links.begin();
+       it != _links.end(); ++it) {
+    if (*it != route) {
+      sendToClient(*it, msg);
     }
   }
 }
 
+// A PRIVMSG or NOTICE to a channel. Members get the tags they negotiated,
+// as a CHATHISTORY replay of it would carry: time with server-time or
+// message-tags, msgid with message-tags only. Links and the history keep the
+// bare line.
+void Server::relayToChannel(Channel *channel, const std::string &line,
+                            Client *sender) {
+  const uint64_t msgid = _nextMsgid++;
+  const uint64_t time = get_time_ms();
+  std::stringstream tagged;
+  tagged << "@time=" << format_server_time(time);
+  const std::string timed = tagged.str() + " " + line;
+  tagged << ";msgid=" << msgid << " " << line;
+  const std::string full = tagged.str();
+  const std::string *const lines[TAGS_COUNT] = {&line, &timed, &full};
+  _sendToChannel(channel, lines, sender, false);
+  _pushHistory(channel, msgid, time, line);
+  _journal.history(channel->getName(), msgid, time, line);
+}
+
+// Channels are ordered by their last message so that the coldest ones lose
+// their history first once the global budget is exceeded
+void Server::_pushHistory(Channel *channel, uint64_t msgid, uint64_t time,
+                          const std::string &line) {
+  History &history = channel->getHistory();
+  _forgetHistory(channel);
+  history.push(msgid, time, line);
+  _historyBytes += history.getBytes();
+  _historyByActivity[history.getLastMsgid()] = channel;
+
+  while (_historyBytes > HISTORY_BUDGET && _historyByActivity.size() > 1) {
+    Channel *coldest = _historyByActivity.begin()->second;
+    _forgetHistory(coldest);
+    coldest->getHistory().clear();
+  }
+}
+
+void Server::_forgetHistory(Channel *channel) {
+  const History &history = channel->getHistory();
+  if (history.empty()) {
+    return;
+  }
+  _historyBytes -= history.getBytes();
+  _historyByActivity.erase(history.getLastMsgid());
+}
+
 bool Server::isNicknameAvailable(const Client *user,
                                  const std::string &nick) const {
   Client *found = findClient(_clients, nick);
@@ -333,6 +863,19 @@ const std::map<std::string, Channel *> &Server::getChannels() const {
   return _channels;
 }
 const ClientList &Server::getClients() const { return _clients; }
+const ServerList &Server::getServers() const { return _servers; }
+Journal &Server::getJournal() { return _journal; }
+Stats &Server::getStats() { return _stats; }
+Logger &Server::getLog() { return _log; }
+
+Capture &Server::getCapture() { return _capture; }
+const Config &Server::getConfig() const { return _config; }
+
+std::string Server::getOperHash(const std::string &name) const {
+  const std::map<std::string, std::string>::const_iterator it =
+      _opers.find(name);
+  return it != _opers.end() ? it->second : "";
+}
 std::time_t Server::getCreatedAt() const { return _createdAt; }
 
 void Server::addClient(Client *client) {
@@ -348,6 +891,7 @@ void Server::addChannel(Channel *channel) {
     return;
   }
   _channels[channel->getName()] = channel;
+  touchChannel(channel->getName());
 }
 
 void Server::removeChannel(const std::string &name) {
@@ -355,6 +899,8 @@ void Server::removeChannel(const std::string &name) {
   if (channel == NULL) {
     return;
   }
+  _forgetHistory(channel);
   delete channel;
   _channels.erase(name);
+  touchChannel(name);
 }
@@ -1,21 +1,62 @@
 #pragma once
 
+#include <stdint.h>
+#include <sys/types.h>
+
 #include <cstddef>
 #include <ctime>
+#include <deque>
 #include <map>
+#include <set>
 #include <string>
 #include <vector>
 
+#include "Admission.hpp"
 #include "Channel.hpp"
+#include "Capture.hpp"
+#include "Config.hpp"
+#include "Directory.hpp"
+#include "Histogram.hpp"
+#include "Journal.hpp"
+#include "Logger.hpp"
+#include "Password.hpp"
+#include "Resolver.hpp"
+#include "Stats.hpp"
+#include "Tls.hpp"
+#include "WorkerPool.hpp"
 
 #define BACKLOG 10
 #define MAX_CLIENTS 100
 #define TIMEOUT 5000  // poll will block for this long unless an event occurs
+#define SNAPSHOT_FILE "ircserv.snapshot"  // default "snapshot", "none" for none
+#define SNAPSHOT_INTERVAL 60              // seconds between two snapshots
+#define UPGRADE_ENV "IRCSERV_UPGRADE_FD"  // set when exec'ed by an upgrade
+#define UPGRADE_TIMEOUT 10000  // ms to wait for the new process to take over
+#define LINK_RETRY 30          // seconds between two attempts to dial a link
+#define SENDQ_MAX 1048576  // unsent bytes before a client is dropped
+#define SLOWLOG_THRESHOLD 10000  // us, default of the "slowlog" config key
+#define SLOWLOG_LENGTH 64        // slow commands kept for STATS s
+#define OVERLOAD_LAG 50       // ms of loop lag, default of the "overload" key
+#define OVERLOAD_WINDOW 100   // ms the loop lag is averaged over
+#define OVERLOAD_HOLD 1000    // ms a stage is held before stepping down
+#define OVERLOAD_TICKS 3      // ticks past a threshold before a stage starts
+#define OVERLOAD_LINES 10     // lines a second a throttled client may send
+#define OVERLOAD_SENDQ 65536  // bytes queued before a client may be shed
+#define OVERLOAD_DROPS 2      // clients shed every OVERLOAD_HOLD ms
 
 typedef std::map<int, Client *> ClientList;
 typedef std::map<std::string, Channel *> ChannelList;
 
+class BlobReader;
+class BlobWriter;
 class Client;
+
+struct RemoteServer {
+  Client *link;        // direct link the server is reachable through
+  std::string parent;  // server that introduced it
+};
+typedef std::map<std::string, RemoteServer> ServerList;
+
 class Server {
  public:
   enum RPL {
@@ -23,6 +64,12 @@ class Server {
     RPL_YOURHOST = 002,
     RPL_CREATED = 003,
     RPL_MYINFO = 004,
+    RPL_ISUPPORT = 005,
+    RPL_STATSCOMMANDS = 212,
+    RPL_ENDOFSTATS = 219,
+    RPL_STATSUPTIME = 242,
+    RPL_STATSDEBUG = 249,
+    RPL_TRYAGAIN = 263,
     RPL_WHOISUSER = 311,
     RPL_WHOISSERVER = 312,
     RPL_WHOISIDLE = 317,
@@ -34,10 +81,16 @@ class Server {
     RPL_NOTOPIC = 331,
     RPL_TOPIC = 332,
     RPL_INVITING = 341,
+    RPL_EXCEPTLIST = 348,
+    RPL_ENDOFEXCEPTLIST = 349,
+    RPL_LINKS = 364,
+    RPL_ENDOFLINKS = 365,
     RPL_WHOREPLY = 352,
     RPL_ENDOFWHO = 315,
     RPL_NAMREPLY = 353,
     RPL_ENDOFNAMES = 366,
+    RPL_BANLIST = 367,
+    RPL_ENDOFBANLIST = 368,
     RPL_YOUREOPER = 381,
     RPL_TIME = 391
   };
@@ -68,19 +121,56 @@ class Server {
     ERR_CHANNELISFULL = 471,
     ERR_UNKNOWNMODE = 472,
     ERR_INVITEONLYCHAN = 473,
+    ERR_BANNEDFROMCHAN = 474,
     ERR_BADCHANNELKEY = 475,
-    ERR_CHANOPRIVSNEEDED = 482
+    ERR_BANLISTFULL = 478,
+    ERR_NOPRIVILEGES = 481,
+    ERR_CHANOPRIVSNEEDED = 482,
+    ERR_NOOPERHOST = 491
+  };
+
+  // Parts of a poll loop tick, timed separately
+  enum Phase { PHASE_WAIT, PHASE_ACCEPT, PHASE_READ, PHASE_WRITE, PHASE_COUNT };
+
+  // Load shedding stages, each one keeps the measures of the ones before
+  enum Overload {
+    OVERLOAD_NONE,
+    OVERLOAD_DEFER,     // new connections wait in the listen backlog
+    OVERLOAD_BULK,      // LIST and NAMES of every channel are refused
+    OVERLOAD_THROTTLE,  // clients past OVERLOAD_LINES a second are not read
+    OVERLOAD_SHED,      // the clients with the largest send queues are dropped
+    OVERLOAD_COUNT
   };
 
   static const std::map<ERR, std::string> ERRORS;
 
-  Server(const std::string &port = "6667", const std::string &password = "");
+  Server(const std::string &port = "6667", const std::string &password = "",
+         const Config &config = Config());
   ~Server();
 
   void run();
+  int tick(int timeout);
+  void setExecutable(const std::string &path);
   void sendToClient(Client *client, const std::string &msg);
+  void queueWrite(Client *client);
   void sendToChannel(Channel *channel, const std::string &msg,
-                     Client *sender = NULL);
+                     Client *sender = NULL, bool toAllLinks = false);
+  void propagate(const std::string &msg, Client *origin = NULL);
+  void checkPassword(Client *client);
+  void checkOper(Client *client, const std::string &password,
+                 const std::string &hash);
+  void deferLines(Client *client);
+  void throttle(Client *client);  // its lines wait a second
+  void stopReading(Client *client);  // until deferLines gives it a turn
+  bool runQuery(QueryJob *job);
+  void touchChannel(const std::string &name);  // after a change LIST or NAMES
+  void touchChannels(const ChannelList &channels);  // would show
+  void relayToChannel(Channel *channel, const std::string &line,
+                      Client *sender);
+  void recordCommand(size_t index, uint64_t ns, const Client *client,
+                     const std::vector<std::string> &msg);
+  std::vector<std::string> latencyReport() const;
+  static const char *overloadName(Overload stage);
 
   static std::map<Server::ERR, std::string> init_error_map();
   bool isNicknameAvailable(const Client *user, const std::string &nick) const;
@@ -88,28 +178,146 @@ class Server {
   // getters
   const std::string &getName() const;
   const std::string &getPort() const;
-  const std::string &getPassword() const;
+  const std::string &getPassword() const;  // hashed
   bool isPassRequired() const;
   const ChannelList &getChannels() const;
   const ClientList &getClients() const;
+  const ServerList &getServers() const;
+  Journal &getJournal();
+  Stats &getStats();
+  Logger &getLog();
+  Capture &getCapture();
+  const std::deque<std::string> &getSlowLog() const;
+  const Config &getConfig() const;
+  std::string getOperHash(const std::string &name) const;  // empty if none
   std::time_t getCreatedAt() const;
+  HostCache &getHostCache();
+  uint64_t getResolveTtl() const;  // ns
+  Directory *getDirectory(bool withNames);
+  MemoryUsage measureMemory() const;
+  size_t getMemoryBudget() const;  // bytes, 0 for none
+  Overload getOverload() const;
+  uint64_t getLoopLag() const;  // ns
 
   void removeChannel(const std::string &name);
   void removeClient(int cfd);
   void addChannel(Channel *channel);
   void addClient(Client *client);
 
+  // * SERVER LINKS *
+  void introduce(Client *client);
+  void acceptLink(Client *link, const std::vector<std::string> &msg);
+  void dialLink(const Directive &link,
+                const std::vector<struct sockaddr_storage> &addresses,
+                const std::string &error);
+  void handleLinkMessage(Client *link, const std::string &line);
+
  private:
+  // Tags a channel member negotiated, what relayToChannel adds to a line
+  enum Tags { TAGS_NONE, TAGS_TIME, TAGS_MSGID, TAGS_COUNT };
+
   Server();
   Server(const Server &other);
   Server &operator=(const Server &other);
 
   void _cleanup();
+  void _loadOpers();
   static int _bindAndListen(const struct addrinfo *res);
   void _addPollFd(int fd, short events);
   void _handleNewConnection(int sockfd);
   bool _handleClientActivity(size_t index);
+  bool _readClient(Client *client, bool isResumed = false);
+  void _resumeClients(const std::vector<std::pair<int, Client *> > &ready);
+  void _setReading(int fd, bool isReading);
+  bool _writeClient(size_t index, Client *client);
   void _handlePollEvents();
+  void _sendToChannel(Channel *channel,
+                      const std::string *const lines[TAGS_COUNT],
+                      Client *sender, bool toAllLinks);
+  static Tags _tagsOf(const Client *client);
+  void _forgetHistory(Channel *channel);
+  void _pushHistory(Channel *channel, uint64_t msgid, uint64_t time,
+                    const std::string &line);
+  bool _writeSnapshot(const std::string &path) const;
+  void _startSnapshot();
+  void _reapSnapshot(bool wait);
+  void _loadSnapshot();
+  void _saveState(BlobWriter &out, std::vector<int> &fds) const;
+  void _loadState(BlobReader &in, const std::vector<int> &fds);
+  void _closeUnhanded();
+  bool _upgrade();
+  void _resumeUpgrade(int sock);
+  void _listenJournal();
+  void _attachStandby();
+  void _syncStandby();
+  bool _attachPrimary(const std::string &path);
+  bool _follow();
+  bool _applyRecord(BlobReader &in);
+  void _takeOver();
+  void _dropMirror();
+  void _flushRemovals();
+  void _flushWrites();
+  void _tuneSocket(int fd) const;
+  bool _openTlsContext();
+  void _listenTls();
+  bool _isTlsListener(int fd) const;
+  void _openStats();
+  static std::vector<std::string> _commandNames();
+  void _recordPhases();
+  void _startWorkers();
+  bool _runJob(WorkerPool &pool, Job *job, uint64_t timeoutMs);
+  void _collectJobs(WorkerPool &pool);
+  void _expireJobs(uint64_t now);
+  void _cancelJobs(int fd);
+  void _removeIfQuitting(int fd);
+  void _startLookup(Client *client, const struct sockaddr_storage &peer);
+  bool _isMemoryTight() const;
+  void _checkMemory(uint64_t now);
+  std::vector<std::pair<size_t, Client *> > _sendQueues(size_t minimum) const;
+  void _recordTick(uint64_t wait, uint64_t busy, uint64_t now);
+  void _setOverload(Overload stage, uint64_t now);
+  void _setAccepting(bool isAccepting);
+  void _shedLoad(uint64_t now);
+  void _releaseThrottled(uint64_t now);
+
+  // * SERVER LINKS *
+  struct LinkMessage {
+    Client *link;    // connection the message arrived on
+    Client *source;  // remote user that sent it, NULL for a server
+    std::string origin;
+    std::vector<std::string> params;
+    std::string line;  // relayed as is
+  };
+  typedef void (Server::*LinkFunction)(const LinkMessage &);
+  static const std::map<std::string, LinkFunction> LINK_COMMANDS;
+  static std::map<std::string, LinkFunction> init_link_commands_map();
+
+  void _connectLinks();
+  void _connectLink(const Directive &link);
+  void _sendBurst(Client *link);
+  void _burstServers(Client *link, const std::string &parent);
+  std::string _uidLine(const Client *client) const;
+  void _netsplit(Client *link);
+  void _dropServer(const std::string &name);
+  void _removeRemoteClient(Client *client, const std::string &reason);
+  void _killClient(Client *victim, Client *origin, const std::string &reason);
+  void _applyLinkMode(Channel *channel, const std::vector<std::string> &params,
+                      const std::string &setter);
+  void _linkServer(const LinkMessage &msg);
+  void _linkSquit(const LinkMessage &msg);
+  void _linkUid(const LinkMessage &msg);
+  void _linkNick(const LinkMessage &msg);
+  void _linkQuit(const LinkMessage &msg);
+  void _linkKill(const LinkMessage &msg);
+  void _linkJoin(const LinkMessage &msg);
+  void _linkPart(const LinkMessage &msg);
+  void _linkKick(const LinkMessage &msg);
+  void _linkTopic(const LinkMessage &msg);
+  void _linkMode(const LinkMessage &msg);
+  void _linkInvite(const LinkMessage &msg);
+  void _linkMessage(const LinkMessage &msg);
+  void _linkPing(const LinkMessage &msg);
+  void _linkError(const LinkMessage &msg);
 
   std::string _port;
   int _sockfdIpv4;
@@ -121,5 +329,59 @@ class Server {
   std::string _name;
   bool _isPassRequired;
   std::string _password;
+  std::map<std::string, std::string> _opers;  // password hashes by name
   std::time_t _createdAt;
+  uint64_t _nextMsgid;
+  size_t _historyBytes;  // kept under HISTORY_BUDGET
+  std::map<uint64_t, Channel *> _historyByActivity;  // by last msgid
+  pid_t _snapshotPid;  // child writing the snapshot, -1 if none
+  std::time_t _lastSnapshot;
+  std::string _snapshotPath;  // empty when snapshots are disabled
+  std::string _executable;  // exec'ed again on SIGUSR2
+  Config _config;
+  ServerList _servers;  // every other server of the network
+  std::set<Client *> _links;  // the local links, a subset of _clients
+  int _nextRemoteId;    // remote users get negative keys in _clients
+  std::time_t _lastLinkAttempt;
+  std::set<std::string> _dialing;  // links whose host is being looked up
+  std::vector<std::pair<int, Client *> > _removals;  // after the poll loop
+  std::vector<std::pair<int, Client *> > _pendingWrites;  // end of the tick
+  std::vector<std::pair<int, Client *> > _readyClients;  // lines left, FIFO
+  Journal _journal;       // state changes sent to the standby
+  int _journalListener;   // UNIX socket the standby connects to
+  int _primaryFd;         // journal of the primary, -1 unless a standby
+  ClientList _mirror;     // clients of the primary, by their id there
+  Stats _stats;           // shared with ircstat once run() starts
+  Logger _log;            // on its writer thread once run() starts
+  std::vector<Histogram> _commandLatency;  // in Client::COMMANDS order
+  Histogram _phaseLatency[PHASE_COUNT];
+  uint64_t _phaseTime[PHASE_COUNT];  // ns spent in each phase this tick
+  uint64_t _slowThreshold;           // ns
+  std::deque<std::string> _slowLog;
+  Capture _capture;  // toggled by CAPTURE
+  Admission _admission;  // connections per address and subnet
+  std::vector<int> _tlsListeners;
+  TlsContext _tlsContext;
+  WorkerPool _resolver;   // reverse DNS and ident lookups
+  WorkerPool _authPool;   // password hashes
+  WorkerPool _queryPool;  // LIST, NAMES and WHOIS replies
+  HostCache _hostCache;
+  uint64_t _resolveTtl;                // ns a cached host name is kept
+  std::map<uint64_t, Job *> _jobs;     // on a pool, by id
+  std::multimap<uint64_t, uint64_t> _jobDeadlines;  // job ids by deadline
+  uint64_t _nextJobId;
+  Directory *_directory;        // latest version, one reference held
+  std::set<std::string> _touchedChannels;  // since _directory was taken
+  size_t _memoryBudget;         // bytes, from the "memory" config key in MiB
+  MemoryUsage _memory;          // as of _memoryCheckedAt
+  uint64_t _memoryCheckedAt;    // ns
+  uint64_t _overloadLag;        // ns, from the "overload" config key in ms
+  uint64_t _loopLag;            // ns, averaged over OVERLOAD_WINDOW
+  Histogram _tickLatency;       // busy part of each tick
+  Overload _overload;
+  uint64_t _overloadChangedAt;  // ns
+  size_t _overloadTicks;        // in a row past the next stage's threshold
+  uint64_t _shedAt;             // ns
+  std::vector<std::pair<int, Client *> > _throttledClients;  // lines held
+  uint64_t _throttledAt;  // ns, when the first of them was held
 };
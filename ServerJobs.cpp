@@ -0,0 +1,217 @@
+#include <poll.h>
+#include <sys/socket.h>
+
+#include <cstddef>
+#include <cstring>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "Client.hpp"
+#include "Directory.hpp"
+#include "Password.hpp"
+#include "Resolver.hpp"
+#include "Server.hpp"
+#include "WorkerPool.hpp"
+#include "utils.hpp"
+
+// * WORKER JOBS *
+
+// Threads for the host lookups when some lookup is enabled, for the password
+// checks when there is a password, and for the channel queries
+void Server::_startWorkers() {
+  if (_config.getString("resolve", "yes") == "yes" ||
+      _config.getString("ident", "no") == "yes") {
+    if (_resolver.start(_config.getSize("resolvers", RESOLVER_THREADS),
+                        RESOLVER_QUEUE)) {
+      _addPollFd(_resolver.getFd(), POLLIN);
+    } else {
+      _log.write(LOG_ERROR, LOG_JOBS, "Could not start the resolver threads");
+    }
+  }
+  if (_isPassRequired) {
+    if (_authPool.start(_config.getSize("authworkers", AUTH_THREADS),
+                        AUTH_QUEUE)) {
+      _addPollFd(_authPool.getFd(), POLLIN);
+    } else {
+      _log.write(LOG_ERROR, LOG_JOBS, "Could not start the auth threads");
+    }
+  }
+  if (_queryPool.start(_config.getSize("queryworkers", QUERY_THREADS),
+                       QUERY_QUEUE)) {
+    _addPollFd(_queryPool.getFd(), POLLIN);
+  } else {
+    _log.write(LOG_ERROR, LOG_JOBS, "Could not start the query threads");
+  }
+}
+
+// Owned by _jobs until collected or expired. False, with the job still the
+// caller's, when the pool is not running or is full.
+bool Server::_runJob(WorkerPool &pool, Job *job, uint64_t timeoutMs) {
+  job->setId(_nextJobId++);
+  if (!pool.submit(job)) {
+    return false;
+  }
+  _jobs[job->getId()] = job;
+  _jobDeadlines.insert(
+      std::make_pair(get_monotonic_ns() + timeoutMs * 1000000, job->getId()));
+  return true;
+}
+
+void Server::_collectJobs(WorkerPool &pool) {
+  std::vector<Job *> done;
+  pool.collect(done);
+  for (size_t i = 0; i < done.size(); ++i) {
+    Job *job = done[i];
+    // Expired or cancelled jobs were already taken out of _jobs
+    if (!job->isCancelled() && _jobs.erase(job->getId()) != 0) {
+      job->finish(*this);
+      _removeIfQuitting(job->getFd());
+    }
+    delete job;
+  }
+}
+
+// The job keeps running, its result is thrown away when it comes back
+void Server::_expireJobs(uint64_t now) {
+  while (!_jobDeadlines.empty() && _jobDeadlines.begin()->first <= now) {
+    const std::map<uint64_t, Job *>::iterator it =
+        _jobs.find(_jobDeadlines.begin()->second);
+    _jobDeadlines.erase(_jobDeadlines.begin());
+    if (it == _jobs.end()) {
+      continue;  // finished in time
+    }
+    Job *job = it->second;
+    _jobs.erase(it);
+    job->cancel();
+    job->expire(*this);
+    _removeIfQuitting(job->getFd());
+  }
+}
+
+// Erased from _jobs, so that the pool deletes it without finish()
+void Server::_cancelJobs(int fd) {
+  for (std::map<uint64_t, Job *>::iterator it = _jobs.begin();
+       it != _jobs.end();) {
+    if (it->second->getFd() == fd) {
+      it->second->cancel();
+      _jobs.erase(it++);
+    } else {
+      ++it;
+    }
+  }
+}
+
+// A result can complete a registration that then fails, a wrong password
+void Server::_removeIfQuitting(int fd) {
+  Client *client = findClient(_clients, fd);
+  if (client != NULL && client->wantsToQuit()) {
+    _removals.push_back(std::make_pair(fd, client));
+  }
+}
+
+// Registration waits for the host name, and the ident user name when the
+// "ident" config key is yes. A cached host name without ident needs no job.
+void Server::_startLookup(Client *client, const struct sockaddr_storage &peer) {
+  const bool wantsHost = (_config.getString("resolve", "yes") == "yes");
+  const bool wantsIdent = (_config.getString("ident", "no") == "yes");
+  if (!wantsHost && !wantsIdent) {
+    return;
+  }
+  std::string host;
+  const bool isCached =
+      !wantsHost ||
+      _hostCache.find(client->getAddress(), get_monotonic_ns(), host);
+  if (host.empty()) {
+    host = client->getAddress();  // not wanted, or a cached failure
+  }
+  client->startLookup();
+  if (isCached && !wantsIdent) {
+    client->lookupDone(host, "");
+    return;
+  }
+  struct sockaddr_storage local = {};
+  socklen_t length = sizeof(local);
+  std::memset(&local, 0, sizeof(local));  // NOLINT
+  getsockname(client->getClientFd(),
+              reinterpret_cast<struct sockaddr *>(&local), &length);  // NOLINT
+  LookupJob *job = new LookupJob(client->getClientFd(), peer, local,
+                                 isCached ? host : "", wantsIdent);
+  if (!_runJob(_resolver, job, RESOLVE_TIMEOUT)) {
+    delete job;
+    client->lookupDone("", "");
+  }
+}
+
+// On the auth pool, inline when it does not run: in the simulation harness,
+// or for a registration resumed by a hot upgrade before run(). A full queue
+// refuses the client rather than queueing key derivations without bound.
+void Server::checkPassword(Client *client) {
+  if (!_authPool.isRunning()) {
+    client->passwordChecked(verify_password(client->getPassword(), _password));
+    return;
+  }
+  AuthJob *job =
+      new AuthJob(client->getClientFd(), client->getPassword(), _password);
+  if (!_runJob(_authPool, job, AUTH_TIMEOUT)) {
+    delete job;
+    _stats.add(STAT_REFUSED);
+    client->closeLink("Server busy");
+  }
+}
+
+// Like checkPassword, but a busy pool only fails the OPER
+void Server::checkOper(Client *client, const std::string &password,
+                       const std::string &hash) {
+  if (!_authPool.isRunning()) {
+    client->operChecked(verify_password(password, hash));
+    return;
+  }
+  OperJob *job = new OperJob(client->getClientFd(), password, hash);
+  if (!_runJob(_authPool, job, AUTH_TIMEOUT)) {
+    delete job;
+    client->operBusy();
+  }
+}
+
+// On the query pool. False, with the job still the caller's to run inline,
+// when the pool does not run or is full.
+bool Server::runQuery(QueryJob *job) {
+  return _runJob(_queryPool, job, QUERY_TIMEOUT);
+}
+
+void Server::touchChannel(const std::string &name) {
+  if (_directory != NULL) {
+    _touchedChannels.insert(name);
+  }
+}
+
+void Server::touchChannels(const ChannelList &channels) {
+  for (ChannelList::const_iterator it = channels.begin(); it != channels.end();
+       ++it) {
+    touchChannel(it->first);
+  }
+}
+
+// A new version only after a change, or when the names are wanted and the
+// last one was taken without them. It takes again the touched channels only,
+// unless the names are wanted for the first time. The jobs still reading the
+// old one keep it alive.
+Directory *Server::getDirectory(bool withNames) {
+  if (_directory == NULL || !_touchedChannels.empty() ||
+      (withNames && !_directory->hasNames())) {
+    Directory *previous = _directory;
+    _directory = new Directory(_channels, withNames, previous,
+                               _touchedChannels);
+    _touchedChannels.clear();
+    if (previous != NULL) {
+      previous->release();
+    }
+  }
+  return _directory;
+}
+
+HostCache &Server::getHostCache() { return _hostCache; }
+
+uint64_t Server::getResolveTtl() const { return _resolveTtl; }
@@ -0,0 +1,86 @@
+#include <stdint.h>
+
+#include <cstddef>
+#include <deque>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "Client.hpp"
+#include "Histogram.hpp"
+#include "Server.hpp"
+
+namespace {
+
+const char *const PHASE_NAMES[Server::PHASE_COUNT] = {"wait", "accept", "read",
+                                                      "write"};
+
+// <kind> <name> <count> p50 <us> p90 <us> p99 <us> max <us>
+std::string summarize(const std::string &kind, const std::string &name,
+                      const Histogram &histogram) {
+  std::stringstream ss;
+  ss << std::fixed << std::setprecision(1) << kind << " " << name << " "
+     << histogram.count() << " p50 " << histogram.percentile(50) / 1000.0
+     << " p90 " << histogram.percentile(90) / 1000.0 << " p99 "
+     << histogram.percentile(99) / 1000.0 << " max "
+     << histogram.max() / 1000.0;
+  return ss.str();
+}
+
+}  // namespace
+
+// Commands slower than the "slowlog" threshold are logged with their
+// target, the first parameter when there are several. The others, or a lone
+// one, may be message text, a channel key or a password (PASS, OPER, SERVER).
+void Server::recordCommand(size_t index, uint64_t ns, const Client *client,
+                           const std::vector<std::string> &msg) {
+  _commandLatency[index].record(ns);
+  if (ns < _slowThreshold) {
+    return;
+  }
+  std::stringstream ss;
+  ss << ns / 1000 << "us "
+     << (client->getNick().empty() ? "*" : client->getNick()) << " "
+     << _stats.getCommandName(index);
+  if (msg.size() > 2) {
+    ss << " " << msg[1];
+  }
+  _log.write(LOG_WARN, LOG_JOBS, "Slow command: %", ss.str());
+  _slowLog.push_back(ss.str());
+  if (_slowLog.size() > SLOWLOG_LENGTH) {
+    _slowLog.pop_front();
+  }
+}
+
+// Called once per tick, a phase that did not run is not recorded
+void Server::_recordPhases() {
+  for (int i = PHASE_ACCEPT; i < PHASE_COUNT; ++i) {
+    if (_phaseTime[i] != 0) {
+      _phaseLatency[i].record(_phaseTime[i]);
+      _phaseTime[i] = 0;
+    }
+  }
+}
+
+// Shared by STATS l and SIGUSR1, times in microseconds
+std::vector<std::string> Server::latencyReport() const {
+  std::vector<std::string> report;
+  for (int i = 0; i < PHASE_COUNT; ++i) {
+    report.push_back(summarize("phase", PHASE_NAMES[i], _phaseLatency[i]));
+  }
+  report.push_back(summarize("loop", "tick", _tickLatency));
+  std::stringstream ss;
+  ss << "loop lag " << _loopLag / 1000 << " overload "
+     << overloadName(_overload);
+  report.push_back(ss.str());
+  for (size_t i = 0; i < _commandLatency.size(); ++i) {
+    if (_commandLatency[i].count() != 0) {
+      report.push_back(
+          summarize("command", _stats.getCommandName(i), _commandLatency[i]));
+    }
+  }
+  return report;
+}
+
+const std::deque<std::string> &Server::getSlowLog() const { return _slowLog; }
@@ -0,0 +1,698 @@
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "Channel.hpp"
+#include "Client.hpp"
+#include "Server.hpp"
+#include "utils.hpp"
+
+// * Server links *
+// Servers form a tree. A link is a Client connection flagged with setLink(),
+// the users behind it are Client objects with a negative key in _clients and
+// the link as uplink. Links speak the client protocol with user prefixes,
+// plus SERVER, UID, KILL and SQUIT for the network state. After the SERVER
+// handshake both sides send a burst of everything they know, afterwards
+// every event is relayed to all links except the one it came from.
+
+const std::map<std::string, Server::LinkFunction> Server::LINK_COMMANDS =
+    init_link_commands_map();
+
+std::map<std::string, Server::LinkFunction> Server::init_link_commands_map() {
+  std::map<std::string, LinkFunction> commands;
+  commands["SERVER"] = &Server::_linkServer;
+  commands["SQUIT"] = &Server::_linkSquit;
+  commands["UID"] = &Server::_linkUid;
+  commands["NICK"] = &Server::_linkNick;
+  commands["QUIT"] = &Server::_linkQuit;
+  commands["KILL"] = &Server::_linkKill;
+  commands["JOIN"] = &Server::_linkJoin;
+  commands["PART"] = &Server::_linkPart;
+  commands["KICK"] = &Server::_linkKick;
+  commands["TOPIC"] = &Server::_linkTopic;
+  commands["MODE"] = &Server::_linkMode;
+  commands["INVITE"] = &Server::_linkInvite;
+  commands["PRIVMSG"] = &Server::_linkMessage;
+  commands["NOTICE"] = &Server::_linkMessage;
+  commands["PING"] = &Server::_linkPing;
+  commands["ERROR"] = &Server::_linkError;
+  return commands;
+}
+
+// Dials every configured peer that is neither linked nor being dialed
+void Server::_connectLinks() {
+  _lastLinkAttempt = std::time(NULL);
+  const std::vector<Directive> links = _config.getAll("link");
+  for (std::vector<Directive>::const_iterator it = links.begin();
+       it != links.end(); ++it) {
+    const Directive &link = *it;
+    if (link.size() < 4 || link[1] == "*" || _servers.count(link[0]) != 0 ||
+        _dialing.count(link[0]) != 0) {
+      continue;
+    }
+    bool pending = false;
+    for (ClientList::const_iterator cit = _clients.begin();
+         cit != _clients.end(); ++cit) {
+      if (cit->second->getServerName() == link[0]) {
+        pending = true;
+        break;
+      }
+    }
+    if (!pending) {
+      _connectLink(link);
+    }
+  }
+}
+
+// link: <name> <host> <port> <password>. The host is looked up on the
+// resolver pool, the poll loop must not block on DNS. Without the pool only
+// numeric hosts are dialed.
+void Server::_connectLink(const Directive &link) {
+  LinkLookupJob *job = new LinkLookupJob(link);
+  if (_runJob(_resolver, job, RESOLVE_TIMEOUT)) {
+    _dialing.insert(link[0]);
+    return;
+  }
+  delete job;
+  std::vector<struct sockaddr_storage> addresses;
+  const std::string error =
+      resolve_link(link, AI_NUMERICHOST | AI_NUMERICSERV, addresses);
+  dialLink(link, addresses, error);
+}
+
+void Server::dialLink(const Directive &link,
+                      const std::vector<struct sockaddr_storage> &addresses,
+                      const std::string &error) {
+  _dialing.erase(link[0]);
+  if (!error.empty()) {
+    _log.write(LOG_WARN, LOG_LINK, "Link %: %", link[0], error);
+    return;
+  }
+  if (_servers.count(link[0]) != 0) {
+    return;  // it dialed us while the lookup ran
+  }
+  int sockfd = -1;
+  for (size_t i = 0; i < addresses.size(); ++i) {
+    const struct sockaddr_storage &addr = addresses[i];
+    sockfd = socket(addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sockfd == -1) {
+      continue;
+    }
+    // The handshake completes in the poll loop, POLLOUT signals the connect
+    fcntl(sockfd, F_SETFL, O_NONBLOCK);
+    const struct sockaddr *peer =
+        reinterpret_cast<const struct sockaddr *>(&addr);  // NOLINT
+    const socklen_t length = addr.ss_family == AF_INET6
+                                 ? sizeof(struct sockaddr_in6)
+                                 : sizeof(struct sockaddr_in);
+    if (connect(sockfd, peer, length) == 0 || errno == EINPROGRESS) {
+      break;
+    }
+    close(sockfd);
+    sockfd = -1;
+  }
+  if (sockfd == -1) {
+    _log.write(LOG_WARN, LOG_LINK, "Link %: %", link[0], strerror(errno));
+    return;
+  }
+  _log.write(LOG_INFO, LOG_LINK, "Connecting to % on fd %", link[0], sockfd);
+  Client *client = new Client(sockfd, this);
+  client->setServerName(link[0]);  // expected in the SERVER reply
+  addClient(client);
+  sendToClient(client, "SERVER " + _name + " " + link[3]);
+}
+
+// SERVER <name> <password>, received from an unregistered connection. The
+// accepting side answers with its own SERVER line, the dialing one already
+// sent it.
+void Server::acceptLink(Client *link, const std::vector<std::string> &msg) {
+  if (link->isAuthenticated() || link->isLink() || link->isPassSet() ||
+      link->isNickSet() || link->isUserSet()) {
+    link->createMessage(ERR_ALREADYREGISTRED);
+    return;
+  }
+  const std::string &name = msg[1];
+  const std::vector<Directive> links = _config.getAll("link");
+  const Directive *config = NULL;
+  for (std::vector<Directive>::const_iterator it = links.begin();
+       it != links.end(); ++it) {
+    if (it->size() >= 4 && (*it)[0] == name && (*it)[3] == msg[2]) {
+      config = &*it;
+      break;
+    }
+  }
+  const bool dialed = !link->getServerName().empty();
+  if (config == NULL || name == _name || _servers.count(name) != 0 ||
+      (dialed && link->getServerName() != name)) {
+    _log.write(LOG_WARN, LOG_LINK, "Refused link from %", name);
+    sendToClient(link, "ERROR :Closing link: " + name + " (not authorized)");
+    link->setWantsToQuit(true);
+    return;
+  }
+  link->setLink(name);
+  _links.insert(link);
+  if (!dialed) {
+    sendToClient(link, "SERVER " + _name + " " + (*config)[3]);
+  }
+  RemoteServer server = {link, _name};
+  _servers[name] = server;
+  propagate(":" + _name + " SERVER " + name, link);
+  _sendBurst(link);
+  _log.write(LOG_INFO, LOG_LINK, "Linked with % on fd %", name,
+             link->getClientFd());
+}
+
+// Announces a freshly registered local user to the network
+void Server::introduce(Client *client) {
+  _journal.client(client->getClientFd(), client->getNick(),
+                  client->getUsername(), client->getHostname(),
+                  client->getRealName(), client->getJoinedAt());
+  propagate(_uidLine(client), client);
+}
+
+std::string Server::_uidLine(const Client *client) const {
+  std::stringstream ss;
+  ss << ":" << (client->isRemote() ? client->getServerName() : _name)
+     << " UID " << client->getNick() << " " << client->getUsername() << " "
+     << client->getHostname() << " " << client->getJoinedAt() << " :"
+     << client->getRealName();
+  return ss.str();
+}
+
+// Servers are sent parents first so that every introduction names a known
+// server
+void Server::_burstServers(Client *link, const std::string &parent) {
+  for (ServerList::const_iterator it = _servers.begin(); it != _servers.end();
+       ++it) {
+    if (it->second.parent == parent && it->second.link != link) {
+      sendToClient(link, ":" + parent + " SERVER " + it->first);
+      _burstServers(link, it->first);
+    }
+  }
+}
+
+void Server::_sendBurst(Client *link) {
+  _burstServers(link, _name);
+  for (ClientList::const_iterator it = _clients.begin(); it != _clients.end();
+       ++it) {
+    Client *client = it->second;
+    if (client->isAuthenticated() && !client->isLink() &&
+        client->getRoute() != link) {
+      sendToClient(link, _uidLine(client));
+    }
+  }
+  for (ChannelList::const_iterator it = _channels.begin();
+       it != _channels.end(); ++it) {
+    Channel *channel = it->second;
+    const std::string &name = it->first;
+    const ClientList members = channel->getClients();
+    const ClientList operators = channel->getOperators();
+    // Operators join first, the first member of a new channel gets +o
+    for (int pass = 0; pass < 2; ++pass) {
+      for (ClientList::const_iterator cit = members.begin();
+           cit != members.end(); ++cit) {
+        if (cit->second->getRoute() != link &&
+            (operators.count(cit->first) != 0) == (pass == 0)) {
+          sendToClient(link, cit->second->getPrefix() + " JOIN " + name);
+        }
+      }
+    }
+    std::stringstream modes;
+    modes << (channel->isInviteOnly() ? "i" : "")
+          << (channel->isTopicOperOnly() ? "t" : "")
+          << (channel->isPassRequired() ? "k" : "")
+          << (channel->isLimited() ? "l" : "");
+    if (channel->isPassRequired()) {
+      modes << " " << channel->getPassword();
+    }
+    if (channel->isLimited()) {
+      modes << " " << channel->getLimit();
+    }
+    if (!modes.str().empty()) {
+      sendToClient(link, ":" + _name + " MODE " + name + " +" + modes.str());
+    }
+    for (ClientList::const_iterator cit = operators.begin();
+         cit != operators.end(); ++cit) {
+      if (cit->second->getRoute() != link) {
+        sendToClient(link, ":" + _name + " MODE " + name + " +o " +
+                               cit->second->getNick());
+      }
+    }
+    for (const char *mode = "be"; *mode != '\0'; ++mode) {
+      const std::vector<MaskList::Entry> &masks =
+          channel->getMasks(*mode).getEntries();
+      for (size_t i = 0; i < masks.size(); ++i) {
+        sendToClient(link, ":" + _name + " MODE " + name + " +" + *mode + " " +
+                               masks[i].mask);
+      }
+    }
+    if (channel->isTopicSet()) {
+      sendToClient(link, ":" + _name + " TOPIC " + name + " :" +
+                             channel->getTopic());
+    }
+  }
+}
+
+// Splits off the prefix, checks that the source is really behind the link and
+// dispatches to the _link* handlers. Anything else is dropped silently.
+void Server::handleLinkMessage(Client *link, const std::string &line) {
+  if (link->wantsToQuit()) {
+    return;
+  }
+  LinkMessage msg;
+  msg.link = link;
+  msg.source = NULL;
+  msg.line = line;
+  msg.origin = link->getServerName();
+  std::string rest = line;
+  if (!rest.empty() && rest[0] == ':') {
+    const size_t space = rest.find(' ');
+    if (space == std::string::npos) {
+      return;
+    }
+    const std::string prefix = rest.substr(1, space - 1);
+    msg.origin = prefix.substr(0, prefix.find('!'));
+    rest.erase(0, space + 1);
+  } else {
+    msg.line = ":" + msg.origin + " " + line;
+  }
+  msg.params = parse(rest);
+  if (msg.params.empty()) {
+    return;
+  }
+  const ServerList::const_iterator server = _servers.find(msg.origin);
+  if (server == _servers.end()) {
+    msg.source = findClient(_clients, msg.origin);
+    if (msg.source == NULL || msg.source->getUplink() != link) {
+      return;  // Already killed or quit on this side
+    }
+  } else if (server->second.link != link) {
+    return;
+  }
+  const std::map<std::string, LinkFunction>::const_iterator fn =
+      LINK_COMMANDS.find(msg.params[0]);
+  if (fn != LINK_COMMANDS.end()) {
+    (this->*(fn->second))(msg);
+  }
+}
+
+// :<parent> SERVER <name>
+void Server::_linkServer(const LinkMessage &msg) {
+  if (msg.source != NULL || msg.params.size() < 2) {
+    return;
+  }
+  const std::string &name = msg.params[1];
+  if (name == _name || _servers.count(name) != 0) {
+    // Two paths to the same server, only a tree is supported
+    _log.write(LOG_WARN, LOG_LINK,
+               "Link % introduced known server %, dropping it",
+               msg.link->getServerName(), name);
+    sendToClient(msg.link, "ERROR :Server " + name + " already exists");
+    msg.link->setWantsToQuit(true);
+    return;
+  }
+  RemoteServer server = {msg.link, msg.origin};
+  _servers[name] = server;
+  propagate(msg.line, msg.link);
+}
+
+// SQUIT <name> [:reason]
+void Server::_linkSquit(const LinkMessage &msg) {
+  if (msg.params.size() < 2) {
+    return;
+  }
+  const std::string &name = msg.params[1];
+  const ServerList::const_iterator server = _servers.find(name);
+  if (server == _servers.end() || server->second.link != msg.link) {
+    return;
+  }
+  if (name == msg.link->getServerName()) {
+    msg.link->setWantsToQuit(true);  // Netsplit handled by removeClient
+    return;
+  }
+  _dropServer(name);
+  propagate(msg.line, msg.link);
+}
+
+// :<server> UID <nick> <user> <host> <registration time> :<real name>
+// On a nick collision the older registration wins, both lose on a tie.
+void Server::_linkUid(const LinkMessage &msg) {
+  if (msg.source != NULL || msg.params.size() < 6 ||
+      !Client::isValidName(msg.params[1])) {
+    return;
+  }
+  const std::string &nick = msg.params[1];
+  Client *existing = findClient(_clients, nick);
+  if (existing != NULL && !existing->wantsToQuit()) {
+    const std::time_t joinedAt =
+        static_cast<std::time_t>(std::atol(msg.params[4].c_str()));
+    if (joinedAt <= existing->getJoinedAt()) {
+      _killClient(existing, msg.link, "Nick collision");
+    }
+    if (joinedAt >= existing->getJoinedAt()) {
+      sendToClient(msg.link, ":" + _name + " KILL " + nick + " :Nick collision");
+      return;
+    }
+  }
+  Client *client = new Client(_nextRemoteId--, this);
+  client->setRemote(msg.link, msg.origin, msg.params);
+  _clients[client->getClientFd()] = client;
+  _journal.client(client->getClientFd(), nick, client->getUsername(),
+                  client->getHostname(), client->getRealName(),
+                  client->getJoinedAt());
+  propagate(msg.line, msg.link);
+}
+
+void Server::_linkNick(const LinkMessage &msg) {
+  if (msg.source == NULL || msg.params.size() < 2 ||
+      !Client::isValidName(msg.params[1])) {
+    return;
+  }
+  const std::string &nick = msg.params[1];
+  Client *existing = findClient(_clients, nick);
+  if (existing != NULL && existing != msg.source && !existing->wantsToQuit()) {
+    if (msg.source->getJoinedAt() <= existing->getJoinedAt()) {
+      _killClient(existing, msg.link, "Nick collision");
+    }
+    if (msg.source->getJoinedAt() >= existing->getJoinedAt()) {
+      // The other servers still know the user under its previous nick
+      sendToClient(msg.link, ":" + _name + " KILL " + nick + " :Nick collision");
+      propagate(msg.source->getPrefix() + " QUIT :Nick collision", msg.link);
+      _removeRemoteClient(msg.source, "Nick collision");
+      return;
+    }
+  }
+  msg.source->broadcastToAllChannels(nick, "NICK");
+  msg.source->setNick(nick);
+  _journal.nick(msg.source->getClientFd(), nick);
+  touchChannels(msg.source->getChannels());
+}
+
+void Server::_linkQuit(const LinkMessage &msg) {
+  if (msg.source == NULL) {
+    return;
+  }
+  propagate(msg.line, msg.link);
+  _removeRemoteClient(msg.source,
+                      (msg.params.size() > 1 ? msg.params[1] : "Client Quit"));
+}
+
+// A KILL for a user behind the link it arrived on crossed our own KILL for
+// the same nick collision, the user it was meant for is already gone.
+void Server::_linkKill(const LinkMessage &msg) {
+  if (msg.params.size() < 2) {
+    return;
+  }
+  Client *victim = findClient(_clients, msg.params[1]);
+  if (victim == NULL || victim->isLink() || victim->getRoute() == msg.link) {
+    return;
+  }
+  _killClient(victim, msg.link,
+              (msg.params.size() > 2 ? msg.params[2] : "Killed"));
+}
+
+// Local victims quit like with a QUIT, the others are killed on every link
+// except the one the kill came from (NULL to kill everywhere). A local victim
+// stays in _clients until the end of the tick, already quitting.
+void Server::_killClient(Client *victim, Client *origin,
+                         const std::string &reason) {
+  if (victim->wantsToQuit()) {
+    return;
+  }
+  if (!victim->isRemote()) {
+    sendToClient(victim, ":" + _name + " KILL " + victim->getNick() + " :" +
+                             reason);
+    std::vector<std::string> quit;
+    quit.push_back("QUIT");
+    quit.push_back("Killed (" + _name + " (" + reason + "))");
+    victim->quit(quit);
+    _removals.push_back(std::make_pair(victim->getClientFd(), victim));
+    return;
+  }
+  const std::string kill = ":" + _name + " KILL " + victim->getNick() + " :" +
+                           reason;
+  for (std::set<Client *>::const_iterator it = _links.begin();
+       it != _links.end(); ++it) {
+    if (*it != origin) {
+      sendToClient(*it, kill);
+    }
+  }
+  _removeRemoteClient(victim, "Killed (" + reason + ")");
+}
+
+// Tells the local users sharing a channel with a remote user that it left,
+// the other servers are told by the caller
+void Server::_removeRemoteClient(Client *client, const std::string &reason) {
+  const std::string line = client->getPrefix() + " QUIT :" + reason;
+  std::set<Client *> peers;
+  const ChannelList &channels = client->getChannels();
+  for (ChannelList::const_iterator it = channels.begin(); it != channels.end();
+       ++it) {
+    const ClientList members = it->second->getClients();
+    for (ClientList::const_iterator cit = members.begin();
+         cit != members.end(); ++cit) {
+      if (!cit->second->isRemote()) {
+        peers.insert(cit->second);
+      }
+    }
+  }
+  for (std::set<Client *>::const_iterator it = peers.begin();
+       it != peers.end(); ++it) {
+    sendToClient(*it, line);
+  }
+  client->leaveAllChannels();
+  client->forgetInvitations();
+  _journal.quit(client->getClientFd());
+  _clients.erase(client->getClientFd());
+  delete client;
+}
+
+// Forgets a server, everything introduced through it and their users
+void Server::_dropServer(const std::string &name) {
+  const ServerList::iterator server = _servers.find(name);
+  if (server == _servers.end()) {
+    return;
+  }
+  const std::string reason = server->second.parent + " " + name;
+  std::set<std::string> names;
+  names.insert(name);
+  for (bool grown = true; grown;) {
+    grown = false;
+    for (ServerList::const_iterator it = _servers.begin();
+         it != _servers.end(); ++it) {
+      if (names.count(it->first) == 0 && names.count(it->second.parent) != 0) {
+        names.insert(it->first);
+        grown = true;
+      }
+    }
+  }
+  std::vector<Client *> users;
+  for (ClientList::const_iterator it = _clients.begin(); it != _clients.end();
+       ++it) {
+    if (it->second->isRemote() &&
+        names.count(it->second->getServerName()) != 0) {
+      users.push_back(it->second);
+    }
+  }
+  for (std::vector<Client *>::const_iterator it = users.begin();
+       it != users.end(); ++it) {
+    _removeRemoteClient(*it, reason);
+  }
+  for (std::set<std::string>::const_iterator it = names.begin();
+       it != names.end(); ++it) {
+    _servers.erase(*it);
+  }
+  _log.write(LOG_INFO, LOG_LINK, "Netsplit %: % servers and % users gone",
+             reason, names.size(), users.size());
+}
+
+// Called when a link connection closes
+void Server::_netsplit(Client *link) {
+  const std::string &name = link->getServerName();
+  const ServerList::const_iterator server = _servers.find(name);
+  if (server == _servers.end() || server->second.link != link) {
+    return;
+  }
+  _dropServer(name);
+  propagate(":" + _name + " SQUIT " + name + " :Link closed", link);
+}
+
+void Server::_linkJoin(const LinkMessage &msg) {
+  if (msg.source == NULL || msg.params.size() < 2 ||
+      !Channel::isValidName(msg.params[1])) {
+    return;
+  }
+  const std::string &name = msg.params[1];
+  Channel *channel = findChannel(_channels, name);
+  if (channel == NULL) {
+    channel = new Channel(name, this);
+    addChannel(channel);
+  } else if (findChannel(msg.source->getChannels(), name) != NULL) {
+    return;
+  }
+  channel->addClient(msg.source);
+  msg.source->addChannel(channel);
+  sendToChannel(channel, msg.line, msg.link, true);
+}
+
+void Server::_linkPart(const LinkMessage &msg) {
+  if (msg.source == NULL || msg.params.size() < 2) {
+    return;
+  }
+  Channel *channel = findChannel(msg.source->getChannels(), msg.params[1]);
+  if (channel == NULL) {
+    return;
+  }
+  sendToChannel(channel, msg.line, msg.link, true);
+  msg.source->removeChannel(channel->getName());
+}
+
+// KICK <channel> <nick> [:reason], also from servers
+void Server::_linkKick(const LinkMessage &msg) {
+  if (msg.params.size() < 3) {
+    return;
+  }
+  Channel *channel = findChannel(_channels, msg.params[1]);
+  if (channel == NULL) {
+    return;
+  }
+  Client *target = findClient(channel->getClients(), msg.params[2]);
+  if (target == NULL) {
+    return;
+  }
+  sendToChannel(channel, msg.line, msg.link, true);
+  target->removeChannel(channel->getName());
+}
+
+void Server::_linkTopic(const LinkMessage &msg) {
+  if (msg.params.size() < 3) {
+    return;
+  }
+  Channel *channel = findChannel(_channels, msg.params[1]);
+  if (channel == NULL) {
+    return;
+  }
+  channel->setTopic(msg.params[2]);
+  channel->setTopicSet(true);
+  sendToChannel(channel, msg.line, msg.link, true);
+}
+
+// Permissions were checked by the server the change comes from
+void Server::_linkMode(const LinkMessage &msg) {
+  if (msg.params.size() < 3) {
+    return;
+  }
+  Channel *channel = findChannel(_channels, msg.params[1]);
+  if (channel == NULL) {
+    return;
+  }
+  _applyLinkMode(channel, msg.params, msg.origin);
+  sendToChannel(channel, msg.line, msg.link, true);
+}
+
+// MODE <channel> <modes> [params...]
+void Server::_applyLinkMode(Channel *channel,
+                            const std::vector<std::string> &params,
+                            const std::string &setter) {
+  bool setting = true;
+  size_t next = 3;
+  const std::string &modes = params[2];
+  for (std::string::const_iterator it = modes.begin(); it != modes.end();
+       ++it) {
+    if (*it == '+' || *it == '-') {
+      setting = (*it == '+');
+    } else if (*it == 'i') {
+      channel->setInviteOnly(setting);
+    } else if (*it == 't') {
+      channel->setTopicOperOnly(setting);
+    } else if (*it == 'k') {
+      if (setting && next < params.size()) {
+        channel->setPass(params[next]);
+      } else if (!setting) {
+        channel->setPass("");
+        channel->setPassRequired(false);
+      }
+      ++next;
+    } else if (*it == 'l') {
+      if (setting && next < params.size()) {
+        channel->setLimit(std::atoi(params[next++].c_str()));
+      } else if (!setting) {
+        channel->setLimited(false);
+      }
+    } else if ((*it == 'b' || *it == 'e') && next < params.size()) {
+      if (setting) {
+        channel->addMask(*it, params[next], setter, std::time(NULL));
+      } else {
+        channel->removeMask(*it, params[next]);
+      }
+      ++next;
+    } else if (*it == 'o' && next < params.size()) {
+      Client *target = findClient(channel->getClients(), params[next++]);
+      if (target != NULL && setting) {
+        channel->addOperator(target);
+      } else if (target != NULL) {
+        channel->removeOperator(target->getClientFd());
+      }
+    }
+  }
+}
+
+// INVITE <nick> <channel>
+void Server::_linkInvite(const LinkMessage &msg) {
+  if (msg.params.size() < 3) {
+    return;
+  }
+  Client *target = findClient(_clients, msg.params[1]);
+  if (target == NULL || target->getRoute() == msg.link) {
+    return;
+  }
+  Channel *channel = findChannel(_channels, msg.params[2]);
+  if (channel != NULL && !target->isRemote()) {
+    channel->addInvited(target);
+  }
+  sendToClient(target, msg.line);
+}
+
+// PRIVMSG and NOTICE, to a channel or to one user
+void Server::_linkMessage(const LinkMessage &msg) {
+  if (msg.params.size() < 3) {
+    return;
+  }
+  const std::string &target = msg.params[1];
+  if (std::strchr(CHANNEL_PREFIXES, target[0]) != NULL) {
+    Channel *channel = findChannel(_channels, target);
+    if (channel != NULL) {
+      relayToChannel(channel, msg.line,
+                     (msg.source != NULL ? msg.source : msg.link));
+    }
+    return;
+  }
+  Client *client = findClient(_clients, target);
+  if (client != NULL && !client->isLink() && client->getRoute() != msg.link) {
+    sendToClient(client, msg.line);
+  }
+}
+
+void Server::_linkPing(const LinkMessage &msg) {
+  const std::string token = (msg.params.size() > 1 ? msg.params[1] : _name);
+  sendToClient(msg.link, ":" + _name + " PONG " + _name + " :" + token);
+}
+
+void Server::_linkError(const LinkMessage &msg) {
+  _log.write(LOG_WARN, LOG_LINK, "Link % error: %", msg.link->getServerName(),
+             msg.params.size() > 1 ? msg.params[1] : "");
+  msg.link->setWantsToQuit(true);
+}
@@ -0,0 +1,98 @@
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <utility>
+#include <vector>
+
+#include "Channel.hpp"
+#include "Client.hpp"
+#include "Memory.hpp"
+#include "Server.hpp"
+
+// * MEMORY *
+
+MemoryUsage Server::measureMemory() const {
+  MemoryUsage usage;
+  for (ClientList::const_iterator it = _clients.begin(); it != _clients.end();
+       ++it) {
+    it->second->measure(usage);
+  }
+  usage.add(MEM_CLIENTS, MemoryUsage::ofMap(_clients.size(),
+                                            sizeof(ClientList::value_type)));
+  for (ChannelList::const_iterator it = _channels.begin();
+       it != _channels.end(); ++it) {
+    it->second->measure(usage);
+  }
+  usage.add(MEM_CHANNELS, MemoryUsage::ofMap(_channels.size(),
+                                             sizeof(ChannelList::value_type)));
+  return usage;
+}
+
+size_t Server::getMemoryBudget() const { return _memoryBudget; }
+
+// New connections are refused while the last measurement is past
+// MEMORY_REFUSE %
+bool Server::_isMemoryTight() const {
+  return _memoryBudget != 0 &&
+         _memory.total() > _memoryBudget / 100 * MEMORY_REFUSE;
+}
+
+// Measured every MEMORY_INTERVAL ms. Past MEMORY_SHED % of the budget the
+// local clients with send queues of MEMORY_SHED_MIN bytes or more are
+// dropped, largest first, until the estimate is back under MEMORY_REFUSE %.
+// When dropping all of them would not get there, the memory is held by
+// something else and nobody is dropped.
+void Server::_checkMemory(uint64_t now) {
+  const uint64_t interval = static_cast<uint64_t>(MEMORY_INTERVAL) * 1000000;
+  if (_memoryBudget == 0 || now - _memoryCheckedAt < interval) {
+    return;
+  }
+  _memoryCheckedAt = now;
+  _memory = measureMemory();
+  size_t total = _memory.total();
+  if (total <= _memoryBudget / 100 * MEMORY_SHED) {
+    return;
+  }
+  const std::vector<std::pair<size_t, Client *> > queues =
+      _sendQueues(MEMORY_SHED_MIN);
+  const size_t target = _memoryBudget / 100 * MEMORY_REFUSE;
+  size_t sheddable = 0;
+  for (size_t i = 0; i < queues.size(); ++i) {
+    sheddable += queues[i].first;
+  }
+  if (total - std::min(total, sheddable) > target) {
+    _log.write(LOG_WARN, LOG_SERVER,
+               "Memory at % of % bytes, % in send queues that can be dropped",
+               total, _memoryBudget, sheddable);
+    return;
+  }
+  for (size_t i = 0; i < queues.size() && total > target; ++i) {
+    Client *client = queues[i].second;
+    total -= std::min(total, queues[i].first);
+    _stats.add(STAT_SENDQ_DROPS);
+    _log.write(LOG_WARN, LOG_CLIENT,
+               "Dropping fd % with % bytes queued, memory at % of % bytes",
+               client->getClientFd(), queues[i].first, _memory.total(),
+               _memoryBudget);
+    _removals.push_back(std::make_pair(client->getClientFd(), client));
+  }
+}
+
+// Local clients with at least minimum bytes unsent, the largest send queue
+// first. Links are left out, dropping one would split the network.
+std::vector<std::pair<size_t, Client *> > Server::_sendQueues(
+    size_t minimum) const {
+  std::vector<std::pair<size_t, Client *> > queues;
+  for (ClientList::const_iterator it = _clients.begin(); it != _clients.end();
+       ++it) {
+    const Client *client = it->second;
+    if (!client->isRemote() && !client->isLink() &&
+        client->getOutBufferSize() != 0 &&
+        client->getOutBufferSize() >= minimum) {
+      queues.push_back(std::make_pair(client->getOutBufferSize(), it->second));
+    }
+  }
+  std::sort(queues.begin(), queues.end(),
+            std::greater<std::pair<size_t, Client *> >());
+  return queues;
+}
@@ -0,0 +1,135 @@
+#include <poll.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+#include "Client.hpp"
+#include "Probes.hpp"
+#include "Server.hpp"
+#include "utils.hpp"
+
+namespace {
+
+const char *const OVERLOAD_NAMES[Server::OVERLOAD_COUNT] = {
+    "none", "defer", "bulk", "throttle", "shed"};
+
+const uint64_t HOLD_NS = static_cast<uint64_t>(OVERLOAD_HOLD) * 1000000;
+const uint64_t WINDOW_NS = static_cast<uint64_t>(OVERLOAD_WINDOW) * 1000000;
+
+}  // namespace
+
+// * OVERLOAD *
+
+Server::Overload Server::getOverload() const { return _overload; }
+
+uint64_t Server::getLoopLag() const { return _loopLag; }
+
+const char *Server::overloadName(Overload stage) {
+  return OVERLOAD_NAMES[stage];
+}
+
+// The loop lag is the time ticks spend past poll, how long a client that
+// became ready waits for its turn, averaged over the last OVERLOAD_WINDOW ms:
+// a tick weighs what it lasted, poll included, so an idle loop catches up
+// at once. Stage n starts once the lag reaches 2^(n-1) times the "overload"
+// threshold, and has stayed there OVERLOAD_TICKS ticks in a row, so that one
+// slow tick does not escalate. Stages start one at a time. A stage is held
+// OVERLOAD_HOLD ms at least, and steps down one stage at a time once the lag
+// is under half its threshold.
+void Server::_recordTick(uint64_t wait, uint64_t busy, uint64_t now) {
+  _tickLatency.record(busy);
+  const uint64_t span = std::min(wait + busy, WINDOW_NS);
+  _loopLag = (_loopLag * (WINDOW_NS - span) + busy * span) / WINDOW_NS;
+  _stats.set(STAT_LOOP_LAG, _loopLag / 1000);
+  if (_overloadLag == 0) {
+    return;
+  }
+  if (_overload + 1 < OVERLOAD_COUNT && _loopLag >= _overloadLag << _overload) {
+    if (++_overloadTicks >= OVERLOAD_TICKS) {
+      _setOverload(static_cast<Overload>(_overload + 1), now);
+    }
+  } else {
+    _overloadTicks = 0;
+    if (_overload != OVERLOAD_NONE &&
+        _loopLag < (_overloadLag << (_overload - 1)) / 2 &&
+        now - _overloadChangedAt >= HOLD_NS) {
+      _setOverload(static_cast<Overload>(_overload - 1), now);
+    }
+  }
+  if (_overload == OVERLOAD_SHED) {
+    _shedLoad(now);
+  }
+}
+
+void Server::_setOverload(Overload stage, uint64_t now) {
+  _log.write(stage > _overload ? LOG_WARN : LOG_INFO, LOG_SERVER,
+             "Overload stage % (was %), loop lag % us", overloadName(stage),
+             overloadName(_overload), _loopLag / 1000);
+  PROBE2(overload, stage, _loopLag);
+  _setAccepting(stage < OVERLOAD_DEFER);
+  _overload = stage;
+  _overloadChangedAt = now;
+  _overloadTicks = 0;
+  _stats.set(STAT_OVERLOAD, stage);
+}
+
+// Deferred connections wait in the listen backlog, poll reports them again
+// once the listeners are watched
+void Server::_setAccepting(bool isAccepting) {
+  for (size_t i = 0; i < _pollFds.size(); ++i) {
+    const int fd = _pollFds[i].fd;
+    if (fd == _sockfdIpv4 || fd == _sockfdIpv6 || _isTlsListener(fd)) {
+      _pollFds[i].events = (isAccepting ? POLLIN : 0);
+    }
+  }
+}
+
+// Every OVERLOAD_HOLD ms, the OVERLOAD_DROPS largest send queues past
+// OVERLOAD_SENDQ bytes: writing them out is what keeps a loop busy once
+// reading is throttled
+void Server::_shedLoad(uint64_t now) {
+  if (now - _shedAt < HOLD_NS) {
+    return;
+  }
+  _shedAt = now;
+  const std::vector<std::pair<size_t, Client *> > queues =
+      _sendQueues(OVERLOAD_SENDQ);
+  for (size_t i = 0; i < queues.size() && i < OVERLOAD_DROPS; ++i) {
+    Client *client = queues[i].second;
+    _stats.add(STAT_SENDQ_DROPS);
+    _log.write(LOG_WARN, LOG_CLIENT,
+               "Dropping fd % with % bytes queued, loop lag % us",
+               client->getClientFd(), queues[i].first, _loopLag / 1000);
+    _removals.push_back(std::make_pair(client->getClientFd(), client));
+  }
+}
+
+// The client is not read, and its lines wait, until _releaseThrottled hands
+// it back to the ready queue
+void Server::throttle(Client *client) {
+  if (_throttledClients.empty()) {
+    _throttledAt = get_monotonic_ns();
+  }
+  _throttledClients.push_back(std::make_pair(client->getClientFd(), client));
+  _setReading(client->getClientFd(), false);
+  _stats.add(STAT_THROTTLED);
+}
+
+// A second after the first was held, or once the server is no longer
+// throttling. A client still past OVERLOAD_LINES is held again.
+void Server::_releaseThrottled(uint64_t now) {
+  if (_throttledClients.empty() ||
+      (_overload >= OVERLOAD_THROTTLE && now - _throttledAt < 1000000000)) {
+    return;
+  }
+  std::vector<std::pair<int, Client *> > held;
+  held.swap(_throttledClients);
+  for (size_t i = 0; i < held.size(); ++i) {
+    if (findClient(_clients, held[i].first) == held[i].second) {
+      deferLines(held[i].second);
+    }
+  }
+}
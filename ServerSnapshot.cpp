@@ -0,0 +1,293 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+
+#include "Channel.hpp"
+#include "Server.hpp"
+
+// * Snapshot layout *
+// The file is a header, one fixed-size record per channel, one per ban or
+// exception mask and a string table the records point into. A channel's
+// masks are consecutive. Everything is stored in host byte order, the file is
+// only meant to be read back by the same build on the same machine.
+
+namespace {
+
+const char SNAPSHOT_MAGIC[8] = {'I', 'R', 'C', 'S', 'N', 'A', 'P', '2'};
+
+enum SnapshotFlag {
+  SNAP_INVITE_ONLY = 1,
+  SNAP_TOPIC_OPER_ONLY = 2,
+  SNAP_TOPIC_SET = 4,
+  SNAP_PASS_REQUIRED = 8,
+  SNAP_LIMITED = 16
+};
+
+struct SnapshotHeader {
+  char magic[8];
+  uint32_t recordSize;
+  uint32_t count;
+  uint32_t maskRecordSize;
+  uint32_t maskCount;
+  uint64_t stringsSize;
+};
+
+struct SnapshotString {
+  uint32_t offset;  // into the string table
+  uint32_t length;
+};
+
+struct SnapshotChannel {
+  SnapshotString name;
+  SnapshotString topic;
+  SnapshotString password;
+  uint32_t flags;
+  uint32_t limit;
+  uint32_t firstMask;  // index into the mask records
+  uint32_t maskCount;
+};
+
+struct SnapshotMask {
+  SnapshotString mask;
+  SnapshotString setter;
+  uint64_t setAt;
+  uint32_t mode;  // 'b' or 'e'
+  uint32_t unused;
+};
+
+SnapshotString appendString(std::string &table, const std::string &str) {
+  SnapshotString ref = {};
+  ref.offset = static_cast<uint32_t>(table.size());
+  ref.length = static_cast<uint32_t>(str.size());
+  table += str;
+  return ref;
+}
+
+void appendMasks(std::vector<SnapshotMask> &records, std::string &table,
+                 char mode, const MaskList &list) {
+  const std::vector<MaskList::Entry> &entries = list.getEntries();
+  for (size_t i = 0; i < entries.size(); ++i) {
+    SnapshotMask record = {};
+    record.mask = appendString(table, entries[i].mask);
+    record.setter = appendString(table, entries[i].setter);
+    record.setAt = entries[i].setAt;
+    record.mode = mode;
+    records.push_back(record);
+  }
+}
+
+bool isInTable(const SnapshotString &ref, uint64_t tableSize) {
+  return static_cast<uint64_t>(ref.offset) + ref.length <= tableSize;
+}
+
+std::string getString(const char *table, const SnapshotString &ref) {
+  return std::string(table + ref.offset, ref.length);  // NOLINT
+}
+
+bool writeAll(int fd, const char *data, size_t size) {
+  while (size > 0) {
+    const ssize_t written = write(fd, data, size);
+    if (written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    data += written;  // NOLINT
+    size -= written;
+  }
+  return true;
+}
+
+}  // namespace
+
+// Serializes _channels into a temporary file and renames it over the previous
+// snapshot, so a crash never leaves a half-written snapshot behind
+bool Server::_writeSnapshot(const std::string &path) const {
+  std::vector<SnapshotChannel> records;
+  records.reserve(_channels.size());
+  std::vector<SnapshotMask> masks;
+  std::string strings;
+  for (ChannelList::const_iterator it = _channels.begin();
+       it != _channels.end(); ++it) {
+    const Channel *channel = it->second;
+    SnapshotChannel record = {};
+    record.name = appendString(strings, channel->getName());
+    record.topic = appendString(strings, channel->getTopic());
+    record.password = appendString(strings, channel->getPassword());
+    record.flags = (channel->isInviteOnly() ? SNAP_INVITE_ONLY : 0) |
+                   (channel->isTopicOperOnly() ? SNAP_TOPIC_OPER_ONLY : 0) |
+                   (channel->isTopicSet() ? SNAP_TOPIC_SET : 0) |
+                   (channel->isPassRequired() ? SNAP_PASS_REQUIRED : 0) |
+                   (channel->isLimited() ? SNAP_LIMITED : 0);
+    record.limit = static_cast<uint32_t>(channel->getLimit());
+    record.firstMask = static_cast<uint32_t>(masks.size());
+    appendMasks(masks, strings, 'b', channel->getMasks('b'));
+    appendMasks(masks, strings, 'e', channel->getMasks('e'));
+    record.maskCount = static_cast<uint32_t>(masks.size()) - record.firstMask;
+    records.push_back(record);
+  }
+  SnapshotHeader header = {};
+  std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+  header.recordSize = sizeof(SnapshotChannel);
+  header.count = static_cast<uint32_t>(records.size());
+  header.maskRecordSize = sizeof(SnapshotMask);
+  header.maskCount = static_cast<uint32_t>(masks.size());
+  header.stringsSize = strings.size();
+
+  const std::string tmp = path + ".tmp";
+  const int fd =
+      open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd == -1) {
+    return false;
+  }
+  const bool ok =
+      writeAll(fd, reinterpret_cast<const char *>(&header),  // NOLINT
+               sizeof(header)) &&
+      (records.empty() ||
+       writeAll(fd, reinterpret_cast<const char *>(&records[0]),  // NOLINT
+                records.size() * sizeof(SnapshotChannel))) &&
+      (masks.empty() ||
+       writeAll(fd, reinterpret_cast<const char *>(&masks[0]),  // NOLINT
+                masks.size() * sizeof(SnapshotMask))) &&
+      writeAll(fd, strings.data(), strings.size()) && fsync(fd) == 0;
+  close(fd);
+  if (!ok || std::rename(tmp.c_str(), path.c_str()) != 0) {
+    unlink(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+// The child works on a copy-on-write image of the channels, so the event loop
+// only pays for the fork itself
+void Server::_startSnapshot() {
+  _lastSnapshot = std::time(NULL);
+  if (_snapshotPid > 0) {
+    return;  // Previous snapshot still being written
+  }
+  const pid_t pid = fork();
+  if (pid == -1) {
+    _log.write(LOG_ERROR, LOG_SERVER, "Snapshot fork error: %",
+               strerror(errno));
+    return;
+  }
+  if (pid == 0) {
+    _exit(_writeSnapshot(_snapshotPath) ? 0 : 1);
+  }
+  _snapshotPid = pid;
+}
+
+void Server::_reapSnapshot(bool wait) {
+  if (_snapshotPid <= 0) {
+    return;
+  }
+  int status = 0;
+  const pid_t pid = waitpid(_snapshotPid, &status, wait ? 0 : WNOHANG);
+  if (pid == 0) {
+    return;
+  }
+  if (pid == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    _log.write(LOG_ERROR, LOG_SERVER, "Snapshot of % channels failed",
+               _channels.size());
+  }
+  _snapshotPid = -1;
+}
+
+void Server::_loadSnapshot() {
+  if (_snapshotPath.empty()) {
+    return;
+  }
+  const int fd = open(_snapshotPath.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return;
+  }
+  struct stat st = {};
+  if (fstat(fd, &st) == -1 ||
+      static_cast<size_t>(st.st_size) < sizeof(SnapshotHeader)) {
+    close(fd);
+    return;
+  }
+  const size_t size = st.st_size;
+  void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    _log.write(LOG_ERROR, LOG_SERVER, "Snapshot mmap error: %",
+               strerror(errno));
+    return;
+  }
+  const char *base = static_cast<const char *>(map);
+  const SnapshotHeader *header =
+      reinterpret_cast<const SnapshotHeader *>(base);  // NOLINT
+  const SnapshotChannel *records =
+      reinterpret_cast<const SnapshotChannel *>(header + 1);  // NOLINT
+  const SnapshotMask *masks = reinterpret_cast<const SnapshotMask *>(  // NOLINT
+      records + header->count);
+  const char *strings =
+      reinterpret_cast<const char *>(masks + header->maskCount);  // NOLINT
+  if (std::memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+      header->recordSize != sizeof(SnapshotChannel) ||
+      header->maskRecordSize != sizeof(SnapshotMask) ||
+      sizeof(SnapshotHeader) +
+              static_cast<uint64_t>(header->count) * sizeof(SnapshotChannel) +
+              static_cast<uint64_t>(header->maskCount) * sizeof(SnapshotMask) +
+              header->stringsSize !=
+          size) {
+    _log.write(LOG_WARN, LOG_SERVER, "Ignoring invalid snapshot %",
+               _snapshotPath);
+    munmap(map, size);
+    return;
+  }
+  for (uint32_t i = 0; i < header->count; ++i) {
+    const SnapshotChannel &record = records[i];  // NOLINT
+    if (!isInTable(record.name, header->stringsSize) ||
+        !isInTable(record.topic, header->stringsSize) ||
+        !isInTable(record.password, header->stringsSize) ||
+        static_cast<uint64_t>(record.firstMask) + record.maskCount >
+            header->maskCount) {
+      continue;
+    }
+    const std::string name = getString(strings, record.name);
+    if (!Channel::isValidName(name) || _channels.count(name) != 0) {
+      continue;
+    }
+    Channel *channel = new Channel(name, this);
+    if ((record.flags & SNAP_TOPIC_SET) != 0) {
+      channel->setTopic(getString(strings, record.topic));
+    }
+    if ((record.flags & SNAP_PASS_REQUIRED) != 0) {
+      channel->setPass(getString(strings, record.password));
+    }
+    if ((record.flags & SNAP_LIMITED) != 0) {
+      channel->setLimit(record.limit);
+    }
+    channel->setInviteOnly((record.flags & SNAP_INVITE_ONLY) != 0);
+    channel->setTopicOperOnly((record.flags & SNAP_TOPIC_OPER_ONLY) != 0);
+    for (uint32_t m = 0; m < record.maskCount; ++m) {
+      const SnapshotMask &mask = masks[record.firstMask + m];  // NOLINT
+      if ((mask.mode == 'b' || mask.mode == 'e') &&
+          isInTable(mask.mask, header->stringsSize) &&
+          isInTable(mask.setter, header->stringsSize)) {
+        channel->addMask(static_cast<char>(mask.mode),
+                         getString(strings, mask.mask),
+                         getString(strings, mask.setter), mask.setAt);
+      }
+    }
+    _channels[name] = channel;
+  }
+  munmap(map, size);
+  _log.write(LOG_INFO, LOG_SERVER, "Restored % channels from %",
+             _channels.size(), _snapshotPath);
+}
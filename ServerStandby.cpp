@@ -0,0 +1,406 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstddef>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "Blob.hpp"
+#include "Channel.hpp"
+#include "Client.hpp"
+#include "Journal.hpp"
+#include "Server.hpp"
+#include "utils.hpp"
+
+// * Hot standby *
+// The primary listens on the "journal" UNIX socket. A process started with
+// "standby" in its config connects to it and receives the listening sockets
+// (SCM_RIGHTS) followed by the journal: first the whole current state, then
+// the changes of every poll tick. The standby applies them to a mirror of the
+// clients and channels without serving anyone. When the connection closes
+// the primary is gone, the standby drops the mirrored clients, keeps the
+// channels and starts polling the listeners it already holds.
+
+extern volatile sig_atomic_t g_terminate;  // NOLINT
+
+namespace {
+
+const uint32_t STANDBY_MAGIC = 0x49524353;  // "IRCS"
+const int STANDBY_RETRY = 100;              // ms between two attach attempts
+
+struct StandbyHeader {
+  uint32_t magic;
+  uint8_t hasIpv4;
+  uint8_t hasIpv6;
+};
+
+bool makeAddress(const std::string &path, struct sockaddr_un &addr) {
+  std::memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return false;
+  }
+  std::memcpy(addr.sun_path, path.c_str(), path.size());  // NOLINT
+  return true;
+}
+
+}  // namespace
+
+void Server::_listenJournal() {
+  const std::string path = _config.getString("journal");
+  struct sockaddr_un addr = {};
+  if (path.empty()) {
+    return;
+  }
+  const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  unlink(path.c_str());  // Left behind by the previous primary
+  if (fd == -1 || !makeAddress(path, addr) ||
+      bind(fd, reinterpret_cast<struct sockaddr *>(&addr),  // NOLINT
+           sizeof(addr)) == -1 ||
+      listen(fd, 1) == -1) {
+    _log.write(LOG_ERROR, LOG_STANDBY, "Journal socket error: %",
+               strerror(errno));
+    if (fd != -1) {
+      close(fd);
+    }
+    return;
+  }
+  _journalListener = fd;
+  _addPollFd(fd, POLLIN);
+  _log.write(LOG_INFO, LOG_STANDBY, "Waiting for a standby on %", path);
+}
+
+// A new standby replaces the previous one
+void Server::_attachStandby() {
+  const int fd = accept(_journalListener, NULL, NULL);
+  if (fd == -1) {
+    _log.write(LOG_ERROR, LOG_STANDBY, "Standby accept error: %",
+               strerror(errno));
+    return;
+  }
+  fcntl(fd, F_SETFD, FD_CLOEXEC);  // Not inherited by a hot upgrade
+  StandbyHeader header = {};
+  header.magic = STANDBY_MAGIC;
+  header.hasIpv4 = (_sockfdIpv4 != -1 ? 1 : 0);
+  header.hasIpv6 = (_sockfdIpv6 != -1 ? 1 : 0);
+  std::vector<int> listeners;
+  if (_sockfdIpv4 != -1) {
+    listeners.push_back(_sockfdIpv4);
+  }
+  if (_sockfdIpv6 != -1) {
+    listeners.push_back(_sockfdIpv6);
+  }
+  try {
+    if (send(fd, &header, sizeof(header), MSG_NOSIGNAL) !=
+        static_cast<ssize_t>(sizeof(header))) {
+      throw std::runtime_error(strerror(errno));
+    }
+    sendFds(fd, listeners);
+  } catch (const std::runtime_error &e) {
+    _log.write(LOG_ERROR, LOG_STANDBY, "Standby attach error: %", e.what());
+    close(fd);
+    return;
+  }
+  _journal.open(fd);
+  _syncStandby();
+  _log.write(LOG_INFO, LOG_STANDBY, "Standby attached on fd %", fd);
+}
+
+// The current state, written as if it had just happened
+void Server::_syncStandby() {
+  for (ClientList::const_iterator it = _clients.begin(); it != _clients.end();
+       ++it) {
+    const Client *client = it->second;
+    if (client->isAuthenticated() && !client->isLink()) {
+      _journal.client(it->first, client->getNick(), client->getUsername(),
+                      client->getHostname(), client->getRealName(),
+                      client->getJoinedAt());
+    }
+  }
+  for (ChannelList::const_iterator it = _channels.begin();
+       it != _channels.end(); ++it) {
+    const Channel *channel = it->second;
+    const std::string &name = it->first;
+    const ClientList members = channel->getClients();
+    const ClientList operators = channel->getOperators();
+    _journal.channel(name);
+    for (ClientList::const_iterator cit = members.begin();
+         cit != members.end(); ++cit) {
+      _journal.join(name, cit->first);
+    }
+    for (ClientList::const_iterator cit = members.begin();
+         cit != members.end(); ++cit) {
+      _journal.setOperator(name, cit->first, operators.count(cit->first) != 0);
+    }
+    if (channel->isTopicSet()) {
+      _journal.topic(name, channel->getTopic());
+    }
+    _journal.modes(name, channel->getFlags(), channel->getPassword(),
+                   channel->getLimit());
+    for (const char *mode = "be"; *mode != '\0'; ++mode) {
+      const std::vector<MaskList::Entry> &masks =
+          channel->getMasks(*mode).getEntries();
+      for (size_t i = 0; i < masks.size(); ++i) {
+        _journal.mask(name, *mode, true, masks[i].mask, masks[i].setter,
+                      masks[i].setAt);
+      }
+    }
+    std::vector<const History::Entry *> entries;
+    const History &history = channel->getHistory();
+    history.select(History::AFTER, true, 0, history.size(), entries);
+    for (std::vector<const History::Entry *>::const_iterator eit =
+             entries.begin();
+         eit != entries.end(); ++eit) {
+      _journal.history(name, (*eit)->msgid, (*eit)->time, (*eit)->line);
+    }
+  }
+}
+
+// Runs in the standby, sets errno and returns false on failure
+bool Server::_attachPrimary(const std::string &path) {
+  struct sockaddr_un addr = {};
+  if (!makeAddress(path, addr)) {
+    return false;
+  }
+  const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    return false;
+  }
+  StandbyHeader header = {};
+  std::vector<int> fds;
+  try {
+    if (connect(fd, reinterpret_cast<struct sockaddr *>(&addr),  // NOLINT
+                sizeof(addr)) == -1) {
+      throw std::runtime_error(strerror(errno));
+    }
+    if (recv(fd, &header, sizeof(header), MSG_WAITALL) !=
+            static_cast<ssize_t>(sizeof(header)) ||
+        header.magic != STANDBY_MAGIC) {
+      errno = EPROTO;
+      throw std::runtime_error("invalid standby header");
+    }
+    receiveFds(fd, header.hasIpv4 + header.hasIpv6, fds);
+  } catch (const std::runtime_error &) {
+    const int error = errno;
+    close(fd);
+    errno = error;
+    return false;
+  }
+  if (_sockfdIpv4 != -1) {
+    close(_sockfdIpv4);
+  }
+  if (_sockfdIpv6 != -1) {
+    close(_sockfdIpv6);
+  }
+  _sockfdIpv4 = (header.hasIpv4 != 0 ? fds[0] : -1);
+  _sockfdIpv6 = (header.hasIpv6 != 0 ? fds.back() : -1);
+  _primaryFd = fd;
+  _log.write(LOG_INFO, LOG_STANDBY, "Following the primary at %", path);
+  return true;
+}
+
+// Applies the journal until the primary goes away (returns true, the caller
+// takes over) or the process is stopped (returns false)
+bool Server::_follow() {
+  std::string buffer;
+  std::vector<char> chunk(65536);
+  while (g_terminate == 0) {
+    struct pollfd pfd = {_primaryFd, POLLIN, 0};
+    const int n_poll = poll(&pfd, 1, TIMEOUT);
+    if (n_poll == -1 && errno != EINTR) {
+      _log.write(LOG_ERROR, LOG_STANDBY, "Poll error: %", strerror(errno));
+    }
+    if (n_poll <= 0) {
+      continue;
+    }
+    const ssize_t received = recv(_primaryFd, &chunk[0], chunk.size(), 0);
+    if (received <= 0) {
+      _takeOver();
+      return true;
+    }
+    buffer.append(&chunk[0], received);
+    size_t offset = 0;
+    bool upgraded = false;
+    try {
+      uint32_t size = 0;
+      while (!upgraded && buffer.size() - offset >= sizeof(size)) {
+        std::memcpy(&size, buffer.data() + offset, sizeof(size));
+        if (buffer.size() - offset - sizeof(size) < size) {
+          break;
+        }
+        BlobReader in(buffer.data() + offset + sizeof(size), size);
+        offset += sizeof(size) + size;
+        while (!upgraded && !in.atEnd()) {
+          upgraded = !_applyRecord(in);
+        }
+      }
+    } catch (const std::runtime_error &e) {
+      _log.write(LOG_ERROR, LOG_STANDBY, "Invalid journal: %", e.what());
+      return false;
+    }
+    buffer.erase(0, offset);
+    if (!upgraded) {
+      continue;
+    }
+    // The new primary sends its whole state again
+    buffer.clear();
+    close(_primaryFd);
+    _primaryFd = -1;
+    _dropMirror();
+    while (!_channels.empty()) {
+      removeChannel(_channels.begin()->first);
+    }
+    const std::string path = _config.getString("standby");
+    const uint64_t deadline = get_time_ms() + UPGRADE_TIMEOUT;
+    while (!_attachPrimary(path)) {
+      if (get_time_ms() > deadline || g_terminate != 0) {
+        _log.write(LOG_ERROR, LOG_STANDBY,
+                   "Lost the primary after its upgrade");
+        return false;
+      }
+      usleep(STANDBY_RETRY * 1000);
+    }
+  }
+  return false;
+}
+
+// Returns false on an UPGRADE record
+bool Server::_applyRecord(BlobReader &in) {
+  const uint8_t type = in.getU8();
+  if (type == Journal::UPGRADE) {
+    return false;
+  }
+  if (type == Journal::CLIENT) {
+    const int id = static_cast<int>(in.getU32());
+    std::vector<std::string> uid(1, "UID");
+    uid.push_back(in.getString());  // nick
+    uid.push_back(in.getString());  // user
+    uid.push_back(in.getString());  // host
+    const std::string realName = in.getString();
+    std::stringstream joinedAt;
+    joinedAt << in.getU64();
+    uid.push_back(joinedAt.str());
+    uid.push_back(realName);
+    if (_mirror.count(id) == 0) {
+      Client *client = new Client(_nextRemoteId--, this);
+      client->setRemote(NULL, "", uid);
+      _mirror[id] = client;
+    }
+    return true;
+  }
+  if (type == Journal::NICK || type == Journal::QUIT) {
+    const int id = static_cast<int>(in.getU32());
+    Client *client = findClient(_mirror, id);
+    if (type == Journal::NICK) {
+      const std::string nick = in.getString();
+      if (client != NULL) {
+        client->setNick(nick);
+      }
+    } else if (client != NULL) {
+      client->leaveAllChannels();
+      _mirror.erase(id);
+      delete client;
+    }
+    return true;
+  }
+  const std::string name = in.getString();
+  Channel *channel = findChannel(_channels, name);
+  if (type == Journal::CHANNEL || type == Journal::JOIN) {
+    if (channel == NULL) {
+      channel = new Channel(name, this);
+      addChannel(channel);
+    }
+    if (type == Journal::CHANNEL) {
+      return true;
+    }
+    Client *client = findClient(_mirror, static_cast<int>(in.getU32()));
+    if (client != NULL) {
+      channel->addClient(client);
+      client->addChannel(channel);
+    }
+  } else if (type == Journal::PART) {
+    Client *client = findClient(_mirror, static_cast<int>(in.getU32()));
+    if (client != NULL && channel != NULL) {
+      client->removeChannel(channel->getName());
+    }
+  } else if (type == Journal::OPERATOR) {
+    Client *client = findClient(_mirror, static_cast<int>(in.getU32()));
+    const bool isOperator = in.getU8() != 0;
+    if (client != NULL && channel != NULL && isOperator) {
+      channel->addOperator(client);
+    } else if (client != NULL && channel != NULL) {
+      channel->removeOperator(client->getClientFd());
+    }
+  } else if (type == Journal::TOPIC) {
+    const std::string topic = in.getString();
+    if (channel != NULL) {
+      channel->setTopic(topic);
+    }
+  } else if (type == Journal::MODES) {
+    const uint8_t flags = in.getU8();
+    const std::string password = in.getString();
+    const size_t limit = static_cast<size_t>(in.getU64());
+    if (channel != NULL) {
+      channel->setInviteOnly((flags & Channel::FLAG_INVITE_ONLY) != 0);
+      channel->setTopicOperOnly((flags & Channel::FLAG_TOPIC_OPER_ONLY) != 0);
+      channel->setPass(password);
+      channel->setPassRequired((flags & Channel::FLAG_PASS_REQUIRED) != 0);
+      channel->setLimit(limit);
+      channel->setLimited((flags & Channel::FLAG_LIMITED) != 0);
+    }
+  } else if (type == Journal::MASK) {
+    const char mode = static_cast<char>(in.getU8());
+    const bool isSet = in.getU8() != 0;
+    const std::string mask = in.getString();
+    const std::string setter = in.getString();
+    const uint64_t setAt = in.getU64();
+    if (channel != NULL && isSet) {
+      channel->addMask(mode, mask, setter, setAt);
+    } else if (channel != NULL) {
+      channel->removeMask(mode, mask);
+    }
+  } else if (type == Journal::HISTORY) {
+    const uint64_t msgid = in.getU64();
+    const uint64_t time = in.getU64();
+    const std::string line = in.getString();
+    if (channel != NULL) {
+      _pushHistory(channel, msgid, time, line);
+      _nextMsgid = std::max(_nextMsgid, msgid + 1);
+    }
+  } else {
+    throw std::runtime_error("unknown journal record");
+  }
+  return true;
+}
+
+void Server::_takeOver() {
+  _log.write(LOG_INFO, LOG_STANDBY, "Primary is gone, taking over % channels",
+             _channels.size());
+  close(_primaryFd);
+  _primaryFd = -1;
+  _dropMirror();
+}
+
+// The mirrored clients were connected to the primary, their channels stay
+void Server::_dropMirror() {
+  for (ClientList::iterator it = _mirror.begin(); it != _mirror.end(); ++it) {
+    const ChannelList channels = it->second->getChannels();
+    for (ChannelList::const_iterator cit = channels.begin();
+         cit != channels.end(); ++cit) {
+      cit->second->removeClient(it->second->getClientFd());
+    }
+    delete it->second;
+  }
+  _mirror.clear();
+}
@@ -0,0 +1,68 @@
+#include <netdb.h>
+#include <sys/poll.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "Server.hpp"
+#include "Tls.hpp"
+
+// * TLS listener *
+// "tls <port> <certificate> <key>" in the config file opens a second port.
+// Connections accepted on it start with a TLS handshake, see Tls.hpp.
+
+// Loads the certificate, also when the listener was handed over by an upgrade
+bool Server::_openTlsContext() {
+  const std::vector<Directive> tls = _config.getAll("tls");
+  if (tls.empty() || tls.back().size() < 3) {
+    return false;
+  }
+  std::string error;
+  if (!_tlsContext.open(tls.back()[1], tls.back()[2], error)) {
+    _log.write(LOG_ERROR, LOG_TLS, "TLS error: %", error);
+    return false;
+  }
+  return true;
+}
+
+// Binds the TLS port unless a previous process handed it over
+void Server::_listenTls() {
+  if (!_tlsListeners.empty() || !_openTlsContext()) {
+    return;
+  }
+  const std::string port = _config.getAll("tls").back()[0];
+  struct addrinfo hints = {};
+  std::memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  struct addrinfo *res = NULL;
+  const int status = getaddrinfo(NULL, port.c_str(), &hints, &res);
+  if (status != 0) {
+    _log.write(LOG_ERROR, LOG_TLS, "TLS getaddrinfo error: %",
+               gai_strerror(status));
+    return;
+  }
+  for (struct addrinfo *p = res; p != NULL; p = p->ai_next) {
+    if (p->ai_family != AF_INET && p->ai_family != AF_INET6) {
+      continue;
+    }
+    try {
+      _tlsListeners.push_back(_bindAndListen(p));
+      _log.write(LOG_INFO, LOG_TLS, "Server is listening on port % (%, TLS)",
+                 port, p->ai_family == AF_INET ? "IPv4" : "IPv6");
+    } catch (const std::runtime_error &e) {
+      _log.write(LOG_ERROR, LOG_TLS, "TLS bind/listen error: %", e.what());
+    }
+  }
+  freeaddrinfo(res);
+}
+
+bool Server::_isTlsListener(int fd) const {
+  return std::find(_tlsListeners.begin(), _tlsListeners.end(), fd) !=
+         _tlsListeners.end();
+}
@@ -0,0 +1,323 @@
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/poll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "Blob.hpp"
+#include "Channel.hpp"
+#include "Client.hpp"
+#include "Server.hpp"
+#include "utils.hpp"
+
+// * Hot upgrade *
+// The running process forks and execs the (new) binary with one end of a
+// SOCK_SEQPACKET socketpair. It then sends a header, the listening and client
+// sockets as SCM_RIGHTS messages and the serialized state. The new process
+// rebuilds _clients, _channels and the poll set from them and acknowledges,
+// the old one exits without touching the connections. If anything fails
+// before the acknowledgement the old process keeps serving.
+
+namespace {
+
+const uint32_t UPGRADE_MAGIC = 0x49524355;  // "IRCU"
+const size_t UPGRADE_BYTES_PER_MESSAGE = 65536;
+const char UPGRADE_ACK = 'R';
+
+struct UpgradeHeader {
+  uint32_t magic;
+  uint32_t fdCount;
+  uint64_t blobSize;
+};
+
+void sendAll(int sock, const char *data, size_t size) {
+  do {
+    const size_t chunk = std::min(size, UPGRADE_BYTES_PER_MESSAGE);
+    if (send(sock, data, chunk, MSG_NOSIGNAL) != static_cast<ssize_t>(chunk)) {
+      throw std::runtime_error("upgrade send: " + std::string(strerror(errno)));
+    }
+    data += chunk;  // NOLINT
+    size -= chunk;
+  } while (size > 0);
+}
+
+void receiveAll(int sock, std::string &data, size_t size) {
+  std::vector<char> buffer(UPGRADE_BYTES_PER_MESSAGE);
+  while (data.size() < size) {
+    const ssize_t received = recv(sock, &buffer[0], buffer.size(), 0);
+    if (received <= 0) {
+      throw std::runtime_error("upgrade state truncated");
+    }
+    data.append(&buffer[0], received);
+  }
+}
+
+}  // namespace
+
+// Resolved once at startup, so that neither a PATH lookup (argv[0] without a
+// slash) nor the working directory matter. The upgrade execs whatever sits at
+// that path by then, the new binary.
+void Server::setExecutable(const std::string &path) {
+  char resolved[PATH_MAX];
+  const ssize_t length =
+      readlink("/proc/self/exe", resolved, sizeof(resolved) - 1);
+  if (length > 0) {
+    _executable.assign(resolved, length);
+  } else if (realpath(path.c_str(), resolved) != NULL) {
+    _executable = resolved;
+  } else {
+    _executable = path;
+  }
+}
+
+void Server::_saveState(BlobWriter &out, std::vector<int> &fds) const {
+  out.putString(_password);
+  out.putU64(static_cast<uint64_t>(_createdAt));
+  out.putU64(_nextMsgid);
+  out.putU8(_sockfdIpv4 != -1 ? 1 : 0);
+  out.putU8(_sockfdIpv6 != -1 ? 1 : 0);
+  if (_sockfdIpv4 != -1) {
+    fds.push_back(_sockfdIpv4);
+  }
+  if (_sockfdIpv6 != -1) {
+    fds.push_back(_sockfdIpv6);
+  }
+  out.putU32(static_cast<uint32_t>(_tlsListeners.size()));
+  fds.insert(fds.end(), _tlsListeners.begin(), _tlsListeners.end());
+  // What _closeUnhanded left
+  std::vector<const Client *> clients;
+  for (ClientList::const_iterator it = _clients.begin(); it != _clients.end();
+       ++it) {
+    if (it->second->getServerName().empty() &&
+        !it->second->hasTlsSession()) {
+      clients.push_back(it->second);
+    }
+  }
+  out.putU32(static_cast<uint32_t>(clients.size()));
+  for (std::vector<const Client *>::const_iterator it = clients.begin();
+       it != clients.end(); ++it) {
+    out.putU32(static_cast<uint32_t>((*it)->getClientFd()));
+    (*it)->saveState(out);
+    fds.push_back((*it)->getClientFd());
+  }
+  out.putU32(static_cast<uint32_t>(_channels.size()));
+  for (ChannelList::const_iterator it = _channels.begin();
+       it != _channels.end(); ++it) {
+    out.putString(it->first);
+    it->second->saveState(out);
+  }
+}
+
+void Server::_loadState(BlobReader &in, const std::vector<int> &fds) {
+  size_t next = 0;
+  _password = in.getString();
+  _isPassRequired = !_password.empty();
+  _createdAt = static_cast<std::time_t>(in.getU64());
+  _nextMsgid = in.getU64();
+  const bool hasIpv4 = in.getU8() != 0;
+  const bool hasIpv6 = in.getU8() != 0;
+  if (hasIpv4) {
+    _sockfdIpv4 = fds.at(next++);
+  }
+  if (hasIpv6) {
+    _sockfdIpv6 = fds.at(next++);
+  }
+  const uint32_t tlsCount = in.getU32();
+  for (uint32_t i = 0; i < tlsCount; ++i) {
+    _tlsListeners.push_back(fds.at(next++));
+  }
+  if (tlsCount != 0) {
+    _openTlsContext();
+  }
+  ClientList clientsByOldFd;
+  const uint32_t clientCount = in.getU32();
+  for (uint32_t i = 0; i < clientCount; ++i) {
+    const int oldFd = static_cast<int>(in.getU32());
+    const int fd = fds.at(next++);
+    Client *client = new Client(fd, this);
+    _clients[fd] = client;
+    client->loadState(in);
+    _admission.restore(client->getAddress());
+    _addPollFd(fd, client->wantsToWrite() ? POLLIN | POLLOUT : POLLIN);
+    if (client->hasLines()) {
+      deferLines(client);  // it had no turn left in the old process
+    }
+    clientsByOldFd[oldFd] = client;
+  }
+  // Lookups do not survive the exec, registrations waiting for one go on
+  for (ClientList::iterator it = clientsByOldFd.begin();
+       it != clientsByOldFd.end(); ++it) {
+    if (it->second->isLookingUp()) {
+      it->second->lookupDone("", "");
+    }
+  }
+  const uint32_t channelCount = in.getU32();
+  for (uint32_t i = 0; i < channelCount; ++i) {
+    const std::string name = in.getString();
+    Channel *channel = new Channel(name, this);
+    _channels[name] = channel;
+    channel->loadState(in, clientsByOldFd);
+    const History &history = channel->getHistory();
+    if (!history.empty()) {
+      _historyBytes += history.getBytes();
+      _historyByActivity[history.getLastMsgid()] = channel;
+    }
+  }
+}
+
+// Links are not handed over, nor are the TLS sessions OpenSSL still holds
+// (the kTLS ones live in the kernel), nor the links still being dialed. They
+// are closed before the state is saved: the users sharing a channel with one
+// of them get its QUIT, and the peers a netsplit, after which they dial
+// again. Users quit before the links do, so the peers see the QUIT first.
+void Server::_closeUnhanded() {
+  std::vector<Client *> users;
+  std::vector<Client *> links;
+  for (ClientList::const_iterator it = _clients.begin(); it != _clients.end();
+       ++it) {
+    Client *client = it->second;
+    if (client->isRemote()) {
+      continue;  // gone with the netsplit of its link
+    }
+    if (client->isLink() || !client->getServerName().empty()) {
+      links.push_back(client);
+    } else if (client->hasTlsSession()) {
+      users.push_back(client);
+    }
+  }
+  std::vector<std::string> quit;
+  quit.push_back("QUIT");
+  quit.push_back("Server upgrade");
+  for (size_t i = 0; i < users.size(); ++i) {
+    users[i]->quit(quit);
+    users[i]->closeLink("Server upgrade");
+    removeClient(users[i]->getClientFd());
+  }
+  for (size_t i = 0; i < links.size(); ++i) {
+    sendToClient(links[i], "ERROR :Closing link: " + _name +
+                               " (Server upgrade)");
+    removeClient(links[i]->getClientFd());
+  }
+  if (!users.empty() || !links.empty()) {
+    _log.write(LOG_INFO, LOG_SERVER,
+               "Closed % TLS clients and % links for the upgrade",
+               users.size(), links.size());
+  }
+}
+
+// Runs in the old process, returns true once the new one has taken over
+bool Server::_upgrade() {
+  if (_executable.empty()) {
+    _log.write(LOG_ERROR, LOG_SERVER, "Upgrade error: executable path unknown");
+    return false;
+  }
+  int sv[2] = {-1, -1};
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == -1) {
+    _log.write(LOG_ERROR, LOG_SERVER, "Upgrade socketpair error: %",
+               strerror(errno));
+    return false;
+  }
+  const pid_t pid = fork();
+  if (pid == -1) {
+    _log.write(LOG_ERROR, LOG_SERVER, "Upgrade fork error: %", strerror(errno));
+    close(sv[0]);
+    close(sv[1]);
+    return false;
+  }
+  if (pid == 0) {
+    // The sockets are handed over explicitly, not inherited. The other fds
+    // (capture, journal, ident queries, eventfds) are opened with O_CLOEXEC.
+    for (size_t i = 0; i < _pollFds.size(); ++i) {
+      close(_pollFds[i].fd);
+    }
+    close(sv[0]);
+    std::stringstream fd;
+    fd << sv[1];
+    setenv(UPGRADE_ENV, fd.str().c_str(), 1);
+    const std::string &config = _config.getPath();
+    char *const argv[] = {
+        const_cast<char *>(_executable.c_str()),                    // NOLINT
+        const_cast<char *>(_port.c_str()),                          // NOLINT
+        const_cast<char *>(""),                                     // NOLINT
+        config.empty() ? NULL : const_cast<char *>(config.c_str()),  // NOLINT
+        NULL};
+    execv(_executable.c_str(), argv);
+    std::cerr << "Upgrade exec error: " << strerror(errno) << "\n";
+    _exit(1);
+  }
+  close(sv[1]);
+  _closeUnhanded();
+
+  bool ok = false;
+  try {
+    std::vector<int> fds;
+    BlobWriter state;
+    _saveState(state, fds);
+    UpgradeHeader header = {};
+    header.magic = UPGRADE_MAGIC;
+    header.fdCount = static_cast<uint32_t>(fds.size());
+    header.blobSize = state.data().size();
+    sendAll(sv[0], reinterpret_cast<const char *>(&header),  // NOLINT
+            sizeof(header));
+    sendFds(sv[0], fds);
+    sendAll(sv[0], state.data().data(), state.data().size());
+
+    struct pollfd pfd = {sv[0], POLLIN, 0};
+    char ack = 0;
+    ok = poll(&pfd, 1, UPGRADE_TIMEOUT) == 1 &&
+         recv(sv[0], &ack, 1, 0) == 1 && ack == UPGRADE_ACK;
+  } catch (const std::runtime_error &e) {
+    _log.write(LOG_ERROR, LOG_SERVER, "Upgrade error: %", e.what());
+  }
+  close(sv[0]);
+  if (!ok) {
+    _log.write(LOG_ERROR, LOG_SERVER,
+               "Upgrade failed, keeping the current process");
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return false;
+  }
+  _log.write(LOG_INFO, LOG_SERVER, "Handed % clients over to pid %",
+             _clients.size(), pid);
+  return true;
+}
+
+// Runs in the new process instead of binding the listeners
+void Server::_resumeUpgrade(int sock) {
+  std::vector<int> fds;
+  try {
+    UpgradeHeader header = {};
+    if (recv(sock, &header, sizeof(header), 0) !=
+            static_cast<ssize_t>(sizeof(header)) ||
+        header.magic != UPGRADE_MAGIC) {
+      throw std::runtime_error("invalid upgrade header");
+    }
+    receiveFds(sock, header.fdCount, fds);
+    std::string state;
+    receiveAll(sock, state, header.blobSize);
+    BlobReader in(state.data(), state.size());
+    _loadState(in, fds);
+  } catch (const std::exception &e) {
+    close(sock);
+    throw std::runtime_error("Upgrade error: " + std::string(e.what()));
+  }
+  send(sock, &UPGRADE_ACK, 1, MSG_NOSIGNAL);
+  close(sock);
+  _log.write(LOG_INFO, LOG_SERVER, "Took over % clients and % channels",
+             _clients.size(), _channels.size());
+}
@@ -0,0 +1,129 @@
+#include "Stats.hpp"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+
+Stats::Stats(const std::vector<std::string> &commands) : _segment(&_local) {
+  _init(&_local, commands);
+}
+
+Stats::~Stats() { close(false); }
+
+// Maps the segment, creating it if needed. The counters of a previous process
+// on the same port (hot upgrade, standby taking over) are kept as long as the
+// layout and the command list did not change.
+bool Stats::open(const std::string &name,
+                 const std::vector<std::string> &commands) {
+  close(false);
+  _init(&_local, commands);
+  const int fd = shm_open(name.c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd == -1) {
+    return false;
+  }
+  if (ftruncate(fd, sizeof(StatsSegment)) == -1) {
+    ::close(fd);
+    return false;
+  }
+  void *addr = mmap(NULL, sizeof(StatsSegment), PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (addr == MAP_FAILED) {  // NOLINT
+    return false;
+  }
+  _segment = static_cast<StatsSegment *>(addr);
+  _name = name;
+  if (!_matches(_segment, commands)) {
+    _init(_segment, commands);
+  }
+  return true;
+}
+
+void Stats::close(bool unlink) {
+  if (_segment == &_local) {
+    return;
+  }
+  _local = *_segment;
+  munmap(_segment, sizeof(StatsSegment));
+  _segment = &_local;
+  if (unlink) {
+    shm_unlink(_name.c_str());
+  }
+  _name.clear();
+}
+
+uint64_t Stats::get(StatCounter counter) const {
+  return _segment->counters[counter].value;
+}
+
+const char *Stats::getName(StatCounter counter) const {
+  return _segment->counterNames[counter];
+}
+
+uint64_t Stats::getStartedAt() const { return _segment->startedAt; }
+
+size_t Stats::getCommandCount() const { return _segment->commandCount + 1; }
+
+const char *Stats::getCommandName(size_t index) const {
+  return _segment->commandNames[index];
+}
+
+uint64_t Stats::getCommand(size_t index) const {
+  return _segment->commands[index].value;
+}
+
+const char *Stats::counterName(StatCounter counter) {
+  static const char *const names[STAT_COUNT] = {
+      "accepts",     "refused",   "bytes_in",    "bytes_out",
+      "lines_in",    "fanout",    "sendq_drops", "poll_wakeups",
+      "log_drops",   "throttled", "clients",     "channels",
+      "loop_lag_us", "overload"};
+  return names[counter];
+}
+
+void Stats::_init(StatsSegment *segment,
+                  const std::vector<std::string> &commands) {
+  std::memset(segment, 0, sizeof(*segment));  // NOLINT
+  std::memcpy(segment->magic, STATS_MAGIC, sizeof(STATS_MAGIC));
+  segment->version = STATS_VERSION;
+  segment->startedAt = static_cast<uint64_t>(std::time(NULL));
+  for (int i = 0; i < STAT_COUNT; ++i) {
+    std::strncpy(segment->counterNames[i],
+                 counterName(static_cast<StatCounter>(i)),
+                 STATS_NAME_SIZE - 1);
+  }
+  size_t count = commands.size();
+  if (count > STATS_MAX_COMMANDS - 1) {
+    count = STATS_MAX_COMMANDS - 1;
+  }
+  for (size_t i = 0; i < count; ++i) {
+    std::strncpy(segment->commandNames[i], commands[i].c_str(),
+                 STATS_NAME_SIZE - 1);
+  }
+  std::strncpy(segment->commandNames[count], "unknown", STATS_NAME_SIZE - 1);
+  segment->commandCount = static_cast<uint32_t>(count);
+}
+
+bool Stats::_matches(const StatsSegment *segment,
+                     const std::vector<std::string> &commands) {
+  if (std::memcmp(segment->magic, STATS_MAGIC, sizeof(STATS_MAGIC)) != 0 ||
+      segment->version != STATS_VERSION ||
+      segment->commandCount != commands.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < commands.size(); ++i) {
+    if (commands[i].compare(0, STATS_NAME_SIZE - 1,
+                            segment->commandNames[i]) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#define STATS_MAGIC "IRCSTAT"
+#define STATS_VERSION 4
+#define STATS_PREFIX "/ircserv-"  // shm name, followed by the port
+#define STATS_CACHE_LINE 64
+#define STATS_MAX_COMMANDS 48
+#define STATS_NAME_SIZE 16
+
+enum StatCounter {
+  STAT_ACCEPTS,
+  STAT_REFUSED,  // connections turned away by the admission limits
+  STAT_BYTES_IN,
+  STAT_BYTES_OUT,
+  STAT_LINES_IN,
+  STAT_FANOUT,  // recipients of channel messages, links counted once
+  STAT_SENDQ_DROPS,  // clients dropped past SENDQ_MAX
+  STAT_POLL_WAKEUPS,
+  STAT_LOG_DROPS,  // log records dropped on a full ring
+  STAT_THROTTLED,  // turns held back a second by the overload throttle
+  STAT_CLIENTS,    // gauge
+  STAT_CHANNELS,   // gauge
+  STAT_LOOP_LAG,   // gauge, us
+  STAT_OVERLOAD,   // gauge, load shedding stage
+  STAT_COUNT
+};
+
+// One counter per cache line, so that a reader sampling one of them does not
+// pull the line the server is writing the next one to
+struct StatsSlot {
+  volatile uint64_t value;
+  char pad[STATS_CACHE_LINE - sizeof(uint64_t)];
+};
+
+// Layout of the shared memory segment, read as is by ircstat
+struct StatsSegment {
+  char magic[8];
+  uint32_t version;
+  uint32_t commandCount;  // the last slot counts unknown commands
+  uint64_t startedAt;
+  char pad[STATS_CACHE_LINE - 24];
+  StatsSlot counters[STAT_COUNT];
+  StatsSlot commands[STATS_MAX_COMMANDS];
+  char counterNames[STAT_COUNT][STATS_NAME_SIZE];
+  char commandNames[STATS_MAX_COMMANDS][STATS_NAME_SIZE];
+};
+
+// Counters updated on the hot paths. They live in a POSIX shared memory
+// segment so that ircstat can sample them without asking the server. Until
+// open() succeeds they are kept in a private copy.
+class Stats {
+ public:
+  explicit Stats(const std::vector<std::string> &commands);
+  ~Stats();
+
+  bool open(const std::string &name, const std::vector<std::string> &commands);
+  void close(bool unlink);
+
+  void add(StatCounter counter, uint64_t n = 1) {
+    _segment->counters[counter].value += n;
+  }
+  void set(StatCounter counter, uint64_t n) {
+    _segment->counters[counter].value = n;
+  }
+  void countCommand(size_t index) {
+    _segment->commands[index < _segment->commandCount
+                           ? index
+                           : _segment->commandCount]
+        .value += 1;
+  }
+
+  uint64_t get(StatCounter counter) const;
+  const char *getName(StatCounter counter) const;
+  uint64_t getStartedAt() const;
+  size_t getCommandCount() const;  // including the unknown slot
+  const char *getCommandName(size_t index) const;
+  uint64_t getCommand(size_t index) const;
+
+  static const char *counterName(StatCounter counter);
+
+ private:
+  Stats(const Stats &other);
+  Stats &operator=(const Stats &other);
+
+  static void _init(StatsSegment *segment,
+                    const std::vector<std::string> &commands);
+  static bool _matches(const StatsSegment *segment,
+                       const std::vector<std::string> &commands);
+
+  StatsSegment *_segment;  // either mapped or _local
+  StatsSegment _local;
+  std::string _name;
+};
@@ -0,0 +1,178 @@
+#include "Tls.hpp"
+
+#include <sys/types.h>
+
+#include <cerrno>
+#include <cstddef>
+#include <string>
+
+#ifdef IRCSERV_TLS
+#include <openssl/bio.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#endif
+
+TlsContext::TlsContext() : _ctx(NULL) {}
+
+TlsContext::~TlsContext() {
+#ifdef IRCSERV_TLS
+  SSL_CTX_free(static_cast<SSL_CTX *>(_ctx));
+#endif
+}
+
+bool TlsContext::isOpen() const { return _ctx != NULL; }
+
+void *TlsContext::get() const { return _ctx; }
+
+#ifdef IRCSERV_TLS
+
+namespace {
+
+std::string lastError() {
+  char buffer[256];
+  ERR_error_string_n(ERR_get_error(), buffer, sizeof(buffer));
+  return buffer;
+}
+
+// Maps an OpenSSL result to the recv/send contract
+ssize_t result(SSL *ssl, int ret) {
+  if (ret > 0) {
+    return ret;
+  }
+  const int error = SSL_get_error(ssl, ret);
+  if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+    errno = EAGAIN;
+    return -1;
+  }
+  if (error == SSL_ERROR_ZERO_RETURN) {
+    return 0;  // close_notify
+  }
+  if (error != SSL_ERROR_SYSCALL || errno == 0) {
+    errno = EIO;
+  }
+  ERR_clear_error();
+  return -1;
+}
+
+}  // namespace
+
+// TLS 1.2 and up. No session tickets, they would be the only records the
+// server sends after the handshake that are not application data.
+bool TlsContext::open(const std::string &certificate, const std::string &key,
+                      std::string &error) {
+  SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+  if (ctx == NULL) {
+    error = lastError();
+    return false;
+  }
+  SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+  SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+  SSL_CTX_set_num_tickets(ctx, 0);
+  // answer() retries with what is left of a buffer that may have moved
+  SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                            SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+  if (SSL_CTX_use_certificate_chain_file(ctx, certificate.c_str()) != 1 ||
+      SSL_CTX_use_PrivateKey_file(ctx, key.c_str(), SSL_FILETYPE_PEM) != 1) {
+    error = lastError();
+    SSL_CTX_free(ctx);
+    return false;
+  }
+  SSL_CTX_free(static_cast<SSL_CTX *>(_ctx));
+  _ctx = ctx;
+  return true;
+}
+
+TlsSession::TlsSession(const TlsContext &context, int fd)
+    : _ssl(SSL_new(static_cast<SSL_CTX *>(context.get()))),
+      _isEstablished(false) {
+  if (_ssl != NULL) {
+    SSL_set_fd(static_cast<SSL *>(_ssl), fd);
+  }
+}
+
+TlsSession::~TlsSession() { SSL_free(static_cast<SSL *>(_ssl)); }
+
+TlsSession::Status TlsSession::handshake() {
+  SSL *ssl = static_cast<SSL *>(_ssl);
+  if (ssl == NULL) {
+    return FAILED;
+  }
+  const int ret = SSL_accept(ssl);
+  if (ret == 1) {
+    _isEstablished = true;
+    return DONE;
+  }
+  const int error = SSL_get_error(ssl, ret);
+  ERR_clear_error();
+  if (error == SSL_ERROR_WANT_READ) {
+    return WANT_READ;
+  }
+  return error == SSL_ERROR_WANT_WRITE ? WANT_WRITE : FAILED;
+}
+
+bool TlsSession::isKernel() const {
+  SSL *ssl = static_cast<SSL *>(_ssl);
+#ifndef OPENSSL_NO_KTLS
+  return _isEstablished && BIO_get_ktls_send(SSL_get_wbio(ssl)) &&
+         BIO_get_ktls_recv(SSL_get_rbio(ssl));
+#else
+  (void)ssl;
+  return false;
+#endif
+}
+
+bool TlsSession::hasPending() const {
+  return SSL_pending(static_cast<SSL *>(_ssl)) > 0;
+}
+
+ssize_t TlsSession::read(char *buffer, size_t size) {
+  SSL *ssl = static_cast<SSL *>(_ssl);
+  return result(ssl, SSL_read(ssl, buffer, static_cast<int>(size)));
+}
+
+ssize_t TlsSession::write(const char *buffer, size_t size) {
+  SSL *ssl = static_cast<SSL *>(_ssl);
+  return result(ssl, SSL_write(ssl, buffer, static_cast<int>(size)));
+}
+
+#else
+
+bool TlsContext::open(const std::string &certificate, const std::string &key,
+                      std::string &error) {
+  (void)certificate;
+  (void)key;
+  error = "built without TLS, rebuild with make TLS=1";
+  return false;
+}
+
+TlsSession::TlsSession(const TlsContext &context, int fd)
+    : _ssl(NULL), _isEstablished(false) {
+  (void)context;
+  (void)fd;
+}
+
+TlsSession::~TlsSession() {}
+
+TlsSession::Status TlsSession::handshake() { return FAILED; }
+
+bool TlsSession::isKernel() const { return false; }
+
+bool TlsSession::hasPending() const { return false; }
+
+ssize_t TlsSession::read(char *buffer, size_t size) {
+  (void)buffer;
+  (void)size;
+  errno = EIO;
+  return -1;
+}
+
+ssize_t TlsSession::write(const char *buffer, size_t size) {
+  (void)buffer;
+  (void)size;
+  errno = EIO;
+  return -1;
+}
+
+#endif
+
+bool TlsSession::isEstablished() const { return _isEstablished; }
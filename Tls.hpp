@@ -0,0 +1,53 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <cstddef>
+#include <string>
+
+// TLS for the "tls" listener, only with "make TLS=1" (IRCSERV_TLS). OpenSSL
+// does the handshake and asks the kernel to take the record layer over (kTLS).
+// When the kernel took both directions the session is dropped and the client
+// goes back to plain send/recv. Otherwise reads and writes go through OpenSSL.
+// Built without TLS, open() fails and the listener is not opened.
+class TlsContext {
+ public:
+  TlsContext();
+  ~TlsContext();
+
+  bool isOpen() const;
+  bool open(const std::string &certificate, const std::string &key,
+            std::string &error);
+  void *get() const;  // SSL_CTX
+
+ private:
+  TlsContext(const TlsContext &other);
+  TlsContext &operator=(const TlsContext &other);
+
+  void *_ctx;
+};
+
+class TlsSession {
+ public:
+  enum Status { DONE, WANT_READ, WANT_WRITE, FAILED };
+
+  TlsSession(const TlsContext &context, int fd);
+  ~TlsSession();
+
+  Status handshake();
+  bool isEstablished() const;
+  bool isKernel() const;  // kTLS in both directions
+  bool hasPending() const;
+
+  // Same contract as recv and send, errno is EAGAIN when OpenSSL waits
+  ssize_t read(char *buffer, size_t size);
+  ssize_t write(const char *buffer, size_t size);
+
+ private:
+  TlsSession();
+  TlsSession(const TlsSession &other);
+  TlsSession &operator=(const TlsSession &other);
+
+  void *_ssl;
+  bool _isEstablished;
+};
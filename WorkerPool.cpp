@@ -0,0 +1,139 @@
+#include "WorkerPool.hpp"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <deque>
+#include <vector>
+
+// * Job *
+
+Job::Job(int fd) : _fd(fd), _id(0), _isCancelled(false) {}
+
+Job::~Job() {}
+
+void Job::expire(Server &server) { (void)server; }
+
+int Job::getFd() const { return _fd; }
+uint64_t Job::getId() const { return _id; }
+bool Job::isCancelled() const { return _isCancelled; }
+void Job::setId(uint64_t id) { _id = id; }
+void Job::cancel() { _isCancelled = true; }
+
+// * Pool *
+
+WorkerPool::WorkerPool() : _queueMax(0), _isStopping(false), _fd(-1) {
+  pthread_mutex_init(&_mutex, NULL);
+  pthread_cond_init(&_ready, NULL);
+}
+
+WorkerPool::~WorkerPool() {
+  stop();
+  pthread_cond_destroy(&_ready);
+  pthread_mutex_destroy(&_mutex);
+}
+
+bool WorkerPool::start(size_t threads, size_t queueMax) {
+  _fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (_fd == -1) {
+    return false;
+  }
+  _queueMax = queueMax;
+  _isStopping = false;
+  for (size_t i = 0; i < threads; ++i) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, &WorkerPool::_main, this) != 0) {
+      break;
+    }
+    _threads.push_back(thread);
+  }
+  if (_threads.empty()) {
+    stop();
+    return false;
+  }
+  return true;
+}
+
+// Waits for the jobs being run, the queued ones are dropped
+void WorkerPool::stop() {
+  pthread_mutex_lock(&_mutex);
+  _isStopping = true;
+  pthread_cond_broadcast(&_ready);
+  pthread_mutex_unlock(&_mutex);
+  for (size_t i = 0; i < _threads.size(); ++i) {
+    pthread_join(_threads[i], NULL);
+  }
+  _threads.clear();
+  for (size_t i = 0; i < _queue.size(); ++i) {
+    delete _queue[i];
+  }
+  _queue.clear();
+  for (size_t i = 0; i < _done.size(); ++i) {
+    delete _done[i];
+  }
+  _done.clear();
+  if (_fd != -1) {
+    close(_fd);
+    _fd = -1;
+  }
+}
+
+bool WorkerPool::isRunning() const { return !_threads.empty(); }
+
+int WorkerPool::getFd() const { return _fd; }
+
+bool WorkerPool::submit(Job *job) {
+  pthread_mutex_lock(&_mutex);
+  const bool isAccepted =
+      !_threads.empty() && !_isStopping && _queue.size() < _queueMax;
+  if (isAccepted) {
+    _queue.push_back(job);
+    pthread_cond_signal(&_ready);
+  }
+  pthread_mutex_unlock(&_mutex);
+  return isAccepted;
+}
+
+// Called when the eventfd is readable
+void WorkerPool::collect(std::vector<Job *> &done) {
+  uint64_t count = 0;
+  if (read(_fd, &count, sizeof(count)) == -1) {
+    return;
+  }
+  pthread_mutex_lock(&_mutex);
+  done.insert(done.end(), _done.begin(), _done.end());
+  _done.clear();
+  pthread_mutex_unlock(&_mutex);
+}
+
+void *WorkerPool::_main(void *pool) {
+  static_cast<WorkerPool *>(pool)->_work();
+  return NULL;
+}
+
+void WorkerPool::_work() {
+  pthread_mutex_lock(&_mutex);
+  while (true) {
+    while (_queue.empty() && !_isStopping) {
+      pthread_cond_wait(&_ready, &_mutex);
+    }
+    if (_isStopping) {
+      break;
+    }
+    Job *job = _queue.front();
+    _queue.pop_front();
+    pthread_mutex_unlock(&_mutex);
+    job->run();
+    pthread_mutex_lock(&_mutex);
+    _done.push_back(job);
+    // Only fails once the counter nears 2^64, the loop reads it long before
+    const uint64_t one = 1;
+    const ssize_t written = write(_fd, &one, sizeof(one));
+    (void)written;
+  }
+  pthread_mutex_unlock(&_mutex);
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <cstddef>
+#include <deque>
+#include <vector>
+
+class Server;
+
+// Work taken off the poll loop. run() happens on a worker thread and must
+// only touch the job itself; finish() happens back on the loop. A job whose
+// client left is cancelled: it still runs, but is deleted without finish().
+class Job {
+ public:
+  explicit Job(int fd);
+  virtual ~Job();
+
+  virtual void run() = 0;
+  virtual void finish(Server &server) = 0;
+  virtual void expire(Server &server);  // timed out, run() may still be going
+
+  int getFd() const;
+  uint64_t getId() const;
+  bool isCancelled() const;
+  void setId(uint64_t id);
+  void cancel();
+
+ private:
+  Job(const Job &other);
+  Job &operator=(const Job &other);
+
+  int _fd;  // client the result is for, -1 for none
+  uint64_t _id;
+  bool _isCancelled;
+};
+
+// Fixed set of threads behind a bounded queue. Finished jobs are handed back
+// through an eventfd the poll loop watches, then collected in one go.
+class WorkerPool {
+ public:
+  WorkerPool();
+  ~WorkerPool();
+
+  bool start(size_t threads, size_t queueMax);
+  void stop();
+  bool isRunning() const;
+  int getFd() const;
+
+  bool submit(Job *job);  // false when stopped or the queue is full
+  void collect(std::vector<Job *> &done);
+
+ private:
+  WorkerPool(const WorkerPool &other);
+  WorkerPool &operator=(const WorkerPool &other);
+
+  static void *_main(void *pool);
+  void _work();
+
+  pthread_mutex_t _mutex;
+  pthread_cond_t _ready;
+  std::deque<Job *> _queue;
+  std::vector<Job *> _done;
+  std::vector<pthread_t> _threads;
+  size_t _queueMax;
+  bool _isStopping;
+  int _fd;  // eventfd, counts the finished jobs
+};
@@ -0,0 +1,269 @@
+// Micro-benchmarks of the hot paths, built and run by "make bench". Prints one
+// tab-separated line per benchmark and population:
+//   benchmark  population  iterations  ns_per_op  allocs_per_op
+//   ./ircbench [population...]   (default 1000 10000 100000)
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <csignal>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "Blob.hpp"
+#include "Channel.hpp"
+#include "Client.hpp"
+#include "Config.hpp"
+#include "Server.hpp"
+#include "utils.hpp"
+
+#define BENCH_TIME 200000000  // ns spent on each benchmark
+#define BENCH_FD 100000       // first fd of the synthetic clients, never opened
+#define BENCH_SINKS 256       // clients createMessage rotates through
+#define BENCH_TARGETS 64      // names looked up in turn
+
+// Signal flags main.cpp defines for the server, run() is never called here
+volatile sig_atomic_t g_terminate = 0;  // NOLINT
+volatile sig_atomic_t g_upgrade = 0;    // NOLINT
+volatile sig_atomic_t g_dumpStats = 0;  // NOLINT
+
+namespace {
+
+uint64_t g_allocs = 0;  // NOLINT
+
+struct Fixture {
+  Server *server;
+  size_t population;
+  std::vector<Client *> clients;
+  std::vector<std::string> nicks;     // spread over the population
+  std::vector<std::string> channels;  // same
+  std::vector<Client *> sinks;        // same, receive createMessage
+  Channel *fanout;                    // every client is a member
+};
+
+typedef void (*Operation)(Fixture &fixture, size_t i);
+
+// The state of a client registered with NICK and USER on a socketpair, once
+// its welcome burst is sent. The synthetic clients are loaded from it, the
+// path of a hot upgrade, so that each one does not check its nick against
+// all the others.
+std::string registeredState(Server *server) {
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+    throw std::runtime_error("socketpair: " + std::string(strerror(errno)));
+  }
+  fcntl(sv[1], F_SETFL, O_NONBLOCK);
+  Client *client = new Client(sv[1], server, "127.0.0.1");
+  server->addClient(client);
+  client->handle("NICK BenchTemplate");
+  client->handle("USER user 0 * :Bench User");
+  client->answer();
+  if (!client->isAuthenticated() || client->wantsToWrite()) {
+    throw std::runtime_error("The template client did not register");
+  }
+  BlobWriter out;
+  client->saveState(out);
+  server->removeClient(sv[1]);
+  close(sv[0]);
+  return out.data();
+}
+
+Client *registeredClient(Server *server, int fd, const std::string &state,
+                         const std::string &nick) {
+  Client *client = new Client(fd, server);
+  BlobReader in(state.data(), state.size());
+  client->loadState(in);
+  client->setNick(nick);
+  return client;
+}
+
+void setUp(Fixture &fixture, size_t population) {
+  std::stringstream silent;
+  std::streambuf *cout = std::cout.rdbuf(silent.rdbuf());
+  Config config;
+  config.set("snapshot", "none");  // a synthetic population only
+  fixture.server = new Server("0", "", config);  // any free port, never polled
+  std::cout.rdbuf(cout);
+  fixture.population = population;
+  fixture.fanout = new Channel("#fanout", fixture.server);
+  fixture.server->addChannel(fixture.fanout);
+  const std::string state = registeredState(fixture.server);
+  for (size_t i = 0; i < population; ++i) {
+    std::stringstream nick;
+    nick << "User" << i;
+    Client *client =
+        registeredClient(fixture.server, BENCH_FD + i, state, nick.str());
+    fixture.server->addClient(client);
+    fixture.clients.push_back(client);
+    std::stringstream name;
+    name << "#Chan" << i;
+    fixture.server->addChannel(new Channel(name.str(), fixture.server));
+    fixture.fanout->addClient(client);
+  }
+  for (size_t i = 0; i < BENCH_TARGETS; ++i) {
+    std::stringstream nick;
+    std::stringstream name;
+    nick << "user" << (i * population / BENCH_TARGETS);
+    name << "#chan" << (i * population / BENCH_TARGETS);
+    fixture.nicks.push_back(nick.str());
+    fixture.channels.push_back(name.str());
+  }
+  for (size_t i = 0; i < BENCH_SINKS && i < population; ++i) {
+    fixture.sinks.push_back(fixture.clients[i * population / BENCH_SINKS]);
+  }
+}
+
+void tearDown(Fixture &fixture) {
+  std::stringstream silent;
+  std::streambuf *cout = std::cout.rdbuf(silent.rdbuf());
+  delete fixture.server;  // closing the synthetic fds fails harmlessly
+  std::cout.rdbuf(cout);
+  fixture.clients.clear();
+  fixture.nicks.clear();
+  fixture.channels.clear();
+  fixture.sinks.clear();
+}
+
+// Results are kept in a volatile sink so the calls are not optimized away
+volatile size_t g_sink = 0;  // NOLINT
+
+void benchParse(Fixture &fixture, size_t i) {
+  (void)fixture;
+  (void)i;
+  g_sink += parse("privmsg #chan,nick :Hello there, how are you?").size();
+}
+
+void benchSplit(Fixture &fixture, size_t i) {
+  (void)fixture;
+  (void)i;
+  g_sink += split("#one,#two,#three,#four", ',').size();
+}
+
+void benchLowercase(Fixture &fixture, size_t i) {
+  (void)fixture;
+  (void)i;
+  g_sink += lowercase("Some[Nick]\\Away~").size();
+}
+
+void benchUppercase(Fixture &fixture, size_t i) {
+  (void)fixture;
+  (void)i;
+  g_sink += uppercase("privmsg").size();
+}
+
+void benchFindClient(Fixture &fixture, size_t i) {
+  g_sink += findClient(fixture.server->getClients(),
+                       fixture.nicks[i % BENCH_TARGETS]) != NULL;
+}
+
+void benchFindChannel(Fixture &fixture, size_t i) {
+  g_sink += findChannel(fixture.server->getChannels(),
+                        fixture.channels[i % BENCH_TARGETS]) != NULL;
+}
+
+void benchCreateMessage(Fixture &fixture, size_t i) {
+  Client *client = fixture.sinks[i % fixture.sinks.size()];
+  client->createMessage(Server::ERR_NOSUCHNICK, "nobody");
+}
+
+void benchFanout(Fixture &fixture, size_t i) {
+  (void)i;
+  fixture.server->sendToChannel(fixture.fanout,
+                                ":nick!~user@host PRIVMSG #fanout :hello");
+}
+
+// Runs batches of doubling size until BENCH_TIME is spent or maxOps reached
+void measure(const char *name, Fixture &fixture, size_t population,
+             Operation operation, size_t maxOps) {
+  operation(fixture, 0);  // warm up
+  uint64_t elapsed = 0;
+  uint64_t allocs = 0;
+  size_t done = 0;
+  for (size_t batch = 1; elapsed < BENCH_TIME && done < maxOps; batch *= 2) {
+    if (batch > maxOps - done) {
+      batch = maxOps - done;
+    }
+    const uint64_t allocsBefore = g_allocs;
+    const uint64_t start = get_monotonic_ns();
+    for (size_t i = 0; i < batch; ++i) {
+      operation(fixture, done + i + 1);
+    }
+    elapsed += get_monotonic_ns() - start;
+    allocs += g_allocs - allocsBefore;
+    done += batch;
+  }
+  std::cout << name << "\t" << population << "\t" << done << "\t"
+            << std::fixed << std::setprecision(1)
+            << static_cast<double>(elapsed) / done << "\t"
+            << std::setprecision(2) << static_cast<double>(allocs) / done
+            << "\n";
+}
+
+}  // namespace
+
+// Every allocation of the process goes through here and is counted. Not
+// inlined, or GCC sees free() called on the result of new.
+__attribute__((noinline)) void *operator new(size_t size) throw(std::bad_alloc) {
+  ++g_allocs;
+  void *ptr = std::malloc(size == 0 ? 1 : size);
+  if (ptr == NULL) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+__attribute__((noinline)) void operator delete(void *ptr) throw() {
+  std::free(ptr);
+}
+
+int main(int argc, char **argv) try {
+  std::vector<size_t> populations;
+  for (int i = 1; i < argc; ++i) {
+    populations.push_back(std::strtoul(argv[i], NULL, 10));  // NOLINT
+  }
+  if (populations.empty()) {
+    populations.push_back(1000);
+    populations.push_back(10000);
+    populations.push_back(100000);
+  }
+  std::cout << "benchmark\tpopulation\titerations\tns_per_op\tallocs_per_op\n";
+  Fixture fixture;
+  setUp(fixture, 0);
+  measure("parse", fixture, 0, benchParse, static_cast<size_t>(-1));
+  measure("split", fixture, 0, benchSplit, static_cast<size_t>(-1));
+  measure("lowercase", fixture, 0, benchLowercase, static_cast<size_t>(-1));
+  measure("uppercase", fixture, 0, benchUppercase, static_cast<size_t>(-1));
+  tearDown(fixture);
+  for (size_t i = 0; i < populations.size(); ++i) {
+    const size_t population = populations[i];
+    if (population == 0) {
+      continue;
+    }
+    setUp(fixture, population);
+    measure("findClient", fixture, population, benchFindClient,
+            static_cast<size_t>(-1));
+    measure("findChannel", fixture, population, benchFindChannel,
+            static_cast<size_t>(-1));
+    // Keeps every send queue under SENDQ_MAX, dropped clients would skew it
+    measure("createMessage", fixture, population, benchCreateMessage,
+            SENDQ_MAX / 128 * (population < BENCH_SINKS ? population
+                                                       : BENCH_SINKS));
+    measure("sendToChannel", fixture, population, benchFanout,
+            2000000 / population + 1);
+    tearDown(fixture);
+  }
+  return 0;
+} catch (const std::exception &e) {
+  std::cerr << e.what() << "\n";
+  return 1;
+}
@@ -0,0 +1,95 @@
+// Samples the counters of a running ircserv from its shared memory segment.
+// Reading them is plain loads from the mapping, the server is never asked.
+//   ./ircstat <port>              print the counters once
+//   ./ircstat <port> <interval>   print them every interval seconds, with
+//                                 the rate since the previous sample
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+#include "Stats.hpp"
+
+namespace {
+
+void print(const StatsSegment *segment, const StatsSegment *previous,
+           unsigned int interval) {
+  std::cout << "uptime " << std::time(NULL) - segment->startedAt << "\n";
+  for (int i = 0; i < STAT_COUNT; ++i) {
+    std::cout << std::left << std::setw(STATS_NAME_SIZE)
+              << segment->counterNames[i] << " " << std::right
+              << std::setw(16) << segment->counters[i].value;
+    if (previous != NULL && i < STAT_CLIENTS) {
+      std::cout << " " << std::setw(12)
+                << (segment->counters[i].value - previous->counters[i].value) /
+                       interval
+                << "/s";
+    }
+    std::cout << "\n";
+  }
+  for (uint32_t i = 0; i <= segment->commandCount; ++i) {
+    if (segment->commands[i].value == 0) {
+      continue;
+    }
+    std::cout << "cmd " << std::left << std::setw(STATS_NAME_SIZE - 4)
+              << segment->commandNames[i] << " " << std::right
+              << std::setw(16) << segment->commands[i].value;
+    if (previous != NULL) {
+      std::cout << " " << std::setw(12)
+                << (segment->commands[i].value -
+                    previous->commands[i].value) /
+                       interval
+                << "/s";
+    }
+    std::cout << "\n";
+  }
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  if (argc < 2 || argc > 3) {
+    std::cerr << "Usage: " << argv[0] << " <port> [interval]\n";
+    return 1;
+  }
+  const std::string name = STATS_PREFIX + std::string(argv[1]);
+  const unsigned int interval =
+      (argc == 3 ? static_cast<unsigned int>(std::atoi(argv[2])) : 0);
+  const int fd = shm_open(name.c_str(), O_RDONLY, 0);
+  if (fd == -1) {
+    std::cerr << "Cannot open " << name << ": " << strerror(errno) << "\n";
+    return 1;
+  }
+  void *addr = mmap(NULL, sizeof(StatsSegment), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {  // NOLINT
+    std::cerr << "Cannot map " << name << ": " << strerror(errno) << "\n";
+    return 1;
+  }
+  const StatsSegment *segment = static_cast<const StatsSegment *>(addr);
+  if (std::memcmp(segment->magic, STATS_MAGIC, sizeof(STATS_MAGIC)) != 0 ||
+      segment->version != STATS_VERSION) {
+    std::cerr << name << " is not a version " << STATS_VERSION
+              << " stats segment\n";
+    return 1;
+  }
+  if (interval == 0) {
+    print(segment, NULL, 0);
+    return 0;
+  }
+  StatsSegment previous = *segment;
+  for (;;) {
+    sleep(interval);
+    std::cout << "\n";
+    print(segment, &previous, interval);
+    previous = *segment;
+  }
+}
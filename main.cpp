@@ -2,27 +2,54 @@
 #include <sys/signal.h>
 
 #include <csignal>
+#include <cstring>
 #include <exception>
 #include <iostream>
 #include <stdexcept>
+#include <string>
 
+#include "Password.hpp"
 #include "Server.hpp"
 
 // use socat -v TCP-LISTEN:6667,reuseaddr,fork TCP:127.0.0.1:6668 for proxy
 volatile sig_atomic_t g_terminate = 0;  // NOLINT
+volatile sig_atomic_t g_upgrade = 0;    // NOLINT
+volatile sig_atomic_t g_dumpStats = 0;  // NOLINT
 
 void handle_signal(int signum) {  // NOLINT
-  (void)signum;
+  if (signum == SIGUSR2) {
+    g_upgrade = 1;
+    return;
+  }
+  if (signum == SIGUSR1) {
+    g_dumpStats = 1;
+    return;
+  }
   g_terminate = 1;
 }
 
 int main(int argc, char **argv) try {
-  if (argc != 3)
-    throw std::invalid_argument("Usage: ./ircserv <port> <password>");
+  // The hash then replaces the password on the command line
+  if (argc == 2 && std::string(argv[1]) == "--hash") {  // NOLINT
+    std::string password;
+    std::getline(std::cin, password);
+    std::cout << hash_password(password) << "\n";
+    return 0;
+  }
+  if (argc != 3 && argc != 4)
+    throw std::invalid_argument(
+        "Usage: ./ircserv <port> <password or hash> [config file]\n"
+        "       ./ircserv --hash < password");
 
   signal(SIGINT, handle_signal);    // NOLINT
   signal(SIGQUIT, handle_signal);   // NOLINT
-  Server server(argv[1], argv[2]);  // NOLINT
+  signal(SIGUSR1, handle_signal);   // NOLINT
+  signal(SIGUSR2, handle_signal);   // NOLINT
+  const Config config =
+      (argc == 4 ? Config(argv[3]) : Config());  // NOLINT
+  Server server(argv[1], argv[2], config);       // NOLINT
+  std::memset(argv[2], 0, std::strlen(argv[2]));  // NOLINT, out of ps
+  server.setExecutable(argv[0]);                 // NOLINT
   server.run();
 
   return 0;
@@ -0,0 +1,335 @@
+// Feeds a trace written by CAPTURE ON back into a server, one connection per
+// recorded connection, with the recorded gaps between the events divided by
+// the speed. Speed 0 sends everything as fast as the server takes it.
+//   ./ircreplay <trace> <port> [speed] [host]
+// Server output is read and discarded. The replay ends once the server closed
+// every connection, or after REPLAY_IDLE ms without traffic. Then stdout gets
+// "key value" lines: the counts, the recorded and replay durations, and how
+// late the events were sent compared to the schedule.
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "Blob.hpp"
+#include "Capture.hpp"
+
+#define REPLAY_IDLE 5000  // ms without traffic that end it, SYN retries too
+
+namespace {
+
+volatile sig_atomic_t g_stop = 0;  // NOLINT
+
+void stop(int signum) {
+  (void)signum;
+  g_stop = 1;
+}
+
+uint64_t monotonicNs() {
+  struct timespec ts = {};
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+struct Event {
+  uint8_t type;
+  uint64_t time;  // ns since the capture started
+  uint32_t fd;    // recorded fd, only identifies the connection
+  std::string line;
+};
+
+// Throws std::runtime_error on a file that is not a trace. A truncated last
+// record, from a server that did not stop the capture, is ignored.
+std::vector<Event> readTrace(const char *path) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file.is_open()) {
+    throw std::runtime_error("Cannot open " + std::string(path));
+  }
+  const std::string data((std::istreambuf_iterator<char>(file)),
+                         std::istreambuf_iterator<char>());
+  BlobReader in(data.data(), data.size());
+  if (in.getString() != CAPTURE_MAGIC || in.getU32() != CAPTURE_VERSION) {
+    throw std::runtime_error(std::string(path) + " is not a trace");
+  }
+  std::vector<Event> events;
+  try {
+    while (!in.atEnd()) {
+      Event event;
+      event.type = in.getU8();
+      event.time = in.getU64();
+      event.fd = in.getU32();
+      if (event.type == Capture::LINE) {
+        event.line = in.getString();
+      }
+      events.push_back(event);
+    }
+  } catch (const std::runtime_error &e) {
+    std::cerr << "Trace truncated after " << events.size() << " events\n";
+  }
+  return events;
+}
+
+class Replay {
+ public:
+  Replay(const std::vector<Event> &events, const std::string &host, int port,
+         double speed)
+      : _events(events),
+        _speed(speed),
+        _connected(0),
+        _failed(0),
+        _reset(0),
+        _lines(0),
+        _bytesOut(0),
+        _bytesIn(0),
+        _maxLag(0),
+        _totalLag(0),
+        _lastActivity(0) {
+    std::memset(&_address, 0, sizeof(_address));  // NOLINT
+    _address.sin_family = AF_INET;
+    _address.sin_port = htons(port);
+    if (inet_pton(AF_INET, host.c_str(), &_address.sin_addr) != 1) {
+      throw std::runtime_error("Invalid address: " + host);
+    }
+  }
+
+  ~Replay() {
+    for (size_t i = 0; i < _connections.size(); ++i) {
+      if (_connections[i].fd != -1) {
+        close(_connections[i].fd);
+      }
+    }
+  }
+
+  void run() {
+    const uint64_t start = monotonicNs();
+    size_t next = 0;
+    _lastActivity = start;
+    while (g_stop == 0) {
+      const uint64_t now = monotonicNs();
+      for (; next < _events.size() && _due(start, next) <= now; ++next) {
+        _apply(_events[next]);
+        const uint64_t lag = now - _due(start, next);
+        _maxLag = std::max(_maxLag, lag);
+        _totalLag += lag;
+      }
+      int timeout = REPLAY_IDLE;
+      if (next < _events.size()) {
+        timeout = static_cast<int>((_due(start, next) - now) / 1000000);
+      } else if (!_isOpen() ||
+                 now - _lastActivity >=
+                     static_cast<uint64_t>(REPLAY_IDLE) * 1000000) {
+        break;  // the connections left open were open when the capture ended
+      }
+      _poll(timeout);
+    }
+    _report(monotonicNs() - start, next);
+  }
+
+ private:
+  struct Connection {
+    int fd;
+    std::string out;
+    bool isClosing;   // shut down for writing once out is sent
+    bool isShutDown;  // the server closes it after reading everything
+  };
+
+  uint64_t _due(uint64_t start, size_t index) const {
+    if (_speed <= 0) {
+      return start;
+    }
+    return start + static_cast<uint64_t>(_events[index].time / _speed);
+  }
+
+  void _apply(const Event &event) {
+    if (event.type == Capture::CONNECT) {
+      _open(event.fd);
+    } else if (event.type == Capture::LINE) {
+      // Opened before the capture started, the earlier lines are missing
+      if (_byFd.count(event.fd) == 0) {
+        _open(event.fd);
+      }
+      Connection &connection = _connections[_byFd[event.fd]];
+      connection.out += event.line + "\r\n";
+      ++_lines;
+    } else if (event.type == Capture::DISCONNECT) {
+      const std::map<uint32_t, size_t>::iterator it = _byFd.find(event.fd);
+      if (it != _byFd.end()) {
+        _connections[it->second].isClosing = true;
+        _byFd.erase(it);
+      }
+    }
+  }
+
+  // The recorded fd may be reused later, the map only holds the open one
+  void _open(uint32_t recordedFd) {
+    const std::map<uint32_t, size_t>::iterator it = _byFd.find(recordedFd);
+    if (it != _byFd.end()) {
+      _connections[it->second].isClosing = true;  // missed its DISCONNECT
+    }
+    Connection connection;
+    connection.fd = socket(AF_INET, SOCK_STREAM, 0);
+    connection.isClosing = false;
+    connection.isShutDown = false;
+    if (connection.fd != -1) {
+      fcntl(connection.fd, F_SETFL, O_NONBLOCK);
+      if (connect(connection.fd,
+                  reinterpret_cast<struct sockaddr *>(&_address),  // NOLINT
+                  sizeof(_address)) == -1 &&
+          errno != EINPROGRESS) {
+        close(connection.fd);
+        connection.fd = -1;
+      }
+    }
+    if (connection.fd == -1) {
+      ++_failed;
+    } else {
+      ++_connected;
+    }
+    _byFd[recordedFd] = _connections.size();
+    _connections.push_back(connection);
+  }
+
+  bool _isOpen() const {
+    for (size_t i = 0; i < _connections.size(); ++i) {
+      if (_connections[i].fd != -1) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void _poll(int timeout) {
+    std::vector<struct pollfd> fds;
+    std::vector<size_t> indexes;
+    for (size_t i = 0; i < _connections.size(); ++i) {
+      Connection &connection = _connections[i];
+      if (connection.fd == -1) {
+        continue;
+      }
+      if (connection.isClosing && connection.out.empty() &&
+          !connection.isShutDown) {
+        shutdown(connection.fd, SHUT_WR);
+        connection.isShutDown = true;
+      }
+      struct pollfd pfd = {};
+      pfd.fd = connection.fd;
+      pfd.events = POLLIN;
+      if (!connection.out.empty()) {
+        pfd.events |= POLLOUT;
+      }
+      fds.push_back(pfd);
+      indexes.push_back(i);
+    }
+    if (poll(fds.data(), fds.size(), timeout) <= 0) {
+      return;
+    }
+    for (size_t i = 0; i < fds.size(); ++i) {
+      Connection &connection = _connections[indexes[i]];
+      if ((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) != 0 &&
+          !_receive(connection)) {
+        close(connection.fd);
+        connection.fd = -1;
+      } else if ((fds[i].revents & POLLOUT) != 0 && !_flush(connection)) {
+        close(connection.fd);
+        connection.fd = -1;
+      }
+    }
+  }
+
+  // False once the server closed the connection
+  bool _receive(Connection &connection) {
+    char buffer[16384];
+    const ssize_t received = recv(connection.fd, buffer, sizeof(buffer), 0);
+    if (received > 0) {
+      _bytesIn += received;
+      _lastActivity = monotonicNs();
+      return true;
+    }
+    if (received == -1 && errno == ECONNRESET) {
+      ++_reset;  // lost by the server, a connection burst overflows BACKLOG
+    }
+    return received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+  }
+
+  bool _flush(Connection &connection) {
+    while (!connection.out.empty()) {
+      const ssize_t sent = send(connection.fd, connection.out.data(),
+                                connection.out.size(), MSG_NOSIGNAL);
+      if (sent == -1) {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOTCONN;
+      }
+      connection.out.erase(0, sent);
+      _bytesOut += sent;
+      _lastActivity = monotonicNs();
+    }
+    return true;
+  }
+
+  void _report(uint64_t elapsed, size_t applied) const {
+    const uint64_t recorded = _events.empty() ? 0 : _events.back().time;
+    std::cout << "events " << applied << "\n"
+              << "connections " << _connected << "\n"
+              << "failed " << _failed << "\n"
+              << "reset " << _reset << "\n"
+              << "lines " << _lines << "\n"
+              << "bytes_sent " << _bytesOut << "\n"
+              << "bytes_received " << _bytesIn << "\n"
+              << "recorded_ms " << recorded / 1000000 << "\n"
+              << "replay_ms " << elapsed / 1000000 << "\n"
+              << "lag_avg_us "
+              << (applied == 0 ? 0 : _totalLag / applied / 1000) << "\n"
+              << "lag_max_us " << _maxLag / 1000 << "\n";
+  }
+
+  const std::vector<Event> &_events;
+  double _speed;
+  struct sockaddr_in _address;
+  std::vector<Connection> _connections;
+  std::map<uint32_t, size_t> _byFd;  // open connections by recorded fd
+  size_t _connected;
+  size_t _failed;
+  size_t _reset;
+  uint64_t _lines;
+  uint64_t _bytesOut;
+  uint64_t _bytesIn;
+  uint64_t _maxLag;  // ns between the schedule and the send
+  uint64_t _totalLag;
+  uint64_t _lastActivity;
+};
+
+}  // namespace
+
+int main(int argc, char **argv) try {
+  if (argc < 3 || argc > 5) {
+    std::cerr << "Usage: " << argv[0] << " <trace> <port> [speed] [host]\n";
+    return 1;
+  }
+  const std::vector<Event> events = readTrace(argv[1]);
+  const double speed = (argc > 3 ? std::strtod(argv[3], NULL) : 1.0);
+  const std::string host = (argc > 4 ? argv[4] : "127.0.0.1");
+  signal(SIGINT, stop);
+  Replay replay(events, host, std::atoi(argv[2]), speed);
+  replay.run();
+  return 0;
+} catch (const std::exception &e) {
+  std::cerr << e.what() << "\n";
+  return 1;
+}
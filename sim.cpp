@@ -0,0 +1,536 @@
+// In-process simulation: virtual clients are socketpairs handed to the server
+// with addClient(), and the poll loop is stepped with tick(). The listeners
+// are bound to a free port but never polled, nothing goes through the
+// network. Built and run by "make sim".
+//   ./ircsim <script> [config file]
+// The script has one command per line, "#" starts a comment:
+//   server <config>           another server, named by its "name" key, the
+//                             path relative to the script
+//   link <dialer> <acceptor>  links two servers over a socketpair, with the
+//                             password of the dialer's "link" line
+//   split <dialer> <acceptor> hangs the link up
+//   connect <name> [server]   new virtual client, on the first server
+//                             unless named
+//   tls <name> <cert> <key>   same, on a TLS session that waits for a
+//                             handshake the client never starts (TLS=1)
+//   register <name> [nick]    NICK and USER, welcome burst discarded
+//   spawn <count> <prefix>    connect and register <prefix>0, <prefix>1...
+//   send <name> <line>        <name> may be <prefix>* for a whole group
+//   burst <name> <n> <line>   <n> copies of <line>, without settling, "%"
+//                             replaced with the number of the copy
+//   settle                    tick until no fd is ready
+//   expect <name> <pattern>   next output line, with * and ? wildcards
+//   within <n> <name> <pattern>
+//                             tick until <name> gets a matching line, with
+//                             at most <n> input lines handled meanwhile
+//   silent <name>             no pending output
+//   drain <name>              discard pending output
+//   close <name>              hang up
+//   sleep <seconds>           lets the clock move on, registration times
+//                             have a one second resolution
+//   report                    memory per client and latency per command
+// Every expect settles first. Exits with 1 at the first mismatch.
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <csignal>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "Client.hpp"
+#include "Config.hpp"
+#include "Server.hpp"
+#include "Tls.hpp"
+#include "utils.hpp"
+
+#define SIM_SETTLE_LIMIT 100000  // ticks before settle gives up
+
+// Signal flags main.cpp defines for the server, run() is never called here
+volatile sig_atomic_t g_terminate = 0;  // NOLINT
+volatile sig_atomic_t g_upgrade = 0;    // NOLINT
+volatile sig_atomic_t g_dumpStats = 0;  // NOLINT
+
+namespace {
+
+struct Virtual {
+  int fd;  // our end of the socketpair
+  std::string in;
+  std::string out;
+  std::deque<std::string> lines;
+};
+
+typedef std::map<std::string, Virtual> VirtualList;
+typedef std::map<std::string, Server *> ServerByName;
+
+size_t heapBytes() {
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 33)
+  return mallinfo2().uordblks;
+#else
+  return 0;
+#endif
+}
+
+uint64_t cpuNs() {
+  struct timespec ts = {};
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+class Simulation {
+ public:
+  Simulation(Server &server, const std::string &directory, std::ostream &out)
+      : _server(server), _directory(directory), _out(out) {
+    _servers[server.getName()] = &server;
+  }
+
+  ~Simulation() {
+    for (VirtualList::iterator it = _virtuals.begin(); it != _virtuals.end();
+         ++it) {
+      if (it->second.fd != -1) {
+        close(it->second.fd);
+      }
+    }
+    for (ServerByName::iterator it = _servers.begin(); it != _servers.end();
+         ++it) {
+      if (it->second != &_server) {
+        delete it->second;
+      }
+    }
+  }
+
+  // Returns false at the first failed expectation
+  bool execute(const std::string &line) {
+    std::istringstream words(line);
+    std::string command;
+    std::string name;
+    words >> command >> name;
+    std::string rest;
+    std::getline(words >> std::ws, rest);
+    if (command == "server") {
+      _addServer(name);
+    } else if (command == "link") {
+      _link(name, rest);
+    } else if (command == "split") {
+      _settle();
+      const std::map<std::string, int>::iterator it =
+          _links.find(name + " " + rest);
+      if (it == _links.end()) {
+        throw std::runtime_error("No such link: " + name + " " + rest);
+      }
+      shutdown(it->second, SHUT_RDWR);  // both servers see it close
+      _links.erase(it);
+      _settle();
+    } else if (command == "sleep") {
+      const std::time_t until =
+          std::time(NULL) + std::strtol(name.c_str(), NULL, 10);
+      while (std::time(NULL) < until) {
+        usleep(10000);
+      }
+    } else if (command == "connect") {
+      _connect(name, rest.empty() ? _server : _findServer(rest));
+    } else if (command == "tls") {
+      _connectTls(name, rest);
+    } else if (command == "register") {
+      _register(name, rest.empty() ? name : rest);
+    } else if (command == "spawn") {
+      _spawn(std::strtoul(name.c_str(), NULL, 10), rest);
+    } else if (command == "send") {
+      std::vector<Virtual *> targets = _select(name);
+      for (size_t i = 0; i < targets.size(); ++i) {
+        targets[i]->out += rest + "\r\n";
+      }
+    } else if (command == "burst") {
+      std::istringstream args(rest);
+      size_t count = 0;
+      std::string copy;
+      args >> count >> std::ws;
+      std::getline(args, copy);
+      Virtual &client = _find(name);
+      const size_t mark = copy.find('%');
+      for (size_t i = 0; i < count; ++i) {
+        std::stringstream numbered;
+        numbered << i;
+        client.out += (mark == std::string::npos
+                           ? copy
+                           : std::string(copy).replace(mark, 1,
+                                                       numbered.str())) +
+                      "\r\n";
+      }
+    } else if (command == "within") {
+      std::istringstream args(rest);
+      std::string target;
+      std::string pattern;
+      args >> target >> std::ws;
+      std::getline(args, pattern);
+      return _within(std::strtoul(name.c_str(), NULL, 10), target, pattern);
+    } else if (command == "settle") {
+      _settle();
+    } else if (command == "expect") {
+      return _expect(name, rest);
+    } else if (command == "silent") {
+      return _silent(name);
+    } else if (command == "drain") {
+      _settle();
+      std::vector<Virtual *> targets = _select(name);
+      for (size_t i = 0; i < targets.size(); ++i) {
+        targets[i]->lines.clear();
+      }
+    } else if (command == "close") {
+      _settle();
+      Virtual &client = _find(name);
+      close(client.fd);
+      client.fd = -1;
+      _settle();
+    } else if (command == "report") {
+      _report();
+    } else {
+      throw std::runtime_error("Unknown command: " + command);
+    }
+    return true;
+  }
+
+ private:
+  void _addServer(const std::string &path) {
+    Config config(path[0] == '/' ? path : _directory + path);
+    config.set("snapshot", "none");
+    Server *server = new Server("0", "", config);
+    if (_servers.count(server->getName()) != 0) {
+      delete server;
+      throw std::runtime_error("Duplicate server: " + path);
+    }
+    _servers[server->getName()] = server;
+  }
+
+  // What _connectLink and an accept do, minus the network
+  void _link(const std::string &dialerName, const std::string &acceptorName) {
+    Server &dialer = _findServer(dialerName);
+    Server &acceptor = _findServer(acceptorName);
+    const std::vector<Directive> links = dialer.getConfig().getAll("link");
+    std::string password;
+    for (size_t i = 0; i < links.size(); ++i) {
+      if (links[i].size() >= 4 && links[i][0] == acceptorName) {
+        password = links[i][3];
+      }
+    }
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+      throw std::runtime_error("socketpair: " + std::string(strerror(errno)));
+    }
+    fcntl(sv[0], F_SETFL, O_NONBLOCK);
+    fcntl(sv[1], F_SETFL, O_NONBLOCK);
+    Client *link = new Client(sv[0], &dialer);
+    link->setServerName(acceptorName);
+    dialer.addClient(link);
+    dialer.sendToClient(link, "SERVER " + dialerName + " " + password);
+    acceptor.addClient(new Client(sv[1], &acceptor));
+    _links[dialerName + " " + acceptorName] = sv[0];
+    _settle();
+  }
+
+  Server &_findServer(const std::string &name) {
+    const ServerByName::iterator it = _servers.find(name);
+    if (it == _servers.end()) {
+      throw std::runtime_error("No such server: " + name);
+    }
+    return *it->second;
+  }
+
+  Client *_connect(const std::string &name) { return _connect(name, _server); }
+
+  Client *_connect(const std::string &name, Server &server) {
+    if (_virtuals.count(name) != 0) {
+      throw std::runtime_error("Duplicate client: " + name);
+    }
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+      throw std::runtime_error("socketpair: " + std::string(strerror(errno)));
+    }
+    fcntl(sv[0], F_SETFL, O_NONBLOCK);
+    fcntl(sv[1], F_SETFL, O_NONBLOCK);
+    Client *client = new Client(sv[1], &server);
+    server.addClient(client);
+    _virtuals[name].fd = sv[0];
+    return client;
+  }
+
+  // Like an accept on the TLS listener: the lookup notices are queued before
+  // the handshake, which never comes
+  void _connectTls(const std::string &name, const std::string &files) {
+    std::istringstream words(files);
+    std::string certificate;
+    std::string key;
+    words >> certificate >> key;
+    std::string error;
+    if (!_tlsContext.isOpen() &&
+        !_tlsContext.open(certificate, key, error)) {
+      throw std::runtime_error("TLS: " + error);
+    }
+    Client *client = _connect(name);
+    client->startTls(new TlsSession(_tlsContext, client->getClientFd()));
+    client->startLookup();
+    client->lookupDone("", "");
+  }
+
+  void _register(const std::string &name, const std::string &nick) {
+    Virtual &client = _find(name);
+    client.out += "NICK " + nick + "\r\nUSER " + nick + " 0 * :" + nick +
+                  "\r\n";
+    _settle();
+    client.lines.clear();
+  }
+
+  // Reports the heap and the CPU time each client costs to set up
+  void _spawn(size_t count, const std::string &prefix) {
+    const size_t heapBefore = heapBytes();
+    const uint64_t cpuBefore = cpuNs();
+    for (size_t i = 0; i < count; ++i) {
+      std::stringstream name;
+      name << prefix << i;
+      _connect(name.str());
+      Virtual &client = _virtuals[name.str()];
+      client.out += "NICK " + name.str() + "\r\nUSER " + name.str() +
+                    " 0 * :" + name.str() + "\r\n";
+    }
+    _settle();
+    for (size_t i = 0; i < count; ++i) {
+      std::stringstream name;
+      name << prefix << i;
+      _virtuals[name.str()].lines.clear();
+    }
+    if (count != 0) {
+      _out << "spawn " << count << " " << prefix << ": "
+           << (heapBytes() - heapBefore) / count << " bytes/client, "
+           << (cpuNs() - cpuBefore) / count / 1000 << " us/client\n";
+    }
+  }
+
+  bool _expect(const std::string &name, const std::string &pattern) {
+    _settle();
+    Virtual &client = _find(name);
+    if (client.lines.empty()) {
+      _out << "expected " << name << " to get: " << pattern
+           << "\n     got nothing\n";
+      return false;
+    }
+    const std::string line = client.lines.front();
+    client.lines.pop_front();
+    if (fnmatch(pattern.c_str(), line.c_str(), 0) != 0) {
+      _out << "expected " << name << " to get: " << pattern
+           << "\n           got: " << line << "\n";
+      return false;
+    }
+    return true;
+  }
+
+  // The lines the server handled meanwhile, every client's, measure how long
+  // the client waited for its turn
+  bool _within(size_t limit, const std::string &name,
+               const std::string &pattern) {
+    Virtual &client = _find(name);
+    const uint64_t start = _server.getStats().get(STAT_LINES_IN);
+    for (size_t ticks = 0; ticks < SIM_SETTLE_LIMIT; ++ticks) {
+      const bool isIdle = _step();
+      const uint64_t lines = _server.getStats().get(STAT_LINES_IN) - start;
+      while (!client.lines.empty()) {
+        const std::string line = client.lines.front();
+        client.lines.pop_front();
+        if (fnmatch(pattern.c_str(), line.c_str(), 0) != 0) {
+          continue;
+        }
+        if (lines > limit) {
+          _out << "expected " << name << " to get " << pattern << " within "
+               << limit << " lines, took " << lines << "\n";
+          return false;
+        }
+        return true;
+      }
+      if (isIdle) {
+        break;
+      }
+    }
+    _out << "expected " << name << " to get: " << pattern
+         << "\n     got nothing\n";
+    return false;
+  }
+
+  bool _silent(const std::string &name) {
+    _settle();
+    const std::vector<Virtual *> targets = _select(name);
+    for (size_t i = 0; i < targets.size(); ++i) {
+      if (!targets[i]->lines.empty()) {
+        _out << "expected silence, got: " << targets[i]->lines.front()
+             << "\n";
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Ticks until the server has nothing left to read or write
+  void _settle() {
+    for (size_t ticks = 0; ticks < SIM_SETTLE_LIMIT; ++ticks) {
+      if (_step()) {
+        return;
+      }
+    }
+    throw std::runtime_error("The server did not settle");
+  }
+
+  // One tick of every server, true when nothing was left to write nor ready.
+  // What a server writes to a link is read by the other one in the same tick
+  // or the next.
+  bool _step() {
+    bool isIdle = true;
+    for (VirtualList::iterator it = _virtuals.begin(); it != _virtuals.end();
+         ++it) {
+      isIdle = _flush(it->second) && isIdle;
+    }
+    int ready = 0;
+    for (ServerByName::iterator it = _servers.begin(); it != _servers.end();
+         ++it) {
+      ready += it->second->tick(0);
+    }
+    for (VirtualList::iterator it = _virtuals.begin(); it != _virtuals.end();
+         ++it) {
+      _collect(it->second);
+    }
+    return isIdle && ready == 0;
+  }
+
+  // Returns true once everything was written
+  static bool _flush(Virtual &client) {
+    while (client.fd != -1 && !client.out.empty()) {
+      const ssize_t sent = send(client.fd, client.out.data(),
+                                client.out.size(), MSG_NOSIGNAL);
+      if (sent == -1) {
+        return false;
+      }
+      client.out.erase(0, sent);
+    }
+    return true;
+  }
+
+  static void _collect(Virtual &client) {
+    char buffer[BUFFER_SIZE * 8];
+    ssize_t received = 0;
+    while (client.fd != -1 &&
+           (received = recv(client.fd, buffer, sizeof(buffer), 0)) > 0) {
+      client.in.append(buffer, received);
+    }
+    size_t pos = 0;
+    while ((pos = client.in.find("\r\n")) != std::string::npos) {
+      client.lines.push_back(client.in.substr(0, pos));
+      client.in.erase(0, pos + 2);
+    }
+  }
+
+  Virtual &_find(const std::string &name) {
+    const VirtualList::iterator it = _virtuals.find(name);
+    if (it == _virtuals.end()) {
+      throw std::runtime_error("No such client: " + name);
+    }
+    return it->second;
+  }
+
+  std::vector<Virtual *> _select(const std::string &name) {
+    std::vector<Virtual *> targets;
+    if (name.empty() || name[name.size() - 1] != '*') {
+      targets.push_back(&_find(name));
+      return targets;
+    }
+    const std::string prefix = name.substr(0, name.size() - 1);
+    for (VirtualList::iterator it = _virtuals.lower_bound(prefix);
+         it != _virtuals.end() &&
+         it->first.compare(0, prefix.size(), prefix) == 0;
+         ++it) {
+      targets.push_back(&it->second);
+    }
+    return targets;
+  }
+
+  void _report() {
+    _settle();
+    const std::vector<std::string> report = _server.latencyReport();
+    for (size_t i = 0; i < report.size(); ++i) {
+      _out << report[i] << "\n";
+    }
+    _out << "clients " << _server.getClients().size() << "\nheap "
+         << heapBytes() << "\n";
+  }
+
+  Server &_server;  // the first one, given the config of the command line
+  ServerByName _servers;
+  std::map<std::string, int> _links;  // the dialer's fd by "dialer acceptor"
+  std::string _directory;             // of the script, with a trailing /
+  std::ostream &_out;  // results, the server logs to std::cout
+  VirtualList _virtuals;
+  TlsContext _tlsContext;  // opened by the first tls command
+};
+
+}  // namespace
+
+int main(int argc, char **argv) try {
+  if (argc != 2 && argc != 3) {
+    std::cerr << "Usage: ./ircsim <script> [config file]\n";
+    return 1;
+  }
+  std::ifstream script(argv[1]);
+  if (!script.is_open()) {
+    std::cerr << "Cannot open " << argv[1] << "\n";
+    return 1;
+  }
+  struct rlimit limit = {};
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+    limit.rlim_cur = limit.rlim_max;  // two fds per virtual client
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+  Config config = (argc == 3 ? Config(argv[2]) : Config());
+  config.set("snapshot", "none");  // only the channels the script creates
+  // The server logs go nowhere, the results are printed through out
+  std::ostream out(std::cout.rdbuf());
+  std::ofstream null("/dev/null");
+  std::cout.rdbuf(null.rdbuf());
+  Server server("0", "", config);  // no password, register skips PASS
+  const std::string path(argv[1]);
+  Simulation simulation(server, path.substr(0, path.rfind('/') + 1), out);
+
+  std::string line;
+  for (size_t number = 1; std::getline(script, line); ++number) {
+    const size_t first = line.find_first_not_of(' ');
+    if (first == std::string::npos || line[first] == '#') {
+      continue;  // only whole-line comments, channels start with #
+    }
+    bool isOk = false;
+    try {
+      isOk = simulation.execute(line.substr(first));
+    } catch (const std::exception &e) {
+      out << argv[1] << ":" << number << ": " << e.what() << "\n";
+      return 1;
+    }
+    if (!isOk) {
+      out << argv[1] << ":" << number << ": " << line << "\n";
+      return 1;
+    }
+  }
+  out << "ok\n";
+  return 0;
+} catch (const std::exception &e) {
+  std::cerr << e.what() << "\n";
+  return 1;
+}
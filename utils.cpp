@@ -1,6 +1,18 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+
+#include <algorithm>
 #include <cctype>
+#include <cerrno>
 #include <cstddef>
+#include <cstdio>
+#include <cstring>
 #include <ctime>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
@@ -118,3 +130,129 @@ std::string get_time(std::time_t t) {
   }
   return result;
 }
+
+// Numeric host of an accepted peer, IPv4-mapped IPv6 shown as IPv4
+std::string format_address(const struct sockaddr_storage &addr) {
+  char buffer[INET6_ADDRSTRLEN] = {};
+  if (addr.ss_family == AF_INET) {
+    const struct sockaddr_in *ipv4 =
+        reinterpret_cast<const struct sockaddr_in *>(&addr);  // NOLINT
+    inet_ntop(AF_INET, &ipv4->sin_addr, buffer, sizeof(buffer));
+  } else if (addr.ss_family == AF_INET6) {
+    const struct sockaddr_in6 *ipv6 =
+        reinterpret_cast<const struct sockaddr_in6 *>(&addr);  // NOLINT
+    if (IN6_IS_ADDR_V4MAPPED(&ipv6->sin6_addr)) {
+      inet_ntop(AF_INET, ipv6->sin6_addr.s6_addr + 12, buffer, sizeof(buffer));
+    } else {
+      inet_ntop(AF_INET6, &ipv6->sin6_addr, buffer, sizeof(buffer));
+    }
+  }
+  return buffer;
+}
+
+uint64_t get_time_ms() {
+  struct timeval tv = {};
+  gettimeofday(&tv, NULL);
+  return static_cast<uint64_t>(tv.tv_sec) * 1000 + tv.tv_usec / 1000;
+}
+
+// For durations, not affected by clock adjustments
+uint64_t get_monotonic_ns() {
+  struct timespec ts = {};
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// IRCv3 server-time format: 2026-01-31T23:59:59.999Z
+std::string format_server_time(uint64_t ms) {
+  const std::time_t t = static_cast<std::time_t>(ms / 1000);
+  struct tm tm = {};
+  gmtime_r(&t, &tm);
+  char buffer[32];
+  const size_t len = std::strftime(buffer, sizeof(buffer), "%Y-%m-%dT%H:%M:%S",
+                                   &tm);  // NOLINT
+  std::snprintf(buffer + len, sizeof(buffer) - len, ".%03uZ",  // NOLINT
+                static_cast<unsigned>(ms % 1000));
+  return buffer;  // NOLINT
+}
+
+bool parse_server_time(const std::string &str, uint64_t &ms) {
+  struct tm tm = {};
+  unsigned millis = 0;
+  if (std::sscanf(str.c_str(), "%4d-%2d-%2dT%2d:%2d:%2d.%3uZ",  // NOLINT
+                  &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour,
+                  &tm.tm_min, &tm.tm_sec, &millis) != 7) {
+    return false;
+  }
+  tm.tm_year -= 1900;
+  tm.tm_mon -= 1;
+  const std::time_t t = timegm(&tm);
+  if (t == -1) {
+    return false;
+  }
+  ms = static_cast<uint64_t>(t) * 1000 + millis;
+  return true;
+}
+
+// * File descriptor passing *
+// Sockets are handed to another process as SCM_RIGHTS messages. Each message
+// carries its fd count as payload, so the receiver knows when it has them all.
+
+namespace {
+
+const size_t FDS_PER_MESSAGE = 200;  // below the kernel's SCM_MAX_FD
+
+}  // namespace
+
+void sendFds(int sock, const std::vector<int> &fds) {
+  for (size_t i = 0; i < fds.size(); i += FDS_PER_MESSAGE) {
+    const size_t count = std::min(fds.size() - i, FDS_PER_MESSAGE);
+    std::vector<char> control(CMSG_SPACE(count * sizeof(int)));
+    uint32_t payload = static_cast<uint32_t>(count);
+    struct iovec iov = {&payload, sizeof(payload)};
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = &control[0];
+    msg.msg_controllen = control.size();
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+    std::memcpy(CMSG_DATA(cmsg), &fds[i], count * sizeof(int));  // NOLINT
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) == -1) {
+      throw std::runtime_error("sendmsg: " +
+                               std::string(strerror(errno)));
+    }
+  }
+}
+
+void receiveFds(int sock, size_t total, std::vector<int> &fds) {
+  while (fds.size() < total) {
+    std::vector<char> control(
+        CMSG_SPACE(FDS_PER_MESSAGE * sizeof(int)));
+    uint32_t payload = 0;
+    struct iovec iov = {&payload, sizeof(payload)};
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = &control[0];
+    msg.msg_controllen = control.size();
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) <= 0) {
+      throw std::runtime_error("recvmsg failed");
+    }
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        continue;
+      }
+      const size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      for (size_t i = 0; i < count; ++i) {
+        int fd = -1;
+        std::memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int),  // NOLINT
+                    sizeof(int));
+        fds.push_back(fd);
+      }
+    }
+  }
+}
@@ -1,5 +1,9 @@
 #pragma once
 
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include <cstddef>
 #include <ctime>
 #include <string>
 #include <vector>
@@ -18,3 +22,12 @@ Client *findClient(const ClientList &clients, const std::string &nick);
 Channel *findChannel(const ChannelList &channels, const std::string &name);
 
 std::string get_time(std::time_t t);
+uint64_t get_time_ms();
+uint64_t get_monotonic_ns();
+std::string format_server_time(uint64_t ms);
+bool parse_server_time(const std::string &str, uint64_t &ms);
+
+std::string format_address(const struct sockaddr_storage &addr);
+
+void sendFds(int sock, const std::vector<int> &fds);
+void receiveFds(int sock, size_t total, std::vector<int> &fds);